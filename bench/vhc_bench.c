@@ -0,0 +1,1082 @@
+/*  =======================================================================
+ *
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *
+ *  =======================================================================
+ *
+ *     File:  vhc_bench.c
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Microbenchmark for the admission engine - admit/release
+ *            throughput and latency percentiles across processes, threads,
+ *            vhost counts and locking strategies. Only needs APR.
+ *
+ */
+
+/*  section:compile {{{
+ *  +++++++++++++++
+ *     normal:  cc -O2 -I. -o vhc_bench bench/vhc_bench.c vhc_engine.c     \
+ *                 $(apr-1-config --cflags --cppflags --includes          \
+ *                                --link-ld) -lm
+ *     usage:   ./vhc_bench -p 1,2,4 -t 1,4 -v 1,16,256 -m atomic,mutex
+ *
+ *  }}}  -- End section:compile.
+ */
+
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the engine + APR header files we need.  */
+#include "vhc_engine.h"
+
+#include "apr_file_io.h"
+#include "apr_general.h"
+#include "apr_getopt.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Defines for the benchmark limits + defaults.  */
+#define  VHC_BENCH_MAX_LIST         16          /*  Values per option.    */
+#define  VHC_BENCH_MAX_WORKERS      4096        /*  Procs x threads.      */
+#define  VHC_BENCH_MAX_VHOSTS       32767
+#define  VHC_BENCH_MAX_DEPTH        64          /*  Requests in flight.   */
+#define  VHC_BENCH_DEFAULT_OPS      1000000     /*  Per thread.           */
+#define  VHC_BENCH_DEFAULT_LIMIT    64          /*  Slot limit.           */
+#define  VHC_BENCH_DEFAULT_DEPTH    4
+#define  VHC_BENCH_STRIPES          8           /*  "stripes" mode locks. */
+#define  VHC_BENCH_LOCK_WAIT_USECS  (100 * 1000)
+#define  VHC_BENCH_BORROW_VHOSTS    4           /*  -b vhosts.            */
+#define  VHC_BENCH_BORROW_OPS       1000000     /*  -b borrows/thread.    */
+
+/*  Defines for the log-linear latency histograms (32 buckets per power  */
+/*  of 2 - so a bucket is within ~3% of the latencies it counts).        */
+#define  VHC_BENCH_SUB_BITS         5
+#define  VHC_BENCH_SUB_BUCKETS      (1 << VHC_BENCH_SUB_BITS)
+#define  VHC_BENCH_BUCKETS          ((64 - VHC_BENCH_SUB_BITS + 1) *       \
+                                     VHC_BENCH_SUB_BUCKETS)
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:typedefs {{{  */
+/*  ++++++++++++++++      */
+
+/*  Locking strategy benchmarked.  */
+typedef  enum {
+   VHC_BENCH_MODE_ATOMIC = 0,    /*  Lock-free (CAS) updates.     */
+   VHC_BENCH_MODE_MUTEX,         /*  One global mutex.            */
+   VHC_BENCH_MODE_STRIPES        /*  VHC_BENCH_STRIPES mutexes.   */
+
+}  VHC_bench_mode;
+
+/*  Structure definitions for a worker's (thread's) results (in shm).  */
+typedef struct  vhc_bench_result {
+   apr_uint64_t  started_ns;        /*  When the worker got going.     */
+   apr_uint64_t  finished_ns;       /*  When it was done.              */
+   apr_uint64_t  admitted;          /*  # of admitted requests.        */
+   apr_uint64_t  choked;            /*  # of choked requests.          */
+   apr_uint64_t  admit_hist[VHC_BENCH_BUCKETS];    /*  Admit latency.  */
+   apr_uint64_t  release_hist[VHC_BENCH_BUCKETS];  /*  Release latency.*/
+
+}  VHC_CACHE_ALIGNED  VHC_bench_result_t, *VHC_bench_result_t_p;
+
+/*  Structure definitions for a benchmark run (one combination).  */
+typedef struct  vhc_bench_run {
+   VHC_bench_mode         mode;         /*  Locking strategy.          */
+   int                    nprocs;       /*  # of processes.            */
+   int                    nthreads;     /*  # of threads per process.  */
+   int                    nvhosts;      /*  # of vhosts.               */
+   apr_uint64_t           nops;         /*  # of admits per thread.    */
+   apr_uint32_t           depth;        /*  Requests held in flight.   */
+
+   VHC_shm_header_t      *header;       /*  Slot table.                */
+   VHC_server_config_t   *configs;      /*  Vhost configs.             */
+   int                    nlocks;       /*  # of lock stripes.         */
+   char                 **lockfiles;    /*  Lock stripe files.         */
+   apr_global_mutex_t   **locks;        /*  Lock stripes.              */
+
+   volatile apr_uint32_t *ready;        /*  Start barrier (in shm).    */
+   VHC_bench_result_t    *results;      /*  Worker results (in shm).   */
+
+}  VHC_bench_run_t, *VHC_bench_run_t_p;
+
+/*  Structure definitions for a worker's context.  */
+typedef struct  vhc_bench_worker {
+   VHC_bench_run_t  *run;           /*  Benchmark run.                 */
+   int               proc;          /*  Process #.                     */
+   int               thread;        /*  Thread # (in the process).     */
+
+}  VHC_bench_worker_t, *VHC_bench_worker_t_p;
+
+/*  Structure definitions for a capacity pool (-b) check thread.  */
+typedef struct  vhc_bench_borrower {
+   VHC_shm_header_t     *header;        /*  Slot table (with the pool).*/
+   VHC_server_config_t  *configs;       /*  Vhost configs.             */
+   apr_uint32_t          seed;          /*  Random vhost picks.        */
+   apr_uint64_t          admitted;      /*  # of admitted requests.    */
+
+}  VHC_bench_borrower_t, *VHC_bench_borrower_t_p;
+
+/*  }}}  -- End section:typedefs.  */
+
+
+/*  section:internal-functions {{{  */
+/*  ++++++++++++++++++++++++++      */
+
+/**
+ *   @brief   Returns the current monotonic time in nanoseconds.
+ *   @return  monotonic time in nanoseconds.
+ *
+ *   Returns the current monotonic time in nanoseconds (the same across
+ *   processes, so the workers' start/finish times can be compared).
+ *
+ */
+static apr_uint64_t  vhc_bench_now_ns_(void) {
+   struct timespec  ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (apr_uint64_t) ts.tv_sec * APR_UINT64_C(1000000000) +
+          (apr_uint64_t) ts.tv_nsec;
+
+}  /*  End of function  vhc_bench_now_ns_.  */
+
+
+
+/**
+ *   @brief   Returns the histogram bucket for a latency.
+ *   @param   ns  latency (in nanoseconds)
+ *   @return  histogram bucket index.
+ *
+ *   Returns the histogram bucket for a latency - exact upto 32ns, then
+ *   32 buckets for every power of 2.
+ *
+ */
+static apr_uint32_t  vhc_bench_bucket_(apr_uint64_t ns) {
+   int  msb;
+
+   if (ns < VHC_BENCH_SUB_BUCKETS)
+      return (apr_uint32_t) ns;
+
+   msb = 63 - __builtin_clzll(ns);
+   return (apr_uint32_t) (msb - VHC_BENCH_SUB_BITS + 1) *
+             VHC_BENCH_SUB_BUCKETS +
+          (apr_uint32_t) ((ns >> (msb - VHC_BENCH_SUB_BITS) ) &
+                          (VHC_BENCH_SUB_BUCKETS - 1) );
+
+}  /*  End of function  vhc_bench_bucket_.  */
+
+
+
+/**
+ *   @brief   Returns the (lowest) latency a histogram bucket counts.
+ *   @param   bucket  histogram bucket index
+ *   @return  latency (in nanoseconds).
+ *
+ *   Returns the (lowest) latency a histogram bucket counts - the inverse
+ *   of vhc_bench_bucket_.
+ *
+ */
+static apr_uint64_t  vhc_bench_bucket_ns_(apr_uint32_t bucket) {
+   int  msb;
+
+   if (bucket < VHC_BENCH_SUB_BUCKETS)
+      return bucket;
+
+   msb = (int) (bucket / VHC_BENCH_SUB_BUCKETS) + VHC_BENCH_SUB_BITS - 1;
+   return (apr_uint64_t) (VHC_BENCH_SUB_BUCKETS +
+                          bucket % VHC_BENCH_SUB_BUCKETS) <<
+             (msb - VHC_BENCH_SUB_BITS);
+
+}  /*  End of function  vhc_bench_bucket_ns_.  */
+
+
+
+/**
+ *   @brief   Returns a latency percentile from a histogram.
+ *   @param   hist      histogram
+ *   @param   quantile  quantile (0.5 = p50, 0.999 = p999)
+ *   @return  latency (in nanoseconds), 0 if the histogram is empty.
+ *
+ *   Returns a latency percentile from a histogram.
+ *
+ */
+static apr_uint64_t  vhc_bench_percentile_(apr_uint64_t *hist,
+                                           double quantile) {
+   apr_uint64_t  total = 0;
+   apr_uint64_t  seen = 0;
+   apr_uint64_t  target;
+   apr_uint32_t  bucket;
+
+   for (bucket = 0; bucket < VHC_BENCH_BUCKETS; bucket++)
+      total += hist[bucket];
+
+   if (0 == total)
+      return 0;
+
+   target = (apr_uint64_t) ceil(total * quantile);
+   for (bucket = 0; bucket < VHC_BENCH_BUCKETS; bucket++) {
+      seen += hist[bucket];
+      if (seen >= target)
+         return vhc_bench_bucket_ns_(bucket);
+   }
+
+   return vhc_bench_bucket_ns_(VHC_BENCH_BUCKETS - 1);
+
+}  /*  End of function  vhc_bench_percentile_.  */
+
+
+
+/**
+ *   @brief   Admit a request the way the module does.
+ *   @param   run      benchmark run
+ *   @param   config   vhost config record
+ *   @param   shmdata  vhost shm data
+ *   @param   stats    vhost stats shard
+ *   @return  APR_SUCCESS if a slot was granted, otherwise errors.
+ *
+ *   Admit a request the way the module does - claim a slot (with the
+ *   vhost's lock stripe held in the mutex modes) and take a token.
+ *
+ */
+static int  vhc_bench_admit_(VHC_bench_run_t *run,
+                             VHC_server_config_t *config,
+                             VHC_shm_data_t *shmdata,
+                             VHC_shm_stats_t *stats) {
+   apr_global_mutex_t  *lock = NULL;
+   apr_status_t         status;
+   apr_uint64_t         nslots;
+   apr_uint64_t         extra;
+
+   if (run->nlocks > 0) {
+      lock = run->locks[config->shm_index % run->nlocks];
+      status = vhc_lock_acquire_(lock, VHC_BENCH_LOCK_WAIT_USECS);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
+   }
+
+   status = vhc_claim_vhost_slots_(run->header, config, shmdata, stats, 0,
+                                   &nslots, &extra);
+   if (VHC_APR_STATUS_IS_SUCCESS(status) ) {
+      status = vhc_check_vhost_rate_(config, shmdata);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         vhc_release_slots_(run->header, shmdata, 1);
+   }
+
+   if (NULL != lock)
+      vhc_lock_release_(lock);
+
+   return status;
+
+}  /*  End of function  vhc_bench_admit_.  */
+
+
+
+/**
+ *   @brief   Release a request's slot the way the module does.
+ *   @param   run      benchmark run
+ *   @param   config   vhost config record
+ *   @param   shmdata  vhost shm data
+ *
+ *   Release a request's slot the way the module does (with the vhost's
+ *   lock stripe held in the mutex modes).
+ *
+ */
+static void  vhc_bench_release_(VHC_bench_run_t *run,
+                                VHC_server_config_t *config,
+                                VHC_shm_data_t *shmdata) {
+   apr_global_mutex_t  *lock = NULL;
+
+   if (run->nlocks > 0) {
+      lock = run->locks[config->shm_index % run->nlocks];
+      if (!VHC_APR_STATUS_IS_SUCCESS(
+              vhc_lock_acquire_(lock, VHC_BENCH_LOCK_WAIT_USECS) ) )
+         lock = NULL;   /*  The module releases without it too.  */
+   }
+
+   vhc_release_slots_(run->header, shmdata, 1);
+
+   if (NULL != lock)
+      vhc_lock_release_(lock);
+
+}  /*  End of function  vhc_bench_release_.  */
+
+
+
+/**
+ *   @brief   Run a worker's admit/release loop.
+ *   @param   worker  worker context
+ *
+ *   Run a worker's admit/release loop - admit requests to random vhosts
+ *   and release every admitted request depth admits later (so each
+ *   worker has upto depth requests in flight). Every admit and release
+ *   is timed into the histograms.
+ *
+ */
+static void  vhc_bench_work_(VHC_bench_worker_t *worker) {
+   VHC_bench_run_t     *run = worker->run;
+   VHC_bench_result_t  *result;
+   VHC_server_config_t *config;
+   VHC_shm_data_t      *shmdata;
+   VHC_shm_stats_t     *stats;
+   apr_uint16_t         held[VHC_BENCH_MAX_DEPTH];
+   apr_uint32_t         seed;
+   apr_uint32_t         total;
+   apr_uint64_t         started;
+   apr_uint64_t         i;
+   apr_uint16_t         idx;
+   apr_status_t         status;
+
+   result = &run->results[worker->proc * run->nthreads + worker->thread];
+   seed = 0x9e3779b9u ^ ((apr_uint32_t) worker->proc << 16) ^
+          (apr_uint32_t) worker->thread;
+
+   for (i = 0; i < VHC_BENCH_MAX_DEPTH; i++)
+      held[i] = VHC_SHM_NO_ENTRY;
+
+   /*  Everyone starts together.  */
+   total = (apr_uint32_t) (run->nprocs * run->nthreads);
+   VHC_ATOMIC_ADD(run->ready, 1);
+   while (VHC_ATOMIC_LOAD(run->ready) < total)
+      apr_sleep(10);
+
+   result->started_ns = vhc_bench_now_ns_();
+
+   for (i = 0; i < run->nops + run->depth; i++) {
+      /*  Release the request admitted depth admits ago (if it was).  */
+      idx = held[i % run->depth];
+      if (VHC_SHM_NO_ENTRY != idx) {
+         config = &run->configs[idx];
+         shmdata = vhc_get_shm_entry_(run->header, idx);
+         held[i % run->depth] = VHC_SHM_NO_ENTRY;
+
+         started = vhc_bench_now_ns_();
+         vhc_bench_release_(run, config, shmdata);
+         result->release_hist[vhc_bench_bucket_(vhc_bench_now_ns_() -
+                                                started)]++;
+      }
+
+      if (i >= run->nops)
+         continue;   /*  Draining.  */
+
+      /*  Admit a request to a random vhost (xorshift32).  */
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      idx = (apr_uint16_t) (seed % (apr_uint32_t) run->nvhosts);
+
+      config = &run->configs[idx];
+      shmdata = vhc_get_shm_entry_(run->header, idx);
+      stats = vhc_get_shm_stats_(run->header, idx,
+                                 (apr_uint32_t) worker->proc %
+                                    run->header->stats_shards);
+
+      started = vhc_bench_now_ns_();
+      status = vhc_bench_admit_(run, config, shmdata, stats);
+      result->admit_hist[vhc_bench_bucket_(vhc_bench_now_ns_() -
+                                           started)]++;
+
+      if (VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         held[i % run->depth] = idx;
+         result->admitted++;
+      }
+      else
+         result->choked++;
+   }
+
+   result->finished_ns = vhc_bench_now_ns_();
+
+}  /*  End of function  vhc_bench_work_.  */
+
+
+
+#if APR_HAS_THREADS
+/**
+ *   @brief   Thread entry point for a worker.
+ *   @param   thread  the thread
+ *   @param   data    worker context
+ *   @return  always NULL.
+ *
+ *   Thread entry point for a worker.
+ *
+ */
+static void * APR_THREAD_FUNC  vhc_bench_thread_(apr_thread_t *thread,
+                                                 void *data) {
+
+   vhc_bench_work_((VHC_bench_worker_t *) data);
+
+   apr_thread_exit(thread, APR_SUCCESS);
+   return NULL;
+
+}  /*  End of function  vhc_bench_thread_.  */
+#endif  /*  APR_HAS_THREADS  */
+
+
+
+/**
+ *   @brief   Run a benchmark child process.
+ *   @param   run   benchmark run
+ *   @param   proc  process #
+ *   @param   pool  memory pool
+ *   @return  exit code for the child process.
+ *
+ *   Run a benchmark child process - attach to the lock stripes and run
+ *   the workers (one per thread).
+ *
+ */
+static int  vhc_bench_child_(VHC_bench_run_t *run, int proc,
+                             apr_pool_t *pool) {
+   VHC_bench_worker_t  *workers;
+   apr_status_t         status;
+   int                  n;
+
+#if APR_HAS_THREADS
+   apr_thread_t       **threads;
+   apr_status_t         rv;
+#endif  /*  APR_HAS_THREADS  */
+
+   for (n = 0; n < run->nlocks; n++) {
+      status = apr_global_mutex_child_init(&run->locks[n],
+                                           run->lockfiles[n], pool);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return 1;
+   }
+
+   workers = apr_pcalloc(pool, run->nthreads * sizeof(VHC_bench_worker_t) );
+   for (n = 0; n < run->nthreads; n++) {
+      workers[n].run = run;
+      workers[n].proc = proc;
+      workers[n].thread = n;
+   }
+
+#if APR_HAS_THREADS
+   threads = apr_pcalloc(pool, run->nthreads * sizeof(apr_thread_t *) );
+   for (n = 0; n < run->nthreads; n++) {
+      status = apr_thread_create(&threads[n], NULL, vhc_bench_thread_,
+                                 &workers[n], pool);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return 1;
+   }
+
+   for (n = 0; n < run->nthreads; n++)
+      apr_thread_join(&rv, threads[n]);
+#else
+   vhc_bench_work_(&workers[0]);
+#endif  /*  APR_HAS_THREADS  */
+
+   return 0;
+
+}  /*  End of function  vhc_bench_child_.  */
+
+
+
+/**
+ *   @brief   Run one benchmark combination and print its results.
+ *   @param   run   benchmark run (settings filled in)
+ *   @param   pool  memory pool
+ *   @return  APR_SUCCESS on success, otherwise errors.
+ *
+ *   Run one benchmark combination - set up a fresh slot table (and lock
+ *   stripes) in shm, fork the processes, wait for them and merge their
+ *   workers' results.
+ *
+ */
+static apr_status_t  vhc_bench_run_(VHC_bench_run_t *run, apr_pool_t *pool) {
+   static const char   *mode_names[] = { "atomic", "mutex", "stripes" };
+   apr_shm_t           *table_shm;
+   apr_shm_t           *results_shm;
+   apr_proc_t          *procs;
+   apr_status_t         status;
+   const char          *tmpdir;
+   apr_uint64_t         admit_hist[VHC_BENCH_BUCKETS];
+   apr_uint64_t         release_hist[VHC_BENCH_BUCKETS];
+   apr_uint64_t         started = 0;
+   apr_uint64_t         finished = 0;
+   apr_uint64_t         admitted = 0;
+   apr_uint64_t         choked = 0;
+   apr_size_t           results_size;
+   VHC_bench_result_t  *result;
+   apr_exit_why_e       why;
+   int                  exitcode;
+   int                  nworkers = run->nprocs * run->nthreads;
+   int                  n;
+   apr_uint32_t         b;
+
+   /*  Slot table + the workers' results (after the start barrier).  */
+   status = apr_shm_create(&table_shm,
+                           vhc_get_table_size_((apr_uint16_t) run->nvhosts),
+                           NULL, pool);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   results_size = VHC_CACHE_LINE_SIZE +
+                  (apr_size_t) nworkers * sizeof(VHC_bench_result_t);
+   status = apr_shm_create(&results_shm, results_size, NULL, pool);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   memset(apr_shm_baseaddr_get(results_shm), 0, results_size);
+   run->ready = (volatile apr_uint32_t *) apr_shm_baseaddr_get(results_shm);
+   run->results = (VHC_bench_result_t *)
+                     ((char *) apr_shm_baseaddr_get(results_shm) +
+                      VHC_CACHE_LINE_SIZE);
+
+   run->header = vhc_init_table_(apr_shm_baseaddr_get(table_shm),
+                                 (apr_uint16_t) run->nvhosts);
+   run->header->used_entries = (apr_uint32_t) run->nvhosts;
+   for (n = 0; n < run->nvhosts; n++)
+      vhc_get_shm_entry_(run->header, (apr_uint16_t) n)->vhost_key =
+         (apr_uint64_t) n + 1;
+
+   /*  Lock stripes for the mutex modes.  */
+   run->nlocks = (VHC_BENCH_MODE_ATOMIC == run->mode) ? 0 :
+                 (VHC_BENCH_MODE_MUTEX == run->mode) ? 1 :
+                                                      VHC_BENCH_STRIPES;
+   run->lockfiles = apr_pcalloc(pool, (run->nlocks + 1) * sizeof(char *) );
+   run->locks = apr_pcalloc(pool, (run->nlocks + 1) *
+                                  sizeof(apr_global_mutex_t *) );
+
+   status = apr_temp_dir_get(&tmpdir, pool);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      tmpdir = "/tmp";
+
+   for (n = 0; n < run->nlocks; n++) {
+      run->lockfiles[n] = apr_psprintf(pool, "%s/vhc_bench.%d.%d.lock",
+                                       tmpdir, (int) getpid(), n);
+      status = apr_global_mutex_create(&run->locks[n], run->lockfiles[n],
+                                       APR_LOCK_DEFAULT, pool);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
+   }
+
+   /*  Fork the processes and wait for all of them - the children skip  */
+   /*  the parent's pool cleanups (shm, locks) and stdio buffers on exit. */
+   fflush(stdout);
+   procs = apr_pcalloc(pool, run->nprocs * sizeof(apr_proc_t) );
+   for (n = 0; n < run->nprocs; n++) {
+      status = apr_proc_fork(&procs[n], pool);
+      if (APR_INCHILD == status)
+         _exit(vhc_bench_child_(run, n, pool) );
+
+      if (APR_INPARENT != status)
+         return status;
+   }
+
+   for (n = 0; n < run->nprocs; n++) {
+      apr_proc_wait(&procs[n], &exitcode, &why, APR_WAIT);
+      if (!APR_PROC_CHECK_EXIT(why)  ||  (0 != exitcode) )
+         status = APR_EGENERAL;
+   }
+
+   for (n = 0; n < run->nlocks; n++)
+      apr_global_mutex_destroy(run->locks[n]);
+
+   if (APR_INPARENT != status)
+      return status;
+
+   /*  Merge the workers' results.  */
+   memset(admit_hist, 0, sizeof(admit_hist) );
+   memset(release_hist, 0, sizeof(release_hist) );
+
+   for (n = 0; n < nworkers; n++) {
+      result = &run->results[n];
+      if ((0 == started)  ||  (result->started_ns < started) )
+         started = result->started_ns;
+      if (result->finished_ns > finished)
+         finished = result->finished_ns;
+
+      admitted += result->admitted;
+      choked += result->choked;
+      for (b = 0; b < VHC_BENCH_BUCKETS; b++) {
+         admit_hist[b] += result->admit_hist[b];
+         release_hist[b] += result->release_hist[b];
+      }
+   }
+
+   printf("%-8s %5d %7d %6d %12.0f %7lu %7lu %7lu %7lu %7lu %7lu %7.2f%%\n",
+          mode_names[run->mode], run->nprocs, run->nthreads, run->nvhosts,
+          (finished > started) ?
+             (double) (admitted + choked) * 1e9 / (finished - started) : 0,
+          (unsigned long) vhc_bench_percentile_(admit_hist, 0.5),
+          (unsigned long) vhc_bench_percentile_(admit_hist, 0.99),
+          (unsigned long) vhc_bench_percentile_(admit_hist, 0.999),
+          (unsigned long) vhc_bench_percentile_(release_hist, 0.5),
+          (unsigned long) vhc_bench_percentile_(release_hist, 0.99),
+          (unsigned long) vhc_bench_percentile_(release_hist, 0.999),
+          (admitted + choked > 0) ?
+             100.0 * choked / (double) (admitted + choked) : 0);
+   fflush(stdout);
+
+   /*  Every admitted request got released - so no slots should be left.  */
+   for (n = 0; n < run->nvhosts; n++)
+      if (0 != vhc_get_shm_entry_(run->header, (apr_uint16_t) n)->inuse_slots)
+         fprintf(stderr, "vhost %d: %lu slots leaked\n", n, (unsigned long)
+                 vhc_get_shm_entry_(run->header, (apr_uint16_t) n)->
+                    inuse_slots);
+
+   apr_shm_destroy(results_shm);
+   apr_shm_destroy(table_shm);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_bench_run_.  */
+
+
+
+/**
+ *   @brief   Check that an adaptive slot limit grows all the way up.
+ *   @param   from  slot limit to start off at
+ *   @param   to    max. slot limit (the adaptive bound)
+ *   @return  0 if the limit got to the max., 1 otherwise.
+ *
+ *   Check the additive increase of an adaptive slot limit - releases of
+ *   fast requests on a full vhost should grow the limit from the start
+ *   to the max. (about one slot per limit's worth of releases).
+ *
+ */
+static int  vhc_bench_adaptive_(int from, int to) {
+   VHC_server_config_t  config;
+   VHC_shm_data_t       shmdata;
+   apr_uint64_t         nreleases = 0;
+   apr_uint64_t         max_releases = (apr_uint64_t) to * to;
+   apr_uint32_t         limit = (apr_uint32_t) from;
+
+   memset(&config, 0, sizeof(config) );
+   memset((void *) &shmdata, 0, sizeof(shmdata) );
+
+   config.slot_limit = (apr_uint16_t) from;
+   config.adaptive_settings.min = 1;
+   config.adaptive_settings.max = (apr_uint16_t) to;
+   config.adaptive_settings.target_latency = 1000 * 1000;
+
+   while ((limit < (apr_uint32_t) to)  &&  (nreleases < max_releases) ) {
+      vhc_adapt_slot_limit_(&config, &shmdata, 1000, limit);
+      limit = vhc_get_slot_limit_(&config, &shmdata);
+      nreleases++;
+   }
+
+   printf("adaptive: %d -> %u slots (max %d) in %" APR_UINT64_T_FMT
+          " releases - %s\n", from, limit, to, nreleases,
+          (limit >= (apr_uint32_t) to) ? "ok" : "FAILED");
+
+   return (limit >= (apr_uint32_t) to) ? 0 : 1;
+
+}  /*  End of function  vhc_bench_adaptive_.  */
+
+
+
+#if APR_HAS_THREADS
+/**
+ *   @brief   Thread entry point for a capacity pool (-b) check thread.
+ *   @param   thread  the thread
+ *   @param   data    borrower context
+ *   @return  always NULL.
+ *
+ *   Admit requests to random (1 slot) vhosts and release each one a few
+ *   admits later - past the slot limit, the slots are borrowed from the
+ *   capacity pool. A released slot repays any loan of its vhost, so one
+ *   thread's release races another's first loan on the same vhost.
+ *
+ */
+static void * APR_THREAD_FUNC  vhc_bench_borrow_thread_(apr_thread_t *thread,
+                                                        void *data) {
+   VHC_bench_borrower_t  *borrower = (VHC_bench_borrower_t *) data;
+   VHC_shm_data_t        *shmdata;
+   apr_uint16_t           held[VHC_BENCH_DEFAULT_DEPTH];
+   apr_uint64_t           nslots;
+   apr_uint64_t           extra;
+   apr_uint64_t           i;
+   apr_uint16_t           idx;
+
+   for (i = 0; i < VHC_BENCH_DEFAULT_DEPTH; i++)
+      held[i] = VHC_SHM_NO_ENTRY;
+
+   for (i = 0; i < VHC_BENCH_BORROW_OPS + VHC_BENCH_DEFAULT_DEPTH; i++) {
+      /*  Release the request admitted depth admits ago (if it was).  */
+      idx = held[i % VHC_BENCH_DEFAULT_DEPTH];
+      if (VHC_SHM_NO_ENTRY != idx) {
+         vhc_release_slots_(borrower->header,
+                            vhc_get_shm_entry_(borrower->header, idx), 1);
+         held[i % VHC_BENCH_DEFAULT_DEPTH] = VHC_SHM_NO_ENTRY;
+      }
+
+      if (i >= VHC_BENCH_BORROW_OPS)
+         continue;   /*  Draining.  */
+
+      borrower->seed ^= borrower->seed << 13;
+      borrower->seed ^= borrower->seed >> 17;
+      borrower->seed ^= borrower->seed << 5;
+      idx = (apr_uint16_t) (borrower->seed % VHC_BENCH_BORROW_VHOSTS);
+
+      shmdata = vhc_get_shm_entry_(borrower->header, idx);
+      if (VHC_APR_STATUS_IS_SUCCESS(vhc_claim_vhost_slots_(
+             borrower->header, &borrower->configs[idx], shmdata, NULL, 0,
+             &nslots, &extra) ) ) {
+         held[i % VHC_BENCH_DEFAULT_DEPTH] = idx;
+         borrower->admitted++;
+      }
+   }
+
+   apr_thread_exit(thread, APR_SUCCESS);
+   return NULL;
+
+}  /*  End of function  vhc_bench_borrow_thread_.  */
+
+
+
+/**
+ *   @brief   Check the capacity pool's counters under concurrent loans.
+ *   @param   nthreads  # of threads borrowing (and repaying)
+ *   @param   pool      memory pool
+ *   @return  0 if the pool's counters got back to 0, 1 otherwise.
+ *
+ *   Check that concurrent borrows and repays keep the capacity pool's
+ *   counters right - once every loan is repaid, the pool's in use and
+ *   borrowed slots and the weight of the borrowing vhosts are all 0.
+ *
+ */
+static int  vhc_bench_borrow_(int nthreads, apr_pool_t *pool) {
+   VHC_bench_borrower_t  *borrowers;
+   VHC_server_config_t   *configs;
+   VHC_shm_header_t      *header;
+   apr_thread_t         **threads;
+   apr_shm_t             *table_shm;
+   apr_status_t           rv;
+   apr_uint64_t           admitted = 0;
+   int                    ok;
+   int                    n;
+
+   if (!VHC_APR_STATUS_IS_SUCCESS(apr_shm_create(&table_shm,
+          vhc_get_table_size_(VHC_BENCH_BORROW_VHOSTS), NULL, pool) ) )
+      return 1;
+
+   /*  A pool with fewer slots than threads, so loans get turned down.  */
+   header = vhc_init_table_(apr_shm_baseaddr_get(table_shm),
+                            VHC_BENCH_BORROW_VHOSTS);
+   header->pool.capacity = (apr_uint64_t) (nthreads + 1) / 2;
+
+   configs = apr_pcalloc(pool, VHC_BENCH_BORROW_VHOSTS *
+                               sizeof(VHC_server_config_t) );
+   for (n = 0; n < VHC_BENCH_BORROW_VHOSTS; n++) {
+      configs[n].shm_index = (apr_uint16_t) n;
+      configs[n].slot_limit = 1;
+      configs[n].weight = (apr_uint16_t) n + 1;
+      vhc_get_shm_entry_(header, (apr_uint16_t) n)->vhost_key =
+         (apr_uint64_t) n + 1;
+   }
+
+   borrowers = apr_pcalloc(pool, nthreads * sizeof(VHC_bench_borrower_t) );
+   threads = apr_pcalloc(pool, nthreads * sizeof(apr_thread_t *) );
+   for (n = 0; n < nthreads; n++) {
+      borrowers[n].header = header;
+      borrowers[n].configs = configs;
+      borrowers[n].seed = 0x9e3779b9u ^ (apr_uint32_t) n;
+      if (!VHC_APR_STATUS_IS_SUCCESS(apr_thread_create(&threads[n], NULL,
+                                        vhc_bench_borrow_thread_,
+                                        &borrowers[n], pool) ) )
+         return 1;
+   }
+
+   for (n = 0; n < nthreads; n++) {
+      apr_thread_join(&rv, threads[n]);
+      admitted += borrowers[n].admitted;
+   }
+
+   ok = (0 == header->pool.inuse_slots)  &&  (0 == header->pool.borrowed)  &&
+        (0 == header->pool.borrow_weight);
+
+   printf("borrow: %d threads, %" APR_UINT64_T_FMT " admitted - pool in "
+          "use %" APR_UINT64_T_FMT ", borrowed %" APR_UINT64_T_FMT
+          ", weight %" APR_INT64_T_FMT " - %s\n", nthreads, admitted,
+          header->pool.inuse_slots, header->pool.borrowed,
+          header->pool.borrow_weight, ok ? "ok" : "FAILED");
+
+   apr_shm_destroy(table_shm);
+
+   return ok ? 0 : 1;
+
+}  /*  End of function  vhc_bench_borrow_.  */
+#endif  /*  APR_HAS_THREADS  */
+
+
+
+/**
+ *   @brief   Parse a comma separated list of numbers.
+ *   @param   arg     option value
+ *   @param   values  parsed values (returned back)
+ *   @param   max     max. value allowed
+ *   @return  # of values parsed, 0 if the list is invalid.
+ *
+ *   Parse a comma separated list of numbers (each in the range 1-max).
+ *
+ */
+static int  vhc_bench_parse_list_(const char *arg, int *values, int max) {
+   const char  *next = arg;
+   char        *end;
+   long         value;
+   int          n = 0;
+
+   while (n < VHC_BENCH_MAX_LIST) {
+      value = strtol(next, &end, 10);
+      if ((end == next)  ||  (value < 1)  ||  (value > max) )
+         return 0;
+
+      values[n++] = (int) value;
+      if ('\0' == *end)
+         return n;
+
+      if (',' != *end)
+         return 0;
+
+      next = end + 1;
+   }
+
+   return 0;
+
+}  /*  End of function  vhc_bench_parse_list_.  */
+
+
+
+/**
+ *   @brief   Parse a comma separated list of locking strategies.
+ *   @param   arg    option value
+ *   @param   modes  parsed modes (returned back)
+ *   @return  # of modes parsed, 0 if the list is invalid.
+ *
+ *   Parse a comma separated list of locking strategies (atomic, mutex
+ *   and stripes).
+ *
+ */
+static int  vhc_bench_parse_modes_(const char *arg, int *modes) {
+   static const char  *names[] = { "atomic", "mutex", "stripes" };
+   const char         *next = arg;
+   apr_size_t          len;
+   int                 n = 0;
+   int                 m;
+
+   while (n < VHC_BENCH_MAX_LIST) {
+      len = strcspn(next, ",");
+      for (m = 0; m < 3; m++)
+         if ((strlen(names[m]) == len)  &&
+             (0 == strncasecmp(next, names[m], len) ) )
+            break;
+
+      if (3 == m)
+         return 0;
+
+      modes[n++] = m;
+      if ('\0' == next[len])
+         return n;
+
+      next += len + 1;
+   }
+
+   return 0;
+
+}  /*  End of function  vhc_bench_parse_modes_.  */
+
+
+
+/**
+ *   @brief   Print usage information.
+ *   @param   prog  program name
+ *
+ *   Print usage information.
+ *
+ */
+static void  vhc_bench_usage_(const char *prog) {
+
+   fprintf(stderr,
+           "usage: %s [-p procs,..] [-t threads,..] [-v vhosts,..]\n"
+           "          [-m atomic|mutex|stripes,..] [-n ops] [-s slots]"
+           " [-d depth]\n\n"
+           "   -p  # of processes            (default 1,2,4)\n"
+           "   -t  # of threads per process  (default 1,4)\n"
+           "   -v  # of vhosts               (default 1,16,256)\n"
+           "   -m  locking strategies        (default atomic,mutex,"
+           "stripes)\n"
+           "   -n  admits per thread         (default %d)\n"
+           "   -s  vhost slot limit          (default %d)\n"
+           "   -d  requests each thread keeps in flight (default %d)\n"
+           "   -a  from,to - check an adaptive slot limit grows from\n"
+           "       'from' to 'to' slots (instead of benchmarking)\n"
+           "   -b  threads - check the capacity pool's counters get back\n"
+           "       to 0 after concurrent loans (instead of benchmarking)\n\n"
+           "Latencies are in nanoseconds (incl. ~20ns of clock reads).\n",
+           prog, VHC_BENCH_DEFAULT_OPS, VHC_BENCH_DEFAULT_LIMIT,
+           VHC_BENCH_DEFAULT_DEPTH);
+
+}  /*  End of function  vhc_bench_usage_.  */
+
+/*  }}}  -- End section:internal-functions.  */
+
+
+/*  section:main {{{  */
+/*  ++++++++++++     */
+
+int  main(int argc, const char * const *argv) {
+   apr_pool_t           *pool;
+   apr_pool_t           *run_pool;
+   apr_getopt_t         *opt;
+   const char           *arg;
+   char                  ch;
+   int                   procs[VHC_BENCH_MAX_LIST]   = { 1, 2, 4 };
+   int                   threads[VHC_BENCH_MAX_LIST] = { 1, 4 };
+   int                   vhosts[VHC_BENCH_MAX_LIST]  = { 1, 16, 256 };
+   int                   modes[VHC_BENCH_MAX_LIST]   = { 0, 1, 2 };
+   int                   nprocs = 3, nthreads = 2, nvhosts = 3, nmodes = 3;
+   int                   slot_limit = VHC_BENCH_DEFAULT_LIMIT;
+   int                   depth = VHC_BENCH_DEFAULT_DEPTH;
+   int                   adaptive[VHC_BENCH_MAX_LIST];
+   int                   nadaptive = -1;
+   int                   nborrowers = 0;
+   apr_uint64_t          nops = VHC_BENCH_DEFAULT_OPS;
+   VHC_server_config_t  *configs;
+   VHC_bench_run_t       run;
+   apr_status_t          status;
+   int                   m, p, t, v, n;
+
+   apr_app_initialize(&argc, &argv, NULL);
+   atexit(apr_terminate);
+   apr_pool_create(&pool, NULL);
+
+   apr_getopt_init(&opt, pool, argc, argv);
+   while (APR_SUCCESS == (status = apr_getopt(opt, "p:t:v:m:n:s:d:a:b:h", &ch,
+                                              &arg) ) ) {
+      switch (ch) {
+         case 'p':  nprocs = vhc_bench_parse_list_(arg, procs, 256);
+                    break;
+         case 't':  nthreads = vhc_bench_parse_list_(arg, threads, 256);
+                    break;
+         case 'v':  nvhosts = vhc_bench_parse_list_(arg, vhosts,
+                                                    VHC_BENCH_MAX_VHOSTS);
+                    break;
+         case 'm':  nmodes = vhc_bench_parse_modes_(arg, modes);
+                    break;
+         case 'n':  nops = (apr_uint64_t) apr_atoi64(arg);
+                    break;
+         case 's':  slot_limit = atoi(arg);
+                    break;
+         case 'd':  depth = atoi(arg);
+                    break;
+         case 'a':  nadaptive = vhc_bench_parse_list_(arg, adaptive, 32767);
+                    break;
+         case 'b':  nborrowers = atoi(arg);
+                    break;
+         default:   vhc_bench_usage_(argv[0]);
+                    return 1;
+      }
+   }
+
+   if ((APR_EOF != status)  ||  (0 == nprocs)  ||  (0 == nthreads)  ||
+       (0 == nvhosts)  ||  (0 == nmodes)  ||  (0 == nops)  ||
+       (slot_limit < 1)  ||  (slot_limit > 32767)  ||
+       (depth < 1)  ||  (depth > VHC_BENCH_MAX_DEPTH)  ||
+       (nborrowers < 0)  ||  (nborrowers > 256) ) {
+      vhc_bench_usage_(argv[0]);
+      return 1;
+   }
+
+   if (nadaptive >= 0) {
+      if ((2 != nadaptive)  ||  (adaptive[0] >= adaptive[1]) ) {
+         vhc_bench_usage_(argv[0]);
+         return 1;
+      }
+
+      return vhc_bench_adaptive_(adaptive[0], adaptive[1]);
+   }
+
+   if (nborrowers > 0) {
+#if APR_HAS_THREADS
+      return vhc_bench_borrow_(nborrowers, pool);
+#else
+      fprintf(stderr, "borrow: no threads - skipped\n");
+      return 0;
+#endif  /*  APR_HAS_THREADS  */
+   }
+
+   printf("%-8s %5s %7s %6s %12s %7s %7s %7s %7s %7s %7s %8s\n",
+          "mode", "procs", "threads", "vhosts", "ops/s",
+          "adm-p50", "adm-p99", "adm-999", "rel-p50", "rel-p99", "rel-999",
+          "choked");
+
+   for (m = 0; m < nmodes; m++) {
+#ifndef  VHC_HAVE_SHM_ATOMICS
+      if (VHC_BENCH_MODE_ATOMIC == modes[m]) {
+         fprintf(stderr, "atomic: no 64-bit shm atomics - skipped\n");
+         continue;
+      }
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+      for (v = 0; v < nvhosts; v++) {
+         /*  Vhost configs - module defaults (bursting on, no rate).  */
+         configs = apr_pcalloc(pool,
+                               vhosts[v] * sizeof(VHC_server_config_t) );
+         for (n = 0; n < vhosts[v]; n++) {
+            configs[n].config_id = (apr_uint16_t) n;
+            configs[n].shm_index = (apr_uint16_t) n;
+            configs[n].vhost_key = (apr_uint64_t) n + 1;
+            configs[n].slot_limit = (apr_uint16_t) slot_limit;
+            configs[n].weight = 1;
+            configs[n].burst_settings.percent = 30;
+            configs[n].burst_settings.grace_period = 10;
+            configs[n].burst_settings.flap_period = 1800;
+         }
+
+         for (p = 0; p < nprocs; p++) {
+            for (t = 0; t < nthreads; t++) {
+#if !APR_HAS_THREADS
+               if (threads[t] > 1)
+                  continue;
+#endif  /*  !APR_HAS_THREADS  */
+
+               if (procs[p] * threads[t] > VHC_BENCH_MAX_WORKERS)
+                  continue;
+
+               memset(&run, 0, sizeof(run) );
+               run.mode = (VHC_bench_mode) modes[m];
+               run.nprocs = procs[p];
+               run.nthreads = threads[t];
+               run.nvhosts = vhosts[v];
+               run.nops = nops;
+               run.depth = (apr_uint32_t) depth;
+               run.configs = configs;
+
+               apr_pool_create(&run_pool, pool);
+               status = vhc_bench_run_(&run, run_pool);
+               apr_pool_destroy(run_pool);
+
+               if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+                  fprintf(stderr, "benchmark run failed: %d\n", status);
+                  return 1;
+               }
+            }
+         }
+      }
+   }
+
+   return 0;
+
+}  /*  End of function  main.  */
+
+/*  }}}  -- End section:main.  */
+
+
+
+/**
+ *  EOF
+ */
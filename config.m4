@@ -1,6 +1,7 @@
 
 APACHE_MODPATH_INIT(mod_vhost_choke)
 
-APACHE_MODULE(vhost_choke, choke virtual host requests, , no)
+APACHE_MODULE(vhost_choke, choke virtual host requests,
+              mod_vhost_choke.lo vhc_engine.lo, , no)
 
 APACHE_MODPATH_FINISH
@@ -0,0 +1,355 @@
+#!/bin/bash
+#
+#  Load-test harness for mod_vhost_choke.
+#
+#  Builds the module (apxs) + the load generator, starts a throwaway httpd
+#  on loopback with a few test vhosts in front of a slow mock backend (a
+#  CGI that sleeps) and reports:
+#     1. overhead - a static file vhost with the module off vs on.
+#     2. overload - admitted vs choked rates per vhost and the latency of
+#                   admitted and choked responses.
+#  Everything runs locally - no network access needed.
+#
+#  Usage:  loadtest/run.sh
+#
+#  Settings (environment variables):
+#     APXS        apxs to build with        (default: apxs or apxs2)
+#     PORT        loopback port             (default: 18080)
+#     DURATION    seconds per run           (default: 10)
+#     CONNS       connections per vhost     (default: 32)
+#     DELAY       backend delay in seconds  (default: 0.05)
+#     SLOT_LIMIT  slot limit of choked.test (default: 8 - choked2.test
+#                 gets twice that, free.test is not limited)
+#     KEEP        keep the work directory (logs, config) if set to 1.
+#
+
+set -e
+
+PORT=${PORT:-18080}
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-32}
+DELAY=${DELAY:-0.05}
+SLOT_LIMIT=${SLOT_LIMIT:-8}
+KEEP=${KEEP:-0}
+
+SRCDIR=$(cd "$(dirname "$0")/.." && pwd)
+
+
+#
+#  Find apxs and the httpd it builds for.
+#
+function find_httpd() {
+   if [ -z "$APXS" ]; then
+      APXS=$(command -v apxs || command -v apxs2 || true)
+   fi
+
+   if [ -z "$APXS" ]; then
+      echo "  - apxs not found. Install the httpd devel package or set APXS."
+      exit 1
+   fi
+
+   HTTPD="$($APXS -q SBINDIR)/$($APXS -q TARGET)"
+   LIBEXECDIR=$($APXS -q LIBEXECDIR)
+   if [ ! -x "$HTTPD" ]; then
+      echo "  - httpd binary $HTTPD not found."
+      exit 1
+   fi
+
+}  #  End of function  find_httpd.
+
+
+#
+#  Build the module and the load generator (in the work directory, so
+#  the source tree stays clean).
+#
+function build() {
+   echo "  - Building mod_vhost_choke with $APXS ..."
+   mkdir -p "$WORKDIR/build"
+   cp "$SRCDIR"/mod_vhost_choke.[ch] "$SRCDIR"/vhc_engine.[ch] \
+      "$SRCDIR"/vhc_trace.h "$WORKDIR/build/"
+   (cd "$WORKDIR/build" &&
+    "$APXS" -c -o mod_vhost_choke.so mod_vhost_choke.c vhc_engine.c \
+       > build.log 2>&1) || { cat "$WORKDIR/build/build.log"; exit 1; }
+
+   echo "  - Building vhc_load ..."
+   ${CC:-cc} -O2 -pthread -o "$WORKDIR/vhc_load" \
+      "$SRCDIR/loadtest/vhc_load.c" -lm
+
+}  #  End of function  build.
+
+
+#
+#  Emit a LoadModule line for a module - unless httpd has it built in or
+#  it isn't there at all.
+#
+function load_module() {
+   local name=$1
+
+   if "$HTTPD" -l | grep -q "mod_$name.c"; then
+      return 0
+   fi
+
+   if [ -f "$LIBEXECDIR/mod_$name.so" ]; then
+      echo "LoadModule ${name}_module $LIBEXECDIR/mod_$name.so"
+   fi
+
+}  #  End of function  load_module.
+
+
+#
+#  Generate the httpd config, docroot and the slow mock backend.
+#
+function generate_config() {
+   local user="" mpm="" cgi=""
+
+   mkdir -p "$WORKDIR"/{conf,logs,run,htdocs,cgi-bin}
+   echo "ok" > "$WORKDIR/htdocs/index.html"
+
+   #  Slow mock backend - sleeps $DELAY seconds, then a tiny response.
+   cat > "$WORKDIR/cgi-bin/slow.cgi" <<EOF
+#!/bin/sh
+sleep $DELAY
+printf 'Content-Type: text/plain\r\nContent-Length: 3\r\n\r\nok\n'
+EOF
+   chmod 755 "$WORKDIR/cgi-bin/slow.cgi"
+
+   #  Pick an MPM (event if it's loadable) unless one is built in.
+   if ! "$HTTPD" -l | grep -Eq "(event|worker|prefork).c"; then
+      for m in event worker prefork; do
+         mpm=$(load_module "mpm_$m")
+         [ -n "$mpm" ] && break
+      done
+   fi
+
+   cgi=$(load_module cgid)
+   [ -z "$cgi" ] && cgi=$(load_module cgi)
+
+   #  httpd won't run its children as root.
+   if [ "$(id -u)" = "0" ]; then
+      user="User nobody
+Group $(id -gn nobody)"
+      chmod -R a+rX "$WORKDIR"
+      chmod 777 "$WORKDIR/run"
+   fi
+
+   cat > "$WORKDIR/conf/httpd.conf" <<EOF
+#  Generated by mod_vhost_choke loadtest/run.sh - throwaway config.
+ServerRoot          "$WORKDIR"
+ServerName          localhost
+Listen              127.0.0.1:$PORT
+PidFile             "$WORKDIR/run/httpd.pid"
+ErrorLog            "$WORKDIR/logs/error_log"
+LogLevel            warn
+DefaultRuntimeDir   "$WORKDIR/run"
+Mutex               file:"$WORKDIR/run" default
+
+$mpm
+$(load_module unixd)
+$(load_module authz_core)
+$(load_module alias)
+$(load_module mime)
+$cgi
+
+$user
+<IfModule mod_cgid.c>
+   ScriptSock       "$WORKDIR/run/cgisock"
+</IfModule>
+
+<IfDefine !VHC_OFF>
+   LoadModule vhost_choke_module "$WORKDIR/build/.libs/mod_vhost_choke.so"
+</IfDefine>
+
+KeepAlive             On
+MaxKeepAliveRequests  0
+Timeout               30
+
+<IfModule mpm_event_module>
+   StartServers         4
+   ServerLimit          16
+   ThreadsPerChild      64
+   MaxRequestWorkers    1024
+   AsyncRequestWorkerFactor  4
+</IfModule>
+<IfModule mpm_worker_module>
+   StartServers         4
+   ServerLimit          16
+   ThreadsPerChild      64
+   MaxRequestWorkers    1024
+</IfModule>
+<IfModule mpm_prefork_module>
+   StartServers         64
+   ServerLimit          1024
+   MaxRequestWorkers    1024
+</IfModule>
+
+<IfModule mod_vhost_choke.c>
+   <Location /vhost-choke-status>
+      SetHandler vhost-choke-status
+   </Location>
+</IfModule>
+
+#  Static files - the module's overhead (throttled, but never choked).
+<VirtualHost 127.0.0.1:$PORT>
+   ServerName    fast.test
+   DocumentRoot  "$WORKDIR/htdocs"
+   <IfModule mod_vhost_choke.c>
+      VHostChokeSlotLimit  30000
+   </IfModule>
+</VirtualHost>
+
+#  Slow backend - choked at the slot limit (no bursting).
+<VirtualHost 127.0.0.1:$PORT>
+   ServerName    choked.test
+   DocumentRoot  "$WORKDIR/htdocs"
+   ScriptAlias   /cgi-bin/ "$WORKDIR/cgi-bin/"
+   <IfModule mod_vhost_choke.c>
+      VHostChokeSlotLimit     $SLOT_LIMIT
+      VHostChokeBurstPercent  0
+   </IfModule>
+</VirtualHost>
+
+<VirtualHost 127.0.0.1:$PORT>
+   ServerName    choked2.test
+   DocumentRoot  "$WORKDIR/htdocs"
+   ScriptAlias   /cgi-bin/ "$WORKDIR/cgi-bin/"
+   <IfModule mod_vhost_choke.c>
+      VHostChokeSlotLimit     $((SLOT_LIMIT * 2))
+      VHostChokeBurstPercent  0
+   </IfModule>
+</VirtualHost>
+
+#  Slow backend - not limited (the control).
+<VirtualHost 127.0.0.1:$PORT>
+   ServerName    free.test
+   DocumentRoot  "$WORKDIR/htdocs"
+   ScriptAlias   /cgi-bin/ "$WORKDIR/cgi-bin/"
+</VirtualHost>
+EOF
+
+}  #  End of function  generate_config.
+
+
+#
+#  Start httpd (module off if $1 is "off") and wait till it's listening.
+#
+function start_httpd() {
+   local defs="" n=0
+
+   [ "$1" = "off" ] && defs="-DVHC_OFF"
+
+   "$HTTPD" -f "$WORKDIR/conf/httpd.conf" $defs -k start
+
+   until (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2> /dev/null; do
+      n=$((n + 1))
+      if [ $n -gt 100 ]; then
+         echo "  - httpd didn't start - see $WORKDIR/logs/error_log"
+         tail -20 "$WORKDIR/logs/error_log"
+         exit 1
+      fi
+      sleep 0.1
+   done
+
+}  #  End of function  start_httpd.
+
+
+#
+#  Stop httpd and wait till it's gone.
+#
+function stop_httpd() {
+   local pid
+
+   [ -f "$WORKDIR/run/httpd.pid" ] || return 0
+
+   pid=$(cat "$WORKDIR/run/httpd.pid")
+   "$HTTPD" -f "$WORKDIR/conf/httpd.conf" -k stop 2> /dev/null || true
+   while kill -0 "$pid" 2> /dev/null; do
+      sleep 0.1
+   done
+
+}  #  End of function  stop_httpd.
+
+
+#
+#  Fetch a page from the local httpd (no curl/wget needed).
+#
+function fetch() {
+   local host=$1 path=$2
+
+   exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+   printf 'GET %s HTTP/1.0\r\nHost: %s\r\n\r\n' "$path" "$host" >&3
+   sed '1,/^\r$/d' <&3
+   exec 3<&-
+
+}  #  End of function  fetch.
+
+
+#
+#  Clean up on exit.
+#
+function cleanup() {
+   stop_httpd
+   if [ "$KEEP" = "1" ]; then
+      echo "  - Work directory kept: $WORKDIR"
+   else
+      rm -rf "$WORKDIR"
+   fi
+
+}  #  End of function  cleanup.
+
+
+#
+#  main():
+#
+find_httpd
+
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/vhc-loadtest.XXXXXX")
+trap cleanup EXIT
+
+build
+generate_config
+
+echo ""
+echo "  - Overhead: fast.test static file, $CONNS connections, ${DURATION}s"
+for mode in off on; do
+   start_httpd $mode
+   "$WORKDIR/vhc_load" -p "$PORT" -c "$CONNS" -d 1 fast.test/index.html \
+      > /dev/null   #  Warm up.
+   "$WORKDIR/vhc_load" -p "$PORT" -c "$CONNS" -d "$DURATION" \
+      fast.test/index.html > "$WORKDIR/overhead.$mode"
+   stop_httpd
+done
+
+awk '$1 == "total" { rps[FILENAME] = $2; p50[FILENAME] = $6;
+                     p99[FILENAME] = $7; p999[FILENAME] = $8; }
+     END {
+        off = ARGV[1];  on = ARGV[2];
+        printf("    %-12s %10s %9s %9s %9s\n", "module", "req/s",
+               "p50(ms)", "p99(ms)", "p999(ms)");
+        printf("    %-12s %10.1f %9.2f %9.2f %9.2f\n", "off", rps[off],
+               p50[off], p99[off], p999[off]);
+        printf("    %-12s %10.1f %9.2f %9.2f %9.2f\n", "on", rps[on],
+               p50[on], p99[on], p999[on]);
+        if (rps[off] > 0)
+           printf("    %-12s %+9.2f%% %+9.3f %+9.3f %+9.3f\n", "overhead",
+                  100.0 * (rps[off] - rps[on]) / rps[off],
+                  p50[on] - p50[off], p99[on] - p99[off],
+                  p999[on] - p999[off]);
+     }' "$WORKDIR/overhead.off" "$WORKDIR/overhead.on"
+
+echo ""
+echo "  - Overload: slow backend (${DELAY}s), $CONNS connections per" \
+     "vhost, ${DURATION}s"
+awk -v slots="$SLOT_LIMIT" -v delay="$DELAY" 'BEGIN {
+       printf("    admit/s can reach: choked.test %.1f, choked2.test %.1f\n",
+              slots / delay, 2 * slots / delay); }'
+start_httpd on
+"$WORKDIR/vhc_load" -p "$PORT" -c "$CONNS" -d "$DURATION" \
+   choked.test/cgi-bin/slow.cgi choked2.test/cgi-bin/slow.cgi \
+   free.test/cgi-bin/slow.cgi | sed 's/^/    /'
+
+echo ""
+echo "  - Module stats:"
+fetch fast.test /vhost-choke-status |
+   grep -E '^vhost_choke_(admitted|choked|inuse)' | sed 's/^/    /'
+
+exit 0
@@ -0,0 +1,570 @@
+/*  =======================================================================
+ *
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *
+ *  =======================================================================
+ *
+ *     File:  vhc_load.c
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Load generator for the load-test harness (see run.sh) - fires
+ *            requests at a set of vhosts on a local server and reports the
+ *            admitted vs choked rates and latencies per vhost.
+ *
+ */
+
+/*  section:compile {{{
+ *  +++++++++++++++
+ *     normal:  cc -O2 -pthread -o vhc_load loadtest/vhc_load.c -lm
+ *     usage:   ./vhc_load -p 8080 -c 16 -d 10 a.test/ b.test/slow.cgi
+ *
+ *  }}}  -- End section:compile.
+ */
+
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the standard header files we need.  */
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Defines for the load generator limits + defaults.  */
+#define  VHC_LOAD_MAX_TARGETS       64
+#define  VHC_LOAD_MAX_CONNECTIONS   1024      /*  Per target.           */
+#define  VHC_LOAD_DEFAULT_PORT      8080
+#define  VHC_LOAD_DEFAULT_CONNS     16        /*  Per target.           */
+#define  VHC_LOAD_DEFAULT_DURATION  10        /*  In seconds.           */
+#define  VHC_LOAD_DEFAULT_CHOKED    429       /*  Choked status code.   */
+#define  VHC_LOAD_IO_TIMEOUT_SECS   30
+#define  VHC_LOAD_BUFFER_SIZE       (64 * 1024)
+
+/*  Defines for the log-linear latency histograms (in microseconds).  */
+#define  VHC_LOAD_SUB_BITS          5
+#define  VHC_LOAD_SUB_BUCKETS       (1 << VHC_LOAD_SUB_BITS)
+#define  VHC_LOAD_BUCKETS           ((64 - VHC_LOAD_SUB_BITS + 1) *        \
+                                     VHC_LOAD_SUB_BUCKETS)
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:typedefs {{{  */
+/*  ++++++++++++++++      */
+
+/*  Structure definitions for the results of a target (vhost + path).  */
+typedef struct  vhc_load_stats {
+   uint64_t  admitted;              /*  # of 2xx/3xx responses.        */
+   uint64_t  choked;                /*  # of choked responses.         */
+   uint64_t  other;                 /*  # of other responses.          */
+   uint64_t  errors;                /*  # of connect/io errors.        */
+   uint64_t  admitted_hist[VHC_LOAD_BUCKETS];  /*  Admitted latency.   */
+   uint64_t  choked_hist[VHC_LOAD_BUCKETS];    /*  Choked latency.     */
+
+}  VHC_load_stats_t;
+
+/*  Structure definitions for a target (vhost + path).  */
+typedef struct  vhc_load_target {
+   char              host[256];     /*  Host header (vhost).           */
+   char              path[1024];    /*  Request path.                  */
+   VHC_load_stats_t  stats;         /*  Merged connection results.     */
+
+}  VHC_load_target_t;
+
+/*  Structure definitions for a connection (one thread each).  */
+typedef struct  vhc_load_conn {
+   VHC_load_target_t  *target;      /*  What we hammer.                */
+   pthread_t           thread;      /*  Connection thread.             */
+   VHC_load_stats_t   *stats;       /*  Connection results.            */
+
+}  VHC_load_conn_t;
+
+/*  }}}  -- End section:typedefs.  */
+
+
+/*  section:globals {{{  */
+/*  +++++++++++++++      */
+
+static struct sockaddr_in  gs_server;          /*  Server address.     */
+static int                 gs_choked_code = VHC_LOAD_DEFAULT_CHOKED;
+static uint64_t            gs_deadline_us = 0; /*  When to stop.       */
+
+/*  }}}  -- End section:globals.  */
+
+
+/*  section:internal-functions {{{  */
+/*  ++++++++++++++++++++++++++      */
+
+/**
+ *   @brief   Returns the current monotonic time in microseconds.
+ *   @return  monotonic time in microseconds.
+ *
+ *   Returns the current monotonic time in microseconds.
+ *
+ */
+static uint64_t  vhc_load_now_us_(void) {
+   struct timespec  ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+
+}  /*  End of function  vhc_load_now_us_.  */
+
+
+
+/**
+ *   @brief   Returns the histogram bucket for a latency.
+ *   @param   us  latency (in microseconds)
+ *   @return  histogram bucket index.
+ *
+ *   Returns the histogram bucket for a latency - exact upto 32us, then
+ *   32 buckets for every power of 2.
+ *
+ */
+static uint32_t  vhc_load_bucket_(uint64_t us) {
+   int  msb;
+
+   if (us < VHC_LOAD_SUB_BUCKETS)
+      return (uint32_t) us;
+
+   msb = 63 - __builtin_clzll(us);
+   return (uint32_t) (msb - VHC_LOAD_SUB_BITS + 1) * VHC_LOAD_SUB_BUCKETS +
+          (uint32_t) ((us >> (msb - VHC_LOAD_SUB_BITS) ) &
+                      (VHC_LOAD_SUB_BUCKETS - 1) );
+
+}  /*  End of function  vhc_load_bucket_.  */
+
+
+
+/**
+ *   @brief   Returns a latency percentile from a histogram.
+ *   @param   hist      histogram
+ *   @param   quantile  quantile (0.5 = p50, 0.999 = p999)
+ *   @return  latency (in milliseconds), 0 if the histogram is empty.
+ *
+ *   Returns a latency percentile from a histogram - the lowest latency
+ *   of the bucket the percentile falls into.
+ *
+ */
+static double  vhc_load_percentile_(uint64_t *hist, double quantile) {
+   uint64_t  total = 0;
+   uint64_t  seen = 0;
+   uint64_t  target;
+   uint32_t  bucket;
+   int       msb;
+
+   for (bucket = 0; bucket < VHC_LOAD_BUCKETS; bucket++)
+      total += hist[bucket];
+
+   if (0 == total)
+      return 0;
+
+   target = (uint64_t) ceil(total * quantile);
+   for (bucket = 0; bucket < VHC_LOAD_BUCKETS - 1; bucket++) {
+      seen += hist[bucket];
+      if (seen >= target)
+         break;
+   }
+
+   if (bucket < VHC_LOAD_SUB_BUCKETS)
+      return bucket / 1000.0;
+
+   msb = (int) (bucket / VHC_LOAD_SUB_BUCKETS) + VHC_LOAD_SUB_BITS - 1;
+   return (double) ((uint64_t) (VHC_LOAD_SUB_BUCKETS +
+                                bucket % VHC_LOAD_SUB_BUCKETS) <<
+                       (msb - VHC_LOAD_SUB_BITS) ) / 1000.0;
+
+}  /*  End of function  vhc_load_percentile_.  */
+
+
+
+/**
+ *   @brief   Connect to the server.
+ *   @return  connected socket, -1 on errors.
+ *
+ *   Connect to the server (with I/O timeouts, so a stuck server can't
+ *   hang the run).
+ *
+ */
+static int  vhc_load_connect_(void) {
+   struct timeval  tv = { VHC_LOAD_IO_TIMEOUT_SECS, 0 };
+   int             one = 1;
+   int             fd;
+
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0)
+      return -1;
+
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+
+   if (connect(fd, (struct sockaddr *) &gs_server, sizeof(gs_server) ) < 0) {
+      close(fd);
+      return -1;
+   }
+
+   return fd;
+
+}  /*  End of function  vhc_load_connect_.  */
+
+
+
+/**
+ *   @brief   Send a request and read the response.
+ *   @param   fd          connected socket
+ *   @param   request     request to send
+ *   @param   len         request length
+ *   @param   keep_alive  if the connection can be reused (returned back)
+ *   @return  HTTP status code, -1 on errors.
+ *
+ *   Send a request and read the response (headers + body). Requests are
+ *   HTTP/1.0 with keep-alive - so responses without a Content-Length end
+ *   with the connection instead of being chunked.
+ *
+ */
+static int  vhc_load_request_(int fd, const char *request, size_t len,
+                              int *keep_alive) {
+   char     buffer[VHC_LOAD_BUFFER_SIZE];
+   size_t   have = 0;
+   ssize_t  n;
+   char    *eoh = NULL;
+   char    *hdr;
+   long     content_length = -1;
+   long     body;
+   int      status;
+
+   *keep_alive = 0;
+
+   for (n = 0; (size_t) n < len; ) {
+      ssize_t  sent = send(fd, request + n, len - n, MSG_NOSIGNAL);
+      if (sent <= 0)
+         return -1;
+
+      n += sent;
+   }
+
+   /*  Read upto the end of the headers.  */
+   while (NULL == eoh) {
+      if (have >= sizeof(buffer) - 1)
+         return -1;
+
+      n = recv(fd, buffer + have, sizeof(buffer) - 1 - have, 0);
+      if (n <= 0)
+         return -1;
+
+      have += n;
+      buffer[have] = '\0';
+      eoh = strstr(buffer, "\r\n\r\n");
+   }
+
+   if (1 != sscanf(buffer, "HTTP/%*d.%*d %d", &status) )
+      return -1;
+
+   /*  Headers we care about - body length and connection reuse.  */
+   *eoh = '\0';
+   for (hdr = strstr(buffer, "\r\n"); NULL != hdr;
+        hdr = strstr(hdr + 2, "\r\n") ) {
+      if (0 == strncasecmp(hdr + 2, "Content-Length:", 15) )
+         content_length = strtol(hdr + 17, NULL, 10);
+      else if (0 == strncasecmp(hdr + 2, "Connection: keep-alive", 22) )
+         *keep_alive = 1;
+   }
+
+   /*  Read (and discard) the body.  */
+   body = (long) (have - (eoh + 4 - buffer) );
+   while ((content_length < 0)  ||  (body < content_length) ) {
+      n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n < 0)
+         return -1;
+
+      if (0 == n)
+         break;
+
+      body += n;
+   }
+
+   if ((content_length < 0)  ||  (body < content_length) )
+      *keep_alive = 0;
+
+   return status;
+
+}  /*  End of function  vhc_load_request_.  */
+
+
+
+/**
+ *   @brief   Connection thread - fire requests until the deadline.
+ *   @param   data  connection
+ *   @return  always NULL.
+ *
+ *   Connection thread - fire requests back-to-back at the target until
+ *   the deadline, (re)connecting when the server closes the connection.
+ *
+ */
+static void  *vhc_load_conn_thread_(void *data) {
+   VHC_load_conn_t   *conn = (VHC_load_conn_t *) data;
+   VHC_load_stats_t  *stats = conn->stats;
+   char               request[2048];
+   size_t             len;
+   uint64_t           started;
+   uint64_t           latency;
+   int                keep_alive = 0;
+   int                status;
+   int                fd = -1;
+
+   len = (size_t) snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.0\r\nHost: %s\r\n"
+                           "User-Agent: vhc_load\r\n"
+                           "Connection: keep-alive\r\n\r\n",
+                           conn->target->path, conn->target->host);
+
+   while (vhc_load_now_us_() < gs_deadline_us) {
+      started = vhc_load_now_us_();
+      if ((fd < 0)  &&  ((fd = vhc_load_connect_() ) < 0) ) {
+         stats->errors++;
+         usleep(1000);
+         continue;
+      }
+
+      status = vhc_load_request_(fd, request, len, &keep_alive);
+      latency = vhc_load_now_us_() - started;
+
+      if (status < 0)
+         stats->errors++;
+      else if (status == gs_choked_code) {
+         stats->choked++;
+         stats->choked_hist[vhc_load_bucket_(latency)]++;
+      }
+      else if ((status >= 200)  &&  (status < 400) ) {
+         stats->admitted++;
+         stats->admitted_hist[vhc_load_bucket_(latency)]++;
+      }
+      else
+         stats->other++;
+
+      if ((status < 0)  ||  !keep_alive) {
+         close(fd);
+         fd = -1;
+      }
+   }
+
+   if (fd >= 0)
+      close(fd);
+
+   return NULL;
+
+}  /*  End of function  vhc_load_conn_thread_.  */
+
+
+
+/**
+ *   @brief   Merge a connection's results into a target's.
+ *   @param   into  target results
+ *   @param   from  connection results
+ *
+ *   Merge a connection's results into a target's.
+ *
+ */
+static void  vhc_load_merge_(VHC_load_stats_t *into,
+                             VHC_load_stats_t *from) {
+   uint32_t  bucket;
+
+   into->admitted += from->admitted;
+   into->choked += from->choked;
+   into->other += from->other;
+   into->errors += from->errors;
+
+   for (bucket = 0; bucket < VHC_LOAD_BUCKETS; bucket++) {
+      into->admitted_hist[bucket] += from->admitted_hist[bucket];
+      into->choked_hist[bucket] += from->choked_hist[bucket];
+   }
+
+}  /*  End of function  vhc_load_merge_.  */
+
+
+
+/**
+ *   @brief   Print a result row.
+ *   @param   name      row name (vhost or total)
+ *   @param   stats     results
+ *   @param   duration  run duration (in seconds)
+ *
+ *   Print a result row - rates per second, latencies in milliseconds.
+ *
+ */
+static void  vhc_load_print_(const char *name, VHC_load_stats_t *stats,
+                             double duration) {
+
+   printf("%-24s %9.1f %9.1f %7lu %7lu %8.2f %8.2f %8.2f %8.2f %8.2f "
+          "%8.2f\n", name, stats->admitted / duration,
+          stats->choked / duration,
+          (unsigned long) stats->other, (unsigned long) stats->errors,
+          vhc_load_percentile_(stats->admitted_hist, 0.5),
+          vhc_load_percentile_(stats->admitted_hist, 0.99),
+          vhc_load_percentile_(stats->admitted_hist, 0.999),
+          vhc_load_percentile_(stats->choked_hist, 0.5),
+          vhc_load_percentile_(stats->choked_hist, 0.99),
+          vhc_load_percentile_(stats->choked_hist, 0.999) );
+
+}  /*  End of function  vhc_load_print_.  */
+
+
+
+/**
+ *   @brief   Print usage information.
+ *   @param   prog  program name
+ *
+ *   Print usage information.
+ *
+ */
+static void  vhc_load_usage_(const char *prog) {
+
+   fprintf(stderr,
+           "usage: %s [-a addr] [-p port] [-c conns] [-d secs] [-e code]\n"
+           "          <vhost>[/path] ...\n\n"
+           "   -a  server address                (default 127.0.0.1)\n"
+           "   -p  server port                   (default %d)\n"
+           "   -c  connections per vhost         (default %d)\n"
+           "   -d  duration in seconds           (default %d)\n"
+           "   -e  status code of choked requests (default %d)\n\n"
+           "Rates are per second, latencies in milliseconds.\n",
+           prog, VHC_LOAD_DEFAULT_PORT, VHC_LOAD_DEFAULT_CONNS,
+           VHC_LOAD_DEFAULT_DURATION, VHC_LOAD_DEFAULT_CHOKED);
+
+}  /*  End of function  vhc_load_usage_.  */
+
+/*  }}}  -- End section:internal-functions.  */
+
+
+/*  section:main {{{  */
+/*  ++++++++++++     */
+
+int  main(int argc, char **argv) {
+   VHC_load_target_t  *targets;
+   VHC_load_conn_t    *conns;
+   VHC_load_stats_t   *total;
+   const char         *addr = "127.0.0.1";
+   const char         *slash;
+   int                 port = VHC_LOAD_DEFAULT_PORT;
+   int                 nconns = VHC_LOAD_DEFAULT_CONNS;
+   int                 duration = VHC_LOAD_DEFAULT_DURATION;
+   int                 ntargets;
+   uint64_t            started;
+   double              elapsed;
+   int                 opt;
+   int                 t, c;
+
+   while (-1 != (opt = getopt(argc, argv, "a:p:c:d:e:h") ) ) {
+      switch (opt) {
+         case 'a':  addr = optarg;                    break;
+         case 'p':  port = atoi(optarg);              break;
+         case 'c':  nconns = atoi(optarg);            break;
+         case 'd':  duration = atoi(optarg);          break;
+         case 'e':  gs_choked_code = atoi(optarg);    break;
+         default:   vhc_load_usage_(argv[0]);
+                    return 1;
+      }
+   }
+
+   ntargets = argc - optind;
+   memset(&gs_server, 0, sizeof(gs_server) );
+   gs_server.sin_family = AF_INET;
+   gs_server.sin_port = htons((uint16_t) port);
+
+   if ((ntargets < 1)  ||  (ntargets > VHC_LOAD_MAX_TARGETS)  ||
+       (port < 1)  ||  (port > 65535)  ||  (duration < 1)  ||
+       (nconns < 1)  ||  (nconns > VHC_LOAD_MAX_CONNECTIONS)  ||
+       (1 != inet_pton(AF_INET, addr, &gs_server.sin_addr) ) ) {
+      vhc_load_usage_(argv[0]);
+      return 1;
+   }
+
+   targets = calloc(ntargets, sizeof(VHC_load_target_t) );
+   conns = calloc((size_t) ntargets * nconns, sizeof(VHC_load_conn_t) );
+   total = calloc(1, sizeof(VHC_load_stats_t) );
+   if ((NULL == targets)  ||  (NULL == conns)  ||  (NULL == total) )
+      return 1;
+
+   for (t = 0; t < ntargets; t++) {
+      slash = strchr(argv[optind + t], '/');
+      snprintf(targets[t].host, sizeof(targets[t].host), "%.*s",
+               (int) ((NULL == slash) ? strlen(argv[optind + t]) :
+                                        (size_t) (slash - argv[optind + t]) ),
+               argv[optind + t]);
+      snprintf(targets[t].path, sizeof(targets[t].path), "%s",
+               (NULL == slash) ? "/" : slash);
+   }
+
+   /*  One thread per connection - all of them go until the deadline.  */
+   started = vhc_load_now_us_();
+   gs_deadline_us = started + (uint64_t) duration * 1000000;
+
+   for (t = 0; t < ntargets; t++) {
+      for (c = 0; c < nconns; c++) {
+         VHC_load_conn_t  *conn = &conns[t * nconns + c];
+
+         conn->target = &targets[t];
+         conn->stats = calloc(1, sizeof(VHC_load_stats_t) );
+         if ((NULL == conn->stats)  ||
+             (0 != pthread_create(&conn->thread, NULL,
+                                  vhc_load_conn_thread_, conn) ) ) {
+            fprintf(stderr, "%s: can't start connection threads\n",
+                    argv[0]);
+            return 1;
+         }
+      }
+   }
+
+   for (c = 0; c < ntargets * nconns; c++) {
+      pthread_join(conns[c].thread, NULL);
+      vhc_load_merge_(&conns[c].target->stats, conns[c].stats);
+      free(conns[c].stats);
+   }
+
+   elapsed = (vhc_load_now_us_() - started) / 1e6;
+
+   printf("%-24s %9s %9s %7s %7s %8s %8s %8s %8s %8s %8s\n",
+          "vhost", "admit/s", "choke/s", "other", "errors",
+          "adm-p50", "adm-p99", "adm-999", "chk-p50", "chk-p99",
+          "chk-999");
+
+   for (t = 0; t < ntargets; t++) {
+      vhc_load_print_(targets[t].host, &targets[t].stats, elapsed);
+      vhc_load_merge_(total, &targets[t].stats);
+   }
+
+   vhc_load_print_("total", total, elapsed);
+
+   return 0;
+
+}  /*  End of function  main.  */
+
+/*  }}}  -- End section:main.  */
+
+
+
+/**
+ *  EOF
+ */
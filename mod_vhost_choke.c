@@ -17,10 +17,10 @@
 
 /*  section:compile {{{
  *  +++++++++++++++
- *     normal:  apxs -i -a -c mod_vhost_choke.c
- *     debug:   apxs -i -a -Wc,-g -Wc,-O0 -c mod_vhost_choke.c
+ *     normal:  apxs -i -a -c mod_vhost_choke.c vhc_engine.c
+ *     debug:   apxs -i -a -Wc,-g -Wc,-O0 -c mod_vhost_choke.c vhc_engine.c
  *     trace:   apxs -i -a -Wc,-g -Wc,-O0 -Wc,-DVHC_DEV_DEBUG    \
- *                   -c mod_vhost_choke.c
+ *                   -c mod_vhost_choke.c vhc_engine.c
  *
  *  }}}  -- End section:compile.
  */
@@ -33,16 +33,27 @@
 #include "mod_vhost_choke.h"
 
 #include "ap_config.h"
+#include "ap_mpm.h"
 
+#include "apr_atomic.h"
 #include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_portable.h"
 #include "apr_shm.h"
+#include "apr_signal.h"
 #include "apr_strings.h"
 #include "apr_tables.h"
+#include "apr_thread_proc.h"
+#include "apr_version.h"
 
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
 #include "http_protocol.h"
+#include "scoreboard.h"
+#include "util_filter.h"
+#include "util_script.h"
 /* #include "http_request.h"  */
 
 /*  We need to setup the mutex permissions for most *nix platforms.  */
@@ -61,6 +72,13 @@
 /*  Define for logging debug messages and turn on debugging.  */
 #define  VHC_DEBUG   if (VHC_TRUE == gs_vhc_env_settings.debug)
 
+/*  Define for the lock mechanism - need one that supports timed waits.  */
+#if APR_VERSION_AT_LEAST(1, 6, 0)
+   #define  VHC_LOCK_MECH  APR_LOCK_DEFAULT_TIMED
+#else
+   #define  VHC_LOCK_MECH  APR_LOCK_DEFAULT
+#endif  /*  APR_VERSION_AT_LEAST(1, 6, 0)  */
+
 /*  }}}  -- End section:defines.  */
 
 
@@ -79,6 +97,16 @@ static VHC_env_settings_t  gs_vhc_env_settings = {
 #endif
 
    .http_code   = VHC_DEFAULT_HTTP_ERROR_CODE,
+   .lock_mode   = VHC_DEFAULT_LOCK_MODE,
+   .lock_wait_usecs = VHC_MAX_LOCK_WAIT_TIME_USECS,
+   .lock_stripes    = VHC_DEFAULT_LOCK_STRIPES,
+   .admit_phase     = VHC_ADMIT_PHASE_POST_READ_REQUEST,
+   .release_at      = VHC_RELEASE_AT_EOS,
+   .dynamic_hosts   = 0,
+   .pool_slots      = 0,
+   .slot_batch      = 0,
+   .trace_records   = VHC_DEFAULT_TRACE_RECORDS,
+   .trace_dir       = NULL,    /*  DefaultRuntimeDir.  */
    .err_message = VHC_DEFAULT_ERROR_MSG
 };
 
@@ -87,12 +115,30 @@ static apr_file_t          *gs_debug_file  = NULL;
 
 static apr_uint16_t         gs_num_configs = 0;
 
-static char                *gs_shm_lockfile = NULL;  /*  Global lockf.  */
-static apr_global_mutex_t  *gs_shm_lock     = NULL;  /*  Global lock.   */
+static apr_uint16_t          gs_num_lock_stripes = 0;    /*  # stripes.  */
+static char               **gs_shm_lockfiles    = NULL; /*  Lockfiles.  */
+static apr_global_mutex_t **gs_shm_locks        = NULL; /*  Locks.      */
 
 static char                *gs_shm_file = NULL;  /*  shm file name.     */
 static apr_shm_t           *gs_shm      = NULL;  /*  shm segment.       */
 
+static server_rec          *gs_main_server = NULL;  /*  Server list head. */
+
+static VHC_persistent_state_t  *gs_state = NULL;  /*  Survives restarts.  */
+
+static apr_shm_t           *gs_host_shm = NULL;  /*  Per-Host buckets.  */
+
+static apr_shm_t           *gs_lease_shm   = NULL;  /*  Slot leases.    */
+static VHC_lease_child_t   *gs_lease_child = NULL;  /*  My leases.      */
+static apr_uint32_t         gs_lease_next  = 0;     /*  Lease hint.     */
+
+static VHC_trace_record_t  *gs_trace      = NULL;  /*  Trace ring.     */
+static volatile apr_uint32_t  gs_trace_seq  = 0;  /*  Last record #.  */
+static char                *gs_trace_file = NULL;  /*  Trace dump.     */
+
+/*  Pre-rendered decimal header values (0 .. VHC_DECIMAL_STRINGS - 1).  */
+static char                 gs_decimals[VHC_DECIMAL_STRINGS][8];
+
 /*  }}}  -- End section:globals.  */
 
 
@@ -104,19 +150,130 @@ static apr_shm_t           *gs_shm      = NULL;  /*  shm segment.       */
 /*  Internal helper functions.  */
 static void   vhc_initialize_process_env_(apr_pool_t *pool);
 static void   vhc_debug_log_(apr_pool_t *pool, char *fmt, ...);
+static void   vhc_trace_(apr_uint16_t event, apr_uint16_t config_id,
+                         apr_uint64_t slots, apr_uint32_t value);
+static void   vhc_get_trace_header_(VHC_trace_header_t *header);
+static int    vhc_dump_trace_(void);
+static void   vhc_trace_signal_(int signo);
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC  vhc_trace_thread_(apr_thread_t *thread,
+                                                 void *data);
+#endif  /*  APR_HAS_THREADS  */
+static void   vhc_init_trace_(apr_pool_t *pool);
+static int    vhc_send_trace_(request_rec *req);
 static char  *vhc_get_vhost_name_(server_rec *srvr);
-static void   vhc_generate_choked_headers_(request_rec  *req,
-                                           apr_uint16_t  http_code);
+static char  *vhc_escape_json_(apr_pool_t *pool, const char *str);
+static char  *vhc_escape_label_(apr_pool_t *pool, const char *str);
+static VHC_choked_response_t  *vhc_render_choked_response_(
+                                   apr_pool_t *pool,
+                                   VHC_server_config_t *cfg);
+static void   vhc_render_choked_responses_(apr_pool_t *pool,
+                                           server_rec *srvr);
+static void   vhc_generate_choked_headers_(request_rec *req,
+                                           VHC_choked_response_t *resp);
 static void   vhc_generate_choked_page_content_(request_rec *req,
-                                                const char  *title,
-                                                const char  *msg);
+                                          VHC_choked_response_t *resp);
+static const char  *vhc_get_decimal_(apr_pool_t *pool, apr_uint64_t n);
+static void   vhc_generate_retry_headers_(request_rec *req,
+                                          VHC_server_config_t *cfg,
+                                          VHC_shm_data_t *shmdata,
+                                          int reason);
 static char  *vhc_mktemp_(apr_pool_t *pool, const char *template);
-static int    vhc_create_global_lock_(apr_pool_t *pool);
+static int    vhc_create_global_lock_(apr_pool_t *pool,
+                                      apr_uint16_t stripe);
+static int    vhc_create_global_locks_(apr_pool_t *pool);
 static int    vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
-                                      const char *template, char *shmfile);
-static int    vhc_lock_acquire_(apr_global_mutex_t *lock,
-                                int timeout_usecs);
-static int    vhc_lock_release_(apr_global_mutex_t *lock);
+                                      const char *template, char **shmfile,
+                                      apr_uint16_t num_entries);
+static apr_global_mutex_t  *vhc_get_vhost_lock_(apr_uint16_t shm_index);
+static VHC_shm_header_t  *vhc_get_shm_header_(apr_shm_t *shm);
+static VHC_shm_data_t  *vhc_get_vhost_shm_data_(apr_uint16_t shm_index);
+static VHC_shm_stats_t  *vhc_get_vhost_stats_(apr_uint16_t shm_index);
+static int    vhc_acquire_vhost_lock_(apr_uint16_t shm_index);
+static apr_uint64_t  vhc_get_vhost_key_(apr_pool_t *pool, server_rec *srvr);
+static void   vhc_set_vhost_keys_(apr_pool_t *pool, server_rec *srvr);
+static VHC_persistent_state_t  *vhc_get_persistent_state_(apr_pool_t *pool);
+static void   vhc_reset_shm_entry_(VHC_shm_header_t *header,
+                                   apr_uint16_t shm_index,
+                                   apr_uint64_t vhost_key);
+static int    vhc_assign_shm_entries_(apr_pool_t *pool,
+                                      VHC_shm_header_t *header,
+                                      server_rec *srvr);
+static void   vhc_set_config_limits_(VHC_shm_header_t *header,
+                                     server_rec *srvr);
+static void   vhc_retire_shm_segment_(apr_pool_t *pool, apr_pool_t *ptemp,
+                                      apr_shm_t *shm,
+                                      VHC_shm_header_t *new_header,
+                                      server_rec *srvr);
+static void   vhc_reconcile_retired_shm_(void);
+static int    vhc_create_host_table_(apr_pool_t *pool, apr_pool_t *ptemp);
+static apr_uint64_t  vhc_get_host_key_(VHC_server_config_t *config,
+                                       const char *hostname);
+static VHC_shm_data_t  *vhc_get_host_shm_data_(VHC_server_config_t *config,
+                                               const char *hostname);
+static int    vhc_create_lease_area_(apr_pool_t *pool, apr_pool_t *ptemp);
+static VHC_lease_header_t  *vhc_get_lease_header_(void);
+static VHC_lease_child_t  *vhc_get_lease_child_(VHC_lease_header_t *header,
+                                                apr_uint32_t idx);
+static VHC_slot_lease_t  *vhc_get_slot_lease_(VHC_lease_child_t *child,
+                                              apr_uint32_t idx);
+static int    vhc_shm_has_entry_(apr_shm_t *shm, apr_uintptr_t shmdata);
+static int    vhc_is_shm_entry_(apr_uintptr_t shmdata);
+static apr_uint32_t  vhc_return_child_leases_(VHC_lease_header_t *header,
+                                              VHC_lease_child_t *child);
+static void   vhc_claim_lease_child_(apr_pool_t *pool);
+static apr_status_t  vhc_child_exit_cleanup_(void *arg);
+static VHC_slot_lease_t  *vhc_lease_slot_(VHC_shm_data_t *shmdata);
+static VHC_slot_block_t  *vhc_get_slot_block_at_(VHC_lease_header_t *header,
+                                                 VHC_lease_child_t *child,
+                                                 apr_uint32_t idx);
+static VHC_slot_block_t  *vhc_get_slot_block_(VHC_server_config_t *config,
+                                              VHC_shm_data_t *shmdata);
+static int    vhc_take_block_slot_(VHC_slot_block_t *block);
+static apr_uint64_t  vhc_release_block_slot_(VHC_server_config_t *config,
+                                             VHC_shm_data_t *shmdata,
+                                             VHC_slot_block_t *block);
+static void   vhc_reap_dead_children_(void);
+static void   vhc_set_pool_capacity_(VHC_shm_header_t *header);
+static apr_interval_time_t  vhc_reserve_vhost_bandwidth_(
+                                    VHC_server_config_t *config,
+                                    VHC_shm_data_t *shmdata,
+                                    apr_off_t nbytes, int *reserved);
+static int    vhc_admit_vhost_request_(VHC_server_config_t *config,
+                                       VHC_shm_data_t *shmdata,
+                                       apr_uint64_t *nslots,
+                                       apr_uint64_t *nextra);
+static apr_uint64_t  vhc_release_vhost_slot_(VHC_shm_data_t *shmdata);
+static apr_uint64_t  vhc_release_vhost_slots_(VHC_shm_data_t *shmdata,
+                                              apr_uint64_t nslots);
+static void   vhc_queue_wait_(volatile apr_uint32_t *wake_seq,
+                              apr_uint32_t seq,
+                              apr_interval_time_t timeout_usecs);
+static void   vhc_queue_wakeup_(volatile apr_uint32_t *wake_seq);
+static int    vhc_try_admit_(request_rec *req, VHC_server_config_t *cfg,
+                             VHC_shm_data_t *vhost_data,
+                             apr_uint64_t *nslots);
+static int    vhc_queue_for_slot_(request_rec *req, VHC_server_config_t *cfg,
+                                  VHC_shm_data_t *vhost_data,
+                                  apr_uint64_t *nslots);
+static void   vhc_send_choked_response_(request_rec *req);
+static request_rec  *vhc_get_top_request_(request_rec *req);
+static int    vhc_admit_request_(request_rec *req);
+static void   vhc_release_admission_(VHC_admission_t *admission,
+                                     int last_chance);
+static int    vhc_admit_subrequest_(request_rec *req);
+static int    vhc_get_vhost_status_(request_rec *req,
+                                    VHC_vhost_status_t **status);
+static void   vhc_print_status_json_(request_rec *req,
+                                     VHC_vhost_status_t *status, int n);
+static void   vhc_print_status_text_(request_rec *req,
+                                     VHC_vhost_status_t *status, int n);
+static apr_status_t  vhc_parse_request_rate_(const char *arg,
+                                             apr_uint32_t *interval,
+                                             apr_uint32_t *burst);
+static const char  *vhc_parse_vhost_limits_(apr_table_t *args,
+                                            VHC_vhost_limits_t *limits);
+static void   vhc_print_vhost_limits_(request_rec *req, server_rec *srvr);
 
 
 /*  Handlers for Apache module specific directives.  */
@@ -126,6 +283,26 @@ static const char  *vhc_set_error_code(cmd_parms *parms, void *unused,
                                        const char *arg);
 static const char  *vhc_set_error_message(cmd_parms *parms, void *unused,
                                           const char *arg);
+static const char  *vhc_set_lock_mode(cmd_parms *parms, void *unused,
+                                      const char *arg);
+static const char  *vhc_set_lock_wait_time(cmd_parms *parms, void *unused,
+                                           const char *arg);
+static const char  *vhc_set_lock_stripes(cmd_parms *parms, void *unused,
+                                         const char *arg);
+static const char  *vhc_set_admit_phase(cmd_parms *parms, void *unused,
+                                        const char *arg);
+static const char  *vhc_set_release_at(cmd_parms *parms, void *unused,
+                                       const char *arg);
+static const char  *vhc_set_dynamic_hosts(cmd_parms *parms, void *unused,
+                                          const char *arg);
+static const char  *vhc_set_capacity_pool(cmd_parms *parms, void *unused,
+                                          const char *arg);
+static const char  *vhc_set_slot_batch(cmd_parms *parms, void *unused,
+                                       const char *arg);
+static const char  *vhc_set_trace(cmd_parms *parms, void *unused,
+                                  const char *arg);
+static const char  *vhc_set_trace_dir(cmd_parms *parms, void *unused,
+                                      const char *arg);
 static const char  *vhc_set_slot_limit(cmd_parms *parms, void *unused,
                                        const char *arg);
 static const char  *vhc_set_burst_percent(cmd_parms *parms, void *unused,
@@ -135,16 +312,53 @@ static const char  *vhc_set_grace_period(cmd_parms *parms, void *unused,
 static const char  *vhc_set_burst_flap_period(cmd_parms *parms,
                                               void *unused,
                                               const char *arg);
+static const char  *vhc_set_request_rate(cmd_parms *parms, void *unused,
+                                         const char *arg);
+static const char  *vhc_set_request_burst(cmd_parms *parms, void *unused,
+                                          const char *arg);
+static const char  *vhc_set_queue_depth(cmd_parms *parms, void *unused,
+                                        const char *arg);
+static const char  *vhc_set_queue_timeout(cmd_parms *parms, void *unused,
+                                          const char *arg);
+static const char  *vhc_set_bandwidth(cmd_parms *parms, void *unused,
+                                      const char *arg);
+static const char  *vhc_set_per_host(cmd_parms *parms, void *unused,
+                                     int flag);
+static const char  *vhc_set_adaptive_limit(cmd_parms *parms, void *unused,
+                                           const char *arg1,
+                                           const char *arg2);
+static const char  *vhc_set_target_latency(cmd_parms *parms, void *unused,
+                                           const char *arg);
+static const char  *vhc_set_weight(cmd_parms *parms, void *unused,
+                                   const char *arg);
+static const char  *vhc_set_response_format(cmd_parms *parms,
+                                            void *unused, const char *arg);
+static const char  *vhc_set_retry_headers(cmd_parms *parms, void *unused,
+                                          const char *arg);
+static const char  *vhc_set_subrequests(cmd_parms *parms, void *unused,
+                                        const char *arg1,
+                                        const char *arg2);
 
 /*  Callbacks - hooks into Apache server/request lifecycle.  */
 static apr_status_t  vhc_req_pool_cleanup_(void *arg);
+static apr_status_t  vhc_subreq_pool_cleanup_(void *arg);
 
 static void  *vhc_create_server_config(apr_pool_t *pool, server_rec *srvr);
 static int    vhc_post_config(apr_pool_t *pool, apr_pool_t *plog,
                               apr_pool_t *ptemp, server_rec *srvr);
+static int   vhc_monitor(apr_pool_t *pool, server_rec *srvr);
 static void  vhc_child_init(apr_pool_t *pool, server_rec *srvr);
 static int   vhc_post_read_request(request_rec *req);
+static int   vhc_quick_handler(request_rec *req, int lookup_uri);
 static int   vhc_handler(request_rec *req);
+static int   vhc_status_handler(request_rec *req);
+static int   vhc_admin_handler(request_rec *req);
+static int   vhc_log_transaction(request_rec *req);
+static void  vhc_insert_filter(request_rec *req);
+static apr_status_t  vhc_release_filter(ap_filter_t *f,
+                                        apr_bucket_brigade *bb);
+static apr_status_t  vhc_bandwidth_filter(ap_filter_t *f,
+                                          apr_bucket_brigade *bb);
 static void  vhc_register_hooks(apr_pool_t *pool);
 
 
@@ -169,10 +383,19 @@ static void  vhc_register_hooks(apr_pool_t *pool);
  */
 static void  vhc_initialize_process_env_(apr_pool_t *pool) {
    apr_status_t   status;
+   int            n;
 
    /*  Get my process id.  */
    gs_mypid = getpid();
 
+   /*  Render the decimal header values (retry hints) up front.  */
+   for (n = 0; n < VHC_DECIMAL_STRINGS; n++)
+      apr_snprintf(gs_decimals[n], sizeof(gs_decimals[n]), "%d", n);
+
+   /*  Route the admission engine's debug messages to our debug log.  */
+   vhc_debug_out_ = (VHC_TRUE == gs_vhc_env_settings.debug) ?
+                       vhc_debug_log_ : NULL;
+
    /*  Link gs_debug_file to stderr.  */
    status = apr_file_open_stderr(&gs_debug_file, pool);
    if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
@@ -213,7 +436,7 @@ static void  vhc_debug_log_(apr_pool_t *pool, char *fmt, ...) {
    va_start(ap, fmt);
 
    if (NULL == pool) {
-      vsprintf(buffer, fmt, ap);
+      apr_vsnprintf(buffer, sizeof(buffer), fmt, ap);
       msg = buffer;
    } 
    else
@@ -234,6 +457,261 @@ static void  vhc_debug_log_(apr_pool_t *pool, char *fmt, ...) {
 
 
 
+/**
+ *   @brief   Record an admission event in this child's trace ring.
+ *   @param   event      event type (VHC_trace_event)
+ *   @param   config_id  vhost config id (or VHC_TRACE_NO_CONFIG)
+ *   @param   slots      # of slots in use
+ *   @param   value      event specific value
+ *
+ *   Record an admission event in this child's trace ring - lock-free, the
+ *   writer claims the next record with an atomic increment and stamps its
+ *   sequence # once the record is filled in. Old records get overwritten.
+ *
+ */
+static void  vhc_trace_(apr_uint16_t event, apr_uint16_t config_id,
+                        apr_uint64_t slots, apr_uint32_t value) {
+
+   VHC_trace_record_t  *record;
+   apr_uint32_t         seq;
+
+   if (NULL == gs_trace)
+      return;   /*  Tracing is off (or not in a child).  */
+
+   seq = apr_atomic_inc32(&gs_trace_seq) + 1;
+   record = &gs_trace[seq & (gs_vhc_env_settings.trace_records - 1)];
+
+   apr_atomic_set32(&record->seq, 0);   /*  Being written.  */
+
+   record->timestamp = (uint64_t) apr_time_now();
+   record->pid       = (uint32_t) gs_mypid;
+   record->tid       = (uint32_t) (apr_uintptr_t) apr_os_thread_current();
+   record->config_id = config_id;
+   record->event     = event;
+   record->slots     = (slots > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) slots;
+   record->value     = value;
+
+   apr_atomic_set32(&record->seq, seq);
+
+}  /*  End of function  vhc_trace_.  */
+
+
+
+/**
+ *   @brief   Fill in the header of a trace dump.
+ *   @param   header  trace dump header
+ *
+ *   Fill in the header of a dump of this child's trace ring. Only uses
+ *   async-signal-safe calls (dumps are made from a signal handler).
+ *
+ */
+static void  vhc_get_trace_header_(VHC_trace_header_t *header) {
+
+   struct timespec  now;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+
+   header->magic       = VHC_TRACE_MAGIC;
+   header->version     = VHC_TRACE_VERSION;
+   header->record_size = sizeof(VHC_trace_record_t);
+   header->num_records = gs_vhc_env_settings.trace_records;
+   header->pid         = (uint32_t) gs_mypid;
+   header->next_seq    = gs_trace_seq + 1;
+   header->dumped_at   = (uint64_t) now.tv_sec * APR_USEC_PER_SEC +
+                         (uint64_t) now.tv_nsec / 1000;
+
+}  /*  End of function  vhc_get_trace_header_.  */
+
+
+
+/**
+ *   @brief   Dump this child's trace ring to its trace file.
+ *   @return  0 on success, -1 on failure.
+ *
+ *   Dump this child's trace ring (header + all the records) to its trace
+ *   file - VHostChokeTraceDir/vhc-trace.<pid>. Async-signal-safe. Any
+ *   old dump is removed first and the file is created exclusively, so a
+ *   file (or symlink) planted in its place is never written through.
+ *
+ */
+static int  vhc_dump_trace_(void) {
+
+   VHC_trace_header_t  header;
+   size_t              nbytes;
+   int                 fd;
+   int                 rc = 0;
+
+   if ((NULL == gs_trace)  ||  (NULL == gs_trace_file) )
+      return -1;
+
+   if ((0 != unlink(gs_trace_file) )  &&  (ENOENT != errno) )
+      return -1;
+
+   fd = open(gs_trace_file, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+   if (fd < 0)
+      return -1;
+
+   vhc_get_trace_header_(&header);
+   nbytes = (size_t) header.num_records * sizeof(VHC_trace_record_t);
+
+   if ((write(fd, &header, sizeof(header) ) != (ssize_t) sizeof(header) ) ||
+       (write(fd, gs_trace, nbytes) != (ssize_t) nbytes) )
+      rc = -1;
+
+   close(fd);
+   return rc;
+
+}  /*  End of function  vhc_dump_trace_.  */
+
+
+
+/**
+ *   @brief   Signal handler - dump the trace ring.
+ *   @param   signo  signal number
+ *
+ *   Signal (VHC_TRACE_DUMP_SIGNAL) handler - dump this child's trace
+ *   ring to its trace file (preserving the interrupted code's errno).
+ *
+ */
+static void  vhc_trace_signal_(int signo) {
+
+   int  saved_errno = errno;
+
+   vhc_dump_trace_();
+   errno = saved_errno;
+
+}  /*  End of function  vhc_trace_signal_.  */
+
+
+
+#if APR_HAS_THREADS
+/**
+ *   @brief   Trace dump thread - waits for the dump signal.
+ *   @param   thread  this thread
+ *   @param   data    unused
+ *   @return  never returns.
+ *
+ *   Threaded MPMs (worker, event) block the signals in every thread of a
+ *   child, so the signal handler never runs there - this thread waits
+ *   for VHC_TRACE_DUMP_SIGNAL (sigwait) and dumps the ring instead.
+ *
+ */
+static void * APR_THREAD_FUNC  vhc_trace_thread_(apr_thread_t *thread,
+                                                 void *data) {
+
+   sigset_t  sigset;
+   int       signo;
+
+   sigemptyset(&sigset);
+   sigaddset(&sigset, VHC_TRACE_DUMP_SIGNAL);
+   pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+   for ( ; ; ) {
+      if ((0 == sigwait(&sigset, &signo) )  &&
+          (VHC_TRACE_DUMP_SIGNAL == signo) )
+         vhc_dump_trace_();
+   }
+
+   return NULL;
+
+}  /*  End of function  vhc_trace_thread_.  */
+#endif  /*  APR_HAS_THREADS  */
+
+
+
+/**
+ *   @brief   Set up this child's trace ring.
+ *   @param   pool  memory pool (child lifetime)
+ *
+ *   Set up this child's trace ring (VHostChokeTrace records) and its
+ *   trace file name, and dump the ring on VHC_TRACE_DUMP_SIGNAL - from
+ *   the signal handler (prefork) or a thread that waits for the signal
+ *   (threaded MPMs).
+ *
+ */
+static void  vhc_init_trace_(apr_pool_t *pool) {
+
+   const char        *trace_dir;
+
+#if APR_HAS_THREADS
+   apr_threadattr_t  *attr;
+   apr_thread_t      *thread;
+   apr_status_t       status;
+   int                threaded = AP_MPMQ_NOT_SUPPORTED;
+#endif  /*  APR_HAS_THREADS  */
+
+   if (0 == gs_vhc_env_settings.trace_records)
+      return;   /*  Tracing is off.  */
+
+   gs_trace = apr_pcalloc(pool, gs_vhc_env_settings.trace_records *
+                                sizeof(VHC_trace_record_t) );
+   gs_trace_seq  = 0;
+
+   /*  Dumps go to the DefaultRuntimeDir unless told otherwise.  */
+   trace_dir = gs_vhc_env_settings.trace_dir;
+   if (NULL == trace_dir)
+      trace_dir = ap_runtime_dir_relative(pool, "");
+
+   if (NULL != trace_dir)
+      gs_trace_file = apr_psprintf(pool, "%s/%s.%ld", trace_dir,
+                                   VHC_TRACE_FILE_PREFIX, (long) gs_mypid);
+
+   apr_signal(VHC_TRACE_DUMP_SIGNAL, vhc_trace_signal_);
+
+#if APR_HAS_THREADS
+   /*  Threaded MPMs block the signal in all their threads.  */
+   ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded);
+   if (AP_MPMQ_NOT_SUPPORTED == threaded)
+      return;
+
+   status = apr_threadattr_create(&attr, pool);
+   if (VHC_APR_STATUS_IS_SUCCESS(status) ) {
+      apr_threadattr_detach_set(attr, 1);
+      status = apr_thread_create(&thread, attr, vhc_trace_thread_, NULL,
+                                 pool);
+   }
+
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      ap_log_perror(APLOG_MARK, APLOG_WARNING, status, pool,
+                    "%s: no trace dump thread, SIGUSR2 won't dump the "
+                    "trace (use ?trace) - pid=%ld", VHC_MODULE_NAME,
+                    (long int) gs_mypid);
+#endif  /*  APR_HAS_THREADS  */
+
+}  /*  End of function  vhc_init_trace_.  */
+
+
+
+/**
+ *   @brief   Send this child's trace ring back to the client.
+ *   @param   req  request record
+ *   @return  OK on success, HTTP_NOT_FOUND if tracing is off.
+ *
+ *   Send a dump of the trace ring of the child that serves the request
+ *   back to the client (status handler ?trace) - same format as the
+ *   trace files.
+ *
+ */
+static int  vhc_send_trace_(request_rec *req) {
+
+   VHC_trace_header_t  header;
+
+   if (NULL == gs_trace)
+      return HTTP_NOT_FOUND;
+
+   vhc_get_trace_header_(&header);
+
+   ap_set_content_type(req, VHC_TRACE_CONTENT_TYPE);
+   ap_rwrite(&header, sizeof(header), req);
+   ap_rwrite(gs_trace, (int) (header.num_records *
+                              sizeof(VHC_trace_record_t) ), req);
+
+   return OK;
+
+}  /*  End of function  vhc_send_trace_.  */
+
+
+
 /**
  *   @brief   Returns the name of the vhost for a request.
  *   @param   srvr  server record
@@ -256,71 +734,325 @@ static char  *vhc_get_vhost_name_(server_rec *srvr) {
 
 
 /**
- *   @brief   Generate HTTP headers for the choked page (response).
- *   @param   req   request record
+ *   @brief   Escape a string for use in a JSON string value.
+ *   @param   pool  memory pool
+ *   @param   str   string to escape
+ *   @return  escaped string (str itself if there's nothing to escape).
+ *
+ *   Escape the double quotes, backslashes and control characters in a
+ *   string so that it can go into a JSON string value.
+ *
+ */
+static char  *vhc_escape_json_(apr_pool_t *pool, const char *str) {
+
+   static const char  *hex = "0123456789abcdef";
+   const unsigned char  *p;
+   char                 *escaped;
+   char                 *q;
+   apr_size_t            n = 0;
+
+   for (p = (const unsigned char *) str; *p; p++)
+      n += ('"' == *p  ||  '\\' == *p) ? 2 : ((*p < 0x20) ? 6 : 1);
+
+   if (n == strlen(str) )
+      return (char *) str;
+
+   escaped = q = apr_palloc(pool, n + 1);
+   for (p = (const unsigned char *) str; *p; p++) {
+      if ('"' == *p  ||  '\\' == *p) {
+         *q++ = '\\';
+         *q++ = (char) *p;
+      }
+      else if (*p < 0x20) {
+         memcpy(q, "\\u00", 4);
+         q[4] = hex[*p >> 4];
+         q[5] = hex[*p & 0xf];
+         q += 6;
+      }
+      else
+         *q++ = (char) *p;
+   }
+
+   *q = '\0';
+   return escaped;
+
+}  /*  End of function  vhc_escape_json_.  */
+
+
+
+/**
+ *   @brief   Escape a string for use in a Prometheus label value.
+ *   @param   pool  memory pool
+ *   @param   str   string to escape
+ *   @return  escaped string (str itself if there's nothing to escape).
+ *
+ *   Escape the double quotes, backslashes and newlines in a string so
+ *   that it can go into a label value of the Prometheus text format.
+ *
+ */
+static char  *vhc_escape_label_(apr_pool_t *pool, const char *str) {
+
+   const char  *p;
+   char        *escaped;
+   char        *q;
+   apr_size_t   n = 0;
+
+   for (p = str; *p; p++)
+      n += ('"' == *p  ||  '\\' == *p  ||  '\n' == *p) ? 2 : 1;
+
+   if (n == strlen(str) )
+      return (char *) str;
+
+   escaped = q = apr_palloc(pool, n + 1);
+   for (p = str; *p; p++) {
+      if ('"' == *p  ||  '\\' == *p  ||  '\n' == *p)
+         *q++ = '\\';
+
+      *q++ = ('\n' == *p) ? 'n' : *p;
+   }
+
+   *q = '\0';
+   return escaped;
+
+}  /*  End of function  vhc_escape_label_.  */
+
+
+
+/**
+ *   @brief   Render the choked response for a vhost.
+ *   @param   pool  memory pool (lives as long as the config)
+ *   @param   cfg   vhost config
+ *   @return  the rendered choked response.
+ *
+ *   Render the choked response (status line, extension header and the
+ *   body in the vhost's response format) once up front - choking a
+ *   request then just sends these bytes as is.
+ *
+ */
+static VHC_choked_response_t  *vhc_render_choked_response_(
+                                   apr_pool_t *pool,
+                                   VHC_server_config_t *cfg) {
+
+   VHC_choked_response_t  *resp;
+   const char             *title = VHC_HTTP_MSG_TOO_MANY_REQUESTS;
+   const char             *msg   = gs_vhc_env_settings.err_message;
+
+   resp = apr_pcalloc(pool, sizeof(VHC_choked_response_t) );
+
+   resp->status      = gs_vhc_env_settings.http_code;
+   resp->status_line = apr_psprintf(pool, "%d %s", resp->status, title);
+   resp->x_throttled_by = VHC_MODULE_BASEPRODUCT "/" VHC_MODULE_VERSION;
+
+   switch (cfg->response_format) {
+      case VHC_RESPONSE_FORMAT_JSON:
+         resp->content_type = VHC_CHOKED_JSON_CONTENT_TYPE;
+         resp->body = apr_psprintf(pool, "{\"status\": %d, \"error\": "
+                                         "\"%s\", \"message\": \"%s\"}\n",
+                                   resp->status, title,
+                                   vhc_escape_json_(pool, msg) );
+         break;
+
+      case VHC_RESPONSE_FORMAT_PLAIN:
+         resp->content_type = VHC_CHOKED_PLAIN_CONTENT_TYPE;
+         resp->body = apr_psprintf(pool, "%s: %s\n%s\n",
+                                   VHC_MODULE_BASEPRODUCT, title, msg);
+         break;
+
+      default:
+         resp->content_type = VHC_CHOKED_HTML_CONTENT_TYPE;
+         resp->body = apr_pstrcat(pool, DOCTYPE_HTML_3_2,
+                         "<HTML>\n  <HEAD><TITLE>", VHC_MODULE_BASEPRODUCT,
+                         ": ", title, "</TITLE></HEAD>\n",
+                         "  <BODY><BR/><H3>", VHC_MODULE_BASEPRODUCT, ": ",
+                         title, "</H3><BR/>", msg, "<BR/></BODY>\n",
+                         "</HTML>\n", NULL);
+         break;
+   }
+
+   resp->body_len       = strlen(resp->body);
+   resp->content_length = apr_off_t_toa(pool, (apr_off_t) resp->body_len);
+
+   return resp;
+
+}  /*  End of function  vhc_render_choked_response_.  */
+
+
+
+/**
+ *   @brief   Render the choked responses for all the vhosts.
+ *   @param   pool  memory pool (lives as long as the config)
+ *   @param   srvr  server record (head of the server list)
  *
- *   Generate HTTP headers for the choked page (response) that we send
- *   back to the client.
+ *   Render the choked response of every vhost in the server list.
  *
  */
-static void  vhc_generate_choked_headers_(request_rec  *req,
-                                          apr_uint16_t  http_code) {
+static void  vhc_render_choked_responses_(apr_pool_t *pool,
+                                          server_rec *srvr) {
+
+   VHC_server_config_t  *cfg;
+   server_rec           *s;
+
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = (VHC_server_config_t *)
+               ap_get_module_config(s->module_config, &vhost_choke_module);
+
+      cfg->choked = vhc_render_choked_response_(pool, cfg);
+   }
 
-   apr_pool_t  *pool = req->pool;
-   char        *status_line;
-   char        *x_throttled_by;
+}  /*  End of function  vhc_render_choked_responses_.  */
 
-   /*  Build the status line.  */
-   status_line = apr_psprintf(pool, "%d %s", http_code,
-                                    VHC_HTTP_MSG_TOO_MANY_REQUESTS);
+
+
+/**
+ *   @brief   Set the HTTP headers of the choked response.
+ *   @param   req    request record
+ *   @param   resp   pre-rendered choked response
+ *
+ *   Set the status, content type, Content-Length and X-Throttled-By
+ *   headers of the choked response we send back to the client. All the
+ *   values are pre-rendered, so nothing gets copied or formatted.
+ *
+ */
+static void  vhc_generate_choked_headers_(request_rec *req,
+                                          VHC_choked_response_t *resp) {
 
    /*  Set content type, status and status line.  */
-   ap_set_content_type(req, VHC_CHOKED_RESPONSE_CONTENT_TYPE);
-   req->status      = http_code;
-   req->status_line = status_line;
+   ap_set_content_type(req, resp->content_type);
+   req->status      = resp->status;
+   req->status_line = resp->status_line;
 
-   /*  Build the X-Throttled-By extension header.  */
-   x_throttled_by = apr_psprintf(pool, "%s/%s", VHC_MODULE_BASEPRODUCT,
-                                       VHC_MODULE_VERSION);
+   /*  Set the body length - it's known up front.  */
+   req->clength = (apr_off_t) resp->body_len;
+   apr_table_setn(req->headers_out, "Content-Length", resp->content_length);
 
    /*  Set the extension header.  */
-   apr_table_set(req->headers_out, VHC_X_THROTTLED_BY_HEADER_NAME,
-                                   x_throttled_by);
+   apr_table_setn(req->headers_out, VHC_X_THROTTLED_BY_HEADER_NAME,
+                                    resp->x_throttled_by);
 
 }  /*  End of function  vhc_generate_choked_headers_.  */
 
 
 
 /**
- *   @brief   Generate the choked page content to return back to client.
- *   @param   req     request record
- *   @param   title   custom page title
- *   @param   msg     custom message
+ *   @brief   Send the choked page content back to the client.
+ *   @param   req    request record
+ *   @param   resp   pre-rendered choked response
  *
- *   Generate the choked page content to return back to client.
+ *   Send the pre-rendered choked page content back to the client - as a
+ *   single immortal bucket (the body lives as long as the config).
  *
  */
 static void  vhc_generate_choked_page_content_(request_rec *req,
-                                               const char  *title,
-                                               const char  *msg) {
-
-   /*  Add doctype.  */
-   ap_rputs(DOCTYPE_HTML_3_2, req);
-
-   /*  Add heading - page title and body content.  */
-   ap_rprintf(req, "<HTML>\n  <HEAD><TITLE>%s: %s</TITLE></HEAD>\n",
-                   VHC_MODULE_BASEPRODUCT,
-                   title ? title : VHC_HTTP_MSG_TOO_MANY_REQUESTS);
-   ap_rprintf(req, "  <BODY><BR/><H3>%s: %s</H3><BR/>%s<BR/></BODY>\n",
-                   VHC_MODULE_BASEPRODUCT,
-                   title ? title : VHC_HTTP_MSG_TOO_MANY_REQUESTS,
-                   msg ? msg : VHC_DEFAULT_ERROR_MSG);
-   ap_rprintf(req, "</HTML>\n");
+                                          VHC_choked_response_t *resp) {
+
+   conn_rec            *c = req->connection;
+   apr_bucket_brigade  *bb;
+   apr_bucket          *b;
+
+   bb = apr_brigade_create(req->pool, c->bucket_alloc);
+   b  = apr_bucket_immortal_create(resp->body, resp->body_len,
+                                   c->bucket_alloc);
+   APR_BRIGADE_INSERT_TAIL(bb, b);
+   APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(c->bucket_alloc) );
+
+   ap_pass_brigade(req->output_filters, bb);
 
 }  /*  End of function  vhc_generate_choked_page_content_.  */
 
 
 
+/**
+ *   @brief   Get the decimal string for a header value.
+ *   @param   pool  memory pool (only used for large values)
+ *   @param   n     value
+ *   @return  the decimal string.
+ *
+ *   Get the decimal string for a header value - a pre-rendered one if it
+ *   is small enough, so it doesn't get formatted (or allocated).
+ *
+ */
+static const char  *vhc_get_decimal_(apr_pool_t *pool, apr_uint64_t n) {
+
+   if (n < VHC_DECIMAL_STRINGS)
+      return gs_decimals[n];
+
+   return apr_psprintf(pool, "%" APR_UINT64_T_FMT, n);
+
+}  /*  End of function  vhc_get_decimal_.  */
+
+
+
+/**
+ *   @brief   Set the retry hint headers of the choked response.
+ *   @param   req      request record
+ *   @param   cfg      vhost config
+ *   @param   shmdata  vhost (or per-Host bucket) shm data
+ *   @param   reason   why the request got choked (VHC_CHOKED_*)
+ *
+ *   Set the Retry-After header (and the RateLimit-* headers if asked
+ *   for) of a choked response - when the vhost is predicted to admit a
+ *   request again, plus upto 50% jitter so that the choked clients don't
+ *   all come back at the same time.
+ *
+ */
+static void  vhc_generate_retry_headers_(request_rec *req,
+                                         VHC_server_config_t *cfg,
+                                         VHC_shm_data_t *shmdata,
+                                         int reason) {
+
+   apr_interval_time_t  wait;
+   apr_time_t           cooldown_expires_at = 0;
+   apr_time_t           changed_at;
+   apr_uint64_t         secs;
+   apr_uint64_t         limit;
+   apr_uint32_t         hash;
+   const char          *retry_after;
+
+   if (VHC_RETRY_HEADERS_OFF == cfg->retry_headers)
+      return;
+
+   /*  Cooling down - no bursting until the flap period is over.  */
+   if (VHC_BURST_STATE_COOLDOWN ==
+          vhc_get_burst_state_(cfg, shmdata, vhc_monotonic_now_(),
+                               &changed_at) )
+      cooldown_expires_at = VHC_ATOMIC_LOAD(&shmdata->grace_expires_at) +
+                            apr_time_from_sec(
+                               cfg->burst_settings.flap_period);
+
+   wait = vhc_get_retry_after_(cfg, shmdata, reason, cooldown_expires_at);
+   secs = (apr_uint64_t) (wait + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC;
+   if (secs < 1)
+      secs = 1;
+
+   /*  Jitter (0 - 50%, at least 0-1s) - hash of request time + conn id. */
+   hash  = ((apr_uint32_t) req->request_time ^
+            ((apr_uint32_t) req->connection->id << 16) ) * 2654435761U;
+   hash ^= hash >> 16;
+   secs += hash % ((secs + 1) / 2 + 1);
+   if (secs > VHC_MAX_RETRY_AFTER)
+      secs = VHC_MAX_RETRY_AFTER;
+
+   retry_after = vhc_get_decimal_(req->pool, secs);
+   apr_table_setn(req->headers_out, VHC_RETRY_AFTER_HEADER_NAME,
+                                    retry_after);
+
+   if (VHC_RETRY_HEADERS_RATELIMIT != cfg->retry_headers)
+      return;
+
+   limit = (VHC_CHOKED_NO_TOKENS == reason) ? cfg->rate_settings.burst :
+              vhc_get_slot_limit_(cfg, shmdata);
+
+   apr_table_setn(req->headers_out, VHC_RATELIMIT_LIMIT_HEADER_NAME,
+                                    vhc_get_decimal_(req->pool, limit) );
+   apr_table_setn(req->headers_out, VHC_RATELIMIT_REMAINING_HEADER_NAME,
+                                    gs_decimals[0]);
+   apr_table_setn(req->headers_out, VHC_RATELIMIT_RESET_HEADER_NAME,
+                                    retry_after);
+
+}  /*  End of function  vhc_generate_retry_headers_.  */
+
+
+
 /**
  *   @brief   Generate a temporary file name using the specified template.
  *   @param   pool      memory pool
@@ -355,16 +1087,19 @@ static char  *vhc_mktemp_(apr_pool_t *pool, const char *template) {
 
 
 /**
- *   @brief   Create a global lock to enable exclusive access to the shm.
- *   @param   pool  memory pool
+ *   @brief   Create a global lock (stripe) to enable exclusive access to
+ *            the shm.
+ *   @param   pool    memory pool
+ *   @param   stripe  lock stripe to create
  *   @return  APR_SUCCESS on success, otherwise HTTP_INTERNAL_SERVER_ERROR
  *            if lock creation/setting permissions failed.
  *
  *   Create a global lock to enable exclusive access to the shared memory
- *   segment we use for storing counters + grace expiry time.
+ *   segment we use for storing counters + grace expiry time. Each lock
+ *   stripe guards the vhosts whose config id maps onto it.
  *
  */
-static int  vhc_create_global_lock_(apr_pool_t *pool) {
+static int  vhc_create_global_lock_(apr_pool_t *pool, apr_uint16_t stripe) {
    apr_status_t  status;
 
    VHC_DEBUG  vhc_debug_log_(pool, "%s: Generate lock file name ...",
@@ -374,33 +1109,36 @@ static int  vhc_create_global_lock_(apr_pool_t *pool) {
     *  Generate a temporary lock file using our pid. Its a global so that
     *  we can use it across the servers (children inherit this).
     */
-   gs_shm_lockfile = vhc_mktemp_(pool, "lock");
+   gs_shm_lockfiles[stripe] = vhc_mktemp_(pool,
+                                          apr_psprintf(pool, "lock.%u.%d",
+                                                       gs_state->generation,
+                                                       (int) stripe) );
 
    /*
     *  Create a global lock using the apr routines.
     *  Note: Depending on the OS + lock type, the lockfile may or may not
     *        be created/used.
     */
-   status = apr_global_mutex_create(&gs_shm_lock,
-                                    (const char *) gs_shm_lockfile,
-                                    APR_LOCK_DEFAULT, pool);
+   status = apr_global_mutex_create(&gs_shm_locks[stripe],
+                                    (const char *) gs_shm_lockfiles[stripe],
+                                    VHC_LOCK_MECH, pool);
    VHC_DEBUG  vhc_debug_log_(pool, "%s: Global lock create returned %d", 
                                    VHC_LOC, status);
    if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
       ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
                     "%s: Failed to create global lock - file=%s",
-                    VHC_MODULE_NAME, gs_shm_lockfile);
+                    VHC_MODULE_NAME, gs_shm_lockfiles[stripe]);
       return HTTP_INTERNAL_SERVER_ERROR;
    }
 
 #ifdef AP_NEED_TO_SET_MUTEX_PERMS
-   status = unixd_set_global_mutex_perms(gs_shm_lock);
+   status = unixd_set_global_mutex_perms(gs_shm_locks[stripe]);
    VHC_DEBUG  vhc_debug_log_(pool, "%s: unixd set lock perms returned %d", 
                                    VHC_LOC, status);
    if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
       ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
                     "%s: Failed to set global lock perms - file=%s",
-                    VHC_MODULE_NAME, gs_shm_lockfile);
+                    VHC_MODULE_NAME, gs_shm_lockfiles[stripe]);
       return HTTP_INTERNAL_SERVER_ERROR;
    }
 
@@ -408,7 +1146,8 @@ static int  vhc_create_global_lock_(apr_pool_t *pool) {
 
 
    /*  All's well - return success.  */
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Global lock created OK", VHC_LOC);
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Global lock %d created OK",
+                                   VHC_LOC, (int) stripe);
 
    return APR_SUCCESS;
 
@@ -416,6 +1155,40 @@ static int  vhc_create_global_lock_(apr_pool_t *pool) {
 
 
 
+/**
+ *   @brief   Create all the global lock stripes.
+ *   @param   pool  memory pool
+ *   @return  APR_SUCCESS on success, otherwise HTTP_INTERNAL_SERVER_ERROR
+ *            if lock creation failed.
+ *
+ *   Create the configured number of global lock stripes, so that busy
+ *   vhosts only contend with the vhosts sharing their stripe.
+ *
+ */
+static int  vhc_create_global_locks_(apr_pool_t *pool) {
+   apr_status_t  status;
+   apr_uint16_t  stripe;
+
+   gs_num_lock_stripes = gs_vhc_env_settings.lock_stripes;
+   gs_shm_lockfiles = apr_pcalloc(pool, gs_num_lock_stripes * sizeof(char *) );
+   gs_shm_locks = apr_pcalloc(pool, gs_num_lock_stripes *
+                                    sizeof(apr_global_mutex_t *) );
+
+   for (stripe = 0; stripe < gs_num_lock_stripes; stripe++) {
+      status = vhc_create_global_lock_(pool, stripe);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
+   }
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Created %d lock stripes",
+                                   VHC_LOC, (int) gs_num_lock_stripes);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_create_global_locks_.  */
+
+
+
 /**
  *   @brief   Create a shared memory segment to use for storing vhost
  *            slot counters + grace expiry time.
@@ -431,25 +1204,27 @@ static int  vhc_create_global_lock_(apr_pool_t *pool) {
  *
  */
 static int  vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
-                                    const char *template, char *shmfile) {
-   apr_status_t     status;
-   apr_size_t       shm_size;
-   apr_size_t       alloc_size;
-   VHC_shm_data_t  *baseaddr;
+                                    const char *template, char **shmfile,
+                                    apr_uint16_t num_entries) {
+   apr_status_t       status;
+   apr_size_t         shm_size;
+   apr_size_t         alloc_size;
+   VHC_shm_header_t  *baseaddr;
 
    VHC_DEBUG  vhc_debug_log_(pool, "%s: Generate %s file name ...",
                                    VHC_LOC, template);
 
    /*  Generate a temporary lock file using our pid.  */
-   shmfile = vhc_mktemp_(pool, template);
+   *shmfile = vhc_mktemp_(pool, template);
 
-   shm_size = (apr_size_t) (gs_num_configs * sizeof(VHC_server_config_t) );
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: need shm size %ld for #%d configs",
+   /*  Table header + entries and stats shards for every vhost config.  */
+   shm_size = vhc_get_table_size_(num_entries);
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: need shm size %ld for #%d entries",
                                    VHC_LOC, (long int) shm_size,
-                                   gs_num_configs);
+                                   (int) num_entries);
 
    /*  First check if the shm segment exists and try cleaning it up.  */
-   status = apr_shm_attach(shm, (const char *) shmfile, pool);
+   status = apr_shm_attach(shm, (const char *) *shmfile, pool);
    VHC_DEBUG  vhc_debug_log_(pool, "%s: OLD shm attach check returned %d",
                                    VHC_LOC, status);
 
@@ -457,7 +1232,7 @@ static int  vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
       /*  Have an shm segment (since attach worked).  */
       ap_log_perror(APLOG_MARK, APLOG_WARNING, status, pool,
                     "%s: existing/old shm - file=%s, destroying it",
-                    VHC_MODULE_NAME, shmfile);
+                    VHC_MODULE_NAME, *shmfile);
 
       status = apr_shm_destroy(*shm);
       VHC_DEBUG  vhc_debug_log_(pool, "%s: OLD shm destroy returned %d",
@@ -472,13 +1247,13 @@ static int  vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
 
 
    /*  Now create a shm segment using the apr routines.  */
-   status = apr_shm_create(shm, shm_size, (const char *) shmfile, pool);
+   status = apr_shm_create(shm, shm_size, (const char *) *shmfile, pool);
    VHC_DEBUG  vhc_debug_log_(pool, "%s: shm create returned %d",
                                    VHC_LOC, status);
    if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
       ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
                     "%s: Failed to create shm segment - file=%s",
-                    VHC_MODULE_NAME, shmfile);
+                    VHC_MODULE_NAME, *shmfile);
       return HTTP_INTERNAL_SERVER_ERROR;
    }
 
@@ -505,8 +1280,8 @@ static int  vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
       return HTTP_INTERNAL_SERVER_ERROR;
    }
 
-   /*  Sad. bzero got deprecated - use memset to initialize shm.   */
-   memset(baseaddr, 0, alloc_size); 
+   /*  Initialize the table + stamp the header with the layout.  */
+   vhc_init_table_(baseaddr, num_entries);
 
    /*  All's well - return success.  */
    VHC_DEBUG  vhc_debug_log_(pool, "%s: shm segment created OK", VHC_LOC);
@@ -518,403 +1293,3817 @@ static int  vhc_create_shm_segment_(apr_pool_t *pool, apr_shm_t **shm,
 
 
 /**
- *   @brief   Try and acquire the global lock within the specified timeout
- *            period (in microseconds).
- *   @param   lock           the lock
- *   @param   timeout_usecs  timeout
- *   @return  APR_SUCCESS on success, otherwise errors.
+ *   @brief   Returns the lock stripe guarding a vhost's shm data.
+ *   @param   shm_index  vhost slot table index
+ *   @return  the global lock for the vhost.
  *
- *   Try and acquire a global lock - timing out if we are unable to acquire
- *   it within the specified time.
+ *   Returns the lock stripe guarding a vhost's shm data.
  *
  */
-static int  vhc_lock_acquire_(apr_global_mutex_t *lock,
-                              int timeout_usecs) {
-
-   apr_status_t  status;
-   apr_time_t    start_time = apr_time_now();
-   apr_time_t    end_time   = start_time + apr_time_usec(timeout_usecs);
+static apr_global_mutex_t  *vhc_get_vhost_lock_(apr_uint16_t shm_index) {
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Acquiring lock", VHC_LOC);
+   return gs_shm_locks[shm_index % gs_num_lock_stripes];
 
-   while (apr_time_now() < end_time) {
-      status = apr_global_mutex_trylock(lock);
-      if (VHC_APR_STATUS_IS_SUCCESS(status) )
-         return status;
-      else if (APR_STATUS_IS_ENOTIMPL(status) )
-         return apr_global_mutex_lock(lock);  /*  No trylock support,  */
-                                              /*  so just wait.        */
+}  /*  End of function  vhc_get_vhost_lock_.  */
 
-      /*  Need to retry - sleep in 5ms blocks.  */
-      VHC_DEBUG  vhc_debug_log_(NULL, "%s: Retry lock acquire in %d usecs",
-                                      VHC_LOC,
-                                      VHC_TRYLOCK_SLEEP_TIME_USECS);
-      apr_sleep(VHC_TRYLOCK_SLEEP_TIME_USECS);
 
-   }  /*  End of  while not timed out.  */
 
+/**
+ *   @brief   Returns the slot table header of a shm segment.
+ *   @param   shm  shm segment
+ *   @return  the slot table header, NULL if the shm segment is unavailable
+ *            or doesn't have our (current) slot table layout.
+ *
+ *   Returns the slot table header of a shm segment - after checking it
+ *   really is our slot table.
+ *
+ */
+static VHC_shm_header_t  *vhc_get_shm_header_(apr_shm_t *shm) {
 
-   /*  Got here, means we timed out - so return ETIMEDOUT.  */
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Lock acquisition timed out",
-                                   VHC_LOC);
+   if (NULL == shm)
+      return NULL;
 
-   return ETIMEDOUT;
+   return vhc_get_table_header_(apr_shm_baseaddr_get(shm) );
 
-}  /*  End of function  vhc_lock_acquire_.  */
+}  /*  End of function  vhc_get_shm_header_.  */
 
 
 
 /**
- *   @brief   Release a previously acquired global lock.
- *   @param   lock           the lock
- *   @return  APR_SUCCESS on success, otherwise errors.
+ *   @brief   Returns the shm data for a vhost.
+ *   @param   shm_index  vhost slot table index
+ *   @return  the vhost's shm data, NULL if the shm segment is unavailable.
  *
- *   Release a previously acquired global lock.
+ *   Returns the shared memory data for a vhost - the slot table entry
+ *   the vhost got assigned (by its stable identity) at post config.
  *
  */
-static int  vhc_lock_release_(apr_global_mutex_t *lock) {
+static VHC_shm_data_t  *vhc_get_vhost_shm_data_(apr_uint16_t shm_index) {
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Releasing lock", VHC_LOC);
+   return vhc_get_shm_entry_(vhc_get_shm_header_(gs_shm), shm_index);
 
-   return  apr_global_mutex_unlock(lock); 
-
-}  /*  End of function  vhc_lock_release_.  */
+}  /*  End of function  vhc_get_vhost_shm_data_.  */
 
 
 
 /**
-  *   @brief   Check if the virtual host has capacity.
-  *   @param   config   vhost config record
-  *   @param   shmdata  vhost shm data
-  *   @return  APR_SUCCESS if host has capacity, otherwise errors.
-  *
-  *   Check if a virtual host has capacity (slots available or can
-  *   burst to free additional slots).
-  *
-  */
-static int  vhc_check_vhost_capacity_(VHC_server_config_t *config,
-                                      VHC_shm_data_t *shmdata) {
+ *   @brief   Returns this process' stats shard for a vhost.
+ *   @param   shm_index  vhost slot table index
+ *   @return  the stats shard, NULL if the shm segment is unavailable.
+ *
+ *   Returns this process' stats shard for a vhost - the shards are picked
+ *   by process id, so the counters don't bounce cache lines between the
+ *   children on the request path (threads in a child share a shard).
+ *
+ */
+static VHC_shm_stats_t  *vhc_get_vhost_stats_(apr_uint16_t shm_index) {
+   VHC_shm_header_t  *header = vhc_get_shm_header_(gs_shm);
 
-   apr_time_t    current_time;
-   apr_time_t    flap_secs;
-   apr_time_t    grace_secs;
-   apr_uint16_t  burst_slots;
-   apr_uint16_t  free_slots;
-   apr_time_t    grace_expiry_time;
+   if (NULL == header)
+      return NULL;
 
+   return vhc_get_shm_stats_(header, shm_index,
+                             (apr_uint32_t) gs_mypid % header->stats_shards);
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: check vhost capacity", VHC_LOC);
+}  /*  End of function  vhc_get_vhost_stats_.  */
 
-   /*  Check that we have enough slots for this vhost.  */
-   if (shmdata->inuse_slots < config->slot_limit)
-      return APR_SUCCESS;  /*  Optimized case all's good.  */
-
-   /*  Ok - at or beyond slot limit - check if within grace period.  */
-   burst_slots = ceil(config->slot_limit *
-                      config->burst_settings.percent / 100.0);
-   free_slots  = config->slot_limit + ((apr_uint16_t) burst_slots) -
-                 shmdata->inuse_slots;
-   if (free_slots <= 0)
-      return VHC_HTTP_TOO_MANY_REQUESTS;  /*  Choked!!  */
-
-
-   /*  Find out when the grace time expires.  */
-   current_time = apr_time_now();
-   grace_secs = apr_time_from_sec(config->burst_settings.grace_period);
-   grace_expiry_time = current_time + grace_secs;
-   if (shmdata->grace_expires_at >= 0) {
-      /*  Check if grace expires at is past the flap expiry period.  */
-      if (shmdata->grace_expires_at > current_time)
-         grace_expiry_time = shmdata->grace_expires_at;
-      else {
-         /*  Use grace_expires_at if in the flap expiry period.  */
-         flap_secs = apr_time_from_sec(config->burst_settings.flap_period);
-         if ((shmdata->grace_expires_at + flap_secs) > current_time)
-            grace_expiry_time = shmdata->grace_expires_at;
-      }
 
-   }  /*  End of if  grace_expires_at is already set.  */
 
+/**
+ *   @brief   Acquire the lock (stripe) for a vhost.
+ *   @param   shm_index  vhost slot table index
+ *   @return  APR_SUCCESS if we got the lock, otherwise errors.
+ *
+ *   Acquire the lock stripe for a vhost (Mutex lock mode) - waiting upto
+ *   the configured lock wait time. The time spent waiting and timeouts
+ *   are added to the vhost's stats.
+ *
+ */
+static int  vhc_acquire_vhost_lock_(apr_uint16_t shm_index) {
+   apr_status_t      status;
+   apr_time_t        start_time = vhc_monotonic_now_();
+   VHC_shm_stats_t  *stats;
+
+   status = vhc_lock_acquire_(vhc_get_vhost_lock_(shm_index),
+                              gs_vhc_env_settings.lock_wait_usecs);
+
+   stats = vhc_get_vhost_stats_(shm_index);
+   if (NULL != stats) {
+      VHC_ATOMIC_INC_RELAXED(&stats->lock_wait_usecs,
+                             vhc_monotonic_now_() - start_time);
+      if (ETIMEDOUT == status)
+         VHC_ATOMIC_INC_RELAXED(&stats->lock_timeouts, 1);
+   }
 
-   /*  And now check if we are within the grace period.  */
-   if (grace_expiry_time > current_time)
-      return APR_SUCCESS;  /*  Still within the grace period.  */
+   if (ETIMEDOUT == status)
+      vhc_trace_(VHC_TRACE_EVENT_LOCK_TIMEOUT, VHC_TRACE_NO_CONFIG, 0,
+                 shm_index);
 
+   return status;
 
-   /*  If we got here, we are all choked up.  */
-   return VHC_HTTP_TOO_MANY_REQUESTS;  /*  Throttle this vhost.  */
+}  /*  End of function  vhc_acquire_vhost_lock_.  */
 
-}  /*  End of function  vhc_check_vhost_capacity_.  */
 
 
-/*  }}}  -- End section:internal-functions.  */
+/**
+ *   @brief   Returns the stable identity of a vhost.
+ *   @param   pool  memory pool
+ *   @param   srvr  server record
+ *   @return  the vhost key (64-bit FNV-1a hash of ServerName:port).
+ *
+ *   Returns the stable identity of a vhost - unlike the config id, it
+ *   doesn't depend on the order of the vhosts in the config, so the
+ *   vhost finds its slot table entry again after a restart.
+ *
+ */
+static apr_uint64_t  vhc_get_vhost_key_(apr_pool_t *pool, server_rec *srvr) {
+   apr_uint64_t    key = VHC_FNV1A_64_OFFSET_BASIS;
+   unsigned short  port = srvr->port;
+   const char     *id;
+
+   if ((0 == port)  &&  (NULL != srvr->addrs) )
+      port = srvr->addrs->host_port;
+
+   id = apr_psprintf(pool, "%s:%d", vhc_get_vhost_name_(srvr), (int) port);
+   for ( ; *id; id++) {
+      key ^= (unsigned char) *id;
+      key *= VHC_FNV1A_64_PRIME;
+   }
 
+   /*  Zero marks a free slot table entry.  */
+   return (0 == key) ? 1 : key;
 
+}  /*  End of function  vhc_get_vhost_key_.  */
 
-/*  section:ap-directive-handlers {{{  */
+
+
+/**
+ *   @brief   Sets the stable identities of all the vhosts.
+ *   @param   pool  memory pool
+ *   @param   srvr  server record (head of the server list)
+ *
+ *   Sets the stable identities of all the vhosts - vhosts with the same
+ *   ServerName:port (e.g. on different addresses) get told apart by the
+ *   order they are in.
+ *
+ */
+static void  vhc_set_vhost_keys_(apr_pool_t *pool, server_rec *srvr) {
+   apr_hash_t           *seen = apr_hash_make(pool);
+   VHC_server_config_t  *cfg;
+   server_rec           *s;
+
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      cfg->vhost_key = vhc_get_vhost_key_(pool, s);
+      cfg->shm_index = VHC_SHM_NO_ENTRY;
+
+      while (apr_hash_get(seen, &cfg->vhost_key, sizeof(apr_uint64_t) ) )
+         cfg->vhost_key = cfg->vhost_key * VHC_FNV1A_64_PRIME + 1;
+
+      apr_hash_set(seen, &cfg->vhost_key, sizeof(apr_uint64_t), cfg);
+   }
+
+}  /*  End of function  vhc_set_vhost_keys_.  */
+
+
+
+/**
+ *   @brief   Returns the state that survives (graceful) restarts.
+ *   @param   pool  process pool
+ *   @return  the persistent state.
+ *
+ *   Returns the state that survives (graceful) restarts - the shm segment
+ *   and locks live in the process pool, as the old children keep using
+ *   them while they finish up their requests.
+ *
+ */
+static VHC_persistent_state_t  *vhc_get_persistent_state_(apr_pool_t *pool) {
+   void  *userdata = NULL;
+
+   apr_pool_userdata_get(&userdata, VHC_PERSISTENT_STATE_KEY, pool);
+   if (NULL != userdata)
+      return (VHC_persistent_state_t *) userdata;
+
+   userdata = apr_pcalloc(pool, sizeof(VHC_persistent_state_t) );
+   ((VHC_persistent_state_t *) userdata)->retired =
+      apr_array_make(pool, 2, sizeof(VHC_retired_shm_t) );
+
+   apr_pool_userdata_set(userdata, VHC_PERSISTENT_STATE_KEY,
+                         apr_pool_cleanup_null, pool);
+
+   return (VHC_persistent_state_t *) userdata;
+
+}  /*  End of function  vhc_get_persistent_state_.  */
+
+
+
+/**
+ *   @brief   Resets a slot table entry (and its stats) for a vhost.
+ *   @param   header     slot table header
+ *   @param   shm_index  slot table index
+ *   @param   vhost_key  vhost the entry now belongs to (0 = free)
+ *
+ *   Resets a slot table entry and its stats shards for a vhost.
+ *
+ */
+static void  vhc_reset_shm_entry_(VHC_shm_header_t *header,
+                                  apr_uint16_t shm_index,
+                                  apr_uint64_t vhost_key) {
+
+   memset(vhc_get_shm_entry_(header, shm_index), 0, header->entry_stride);
+   memset(vhc_get_shm_stats_(header, shm_index, 0), 0,
+          (apr_size_t) header->stats_stride * header->stats_shards);
+
+   vhc_get_shm_entry_(header, shm_index)->vhost_key = vhost_key;
+
+}  /*  End of function  vhc_reset_shm_entry_.  */
+
+
+
+/**
+ *   @brief   Assigns slot table entries to all the vhosts.
+ *   @param   pool    memory pool
+ *   @param   header  slot table header
+ *   @param   srvr    server record (head of the server list)
+ *   @return  APR_SUCCESS if all vhosts got an entry, otherwise APR_ENOSPC.
+ *
+ *   Assigns slot table entries to all the vhosts - a vhost gets its old
+ *   entry (and so keeps its slots + burst state) if it had one. Entries
+ *   of vhosts that are gone are reused once no requests are using them.
+ *
+ */
+static int  vhc_assign_shm_entries_(apr_pool_t *pool,
+                                    VHC_shm_header_t *header,
+                                    server_rec *srvr) {
+   apr_hash_t           *owners = apr_hash_make(pool);
+   char                 *claimed = apr_pcalloc(pool, header->num_entries);
+   VHC_server_config_t  *cfg;
+   VHC_shm_data_t       *entry;
+   server_rec           *s;
+   void                 *found;
+   apr_uint16_t          idx;
+   apr_uint16_t          next = 0;
+
+   /*  Map the vhost keys to their entries.  */
+   for (idx = 0; idx < header->num_entries; idx++) {
+      entry = vhc_get_shm_entry_(header, idx);
+      if (0 != entry->vhost_key)
+         apr_hash_set(owners, &entry->vhost_key, sizeof(apr_uint64_t),
+                      entry);
+   }
+
+   /*  Vhosts we already know about keep their entries.  */
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      found = apr_hash_get(owners, &cfg->vhost_key, sizeof(apr_uint64_t) );
+      if (NULL != found) {
+         cfg->shm_index = (apr_uint16_t)
+            (((char *) found - ((char *) header + VHC_SHM_HEADER_SIZE) ) /
+             header->entry_stride);
+         claimed[cfg->shm_index] = 1;
+      }
+   }
+
+   /*  Free up the entries of vhosts that are gone (if not in use).  */
+   for (idx = 0; idx < header->num_entries; idx++) {
+      entry = vhc_get_shm_entry_(header, idx);
+      if (!claimed[idx]  &&  (0 != entry->vhost_key)  &&
+          (0 == VHC_ATOMIC_LOAD(&entry->inuse_slots) )  &&
+          (0 == VHC_ATOMIC_LOAD(&entry->queue_waiters) ) )
+         vhc_reset_shm_entry_(header, idx, 0);
+   }
+
+   /*  And new vhosts get free entries.  */
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      if (VHC_SHM_NO_ENTRY != cfg->shm_index)
+         continue;
+
+      while ((next < header->num_entries)  &&
+             (claimed[next]  ||
+              (0 != vhc_get_shm_entry_(header, next)->vhost_key) ) )
+         next++;
+
+      if (next >= header->num_entries)
+         return APR_ENOSPC;   /*  Out of entries.  */
+
+      vhc_reset_shm_entry_(header, next, cfg->vhost_key);
+      claimed[next]  = 1;
+      cfg->shm_index = next;
+   }
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_assign_shm_entries_.  */
+
+
+
+/**
+ *   @brief   Sets the effective limits of all the vhosts to the
+ *            configured ones.
+ *   @param   header  slot table header
+ *   @param   srvr    server record (head of the server list)
+ *
+ *   Sets the effective limits (in their slot table entries) of all the
+ *   vhosts to the configured ones - the config is what the vhosts start
+ *   with, so limits changed at runtime last until the next restart.
+ *
+ */
+static void  vhc_set_config_limits_(VHC_shm_header_t *header,
+                                    server_rec *srvr) {
+   VHC_server_config_t  *cfg;
+   VHC_vhost_limits_t    limits;
+   server_rec           *s;
+
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      vhc_get_config_limits_(cfg, &limits);
+      vhc_set_vhost_limits_(vhc_get_shm_entry_(header, cfg->shm_index),
+                            &limits);
+   }
+
+}  /*  End of function  vhc_set_config_limits_.  */
+
+
+
+/**
+ *   @brief   Retires a shm segment replaced by a new (bigger) one.
+ *   @param   pool        process pool
+ *   @param   ptemp       temporary pool
+ *   @param   shm         the old shm segment
+ *   @param   new_header  slot table header of the new shm segment
+ *   @param   srvr        server record (head of the server list)
+ *
+ *   Retires a shm segment replaced by a new (bigger) one - the live
+ *   state (slots, burst state, token buckets + stats) of the vhosts gets
+ *   migrated into their new entries. The old children still release their
+ *   slots into the old segment, so we hang on to it until it drains (see
+ *   vhc_reconcile_retired_shm_).
+ *
+ */
+static void  vhc_retire_shm_segment_(apr_pool_t *pool, apr_pool_t *ptemp,
+                                     apr_shm_t *shm,
+                                     VHC_shm_header_t *new_header,
+                                     server_rec *srvr) {
+   VHC_shm_header_t     *old_header = vhc_get_shm_header_(shm);
+   VHC_retired_shm_t    *retired;
+   VHC_server_config_t  *cfg;
+   VHC_shm_data_t       *old_entry;
+   VHC_shm_data_t       *new_entry;
+   VHC_shm_stats_t      *new_stats;
+   apr_hash_t           *new_entries = apr_hash_make(ptemp);
+   server_rec           *s;
+   apr_uint16_t          idx;
+
+   /*  Different layout (module upgraded) - nothing we can migrate.  */
+   if (NULL == old_header) {
+      ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, pool,
+                    "%s: old shm has a different layout - not migrated",
+                    VHC_MODULE_NAME);
+      return;
+   }
+
+   for (s = srvr; NULL != s; s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      apr_hash_set(new_entries, &cfg->vhost_key, sizeof(apr_uint64_t), cfg);
+   }
+
+   retired = (VHC_retired_shm_t *) apr_array_push(gs_state->retired);
+   retired->shm = shm;
+   retired->new_index   = apr_palloc(pool, sizeof(apr_uint16_t) *
+                                           old_header->num_entries);
+   retired->inuse_slots = apr_palloc(pool, sizeof(apr_uint64_t) *
+                                           old_header->num_entries);
+
+   for (idx = 0; idx < old_header->num_entries; idx++) {
+      old_entry = vhc_get_shm_entry_(old_header, idx);
+      retired->inuse_slots[idx] = VHC_ATOMIC_LOAD(&old_entry->inuse_slots);
+      retired->new_index[idx]   = VHC_SHM_NO_ENTRY;
+
+      cfg = (0 == old_entry->vhost_key) ? NULL :
+               apr_hash_get(new_entries, &old_entry->vhost_key,
+                            sizeof(apr_uint64_t) );
+      if (NULL == cfg)
+         continue;
+
+      /*  Carry the live state over into the new entry.  */
+      retired->new_index[idx] = cfg->shm_index;
+      new_entry = vhc_get_shm_entry_(new_header, cfg->shm_index);
+      new_entry->inuse_slots      = retired->inuse_slots[idx];
+      new_entry->grace_expires_at = old_entry->grace_expires_at;
+      new_entry->burst_changed_at = old_entry->burst_changed_at;
+      new_entry->burst_state      = old_entry->burst_state;
+      new_entry->rate_tat         = old_entry->rate_tat;
+      new_entry->bandwidth_tat    = old_entry->bandwidth_tat;
+      new_entry->adaptive_limit   = old_entry->adaptive_limit;
+      new_entry->latency_ewma     = old_entry->latency_ewma;
+      new_entry->decreased_at     = old_entry->decreased_at;
+      new_entry->borrowed         = old_entry->borrowed;
+      new_entry->borrow_weight    = old_entry->borrow_weight;
+      new_entry->limits           = old_entry->limits;
+
+      new_stats = vhc_get_shm_stats_(new_header, cfg->shm_index, 0);
+      vhc_sum_vhost_stats_(old_header, idx, new_stats);
+   }
+
+   ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pool,
+                 "%s: migrated %d vhost entries into a new shm segment",
+                 VHC_MODULE_NAME, (int) old_header->num_entries);
+
+}  /*  End of function  vhc_retire_shm_segment_.  */
+
+
+
+/**
+ *   @brief   Reconciles the retired shm segments with the current one.
+ *
+ *   Reconciles the retired shm segments with the current one (in the
+ *   parent) - slots the old children released into a retired segment are
+ *   released from the vhost's current entry as well (they were migrated
+ *   over). A retired segment is destroyed once it has drained.
+ *
+ */
+static void  vhc_reconcile_retired_shm_(void) {
+   VHC_retired_shm_t  *retired;
+   VHC_shm_header_t   *old_header;
+   VHC_shm_data_t     *old_entry;
+   VHC_shm_data_t     *new_entry;
+   apr_uint64_t        inuse_slots;
+   apr_uint64_t        released;
+   apr_uint64_t        nslots;
+   apr_uint16_t        idx;
+   int                 busy;
+   int                 r;
+
+   if ((NULL == gs_state)  ||  (NULL == gs_state->retired) )
+      return;
+
+   for (r = 0; r < gs_state->retired->nelts; r++) {
+      retired = &((VHC_retired_shm_t *) gs_state->retired->elts)[r];
+      old_header = vhc_get_shm_header_(retired->shm);
+      if (NULL == old_header)
+         continue;   /*  Already destroyed.  */
+
+      busy = 0;
+      for (idx = 0; idx < old_header->num_entries; idx++) {
+         old_entry = vhc_get_shm_entry_(old_header, idx);
+         inuse_slots = VHC_ATOMIC_LOAD(&old_entry->inuse_slots);
+         if ((inuse_slots > 0)  ||
+             (VHC_ATOMIC_LOAD(&old_entry->queue_waiters) > 0) )
+            busy = 1;
+
+         if (inuse_slots >= retired->inuse_slots[idx])
+            continue;
+
+         released = retired->inuse_slots[idx] - inuse_slots;
+         retired->inuse_slots[idx] = inuse_slots;
+
+         new_entry = vhc_get_vhost_shm_data_(retired->new_index[idx]);
+         if (NULL == new_entry)
+            continue;
+
+         if ((VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)  &&
+             !VHC_APR_STATUS_IS_SUCCESS(
+                vhc_acquire_vhost_lock_(retired->new_index[idx]) ) ) {
+            retired->inuse_slots[idx] += released;   /*  Next time.  */
+            continue;
+         }
+
+         nslots = VHC_ATOMIC_LOAD(&new_entry->inuse_slots);
+         do {
+            released = (released > nslots) ? nslots : released;
+
+         } while (!VHC_ATOMIC_CAS(&new_entry->inuse_slots, &nslots,
+                                  nslots - released) );
+
+         vhc_return_pool_slots_(vhc_get_shm_header_(gs_shm), new_entry,
+                                released);
+
+         if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)
+            vhc_lock_release_(vhc_get_vhost_lock_(retired->new_index[idx]) );
+
+         if (VHC_ATOMIC_LOAD(&new_entry->queue_waiters) > 0)
+            vhc_queue_wakeup_(&new_entry->wake_seq);
+      }
+
+      if (!busy) {
+         VHC_DEBUG  vhc_debug_log_(NULL, "%s: retired shm drained",
+                                         VHC_LOC);
+         apr_shm_destroy(retired->shm);
+         retired->shm = NULL;
+      }
+   }
+
+}  /*  End of function  vhc_reconcile_retired_shm_.  */
+
+
+
+/**
+ *   @brief   Create (or reuse) the dynamic per-Host bucket table.
+ *   @param   pool   process pool
+ *   @param   ptemp  temporary pool
+ *   @return  APR_SUCCESS on success, otherwise HTTP_INTERNAL_SERVER_ERROR.
+ *
+ *   Create the fixed size (VHostChokeDynamicHosts) open addressing hash
+ *   table of per-Host buckets in shm - reused across restarts as long as
+ *   the size doesn't change.
+ *
+ */
+static int  vhc_create_host_table_(apr_pool_t *pool, apr_pool_t *ptemp) {
+   VHC_shm_header_t  *header;
+   apr_status_t       status;
+   apr_shm_t         *shm;
+   apr_size_t         shm_size;
+   char              *shm_file;
+
+   if (0 == gs_vhc_env_settings.dynamic_hosts)
+      return APR_SUCCESS;
+
+   header = vhc_get_shm_header_(gs_state->host_shm);
+   if ((NULL != header)  &&
+       (gs_vhc_env_settings.dynamic_hosts == header->num_entries) ) {
+      gs_host_shm = gs_state->host_shm;
+      return APR_SUCCESS;
+   }
+
+   /*  Note: the old table (if any) stays around for the old children.  */
+   shm_file = vhc_mktemp_(pool, apr_psprintf(ptemp, "hshm.%u",
+                                             gs_state->generation) );
+   shm_size = VHC_SHM_HEADER_SIZE +
+              (apr_size_t) gs_vhc_env_settings.dynamic_hosts *
+                 VHC_SHM_ENTRY_STRIDE;
+
+   status = apr_shm_create(&shm, shm_size, (const char *) shm_file, pool);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status)  ||
+       (NULL == (header = apr_shm_baseaddr_get(shm) ) ) ) {
+      ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
+                    "%s: Failed to create dynamic hosts shm - file=%s",
+                    VHC_MODULE_NAME, shm_file);
+      return HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+   memset(header, 0, shm_size);
+
+   /*  Same layout as the slot table (minus the stats shards).  */
+   header->num_entries  = gs_vhc_env_settings.dynamic_hosts;
+   header->entry_stride = (apr_uint32_t) VHC_SHM_ENTRY_STRIDE;
+   header->version      = VHC_SHM_TABLE_VERSION;
+   header->magic        = VHC_SHM_TABLE_MAGIC;
+
+   gs_state->host_shm = gs_host_shm = shm;
+
+   VHC_DEBUG  vhc_debug_log_(ptemp, "%s: Created %d dynamic host buckets",
+                                    VHC_LOC,
+                                    (int) gs_vhc_env_settings.dynamic_hosts);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_create_host_table_.  */
+
+
+
+/**
+ *   @brief   Returns the key of a (vhost, Host) dynamic bucket.
+ *   @param   config    vhost config record
+ *   @param   hostname  request Host
+ *   @return  the bucket key (never 0).
+ *
+ *   Returns the key of a (vhost, Host) dynamic bucket - a 64-bit FNV-1a
+ *   hash of the vhost identity and the normalised Host (lowercased, w/o
+ *   a trailing dot - the port is already stripped off by httpd).
+ *
+ */
+static apr_uint64_t  vhc_get_host_key_(VHC_server_config_t *config,
+                                       const char *hostname) {
+   apr_uint64_t  key = config->vhost_key ^ VHC_FNV1A_64_OFFSET_BASIS;
+   const char   *end = hostname + strlen(hostname);
+
+   while ((end > hostname)  &&  ('.' == end[-1]) )
+      end--;
+
+   for ( ; hostname < end; hostname++) {
+      key ^= (unsigned char) apr_tolower(*hostname);
+      key *= VHC_FNV1A_64_PRIME;
+   }
+
+   /*  Zero marks a free bucket.  */
+   return (0 == key) ? 1 : key;
+
+}  /*  End of function  vhc_get_host_key_.  */
+
+
+
+/**
+ *   @brief   Returns the dynamic bucket for a request's Host.
+ *   @param   config    vhost config record
+ *   @param   hostname  request Host
+ *   @return  the Host's bucket, NULL if there's none to be had.
+ *
+ *   Returns the dynamic bucket for a request's Host - looked up (or
+ *   claimed) lock-free in a small window of the open addressing table.
+ *   If the window is full, an idle bucket in it gets evicted (clock style
+ *   - recently used buckets get a second chance).
+ *
+ */
+static VHC_shm_data_t  *vhc_get_host_shm_data_(VHC_server_config_t *config,
+                                               const char *hostname) {
+   VHC_shm_header_t  *header = vhc_get_shm_header_(gs_host_shm);
+   VHC_shm_data_t    *bucket;
+   apr_uint64_t       key;
+   apr_uint64_t       owner;
+   apr_uint32_t       mask;
+   apr_uint32_t       referenced;
+   apr_uint32_t       idx;
+   int                probe;
+   int                sweep;
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   /*  Buckets are shared by all the vhosts (+ lock stripes).  */
+   return NULL;
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+   if ((NULL == header)  ||  (NULL == hostname)  ||  ('\0' == *hostname) )
+      return NULL;
+
+   key  = vhc_get_host_key_(config, hostname);
+   mask = header->num_entries - 1;
+
+   /*  Look for the Host (or a free bucket) in its probe window.  */
+   for (probe = 0; probe < VHC_DYNAMIC_HOSTS_PROBES; probe++) {
+      idx = (apr_uint32_t) (key + probe) & mask;
+      bucket = (VHC_shm_data_t *) ((char *) header + VHC_SHM_HEADER_SIZE +
+                                   (apr_size_t) header->entry_stride * idx);
+
+      /*  Claim a free bucket - on a lost race, owner has the winner.  */
+      owner = VHC_ATOMIC_LOAD(&bucket->vhost_key);
+      if ((0 == owner)  &&  VHC_ATOMIC_CAS(&bucket->vhost_key, &owner, key) ) {
+         VHC_ATOMIC_ADD(&header->used_entries, 1);
+         owner = key;
+      }
+
+      if (owner == key) {
+         if (0 == VHC_ATOMIC_LOAD(&bucket->referenced) )
+            VHC_ATOMIC_STORE(&bucket->referenced, 1);
+
+         return bucket;
+      }
+   }
+
+   /*  Window is full - evict an idle bucket (2 sweeps: second chance).  */
+   for (sweep = 0; sweep < 2; sweep++) {
+      for (probe = 0; probe < VHC_DYNAMIC_HOSTS_PROBES; probe++) {
+         idx = (apr_uint32_t) (key + probe) & mask;
+         bucket = (VHC_shm_data_t *) ((char *) header + VHC_SHM_HEADER_SIZE +
+                                      (apr_size_t) header->entry_stride * idx);
+
+         referenced = VHC_ATOMIC_LOAD(&bucket->referenced);
+         if (referenced) {
+            VHC_ATOMIC_CAS(&bucket->referenced, &referenced, 0);
+            continue;
+         }
+
+         if ((0 != VHC_ATOMIC_LOAD(&bucket->inuse_slots) )  ||
+             (0 != VHC_ATOMIC_LOAD(&bucket->queue_waiters) ) )
+            continue;   /*  In use - can't evict.  */
+
+         /*  Take it over - slots stay paired w/ the bucket, so we don't  */
+         /*  touch the slot count, just reset the limiter state.          */
+         owner = VHC_ATOMIC_LOAD(&bucket->vhost_key);
+         if (!VHC_ATOMIC_CAS(&bucket->vhost_key, &owner, key) )
+            continue;
+
+         VHC_ATOMIC_STORE(&bucket->grace_expires_at, 0);
+         VHC_ATOMIC_STORE(&bucket->burst_changed_at, 0);
+         VHC_ATOMIC_STORE(&bucket->burst_state, VHC_BURST_STATE_NORMAL);
+         VHC_ATOMIC_STORE(&bucket->rate_tat, 0);
+         VHC_ATOMIC_STORE(&bucket->adaptive_limit, 0);
+         VHC_ATOMIC_STORE(&bucket->latency_ewma, 0);
+         VHC_ATOMIC_STORE(&bucket->decreased_at, 0);
+         VHC_ATOMIC_STORE(&bucket->referenced, 1);
+
+         VHC_DEBUG  vhc_debug_log_(NULL, "%s: evicted host bucket %d",
+                                         VHC_LOC, (int) idx);
+         return bucket;
+      }
+   }
+
+   /*  Everything in the window is busy.  */
+   return NULL;
+
+}  /*  End of function  vhc_get_host_shm_data_.  */
+
+
+
+/**
+ *   @brief   Create (or reuse) the per-child slot lease area.
+ *   @param   pool   process pool
+ *   @param   ptemp  temporary pool
+ *   @return  APR_SUCCESS on success, otherwise HTTP_INTERNAL_SERVER_ERROR.
+ *
+ *   Create the per-child slot lease area in shm - a lease record for
+ *   twice the max. number of children (dead children not yet reaped +
+ *   their replacements), each with room for a few leases per worker
+ *   thread and (threaded MPMs) a slot block per vhost index. ServerLimit
+ *   and ThreadLimit can't change on a restart, so the lease area is
+ *   created once and kept across restarts.
+ *
+ */
+static int  vhc_create_lease_area_(apr_pool_t *pool, apr_pool_t *ptemp) {
+   VHC_lease_header_t  *header;
+   apr_status_t         status;
+   apr_shm_t           *shm;
+   apr_size_t           shm_size;
+   apr_size_t           child_stride;
+   apr_size_t           block_offset;
+   apr_uint32_t         nleases;
+   apr_uint32_t         nblocks;
+   char                *shm_file;
+   int                  max_daemons = 0;
+   int                  max_threads = 0;
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   /*  Leases are granted by multiple threads w/o a lock.  */
+   return APR_SUCCESS;
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+   header = (NULL == gs_state->lease_shm) ? NULL :
+               apr_shm_baseaddr_get(gs_state->lease_shm);
+   if ((NULL != header)  &&  (VHC_LEASE_AREA_MAGIC == header->magic)  &&
+       (VHC_LEASE_AREA_VERSION == header->version) ) {
+      gs_lease_shm = gs_state->lease_shm;
+      return APR_SUCCESS;
+   }
+
+   ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &max_daemons);
+   ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &max_threads);
+   if (max_daemons < 1)
+      max_daemons = 1;
+
+   if (max_threads < 1)
+      max_threads = 1;
+
+   nleases = (apr_uint32_t) max_threads * VHC_LEASES_PER_THREAD;
+   if (nleases > VHC_MAX_LEASES_PER_CHILD)
+      nleases = VHC_MAX_LEASES_PER_CHILD;
+
+   /*  Slot blocks only pay off with more than one thread per child.  */
+   nblocks = (max_threads > 1) ? VHC_SLOT_BLOCKS_PER_CHILD : 0;
+
+   block_offset = VHC_CACHE_LINE_ROUNDUP(VHC_LEASE_CHILD_SIZE +
+                                         sizeof(VHC_slot_lease_t) * nleases);
+   child_stride = block_offset + sizeof(VHC_slot_block_t) * nblocks;
+   shm_size = VHC_LEASE_HEADER_SIZE +
+              child_stride * 2 * (apr_size_t) max_daemons;
+
+   shm_file = vhc_mktemp_(pool, apr_psprintf(ptemp, "lshm.%u",
+                                             gs_state->generation) );
+
+   status = apr_shm_create(&shm, shm_size, (const char *) shm_file, pool);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status)  ||
+       (NULL == (header = apr_shm_baseaddr_get(shm) ) ) ) {
+      ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
+                    "%s: Failed to create slot lease shm - file=%s",
+                    VHC_MODULE_NAME, shm_file);
+      return HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+   memset(header, 0, shm_size);
+
+   header->num_children     = 2 * (apr_uint32_t) max_daemons;
+   header->leases_per_child = nleases;
+   header->child_stride     = (apr_uint32_t) child_stride;
+   header->blocks_per_child = nblocks;
+   header->block_offset     = (apr_uint32_t) block_offset;
+   header->version          = VHC_LEASE_AREA_VERSION;
+   header->magic            = VHC_LEASE_AREA_MAGIC;
+
+   gs_state->lease_shm = gs_lease_shm = shm;
+
+   VHC_DEBUG  vhc_debug_log_(ptemp, "%s: Created %d x %d slot leases",
+                                    VHC_LOC, (int) header->num_children,
+                                    (int) nleases);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_create_lease_area_.  */
+
+
+
+/**
+ *   @brief   Returns the slot lease area header.
+ *   @return  the lease area header, NULL if there's no lease area.
+ *
+ *   Returns the slot lease area header (after validating it).
+ *
+ */
+static VHC_lease_header_t  *vhc_get_lease_header_(void) {
+   VHC_lease_header_t  *header;
+
+   if (NULL == gs_lease_shm)
+      return NULL;
+
+   header = (VHC_lease_header_t *) apr_shm_baseaddr_get(gs_lease_shm);
+   if ((NULL == header)  ||  (VHC_LEASE_AREA_MAGIC != header->magic)  ||
+       (VHC_LEASE_AREA_VERSION != header->version) )
+      return NULL;
+
+   return header;
+
+}  /*  End of function  vhc_get_lease_header_.  */
+
+
+
+/**
+ *   @brief   Returns a child's lease record.
+ *   @param   header  lease area header
+ *   @param   idx     child record index
+ *   @return  the child's lease record.
+ *
+ *   Returns a child's lease record in the lease area.
+ *
+ */
+static VHC_lease_child_t  *vhc_get_lease_child_(VHC_lease_header_t *header,
+                                                apr_uint32_t idx) {
+
+   return (VHC_lease_child_t *) ((char *) header + VHC_LEASE_HEADER_SIZE +
+                                 (apr_size_t) header->child_stride * idx);
+
+}  /*  End of function  vhc_get_lease_child_.  */
+
+
+
+/**
+ *   @brief   Returns one of a child's slot leases.
+ *   @param   child  child lease record
+ *   @param   idx    lease index
+ *   @return  the slot lease.
+ *
+ *   Returns one of a child's slot leases (they follow the lease record).
+ *
+ */
+static VHC_slot_lease_t  *vhc_get_slot_lease_(VHC_lease_child_t *child,
+                                              apr_uint32_t idx) {
+
+   return (VHC_slot_lease_t *) ((char *) child + VHC_LEASE_CHILD_SIZE) +
+          idx;
+
+}  /*  End of function  vhc_get_slot_lease_.  */
+
+
+
+/**
+ *   @brief   Checks if an address is an entry in a shm segment.
+ *   @param   shm      slot table or dynamic bucket table shm segment
+ *   @param   shmdata  address to check
+ *   @return  1 if it is an entry in the segment, 0 otherwise.
+ *
+ *   Checks if an address (from a lease) is an entry in a slot table or
+ *   a dynamic bucket table shm segment.
+ *
+ */
+static int  vhc_shm_has_entry_(apr_shm_t *shm, apr_uintptr_t shmdata) {
+   VHC_shm_header_t  *header = vhc_get_shm_header_(shm);
+   apr_uintptr_t      entries;
+
+   if (NULL == header)
+      return 0;
+
+   entries = (apr_uintptr_t) header + VHC_SHM_HEADER_SIZE;
+
+   return (shmdata >= entries)  &&
+          (shmdata < entries +
+                     (apr_uintptr_t) header->entry_stride *
+                        header->num_entries)  &&
+          (0 == (shmdata - entries) % header->entry_stride);
+
+}  /*  End of function  vhc_shm_has_entry_.  */
+
+
+
+/**
+ *   @brief   Checks if a leased slot's shm data still exists.
+ *   @param   shmdata  shm data address (from a lease)
+ *   @return  1 if it is in the current or a retired slot table (or the
+ *            dynamic bucket table), 0 otherwise.
+ *
+ *   Checks if a leased slot's shm data still exists - the segments are
+ *   mapped at the same address in the parent and all the children.
+ *
+ */
+static int  vhc_is_shm_entry_(apr_uintptr_t shmdata) {
+   VHC_retired_shm_t  *retired;
+   int                 r;
+
+   if (vhc_shm_has_entry_(gs_shm, shmdata)  ||
+       vhc_shm_has_entry_(gs_host_shm, shmdata) )
+      return 1;
+
+   if ((NULL == gs_state)  ||  (NULL == gs_state->retired) )
+      return 0;
+
+   for (r = 0; r < gs_state->retired->nelts; r++) {
+      retired = &((VHC_retired_shm_t *) gs_state->retired->elts)[r];
+      if ((NULL != retired->shm)  &&
+          vhc_shm_has_entry_(retired->shm, shmdata) )
+         return 1;
+   }
+
+   return 0;
+
+}  /*  End of function  vhc_is_shm_entry_.  */
+
+
+
+/**
+ *   @brief   Returns the slots leased by a (dead) child.
+ *   @param   header  lease area header
+ *   @param   child   child lease record (owned by the caller)
+ *   @return  # of slots returned.
+ *
+ *   Returns the slots leased by a child that is gone - the slots its
+ *   pool cleanups never released, and the spare slots in its blocks.
+ *   Lock-free (the lease area only exists with shm atomics), so this
+ *   works in Mutex lock mode too.
+ *
+ */
+static apr_uint32_t  vhc_return_child_leases_(VHC_lease_header_t *header,
+                                              VHC_lease_child_t *child) {
+   VHC_slot_lease_t  *lease;
+   VHC_slot_block_t  *block;
+   VHC_shm_data_t    *shmdata;
+   apr_uintptr_t      leased;
+   apr_uint64_t       spare;
+   apr_uint32_t       nreturned = 0;
+   apr_uint32_t       idx;
+
+   for (idx = 0; idx < header->leases_per_child; idx++) {
+      lease  = vhc_get_slot_lease_(child, idx);
+      leased = VHC_ATOMIC_LOAD(&lease->shmdata);
+      if (0 == leased)
+         continue;
+
+      VHC_ATOMIC_STORE(&lease->shmdata, 0);
+      if (!vhc_is_shm_entry_(leased) )
+         continue;   /*  Segment is gone.  */
+
+      shmdata = (VHC_shm_data_t *) leased;
+      vhc_release_vhost_slot_(shmdata);
+      if (VHC_ATOMIC_LOAD(&shmdata->queue_waiters) > 0)
+         vhc_queue_wakeup_(&shmdata->wake_seq);
+
+      nreturned++;
+   }
+
+   for (idx = 0; idx < header->blocks_per_child; idx++) {
+      block  = vhc_get_slot_block_at_(header, child, idx);
+      leased = VHC_ATOMIC_LOAD(&block->shmdata);
+      spare  = VHC_ATOMIC_LOAD(&block->spare);
+      if (0 == leased)
+         continue;
+
+      VHC_ATOMIC_STORE(&block->spare, 0);
+      VHC_ATOMIC_STORE(&block->shmdata, 0);
+      if ((0 == spare)  ||  !vhc_is_shm_entry_(leased) )
+         continue;
+
+      shmdata = (VHC_shm_data_t *) leased;
+      vhc_release_vhost_slots_(shmdata, spare);
+      if (VHC_ATOMIC_LOAD(&shmdata->queue_waiters) > 0)
+         vhc_queue_wakeup_(&shmdata->wake_seq);
+
+      nreturned += (apr_uint32_t) spare;
+   }
+
+   return nreturned;
+
+}  /*  End of function  vhc_return_child_leases_.  */
+
+
+
+/**
+ *   @brief   Claim a lease record for this child.
+ *   @param   pool  child pool
+ *
+ *   Claim a lease record for this child (at child init). A record that
+ *   still has our pid belongs to a dead child whose pid we got - so we
+ *   return its slots before claiming a record of our own.
+ *
+ */
+static void  vhc_claim_lease_child_(apr_pool_t *pool) {
+   VHC_lease_header_t  *header = vhc_get_lease_header_();
+   VHC_lease_child_t   *child;
+   apr_uint32_t         mypid = (apr_uint32_t) gs_mypid;
+   apr_uint32_t         owner;
+   apr_uint32_t         idx;
+   apr_uint32_t         nreturned;
+   int                  generation = 0;
+
+   if (NULL == header)
+      return;
+
+   for (idx = 0; idx < header->num_children; idx++) {
+      child = vhc_get_lease_child_(header, idx);
+      owner = mypid;
+      if (!VHC_ATOMIC_CAS(&child->owner, &owner, VHC_LEASE_OWNER_REAPING) )
+         continue;
+
+      nreturned = vhc_return_child_leases_(header, child);
+      VHC_ATOMIC_ADD(&header->reclaimed_slots, nreturned);
+      VHC_ATOMIC_ADD(&header->reaped_children, 1);
+      VHC_ATOMIC_STORE(&child->owner, 0);
+
+      ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, pool,
+                    "%s: reclaimed %u slots of dead child pid %ld",
+                    VHC_MODULE_NAME, nreturned, (long int) gs_mypid);
+   }
+
+   ap_mpm_query(AP_MPMQ_GENERATION, &generation);
+
+   for (idx = 0; idx < header->num_children; idx++) {
+      child = vhc_get_lease_child_(header, idx);
+      owner = 0;
+      if (VHC_ATOMIC_CAS(&child->owner, &owner, mypid) ) {
+         child->mpm_generation = generation;
+         gs_lease_child = child;
+
+         apr_pool_cleanup_register(pool, header, vhc_child_exit_cleanup_,
+                                   apr_pool_cleanup_null);
+         return;
+      }
+   }
+
+   ap_log_perror(APLOG_MARK, APLOG_WARNING, 0, pool,
+                 "%s: no free slot lease record - slots of this child "
+                 "are not crash-safe", VHC_MODULE_NAME);
+
+}  /*  End of function  vhc_claim_lease_child_.  */
+
+
+
+/**
+ *   @brief   Child pool cleanup - give up the child's lease record.
+ *   @param   arg  lease area header
+ *   @return  APR_SUCCESS always.
+ *
+ *   Child pool cleanup (child exit) - returns any slots still leased
+ *   and frees up the child's lease record.
+ *
+ */
+static apr_status_t  vhc_child_exit_cleanup_(void *arg) {
+   VHC_lease_header_t  *header = (VHC_lease_header_t *) arg;
+   VHC_lease_child_t   *child = gs_lease_child;
+
+   if (NULL == child)
+      return APR_SUCCESS;
+
+   gs_lease_child = NULL;
+   vhc_return_child_leases_(header, child);
+   VHC_ATOMIC_STORE(&child->owner, 0);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_child_exit_cleanup_.  */
+
+
+
+/**
+ *   @brief   Lease a slot granted to a request.
+ *   @param   shmdata  vhost shm data the slot is from
+ *   @return  the slot lease, NULL if this child has none to spare.
+ *
+ *   Lease a slot granted to a request - records it in this child's lease
+ *   record, so the slot is returned even if the child dies before the
+ *   request's pool cleanup gets to run.
+ *
+ */
+static VHC_slot_lease_t  *vhc_lease_slot_(VHC_shm_data_t *shmdata) {
+   VHC_lease_header_t  *header = vhc_get_lease_header_();
+   VHC_slot_lease_t    *lease;
+   apr_uintptr_t        leased;
+   apr_uint32_t         start;
+   apr_uint32_t         n;
+
+   if ((NULL == header)  ||  (NULL == gs_lease_child) )
+      return NULL;
+
+   /*  Spread the threads out over the leases.  */
+   start = VHC_ATOMIC_ADD(&gs_lease_next, 1);
+   for (n = 0; n < header->leases_per_child; n++) {
+      lease  = vhc_get_slot_lease_(gs_lease_child,
+                                   (start + n) % header->leases_per_child);
+      leased = 0;
+      if (VHC_ATOMIC_CAS(&lease->shmdata, &leased,
+                         (apr_uintptr_t) shmdata) )
+         return lease;
+   }
+
+   VHC_ATOMIC_INC_RELAXED(&header->untracked, 1);
+   return NULL;
+
+}  /*  End of function  vhc_lease_slot_.  */
+
+
+
+/**
+ *   @brief   Returns a child's slot block.
+ *   @param   header  lease area header
+ *   @param   child   child lease record
+ *   @param   idx     slot block index
+ *   @return  the slot block.
+ *
+ */
+static VHC_slot_block_t  *vhc_get_slot_block_at_(VHC_lease_header_t *header,
+                                                 VHC_lease_child_t *child,
+                                                 apr_uint32_t idx) {
+
+   return (VHC_slot_block_t *) ((char *) child + header->block_offset) +
+          idx;
+
+}  /*  End of function  vhc_get_slot_block_at_.  */
+
+
+
+/**
+ *   @brief   Get this child's slot block for a vhost.
+ *   @param   config   vhost config record
+ *   @param   shmdata  vhost shm data
+ *   @return  the slot block, NULL if the vhost's slots are not batched.
+ *
+ *   Get this child's slot block for a vhost (claiming it on first use).
+ *   Only plain slot limits are batched - per-Host buckets and vhosts with
+ *   a request rate still go to shm for every request. Vhosts that share
+ *   a block index with a vhost that got there first are not batched.
+ *
+ */
+static VHC_slot_block_t  *vhc_get_slot_block_(VHC_server_config_t *config,
+                                              VHC_shm_data_t *shmdata) {
+   VHC_lease_header_t  *header;
+   VHC_slot_block_t    *block;
+   apr_uintptr_t        owner = 0;
+
+   if ((gs_vhc_env_settings.slot_batch < 2)  ||  (NULL == gs_lease_child)  ||
+       (0 == config->slot_limit)  ||  config->per_host  ||
+       (config->rate_settings.interval > 0) )
+      return NULL;
+
+   header = vhc_get_lease_header_();
+   if ((NULL == header)  ||  (0 == header->blocks_per_child) )
+      return NULL;
+
+   block = vhc_get_slot_block_at_(header, gs_lease_child,
+                                  config->shm_index %
+                                     header->blocks_per_child);
+
+   if ((VHC_ATOMIC_LOAD(&block->shmdata) == (apr_uintptr_t) shmdata)  ||
+       VHC_ATOMIC_CAS(&block->shmdata, &owner, (apr_uintptr_t) shmdata) )
+      return block;
+
+   return NULL;
+
+}  /*  End of function  vhc_get_slot_block_.  */
+
+
+
+/**
+ *   @brief   Take a spare slot from this child's slot block.
+ *   @param   block  slot block
+ *   @return  1 if we got a slot, 0 if the block has none to spare.
+ *
+ *   Take a spare slot from this child's slot block - a process-local
+ *   update, the slot is already counted in the vhost's inuse slots.
+ *
+ */
+static int  vhc_take_block_slot_(VHC_slot_block_t *block) {
+   apr_uint64_t  spare = VHC_ATOMIC_LOAD(&block->spare);
+
+   do {
+      if (0 == spare)
+         return 0;
+
+   } while (!VHC_ATOMIC_CAS(&block->spare, &spare, spare - 1) );
+
+   return 1;
+
+}  /*  End of function  vhc_take_block_slot_.  */
+
+
+
+/**
+ *   @brief   Release a slot into this child's slot block.
+ *   @param   config   vhost config record
+ *   @param   shmdata  vhost shm data
+ *   @param   block    slot block
+ *   @return  # of slots returned to the vhost (0 = kept in the block).
+ *
+ *   Release a slot into this child's slot block. The block keeps up to
+ *   2 x VHostChokeSlotBatch spare slots and gives back a batch's worth
+ *   of surplus in one go. Near the slot limit (or with requests queued)
+ *   all its spare slots go back right away, so the slots other children
+ *   can't get at are bounded and only exist well within the limit.
+ *
+ */
+static apr_uint64_t  vhc_release_block_slot_(VHC_server_config_t *config,
+                                             VHC_shm_data_t *shmdata,
+                                             VHC_slot_block_t *block) {
+   apr_uint64_t  batch = gs_vhc_env_settings.slot_batch;
+   apr_uint64_t  keep = batch;
+   apr_uint64_t  spare;
+   apr_uint64_t  nreturn;
+
+   if ((VHC_ATOMIC_LOAD(&shmdata->inuse_slots) + 2 * batch >
+           vhc_get_slot_limit_(config, shmdata) )  ||
+       (VHC_ATOMIC_LOAD(&shmdata->queue_waiters) > 0) )
+      keep = 0;
+
+   spare = VHC_ATOMIC_ADD(&block->spare, 1);
+   if ((keep > 0)  &&  (spare < 2 * batch) )
+      return 0;
+
+   do {
+      nreturn = (spare > keep) ? spare - keep : 0;
+      if (0 == nreturn)
+         return 0;
+
+   } while (!VHC_ATOMIC_CAS(&block->spare, &spare, spare - nreturn) );
+
+   vhc_release_vhost_slots_(shmdata, nreturn);
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: returned %d block slots", VHC_LOC,
+                                   (int) nreturn);
+
+   return nreturn;
+
+}  /*  End of function  vhc_release_block_slot_.  */
+
+
+
+/**
+ *   @brief   Reap the slot leases of dead children.
+ *
+ *   Reap the slot leases of dead children (in the parent) - children
+ *   that crashed or got killed never ran their pool cleanups, so their
+ *   slots would leak. A child is dead if its pid is gone, or replaced if
+ *   the scoreboard has its pid for another generation. A live pid the
+ *   scoreboard doesn't know is left alone (could be an extra process of
+ *   the MPM), the child that next gets that pid returns the leases.
+ *
+ */
+static void  vhc_reap_dead_children_(void) {
+   VHC_lease_header_t  *header = vhc_get_lease_header_();
+   VHC_lease_child_t   *child;
+   process_score       *ps;
+   apr_proc_t           proc;
+   apr_uint32_t         owner;
+   apr_uint32_t         nreturned;
+   apr_uint32_t         idx;
+   int                  slot;
+   int                  dead;
+
+   if (NULL == header)
+      return;
+
+   for (idx = 0; idx < header->num_children; idx++) {
+      child = vhc_get_lease_child_(header, idx);
+      owner = VHC_ATOMIC_LOAD(&child->owner);
+      if ((0 == owner)  ||  (VHC_LEASE_OWNER_REAPING == owner) )
+         continue;
+
+      proc.pid = (pid_t) owner;
+      dead = (0 != kill(proc.pid, 0) )  &&  (ESRCH == errno);
+      if (!dead) {
+         slot = ap_find_child_by_pid(&proc);
+         ps = (slot < 0) ? NULL : ap_get_scoreboard_process(slot);
+         dead = (NULL != ps)  &&  (ps->generation != child->mpm_generation);
+      }
+
+      if (!dead  ||
+          !VHC_ATOMIC_CAS(&child->owner, &owner, VHC_LEASE_OWNER_REAPING) )
+         continue;
+
+      nreturned = vhc_return_child_leases_(header, child);
+      VHC_ATOMIC_ADD(&header->reclaimed_slots, nreturned);
+      VHC_ATOMIC_ADD(&header->reaped_children, 1);
+      VHC_ATOMIC_STORE(&child->owner, 0);
+
+      if (nreturned > 0)
+         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, gs_main_server,
+                      "%s: reclaimed %u slots of dead child pid %ld",
+                      VHC_MODULE_NAME, nreturned, (long int) owner);
+   }
+
+}  /*  End of function  vhc_reap_dead_children_.  */
+
+
+
+/**
+  *   @brief   Set up the global capacity pool.
+  *   @param   header  slot table header
+  *
+  *   Set up the global capacity pool (in the slot table header) - sized
+  *   by VHostChokeCapacityPool or from MaxRequestWorkers. The pool's
+  *   counters are recounted from the slot table + per-Host buckets, so
+  *   they are right no matter what the pool was before the restart.
+  *
+  */
+static void  vhc_set_pool_capacity_(VHC_shm_header_t *header) {
+   VHC_shm_header_t  *tables[2];
+   VHC_shm_data_t    *entry;
+   apr_uint64_t       capacity = gs_vhc_env_settings.pool_slots;
+   apr_uint64_t       inuse_slots = 0;
+   apr_uint64_t       borrowed = 0;
+   apr_int64_t        borrow_weight = 0;
+   apr_uint32_t       idx;
+   int                max_daemons = 0;
+   int                max_threads = 0;
+   int                t;
+
+   if (VHC_CAPACITY_POOL_AUTO == capacity) {
+      ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons);
+      ap_mpm_query(AP_MPMQ_MAX_THREADS, &max_threads);
+      capacity = (apr_uint64_t) ((max_daemons < 1) ? 1 : max_daemons) *
+                 (apr_uint64_t) ((max_threads < 1) ? 1 : max_threads);
+   }
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   /*  Slots are lent across vhosts (+ lock stripes).  */
+   capacity = 0;
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+   tables[0] = header;
+   tables[1] = vhc_get_shm_header_(gs_host_shm);
+
+   for (t = 0; t < 2; t++) {
+      for (idx = 0; (NULL != tables[t])  &&  (idx < tables[t]->num_entries);
+           idx++) {
+         entry = (VHC_shm_data_t *) ((char *) tables[t] +
+                                     VHC_SHM_HEADER_SIZE +
+                                     (apr_size_t) tables[t]->entry_stride *
+                                        idx);
+         if (0 == capacity)
+            VHC_ATOMIC_STORE(&entry->borrowed, 0);   /*  No more loans.  */
+
+         inuse_slots += VHC_ATOMIC_LOAD(&entry->inuse_slots);
+         if (VHC_ATOMIC_LOAD(&entry->borrowed) > 0) {
+            borrowed      += VHC_ATOMIC_LOAD(&entry->borrowed);
+            borrow_weight += VHC_ATOMIC_LOAD(&entry->borrow_weight);
+         }
+      }
+   }
+
+   VHC_ATOMIC_STORE(&header->pool.inuse_slots, inuse_slots);
+   VHC_ATOMIC_STORE(&header->pool.borrowed, borrowed);
+   VHC_ATOMIC_STORE(&header->pool.borrow_weight, borrow_weight);
+   header->pool.capacity = capacity;
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: capacity pool %ld slots (%ld used)",
+                                   VHC_LOC, (long int) capacity,
+                                   (long int) inuse_slots);
+
+}  /*  End of function  vhc_set_pool_capacity_.  */
+
+
+
+/**
+  *   @brief   Reserve bandwidth for sending bytes to a vhost's client.
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @param   nbytes    # of bytes to send
+  *   @param   reserved  set to 0 if the bytes weren't reserved (returned)
+  *   @return  how long (usecs) to defer sending the bytes - 0 to send now
+  *            (or, if not reserved, to wait before trying again).
+  *
+  *   Reserve the bytes from the vhost's byte budget (shared by all the
+  *   children). Like the request rate, the budget is a theoretical
+  *   arrival time (in nsecs, with a one second burst). The budget is
+  *   only booked upto VHC_BANDWIDTH_MAX_DELAY_USECS ahead - bytes that
+  *   would have to wait any longer aren't reserved, the caller waits
+  *   and tries again. An idle budget always takes the bytes.
+  *
+  */
+static apr_interval_time_t  vhc_reserve_vhost_bandwidth_(
+                                    VHC_server_config_t *config,
+                                    VHC_shm_data_t *shmdata,
+                                    apr_off_t nbytes, int *reserved) {
+
+   apr_int64_t  burst = APR_INT64_C(1000000000);   /*  1 sec in nsecs.  */
+   apr_int64_t  max_delay = (apr_int64_t) VHC_BANDWIDTH_MAX_DELAY_USECS *
+                            1000;
+   apr_int64_t  cost;
+   apr_int64_t  current_time;
+   apr_int64_t  tat;
+   apr_int64_t  new_tat;
+   apr_int64_t  delay;
+
+   *reserved = 1;
+
+   if ((0 == config->bandwidth_settings.rate)  ||  (nbytes <= 0) )
+      return 0;
+
+   cost = (apr_int64_t) nbytes * burst /
+          (apr_int64_t) config->bandwidth_settings.rate;
+   current_time = vhc_monotonic_now_() * 1000;
+   tat = VHC_ATOMIC_LOAD(&shmdata->bandwidth_tat);
+
+   do {
+      /*  Booked too far ahead - try again once the backlog drains.  */
+      delay = tat + cost - burst - current_time - max_delay;
+      if ((tat > current_time)  &&  (delay > 0) ) {
+         *reserved = 0;
+         return delay / 1000 + 1;
+      }
+
+      new_tat = ((tat > current_time) ? tat : current_time) + cost;
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->bandwidth_tat, &tat, new_tat) );
+
+   /*  Bytes are due once they fit in the (one second) burst.  */
+   delay = (new_tat - burst - current_time) / 1000;
+   if (delay <= 0)
+      return 0;
+
+   return (delay > VHC_BANDWIDTH_MAX_DELAY_USECS) ?
+             VHC_BANDWIDTH_MAX_DELAY_USECS : delay;
+
+}  /*  End of function  vhc_reserve_vhost_bandwidth_.  */
+
+
+
+/**
+  *   @brief   Admit a request to the virtual host - grab a slot if the
+  *            vhost has capacity.
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @param   nslots   # of slots in use (returned back)
+  *   @param   nextra   extra slots wanted for a slot block (in) and
+  *                     extra slots granted (out) - can be NULL
+  *   @return  APR_SUCCESS if a slot was granted, otherwise errors.
+  *
+  *   Admit a request to a virtual host - claim its slot (see
+  *   vhc_claim_vhost_slots_, in mutex mode the caller holds the vhost's
+  *   lock). Requests within the slot limit also need a token from the
+  *   request rate bucket. Extra slots for the child's slot block are only
+  *   granted when the vhost is well within its slot limit.
+  *
+  */
+static int  vhc_admit_vhost_request_(VHC_server_config_t *config,
+                                     VHC_shm_data_t *shmdata,
+                                     apr_uint64_t *nslots,
+                                     apr_uint64_t *nextra) {
+
+   apr_status_t  status;
+   apr_uint64_t  wanted = (NULL == nextra) ? 0 : *nextra;
+   apr_uint64_t  extra = 0;
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: check vhost capacity", VHC_LOC);
+
+   if (NULL != nextra)
+      *nextra = 0;
+
+   /*  Concurrency slots (slot limit 0 == unlimited slots).  */
+   status = vhc_claim_vhost_slots_(vhc_get_shm_header_(gs_shm), config,
+                                   shmdata,
+                                   vhc_get_vhost_stats_(config->shm_index),
+                                   wanted, nslots, &extra);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   /*  Request rate - give the slot back if we are out of tokens.  */
+   status = vhc_check_vhost_rate_(config, shmdata);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+      VHC_DEBUG  vhc_debug_log_(NULL, "%s: vhost request rate exceeded",
+                                      VHC_LOC);
+      if (config->slot_limit > 0)
+         *nslots = vhc_release_vhost_slots_(shmdata, 1 + extra);
+
+      return status;
+   }
+
+   if (NULL != nextra)
+      *nextra = extra;
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_admit_vhost_request_.  */
+
+
+
+/**
+  *   @brief   Release a slot previously granted to a request.
+  *   @param   shmdata  vhost shm data
+  *   @return  # of slots in use after the release.
+  *
+  *   Release a slot previously granted to a request (never goes below
+  *   zero) - and return it to the capacity pool.
+  *
+  */
+static apr_uint64_t  vhc_release_vhost_slot_(VHC_shm_data_t *shmdata) {
+
+   return vhc_release_vhost_slots_(shmdata, 1);
+
+}  /*  End of function  vhc_release_vhost_slot_.  */
+
+
+
+/**
+  *   @brief   Release slots (a slot block's surplus) in one go.
+  *   @param   shmdata  vhost shm data
+  *   @param   nslots   # of slots to release
+  *   @return  # of slots in use after the release.
+  *
+  *   Release a number of slots with a single update (never goes below
+  *   zero) - and return them to the capacity pool.
+  *
+  */
+static apr_uint64_t  vhc_release_vhost_slots_(VHC_shm_data_t *shmdata,
+                                              apr_uint64_t nslots) {
+
+   VHC_shm_header_t  *header = vhc_get_shm_header_(gs_shm);
+
+   /*  Give the slots back to the capacity pool - slots of retired slot  */
+   /*  tables get there when the parent reconciles them.                 */
+   if ((NULL != header)  &&
+       ((0 == header->pool.capacity)  ||
+        !(vhc_shm_has_entry_(gs_shm, (apr_uintptr_t) shmdata)  ||
+          vhc_shm_has_entry_(gs_host_shm, (apr_uintptr_t) shmdata) ) ) )
+      header = NULL;
+
+   return vhc_release_slots_(header, shmdata, nslots);
+
+}  /*  End of function  vhc_release_vhost_slots_.  */
+
+
+
+/**
+  *   @brief   Park a queued request until woken up (a slot got released)
+  *            or the timeout expires.
+  *   @param   wake_seq       vhost queue wakeup sequence (in shm)
+  *   @param   seq            wakeup sequence seen before the last attempt
+  *   @param   timeout_usecs  max. time to wait
+  *
+  *   Park a queued request on the vhost's wakeup sequence - a futex in
+  *   the shm on Linux, so waiters sleep in the kernel and only wake up
+  *   when a slot is released (returns at once if the sequence already
+  *   moved on). Other platforms poll.
+  *
+  */
+static void  vhc_queue_wait_(volatile apr_uint32_t *wake_seq,
+                             apr_uint32_t seq,
+                             apr_interval_time_t timeout_usecs) {
+
+#ifdef  VHC_HAVE_FUTEX
+   struct timespec  ts;
+
+   ts.tv_sec  = (time_t) apr_time_sec(timeout_usecs);
+   ts.tv_nsec = (long) apr_time_usec(timeout_usecs) * 1000;
+
+   /*  Shared (non-private) futex - waiters are in other processes.  */
+   syscall(SYS_futex, (void *) wake_seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+#else
+   if (timeout_usecs > VHC_QUEUE_POLL_USECS)
+      timeout_usecs = VHC_QUEUE_POLL_USECS;
+
+   if (VHC_ATOMIC_LOAD(wake_seq) == seq)
+      apr_sleep(timeout_usecs);
+#endif  /*  VHC_HAVE_FUTEX  */
+
+}  /*  End of function  vhc_queue_wait_.  */
+
+
+
+/**
+  *   @brief   Wake up one queued request.
+  *   @param   wake_seq  vhost queue wakeup sequence (in shm)
+  *
+  *   Wake up one request queued on the vhost (a slot got released).
+  *
+  */
+static void  vhc_queue_wakeup_(volatile apr_uint32_t *wake_seq) {
+
+   VHC_ATOMIC_ADD(wake_seq, 1);
+
+#ifdef  VHC_HAVE_FUTEX
+   syscall(SYS_futex, (void *) wake_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif  /*  VHC_HAVE_FUTEX  */
+
+}  /*  End of function  vhc_queue_wakeup_.  */
+
+
+
+/**
+  *   @brief   Send the choked response back to the client.
+  *   @param   req  request record
+  *
+  *   Send the choked response (headers + page content) back to the
+  *   client.
+  *
+  */
+static void  vhc_send_choked_response_(request_rec *req) {
+
+   VHC_server_config_t  *cfg = (VHC_server_config_t *)
+      ap_get_module_config(req->server->module_config, &vhost_choke_module);
+
+   /*  Set response headers - content type, status & extension headers.  */
+   vhc_generate_choked_headers_(req, cfg->choked);
+
+   /*  !HEAD request, so send the choked page content as well.  */
+   if (!req->header_only) {
+      /*  TODO: add a link to the choked page w/ the error message.  */
+
+      /*  Send an error page w/ the customized "choked" message.     */
+      vhc_generate_choked_page_content_(req, cfg->choked);
+   }
+
+
+   /*  Log error if dev debugging - don't overload log on high load.  */
+#ifdef VHC_DEV_DEBUG
+   ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
+                "%s: vhost %s choked - %s",
+                   VHC_MODULE_NAME, vhc_get_vhost_name_(req->server),
+                   VHC_HTTP_MSG_TOO_MANY_REQUESTS);
+
+#endif  /*  For VHC_DEV_DEBUG.  */
+
+   /*  Log that we returned the customized "choked" http error code.  */
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: vhost choked response "
+                                        "status=%d", VHC_LOC,
+                                        cfg->choked->status);
+
+}  /*  End of function  vhc_send_choked_response_.  */
+
+
+
+/**
+  *   @brief   Try and admit a request to the vhost (one shot).
+  *   @param   req         request record
+  *   @param   cfg         vhost config record
+  *   @param   vhost_data  vhost shm data
+  *   @param   nslots      # of slots in use (returned back)
+  *   @return  APR_SUCCESS if admitted, VHC_CHOKED_* if choked,
+  *            HTTP_INTERNAL_SERVER_ERROR if we couldn't get the lock.
+  *
+  *   Try and admit a request to the vhost - with a spare slot from this
+  *   child's slot block (no lock, no shm update) or else taking the
+  *   vhost's lock stripe around the check if we are not lock-free.
+  *
+  */
+static int  vhc_try_admit_(request_rec *req, VHC_server_config_t *cfg,
+                           VHC_shm_data_t *vhost_data,
+                           apr_uint64_t *nslots) {
+
+   apr_status_t       status;
+   VHC_slot_block_t  *block = vhc_get_slot_block_(cfg, vhost_data);
+   apr_uint64_t       nextra = 0;
+
+   if ((NULL != block)  &&  vhc_take_block_slot_(block) ) {
+      *nslots = VHC_ATOMIC_LOAD(&vhost_data->inuse_slots);
+      return APR_SUCCESS;
+   }
+
+   /*  Acquire the lock if we are not lock-free.  */
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode) {
+      status = vhc_acquire_vhost_lock_(cfg->shm_index);
+      VHC_DEBUG  vhc_debug_log_(req->pool, "%s: Lock acquistion status %d",
+                                           VHC_LOC, status);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         /*  Got some error - need to log and bail out.  */
+         ap_log_error(APLOG_MARK, APLOG_ERR, status, req->server,
+                      "%s: admission failed to acquire shm lock - pid=%ld",
+                      VHC_MODULE_NAME, (long int) getpid() );
+         return HTTP_INTERNAL_SERVER_ERROR;
+      }
+   }
+
+   /*  Check vhost has capacity and grab a slot (+ a block's worth).  */
+   if (NULL != block)
+      nextra = gs_vhc_env_settings.slot_batch - 1;
+
+   status = vhc_admit_vhost_request_(cfg, vhost_data, nslots, &nextra);
+
+   /*  Release the previously acquired lock.  */
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)
+      vhc_lock_release_(vhc_get_vhost_lock_(cfg->shm_index) );
+
+   if (nextra > 0)
+      VHC_ATOMIC_ADD(&block->spare, nextra);
+
+   return status;
+
+}  /*  End of function  vhc_try_admit_.  */
+
+
+
+/**
+  *   @brief   Queue a request that got choked for want of slots.
+  *   @param   req         request record
+  *   @param   cfg         vhost config record
+  *   @param   vhost_data  vhost shm data
+  *   @param   nslots      # of slots in use (returned back)
+  *   @return  APR_SUCCESS if admitted, VHC_CHOKED_* if the queue is full
+  *            or the wait timed out, HTTP_* on errors.
+  *
+  *   Hold a choked request in the vhost's (bounded) admission queue for
+  *   upto the queue timeout - it gets retried every time a slot is
+  *   released. Needs shm atomics (the queue is not under the lock).
+  *
+  */
+static int  vhc_queue_for_slot_(request_rec *req, VHC_server_config_t *cfg,
+                                VHC_shm_data_t *vhost_data,
+                                apr_uint64_t *nslots) {
+
+   apr_status_t  status = VHC_CHOKED_NO_SLOTS;
+
+#ifdef  VHC_HAVE_SHM_ATOMICS
+   apr_uint32_t  waiters;
+   apr_uint32_t  seq;
+   apr_time_t    queued_at;
+   apr_time_t    current_time;
+   apr_time_t    deadline;
+
+   if (0 == cfg->queue_settings.depth)
+      return status;   /*  No queueing - choke right away.  */
+
+   /*  Join the queue unless it is full.  */
+   waiters = VHC_ATOMIC_LOAD(&vhost_data->queue_waiters);
+   do {
+      if (waiters >= cfg->queue_settings.depth)
+         return status;   /*  Queue overflow.  */
+
+   } while (!VHC_ATOMIC_CAS(&vhost_data->queue_waiters, &waiters,
+                            waiters + 1) );
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: queued request #%d",
+                                        VHC_LOC, (int) waiters + 1);
+
+   queued_at = current_time = vhc_monotonic_now_();
+   deadline = current_time +
+              apr_time_from_msec(cfg->queue_settings.timeout);
+
+   while (current_time < deadline) {
+      /*  Note the wakeup sequence before retrying, so no lost wakeups.  */
+      seq = VHC_ATOMIC_LOAD(&vhost_data->wake_seq);
+
+      status = vhc_try_admit_(req, cfg, vhost_data, nslots);
+      if (VHC_CHOKED_NO_SLOTS != status)
+         break;   /*  Admitted, out of tokens or an error.  */
+
+      vhc_queue_wait_(&vhost_data->wake_seq, seq, deadline - current_time);
+      current_time = vhc_monotonic_now_();
+
+   }  /*  End of  while not timed out.  */
+
+   /*  Leave the queue.  */
+   VHC_ATOMIC_ADD(&vhost_data->queue_waiters, -1);
+
+   vhc_trace_(VHC_TRACE_EVENT_QUEUED, cfg->config_id, *nslots,
+              (apr_uint32_t) (vhc_monotonic_now_() - queued_at) );
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: dequeued request status %d",
+                                        VHC_LOC, status);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+   return status;
+
+}  /*  End of function  vhc_queue_for_slot_.  */
+
+
+
+/**
+  *   @brief   Returns the top-level (client) request of a request.
+  *   @param   req  request record
+  *   @return  the client request that req is (ultimately) a part of.
+  *
+  *   Returns the client request a subrequest or an internal redirect
+  *   (ErrorDocument, mod_rewrite, DirectoryIndex, ...) belongs to - the
+  *   one request whose slot accounting covers them all.
+  *
+  */
+static request_rec  *vhc_get_top_request_(request_rec *req) {
+
+   while ((NULL != req->main)  ||  (NULL != req->prev) )
+      req = (NULL != req->main) ? req->main : req->prev;
+
+   return req;
+
+}  /*  End of function  vhc_get_top_request_.  */
+
+
+
+/**
+  *   @brief   Admit a request - check whether or not to choke requests
+  *            to the vhost.
+  *   @param   req  request record
+  *   @return  DECLINED if the request was admitted (there's enough slots,
+  *            within the burst grace period or the vhost is not throttled),
+  *            VHC_HTTP_TOO_MANY_REQUESTS if the request is to be choked,
+  *            HTTP_* if an error occurred and needs to be reported
+  *
+  *   Admit a request to the vhost. Admitted requests hold a slot until
+  *   the release point (VHostChokeReleaseAt) - the request pool cleanup
+  *   is the last resort. The request is checked against the vhost's
+  *   effective limits (in shm). A client request is admitted once -
+  *   its internal redirects (and error documents) run on its slot.
+  *   Subrequests are only passed in to be counted (Count subrequests).
+  *
+  */
+static int  vhc_admit_request_(request_rec *req) {
+
+   apr_status_t          status;
+   apr_pool_t           *pool = req->pool;
+   request_rec          *owner = req;
+   VHC_server_config_t  *vhost_cfg;
+   VHC_server_config_t  *cfg;
+   VHC_server_config_t   effective;
+   VHC_shm_data_t       *vhost_data;
+   VHC_shm_data_t       *host_data = NULL;
+   VHC_admission_t      *admission;
+   VHC_shm_stats_t      *stats;
+   apr_uint64_t          inuse_slots = 0;
+   char                  burst_grace[] = "(burst grace period)";
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
+                                   vhc_get_vhost_name_(req->server) );
+
+   cfg = vhost_cfg = ap_get_module_config(req->server->module_config,
+                                          &vhost_choke_module);
+
+   /*  Limits changed at runtime - the vhost's entry has the lot.  */
+   vhost_data = vhc_get_vhost_shm_data_(vhost_cfg->shm_index);
+   if (NULL != vhost_data)
+      cfg = vhc_get_effective_config_(vhost_cfg, vhost_data, &effective);
+
+   /*  Check if we need to throttle this vhost.  */
+   if (!VHC_VHOST_IS_THROTTLED(cfg) ) {
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: NOT throttled slot limit=%d", 
+                                      VHC_LOC, cfg->slot_limit);
+      return DECLINED;
+   }
+
+   /*  Admit the client request only once - not again for each of its  */
+   /*  internal redirects. Note lives as long as the request pool.      */
+   if (NULL == req->main) {
+      owner = vhc_get_top_request_(req);
+      if (NULL != apr_table_get(owner->notes, VHC_ADMITTED_NOTE) ) {
+         VHC_DEBUG  vhc_debug_log_(pool, "%s: request already admitted",
+                                         VHC_LOC);
+         return DECLINED;
+      }
+
+      apr_table_setn(owner->notes, VHC_ADMITTED_NOTE, "1");
+   }
+
+   /*  Ensure valid config id.  */
+   if (cfg->config_id >= gs_num_configs) {
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: Config Id %d not valid (>= %d)",
+                                      VHC_LOC, cfg->config_id,
+                                      gs_num_configs);
+      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
+                   "%s: invalid config id [%d] >= %d",
+                   VHC_MODULE_NAME, cfg->config_id, gs_num_configs);
+      return HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+
+   /*  Get the vhost (or its per-Host bucket) data from shm. Locking  */
+   /*  and stats stay per-vhost - the limits apply to each bucket.    */
+   if (cfg->per_host)
+      host_data = vhc_get_host_shm_data_(cfg, req->hostname);
+
+   if (NULL != host_data)
+      vhost_data = host_data;
+
+   if (NULL == vhost_data) {
+      /*  Error getting shm segment base address.  */
+      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
+                   "%s: admission error getting shm base address",
+                   VHC_MODULE_NAME);
+      return HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+   /*  Per-process stats shard - counters are approximate w/o atomics.  */
+   stats = vhc_get_vhost_stats_(cfg->shm_index);
+
+   /*  Check vhost has capacity and grab a slot - or wait in the queue.  */
+   status = vhc_try_admit_(req, cfg, vhost_data, &inuse_slots);
+   if (VHC_CHOKED_NO_SLOTS == status)
+      status = vhc_queue_for_slot_(req, cfg, vhost_data, &inuse_slots);
+
+   if (VHC_IS_CHOKED(status) ) {
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost choked inuse_slots = %d",
+                                      VHC_LOC, (int) inuse_slots);
+
+      if (NULL != stats) {
+         if (VHC_CHOKED_NO_TOKENS == status)
+            VHC_ATOMIC_INC_RELAXED(&stats->choked_no_tokens, 1);
+         else
+            VHC_ATOMIC_INC_RELAXED(&stats->choked_no_slots, 1);
+      }
+
+      vhc_trace_((VHC_CHOKED_NO_TOKENS == status) ?
+                    VHC_TRACE_EVENT_CHOKE_RATE : VHC_TRACE_EVENT_CHOKE_SLOTS,
+                 cfg->config_id, inuse_slots,
+                 VHC_ATOMIC_LOAD(&vhost_data->queue_waiters) );
+
+      /*  Tell the client when to come back (Retry-After).  */
+      vhc_generate_retry_headers_(req, cfg, vhost_data, status);
+
+      return VHC_HTTP_TOO_MANY_REQUESTS;
+   }
+
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+
+   /*  We have enough slots for this vhost (borrowed ones aren't burst).  */
+   if (inuse_slots <= vhc_get_slot_limit_(cfg, vhost_data) +
+                      VHC_ATOMIC_LOAD(&vhost_data->borrowed) )
+      burst_grace[0] = '\0';  /*  Within slot limit.  */
+   else if (NULL != stats)
+      VHC_ATOMIC_INC_RELAXED(&stats->burst_admitted, 1);
+
+   vhc_trace_(burst_grace[0] ? VHC_TRACE_EVENT_ADMIT_BURST :
+                               VHC_TRACE_EVENT_ADMIT,
+              cfg->config_id, inuse_slots, 0);
+
+   if (NULL != stats)
+      VHC_ATOMIC_INC_RELAXED(&stats->admitted, 1);
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost has capacity %d/%d %s",
+                                   VHC_LOC, (int) inuse_slots,
+                                   (int) vhc_get_slot_limit_(cfg, vhost_data),
+                                   burst_grace);
+
+   /*  Rate limited only - no slot to release.  */
+   if (0 == cfg->slot_limit)
+      return DECLINED;
+
+   /*  Release the slot when the request ends (pool cleanup) - or  */
+   /*  earlier, at the end of the response or when it gets logged.  */
+   admission = apr_palloc(pool, sizeof(VHC_admission_t) );
+   admission->req     = req;
+   admission->config  = vhost_cfg;
+   admission->shmdata = vhost_data;
+   admission->lease   = vhc_lease_slot_(vhost_data);
+   admission->block   = vhc_get_slot_block_(cfg, vhost_data);
+   admission->admitted_at = vhc_monotonic_now_();
+   admission->released    = 0;
+
+   apr_pool_cleanup_register(pool, admission, vhc_req_pool_cleanup_,
+                             apr_pool_cleanup_null);
+
+   ap_set_module_config(owner->request_config, &vhost_choke_module,
+                        admission);
+
+   /*  Subrequests share the client request's protocol filters.  */
+   if ((VHC_RELEASE_AT_EOS == gs_vhc_env_settings.release_at)  &&
+       (NULL == req->main) )
+      ap_add_output_filter(VHC_RELEASE_FILTER_NAME, admission, req,
+                           req->connection);
+
+   return DECLINED;
+
+}  /*  End of function  vhc_admit_request_.  */
+
+
+
+/**
+  *   @brief   Release the slot an admitted request holds.
+  *   @param   admission    the request's admission record
+  *   @param   last_chance  non-zero if no later release point follows
+  *
+  *   Release the slot an admitted request holds (against the vhost's
+  *   current effective limits) - exactly once, no matter how many of
+  *   the release points (end of response, logging, pool cleanup) the
+  *   request gets to. If the lock can't be had, the slot is left to a
+  *   later release point - the last one releases it without the lock.
+  *
+  */
+static void  vhc_release_admission_(VHC_admission_t *admission,
+                                    int last_chance) {
+
+   apr_uint32_t          released = 0;
+   int                   locked = 0;
+   request_rec          *req = admission->req;
+   VHC_server_config_t  *cfg = admission->config;
+   VHC_server_config_t   effective;
+   VHC_shm_data_t       *vhost_data;
+   apr_status_t          status;
+   apr_pool_t           *pool = req->pool;
+   apr_uint64_t          nslots;
+   apr_interval_time_t   service_time;
+
+   /*  Whichever release point gets here first releases the slot.  */
+   if (!VHC_ATOMIC_CAS(&admission->released, &released, 1) )
+      return;
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
+                                   vhc_get_vhost_name_(req->server) );
+
+   service_time = vhc_monotonic_now_() - admission->admitted_at;
+
+   vhost_data = vhc_get_vhost_shm_data_(cfg->shm_index);
+   if (NULL != vhost_data)
+      cfg = vhc_get_effective_config_(cfg, vhost_data, &effective);
+
+   /*  Keep the slot in this child's slot block (no lock needed).  */
+   if ((NULL != admission->block)  &&  (NULL != gs_lease_child) ) {
+      if (NULL != admission->lease)
+         VHC_ATOMIC_STORE(&admission->lease->shmdata, 0);
+
+      nslots = vhc_release_block_slot_(cfg, admission->shmdata,
+                                       admission->block);
+
+      vhc_adapt_slot_limit_(cfg, admission->shmdata, service_time,
+                            VHC_ATOMIC_LOAD(&admission->shmdata->
+                                               inuse_slots) );
+
+      vhc_trace_(VHC_TRACE_EVENT_RELEASE, cfg->config_id,
+                 VHC_ATOMIC_LOAD(&admission->shmdata->inuse_slots),
+                 (apr_uint32_t) service_time);
+
+      /*  Slots went back - hand one to a queued request (if any).  */
+      if ((nslots > 0)  &&
+          (VHC_ATOMIC_LOAD(&admission->shmdata->queue_waiters) > 0) )
+         vhc_queue_wakeup_(&admission->shmdata->wake_seq);
+
+      return;
+   }
+
+   /*  Acquire the lock if we are not lock-free.  */
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode) {
+      status = vhc_acquire_vhost_lock_(cfg->shm_index);
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: Lock acquistion status %d",
+                                      VHC_LOC, status);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         /*  Got some error - log it and leave it to a later point.  */
+         ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
+                      "%s: slot release failed to acquire shm lock - "
+                      "pid=%ld%s", VHC_MODULE_NAME, (long int) getpid(),
+                      last_chance ? " (releasing unlocked)" : "");
+         if (!last_chance) {
+            VHC_ATOMIC_STORE(&admission->released, 0);
+            return;
+         }
+      }
+      else
+         locked = 1;
+   }
+
+   /*  Give up the lease first - a crash in between leaks the slot  */
+   /*  rather than the reaper releasing it twice.                    */
+   if (NULL != admission->lease)
+      VHC_ATOMIC_STORE(&admission->lease->shmdata, 0);
+
+   /*  Reduce the number of inuse slots.  */
+   nslots = vhc_release_vhost_slot_(admission->shmdata);
+
+   /*  Feed the request's service time to the adaptive slot limit.  */
+   if (locked  ||  (VHC_LOCK_MODE_MUTEX != gs_vhc_env_settings.lock_mode) )
+      vhc_adapt_slot_limit_(cfg, admission->shmdata, service_time,
+                            nslots + 1);
+
+   if (locked)
+      status = vhc_lock_release_(vhc_get_vhost_lock_(cfg->shm_index) );
+
+   /*  Hand the slot to a queued request (if any).  */
+   if (VHC_ATOMIC_LOAD(&admission->shmdata->queue_waiters) > 0)
+      vhc_queue_wakeup_(&admission->shmdata->wake_seq);
+
+   vhc_trace_(VHC_TRACE_EVENT_RELEASE, cfg->config_id, nslots,
+              (apr_uint32_t) service_time);
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost usage = %d slots",
+                                   VHC_LOC, (int) nslots);
+
+}  /*  End of function  vhc_release_admission_.  */
+
+
+
+/**
+  *   @brief   Admit a subrequest - as per the vhost's VHostChokeSubrequests.
+  *   @param   req  (sub)request record
+  *   @return  DECLINED if the subrequest was admitted (or isn't counted),
+  *            VHC_HTTP_TOO_MANY_REQUESTS if it is to be choked, HTTP_* if
+  *            an error occurred and needs to be reported
+  *
+  *   Admit a subrequest that gets run (SSI includes, ...) - lookups that
+  *   never get to the handler cost nothing. Subrequests are ignored (the
+  *   client request's slot covers them), take a slot of their own
+  *   (Count) or are limited by a separate per-vhost counter (Separate).
+  *   Whatever a subrequest holds is released with its pool.
+  *
+  */
+static int  vhc_admit_subrequest_(request_rec *req) {
+
+   VHC_server_config_t  *vhost_cfg;
+   VHC_server_config_t  *cfg;
+   VHC_server_config_t   effective;
+   VHC_shm_data_t       *vhost_data;
+   VHC_admission_t      *admission;
+   apr_status_t          status;
+   apr_uint32_t          limit;
+   apr_uint32_t          inuse;
+
+   vhost_cfg = ap_get_module_config(req->server->module_config,
+                                    &vhost_choke_module);
+
+   if (VHC_SUBREQUESTS_IGNORE == vhost_cfg->subrequests)
+      return DECLINED;
+
+   if (VHC_SUBREQUESTS_COUNT == vhost_cfg->subrequests)
+      return vhc_admit_request_(req);
+
+   vhost_data = vhc_get_vhost_shm_data_(vhost_cfg->shm_index);
+   if (NULL == vhost_data)
+      return DECLINED;
+
+   cfg = vhc_get_effective_config_(vhost_cfg, vhost_data, &effective);
+   limit = (cfg->subrequest_limit > 0) ? cfg->subrequest_limit
+                                       : cfg->slot_limit;
+   if (0 == limit)
+      return DECLINED;
+
+   /*  Acquire the lock if we are not lock-free.  */
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode) {
+      status = vhc_acquire_vhost_lock_(cfg->shm_index);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         ap_log_error(APLOG_MARK, APLOG_ERR, status, req->server,
+                      "%s: subrequest admission failed to acquire shm "
+                      "lock - pid=%ld", VHC_MODULE_NAME,
+                      (long int) getpid() );
+         return HTTP_INTERNAL_SERVER_ERROR;
+      }
+   }
+
+   inuse = VHC_ATOMIC_LOAD(&vhost_data->subreq_slots);
+   while ((inuse < limit)  &&
+          !VHC_ATOMIC_CAS(&vhost_data->subreq_slots, &inuse, inuse + 1) )
+      ;
+
+   /*  Release the previously acquired lock.  */
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)
+      vhc_lock_release_(vhc_get_vhost_lock_(cfg->shm_index) );
+
+   if (inuse >= limit) {
+      VHC_DEBUG  vhc_debug_log_(req->pool, "%s: subrequest choked %u/%u",
+                                           VHC_LOC, inuse, limit);
+
+      vhc_trace_(VHC_TRACE_EVENT_CHOKE_SLOTS, cfg->config_id, inuse, 0);
+      return VHC_HTTP_TOO_MANY_REQUESTS;
+   }
+
+   /*  Give the subrequest slot back when the subrequest is done.  */
+   admission = apr_pcalloc(req->pool, sizeof(VHC_admission_t) );
+   admission->req     = req;
+   admission->config  = vhost_cfg;
+   admission->shmdata = vhost_data;
+
+   apr_pool_cleanup_register(req->pool, admission, vhc_subreq_pool_cleanup_,
+                             apr_pool_cleanup_null);
+
+   return DECLINED;
+
+}  /*  End of function  vhc_admit_subrequest_.  */
+
+
+
+/**
+  *   @brief   Get a snapshot of the status of all the vhosts.
+  *   @param   req     request record
+  *   @param   status  vhost status array (returned back)
+  *   @return  # of vhosts in the status array.
+  *
+  *   Get a snapshot of the status of all the vhosts - reads the slot
+  *   table without taking any locks (each value is read atomically, but
+  *   the snapshot as a whole is not). So the cost only depends on the
+  *   number of vhosts and not on the request traffic.
+  *
+  */
+static int  vhc_get_vhost_status_(request_rec *req,
+                                  VHC_vhost_status_t **status) {
+
+   server_rec           *s;
+   VHC_server_config_t  *cfg;
+   VHC_server_config_t   effective;
+   VHC_shm_header_t     *header;
+   VHC_shm_data_t       *vhost_data;
+   VHC_vhost_status_t   *vs;
+   apr_time_t            wall_time = apr_time_now();
+   apr_time_t            current_time = vhc_monotonic_now_();
+   apr_time_t            changed_at;
+   int                   n = 0;
+
+   *status = apr_pcalloc(req->pool,
+                         sizeof(VHC_vhost_status_t) * (gs_num_configs + 1) );
+
+   /*  Check it really is our slot table before reading from it.  */
+   header = vhc_get_shm_header_(gs_shm);
+   if (NULL == header)
+      return 0;
+
+   for (s = gs_main_server; (NULL != s)  &&  (n < gs_num_configs);
+        s = s->next) {
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      if (NULL == cfg)
+         continue;
+
+      vhost_data = vhc_get_vhost_shm_data_(cfg->shm_index);
+      if (NULL == vhost_data)
+         continue;
+
+      /*  Report the effective (maybe changed at runtime) limits.  */
+      cfg = vhc_get_effective_config_(cfg, vhost_data, &effective);
+
+      vs = &(*status)[n++];
+      vs->server           = s;
+      vs->shm_index        = cfg->shm_index;
+      vs->slot_limit       = cfg->slot_limit;
+      vs->weight           = cfg->weight;
+      vs->per_host         = cfg->per_host;
+      vs->queue_waiters    = VHC_ATOMIC_LOAD(&vhost_data->queue_waiters);
+      vs->inuse_slots      = VHC_ATOMIC_LOAD(&vhost_data->inuse_slots);
+      vs->borrowed         = VHC_ATOMIC_LOAD(&vhost_data->borrowed);
+      vs->effective_limit  = vhc_get_slot_limit_(cfg, vhost_data);
+      vs->latency_ewma     = VHC_ATOMIC_LOAD(&vhost_data->latency_ewma);
+      vs->burst_state      = vhc_get_burst_state_(cfg, vhost_data,
+                                                  current_time, &changed_at);
+      vhc_sum_vhost_stats_(header, cfg->shm_index, &vs->stats);
+
+      /*  Burst times are monotonic - report them as wall clock times.  */
+      if (VHC_BURST_STATE_BURSTING == vs->burst_state)
+         vs->grace_expires_at = wall_time - current_time +
+            VHC_ATOMIC_LOAD(&vhost_data->grace_expires_at);
+
+      if (changed_at > 0)
+         vs->burst_changed_at = wall_time - current_time + changed_at;
+   }
+
+   return n;
+
+}  /*  End of function  vhc_get_vhost_status_.  */
+
+
+
+/**
+  *   @brief   Print the vhost status as JSON.
+  *   @param   req     request record
+  *   @param   status  vhost status array
+  *   @param   n       # of vhosts in the status array
+  *
+  *   Print the vhost status as a JSON document (one object per vhost).
+  *
+  */
+static void  vhc_print_status_json_(request_rec *req,
+                                    VHC_vhost_status_t *status, int n) {
+   static const char   *burst_states[] = { "normal", "bursting",
+                                           "cooldown" };
+   VHC_shm_header_t    *header = vhc_get_shm_header_(gs_shm);
+   VHC_shm_header_t    *hosts = vhc_get_shm_header_(gs_host_shm);
+   VHC_lease_header_t  *leases = vhc_get_lease_header_();
+   VHC_vhost_status_t  *vs;
+   int                  idx;
+
+   ap_set_content_type(req, VHC_STATUS_JSON_CONTENT_TYPE);
+   if (req->header_only)
+      return;
+
+   ap_rprintf(req, "{\"module\": \"%s\", \"version\": \"%s\", "
+                   "\"pool_capacity\": %" APR_UINT64_T_FMT ", "
+                   "\"pool_inuse_slots\": %" APR_UINT64_T_FMT ", "
+                   "\"pool_borrowed\": %" APR_UINT64_T_FMT ", "
+                   "\"host_buckets\": %u, \"host_buckets_used\": %u, "
+                   "\"reclaimed_slots\": %" APR_UINT64_T_FMT ", "
+                   "\"reaped_children\": %" APR_UINT64_T_FMT ", "
+                   "\"untracked_slots\": %" APR_UINT64_T_FMT ", "
+                   "\"vhosts\": [", VHC_MODULE_NAME, VHC_MODULE_VERSION,
+                   header ? header->pool.capacity : 0,
+                   header ? VHC_ATOMIC_LOAD(&header->pool.inuse_slots) : 0,
+                   header ? VHC_ATOMIC_LOAD(&header->pool.borrowed) : 0,
+                   hosts ? hosts->num_entries : 0,
+                   hosts ? VHC_ATOMIC_LOAD(&hosts->used_entries) : 0,
+                   leases ? VHC_ATOMIC_LOAD(&leases->reclaimed_slots) : 0,
+                   leases ? VHC_ATOMIC_LOAD(&leases->reaped_children) : 0,
+                   leases ? VHC_ATOMIC_LOAD(&leases->untracked) : 0);
+
+   for (idx = 0; idx < n; idx++) {
+      vs = &status[idx];
+      ap_rprintf(req, "%s\n  {\"id\": %d, \"vhost\": \"%s\", "
+                      "\"port\": %d, \"slot_limit\": %d, \"weight\": %d, "
+                      "\"per_host\": %s, \"effective_limit\": %u, "
+                      "\"latency_ewma_usecs\": %u, "
+                      "\"inuse_slots\": %" APR_UINT64_T_FMT ", "
+                      "\"borrowed\": %" APR_UINT64_T_FMT ", "
+                      "\"queued\": %u, \"burst_state\": \"%s\", "
+                      "\"burst_changed_at\": %" APR_INT64_T_FMT ", "
+                      "\"grace_expires_at\": %" APR_INT64_T_FMT ", "
+                      "\"admitted\": %" APR_UINT64_T_FMT ", "
+                      "\"burst_admitted\": %" APR_UINT64_T_FMT ", "
+                      "\"borrow_admitted\": %" APR_UINT64_T_FMT ", "
+                      "\"bursts\": %" APR_UINT64_T_FMT ", "
+                      "\"choked_no_slots\": %" APR_UINT64_T_FMT ", "
+                      "\"choked_no_tokens\": %" APR_UINT64_T_FMT ", "
+                      "\"lock_timeouts\": %" APR_UINT64_T_FMT ", "
+                      "\"lock_wait_usecs\": %" APR_UINT64_T_FMT "}",
+                 (idx > 0) ? "," : "", (int) vs->shm_index,
+                 vhc_escape_json_(req->pool,
+                                  vhc_get_vhost_name_(vs->server) ),
+                 (int) vs->server->port, (int) vs->slot_limit,
+                 (int) vs->weight, vs->per_host ? "true" : "false",
+                 vs->effective_limit, vs->latency_ewma,
+                 vs->inuse_slots, vs->borrowed, vs->queue_waiters,
+                 burst_states[vs->burst_state],
+                 (apr_int64_t) apr_time_sec(vs->burst_changed_at),
+                 (apr_int64_t) apr_time_sec(vs->grace_expires_at),
+                 vs->stats.admitted, vs->stats.burst_admitted,
+                 vs->stats.borrow_admitted, vs->stats.bursts,
+                 vs->stats.choked_no_slots, vs->stats.choked_no_tokens,
+                 vs->stats.lock_timeouts, vs->stats.lock_wait_usecs);
+   }
+
+   ap_rputs("\n]}\n", req);
+
+}  /*  End of function  vhc_print_status_json_.  */
+
+
+
+/**
+  *   @brief   Print the vhost status in the Prometheus text format.
+  *   @param   req     request record
+  *   @param   status  vhost status array
+  *   @param   n       # of vhosts in the status array
+  *
+  *   Print the vhost status in the (compact) Prometheus text exposition
+  *   format - one sample per vhost for each metric.
+  *
+  */
+static void  vhc_print_status_text_(request_rec *req,
+                                    VHC_vhost_status_t *status, int n) {
+   /*  Note: a NULL type continues the previous metric (another label).  */
+   static const struct {
+      const char  *name;
+      const char  *type;
+      const char  *help;
+      const char  *labels;
+
+   } metrics[] = {
+      { "slot_limit",             "gauge",
+        "Max. concurrent requests (0 = none)",                    "" },
+      { "effective_slot_limit",   "gauge",
+        "Adapted (or configured) max. concurrent requests",       "" },
+      { "weight",                 "gauge",
+        "Capacity pool weight",                                   "" },
+      { "latency_ewma_microseconds",  "gauge",
+        "Request service time (EWMA, adaptive slot limit)",       "" },
+      { "inuse_slots",            "gauge",
+        "Concurrent requests in progress",                        "" },
+      { "borrowed_slots",         "gauge",
+        "Slots borrowed from the capacity pool",                  "" },
+      { "queued",                 "gauge",
+        "Requests waiting for a slot",                            "" },
+      { "burst_state",            "gauge",
+        "Burst state (0 = normal, 1 = bursting, 2 = cooldown)",   "" },
+      { "burst_changed_seconds",  "gauge",
+        "When the burst state last changed (unix time)",          "" },
+      { "grace_expires_seconds",  "gauge",
+        "When the burst grace period expires (unix time, 0 = none)", "" },
+      { "admitted_total",         "counter",
+        "Requests admitted",                                      "" },
+      { "burst_admitted_total",   "counter",
+        "Requests admitted over the slot limit (burst grace)",    "" },
+      { "borrow_admitted_total",  "counter",
+        "Requests admitted on a borrowed slot",                   "" },
+      { "bursts_total",           "counter",
+        "Bursts (grace periods) started",                         "" },
+      { "choked_total",           "counter",
+        "Requests choked (by reason)",        ",reason=\"slots\"" },
+      { "choked_total",           NULL,  NULL, ",reason=\"rate\"" },
+      { "lock_timeouts_total",    "counter",
+        "Lock acquisition timeouts (Mutex lock mode)",            "" },
+      { "lock_wait_microseconds_total",  "counter",
+        "Time spent waiting for locks (Mutex lock mode)",         "" },
+   };
+
+   const int            nmetrics = sizeof(metrics) / sizeof(metrics[0]);
+   VHC_shm_header_t    *header = vhc_get_shm_header_(gs_shm);
+   VHC_shm_header_t    *hosts = vhc_get_shm_header_(gs_host_shm);
+   VHC_lease_header_t  *leases = vhc_get_lease_header_();
+   VHC_vhost_status_t  *vs;
+   apr_uint64_t        *values;
+   const char         **labels;
+   int                  m;
+   int                  idx;
+
+   ap_set_content_type(req, VHC_STATUS_TEXT_CONTENT_TYPE);
+   if (req->header_only)
+      return;
+
+   /*  Metric values in the same order as the metrics table.  */
+   labels = apr_palloc(req->pool, sizeof(char *) * (n + 1) );
+   values = apr_palloc(req->pool, sizeof(apr_uint64_t) * (n + 1) * nmetrics);
+   for (idx = 0; idx < n; idx++) {
+      vs = &status[idx];
+      labels[idx] = apr_psprintf(req->pool, "vhost=\"%s\",port=\"%d\"",
+                                 vhc_escape_label_(req->pool,
+                                    vhc_get_vhost_name_(vs->server) ),
+                                 (int) vs->server->port);
+
+      m = idx * nmetrics;
+      values[m++] = vs->slot_limit;
+      values[m++] = vs->effective_limit;
+      values[m++] = vs->weight;
+      values[m++] = vs->latency_ewma;
+      values[m++] = vs->inuse_slots;
+      values[m++] = vs->borrowed;
+      values[m++] = vs->queue_waiters;
+      values[m++] = (apr_uint64_t) vs->burst_state;
+      values[m++] = (apr_uint64_t) apr_time_sec(vs->burst_changed_at);
+      values[m++] = (apr_uint64_t) apr_time_sec(vs->grace_expires_at);
+      values[m++] = vs->stats.admitted;
+      values[m++] = vs->stats.burst_admitted;
+      values[m++] = vs->stats.borrow_admitted;
+      values[m++] = vs->stats.bursts;
+      values[m++] = vs->stats.choked_no_slots;
+      values[m++] = vs->stats.choked_no_tokens;
+      values[m++] = vs->stats.lock_timeouts;
+      values[m++] = vs->stats.lock_wait_usecs;
+   }
+
+   for (m = 0; m < nmetrics; m++) {
+      if (NULL != metrics[m].type)
+         ap_rprintf(req, "# HELP %s%s %s.\n# TYPE %s%s %s\n",
+                    VHC_STATUS_METRIC_PREFIX, metrics[m].name,
+                    metrics[m].help, VHC_STATUS_METRIC_PREFIX,
+                    metrics[m].name, metrics[m].type);
+
+      for (idx = 0; idx < n; idx++)
+         ap_rprintf(req, "%s%s{%s%s} %" APR_UINT64_T_FMT "\n",
+                    VHC_STATUS_METRIC_PREFIX, metrics[m].name, labels[idx],
+                    metrics[m].labels,
+                    values[idx * nmetrics + m]);
+   }
+
+   /*  Global capacity pool (slots lent out between the vhosts).  */
+   if ((NULL != header)  &&  (header->pool.capacity > 0) )
+      ap_rprintf(req, "# HELP %spool_capacity_slots Capacity pool size.\n"
+                      "# TYPE %spool_capacity_slots gauge\n"
+                      "%spool_capacity_slots %" APR_UINT64_T_FMT "\n"
+                      "# HELP %spool_inuse_slots Capacity pool slots in use.\n"
+                      "# TYPE %spool_inuse_slots gauge\n"
+                      "%spool_inuse_slots %" APR_UINT64_T_FMT "\n"
+                      "# HELP %spool_borrowed_slots Capacity pool slots "
+                      "lent out.\n"
+                      "# TYPE %spool_borrowed_slots gauge\n"
+                      "%spool_borrowed_slots %" APR_UINT64_T_FMT "\n",
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX, header->pool.capacity,
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&header->pool.inuse_slots),
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&header->pool.borrowed) );
+
+   /*  Dynamic per-Host bucket table (shared by all the vhosts).  */
+   if (NULL != hosts)
+      ap_rprintf(req, "# HELP %shost_buckets Dynamic per-Host buckets.\n"
+                      "# TYPE %shost_buckets gauge\n"
+                      "%shost_buckets %u\n"
+                      "# HELP %shost_buckets_used Per-Host buckets in use.\n"
+                      "# TYPE %shost_buckets_used gauge\n"
+                      "%shost_buckets_used %u\n",
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX, hosts->num_entries,
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&hosts->used_entries) );
+
+   /*  Slots returned by the reaper (for children that died).  */
+   if (NULL != leases)
+      ap_rprintf(req, "# HELP %sreclaimed_slots_total Slots of dead "
+                      "children returned.\n"
+                      "# TYPE %sreclaimed_slots_total counter\n"
+                      "%sreclaimed_slots_total %" APR_UINT64_T_FMT "\n"
+                      "# HELP %sreaped_children_total Dead children "
+                      "reaped.\n"
+                      "# TYPE %sreaped_children_total counter\n"
+                      "%sreaped_children_total %" APR_UINT64_T_FMT "\n"
+                      "# HELP %suntracked_slots_total Slots granted "
+                      "without a lease.\n"
+                      "# TYPE %suntracked_slots_total counter\n"
+                      "%suntracked_slots_total %" APR_UINT64_T_FMT "\n",
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&leases->reclaimed_slots),
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&leases->reaped_children),
+                 VHC_STATUS_METRIC_PREFIX, VHC_STATUS_METRIC_PREFIX,
+                 VHC_STATUS_METRIC_PREFIX,
+                 VHC_ATOMIC_LOAD(&leases->untracked) );
+
+}  /*  End of function  vhc_print_status_text_.  */
+
+
+
+/**
+  *   @brief   Parse a request rate.
+  *   @param   arg       request rate (<num-requests>[/s|/m|/h])
+  *   @param   interval  usecs per request (returned back, 0 = no limit)
+  *   @param   burst     default bucket size - one period's worth of
+  *                      requests (returned back)
+  *   @return  APR_SUCCESS if the rate is valid, otherwise APR_EINVAL.
+  *
+  */
+static apr_status_t  vhc_parse_request_rate_(const char *arg,
+                                             apr_uint32_t *interval,
+                                             apr_uint32_t *burst) {
+
+   char         *unit;
+   apr_time_t    period = apr_time_from_sec(1);
+   apr_int64_t   nrequests = apr_strtoi64(arg, &unit, 10);
+
+   if ('/' == *unit) {
+      switch (unit[1]) {
+         case 'm':  case 'M':  period = apr_time_from_sec(60);    break;
+         case 'h':  case 'H':  period = apr_time_from_sec(3600);  break;
+         default:   break;
+      }
+   }
+
+   if ((unit == arg)  ||  (nrequests < 0)  ||
+       (nrequests > VHC_MAX_REQUEST_RATE) )
+      return APR_EINVAL;
+
+   *interval = (0 == nrequests) ? 0 :
+                  (apr_uint32_t) ((period + nrequests - 1) / nrequests);
+   *burst    = (apr_uint32_t) ((nrequests > 0) ? nrequests : 1);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_parse_request_rate_.  */
+
+
+
+/**
+  *   @brief   Apply the limits in the admin handler's args.
+  *   @param   args    request args (name=value)
+  *   @param   limits  vhost limits (updated)
+  *   @return  NULL on success, otherwise an error message.
+  *
+  *   Apply the limits in the admin handler's args (slot_limit,
+  *   burst_percent, grace_period, flap_period, rate and rate_burst) to a
+  *   vhost's limits - all or nothing, limits are only updated if all
+  *   the values are valid.
+  *
+  */
+static const char  *vhc_parse_vhost_limits_(apr_table_t *args,
+                                            VHC_vhost_limits_t *limits) {
+   static const struct {
+      const char   *name;
+      apr_int64_t   max;
+
+   } numbers[] = {
+      { "slot_limit",     VHC_MAX_SLOT_LIMIT     },
+      { "burst_percent",  VHC_MAX_BURST_SETTING  },
+      { "grace_period",   VHC_MAX_BURST_SETTING  },
+      { "flap_period",    VHC_MAX_BURST_SETTING  },
+      { "rate_burst",     VHC_MAX_REQUEST_BURST  },
+   };
+
+   const int           nnumbers = sizeof(numbers) / sizeof(numbers[0]);
+   VHC_vhost_limits_t  updated = *limits;
+   apr_int64_t         values[sizeof(numbers) / sizeof(numbers[0])];
+   apr_uint32_t        burst = 0;
+   const char         *arg;
+   char               *end;
+   int                 idx;
+
+   for (idx = 0; idx < nnumbers; idx++) {
+      values[idx] = -1;   /*  Not changed.  */
+
+      arg = apr_table_get(args, numbers[idx].name);
+      if (NULL == arg)
+         continue;
+
+      values[idx] = apr_strtoi64(arg, &end, 10);
+      if ((end == arg)  ||  ('\0' != *end)  ||  (values[idx] < 0)  ||
+          (values[idx] > numbers[idx].max) )
+         return numbers[idx].name;
+   }
+
+   if (values[0] >= 0)
+      updated.slot_limit    = (apr_uint16_t) values[0];
+
+   if (values[1] >= 0)
+      updated.burst_percent = (apr_uint16_t) values[1];
+
+   if (values[2] >= 0)
+      updated.grace_period  = (apr_uint16_t) values[2];
+
+   if (values[3] >= 0)
+      updated.flap_period   = (apr_uint16_t) values[3];
+
+   arg = apr_table_get(args, "rate");
+   if ((NULL != arg)  &&
+       !VHC_APR_STATUS_IS_SUCCESS(vhc_parse_request_rate_(arg,
+                                     &updated.rate_interval, &burst) ) )
+      return "rate";
+
+   /*  Same as the directives - a new rate starts w/ a default burst.  */
+   if (values[4] >= 0)
+      updated.rate_burst = (apr_uint32_t) values[4];
+   else if ((0 == updated.rate_burst)  &&  (burst > 0) )
+      updated.rate_burst = burst;
+
+   if ((updated.rate_interval > 0)  &&  (0 == updated.rate_burst) )
+      return "rate_burst";
+
+   *limits = updated;
+
+   return NULL;
+
+}  /*  End of function  vhc_parse_vhost_limits_.  */
+
+
+
+/**
+  *   @brief   Print a vhost's effective (and configured) limits.
+  *   @param   req   request record
+  *   @param   srvr  vhost's server record
+  *
+  *   Print a vhost's effective limits - one line, name=value pairs (the
+  *   admin handler's args) plus the configured ones where they differ.
+  *
+  */
+static void  vhc_print_vhost_limits_(request_rec *req, server_rec *srvr) {
+
+   VHC_server_config_t  *cfg;
+   VHC_shm_data_t       *vhost_data;
+   VHC_vhost_limits_t    limits;
+   VHC_vhost_limits_t    configured;
+
+   cfg = ap_get_module_config(srvr->module_config, &vhost_choke_module);
+   vhost_data = vhc_get_vhost_shm_data_(cfg->shm_index);
+   if (NULL == vhost_data)
+      return;
+
+   vhc_get_vhost_limits_(vhost_data, &limits);
+   vhc_get_config_limits_(cfg, &configured);
+
+   ap_rprintf(req, "%s:%d slot_limit=%d burst_percent=%d grace_period=%d "
+                   "flap_period=%d rate_interval=%u rate_burst=%u%s\n",
+              vhc_get_vhost_name_(srvr), (int) srvr->port,
+              (int) limits.slot_limit, (int) limits.burst_percent,
+              (int) limits.grace_period, (int) limits.flap_period,
+              (unsigned int) limits.rate_interval,
+              (unsigned int) limits.rate_burst,
+              memcmp(&limits, &configured, sizeof(limits) ) ?
+                 " (changed)" : "");
+
+}  /*  End of function  vhc_print_vhost_limits_.  */
+
+
+/*  }}}  -- End section:internal-functions.  */
+
+
+
+/*  section:ap-directive-handlers {{{  */
 /*  +++++++++++++++++++++++++++++      */
 
-/*  ===================================================================  */
-/*  @@@@@  Apache Config Directive Handlers.                             */
-/*  ===================================================================  */
+/*  ===================================================================  */
+/*  @@@@@  Apache Config Directive Handlers.                             */
+/*  ===================================================================  */
+
+/*  A: Setter functions (settings for the global/entire env).  */
+/*  ---------------------------------------------------------  */
+
+/**
+ *   @brief   Turn on/off writing debug messages.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Turn ON/OFF writing debug messages.
+ *
+ */
+static const char  *vhc_set_debug(cmd_parms *parms, void *unused,
+                                  int flag) {
+
+   gs_vhc_env_settings.debug = flag ? VHC_TRUE : VHC_FALSE;
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.Debug = %d",
+                                   VHC_LOC, gs_vhc_env_settings.debug);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_debug.  */
+
+
+
+/**
+ *   @brief   Set HTTP error code to return back to clients when vhosts
+ *            are "choked".
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the HTTP response code (error code) to return back to clients
+ *   when we throttle vhosts.
+ *
+ */
+static const char  *vhc_set_error_code(cmd_parms *parms, void *unused,
+                                       const char *arg) {
+
+   apr_int64_t http_code = (apr_uint64_t) apr_atoi64(arg);
+
+   if (http_code >= 0)
+      gs_vhc_env_settings.http_code = (apr_uint16_t) http_code;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.http_code = %d",
+                                   VHC_LOC, gs_vhc_env_settings.http_code);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_error_code.  */
+
+
+
+/**
+ *   @brief   Set the customized error message to return back to clients
+ *            when vhosts are "choked".
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the customized error message to send back to clients when we
+ *   throttle vhosts.
+ *
+ */
+static const char  *vhc_set_error_message(cmd_parms *parms, void *unused,
+                                          const char *arg) {
+
+   if ((arg != NULL)  &&  (strlen(arg) > 0) )
+      apr_cpystrn(gs_vhc_env_settings.err_message, arg,
+                  VHC_MAX_ERROR_MESSAGE_LEN);
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.err_message = '%s'",
+                                   VHC_LOC,
+                                   gs_vhc_env_settings.err_message);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_error_message.  */
+
+
+
+/**
+ *   @brief   Set the locking mode used to update the shm data.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the locking mode used to update the shared memory counters -
+ *   Atomic (lock-free, default) or Mutex (global lock). Platforms without
+ *   64-bit shared memory atomics always use the global lock.
+ *
+ */
+static const char  *vhc_set_lock_mode(cmd_parms *parms, void *unused,
+                                      const char *arg) {
+
+   if (0 == strcasecmp(arg, "Mutex") )
+      gs_vhc_env_settings.lock_mode = VHC_LOCK_MODE_MUTEX;
+   else if (0 == strcasecmp(arg, "Atomic") ) {
+#ifdef  VHC_HAVE_SHM_ATOMICS
+      gs_vhc_env_settings.lock_mode = VHC_LOCK_MODE_ATOMIC;
+#else
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server,
+                   "%s: no shm atomics on this platform, using Mutex",
+                   VHC_MODULE_NAME);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.lock_mode = %d",
+                                   VHC_LOC, gs_vhc_env_settings.lock_mode);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_lock_mode.  */
+
+
+
+/**
+ *   @brief   Set the max. time to wait for the global lock.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the maximum time (in milliseconds) a request waits to acquire the
+ *   global lock (mutex mode) before giving up.
+ *
+ */
+static const char  *vhc_set_lock_wait_time(cmd_parms *parms, void *unused,
+                                           const char *arg) {
+
+   apr_int64_t  msecs = apr_atoi64(arg);
+
+   if ((msecs > 0)  &&  (msecs <= VHC_MAX_LOCK_WAIT_TIME_MSECS) )
+      gs_vhc_env_settings.lock_wait_usecs = (apr_uint32_t) (msecs * 1000);
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.lock_wait_usecs = %d",
+                                   VHC_LOC,
+                                   (int) gs_vhc_env_settings.lock_wait_usecs);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_lock_wait_time.  */
+
+
+
+/**
+ *   @brief   Set the number of global lock stripes.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the number of global lock stripes used in mutex mode. A vhost
+ *   uses lock stripe (slot table index % stripes), so busy vhosts only
+ *   stall the vhosts that share their stripe.
+ *
+ */
+static const char  *vhc_set_lock_stripes(cmd_parms *parms, void *unused,
+                                         const char *arg) {
+
+   apr_int64_t  nstripes = apr_atoi64(arg);
+
+   if ((nstripes > 0)  &&  (nstripes <= VHC_MAX_LOCK_STRIPES) )
+      gs_vhc_env_settings.lock_stripes = (apr_uint16_t) nstripes;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.lock_stripes = %d",
+                                   VHC_LOC,
+                                   gs_vhc_env_settings.lock_stripes);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_lock_stripes.  */
+
+
+
+/**
+ *   @brief   Set the request phase in which requests get admitted.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the request phase in which we admit (or choke) requests -
+ *   PostReadRequest (default), QuickHandler or Handler. The earlier the
+ *   phase, the less a choked request costs.
+ *
+ */
+static const char  *vhc_set_admit_phase(cmd_parms *parms, void *unused,
+                                        const char *arg) {
+
+   if (0 == strcasecmp(arg, "PostReadRequest") )
+      gs_vhc_env_settings.admit_phase = VHC_ADMIT_PHASE_POST_READ_REQUEST;
+   else if (0 == strcasecmp(arg, "QuickHandler") )
+      gs_vhc_env_settings.admit_phase = VHC_ADMIT_PHASE_QUICK_HANDLER;
+   else if (0 == strcasecmp(arg, "Handler") )
+      gs_vhc_env_settings.admit_phase = VHC_ADMIT_PHASE_HANDLER;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.admit_phase = %d",
+                                   VHC_LOC,
+                                   gs_vhc_env_settings.admit_phase);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_admit_phase.  */
+
+
+
+/**
+ *   @brief   Set when admitted requests release their slot.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set when admitted requests release their slot - EOS (default, once
+ *   the response is sent), LogTransaction or PoolCleanup (the request
+ *   pool is destroyed, after logging + keep-alive/write completion). The
+ *   pool cleanup releases the slot if the earlier points didn't.
+ *
+ */
+static const char  *vhc_set_release_at(cmd_parms *parms, void *unused,
+                                       const char *arg) {
+
+   if (0 == strcasecmp(arg, "EOS") )
+      gs_vhc_env_settings.release_at = VHC_RELEASE_AT_EOS;
+   else if (0 == strcasecmp(arg, "LogTransaction") )
+      gs_vhc_env_settings.release_at = VHC_RELEASE_AT_LOG_TRANSACTION;
+   else if (0 == strcasecmp(arg, "PoolCleanup") )
+      gs_vhc_env_settings.release_at = VHC_RELEASE_AT_POOL_CLEANUP;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.release_at = %d",
+                                   VHC_LOC,
+                                   gs_vhc_env_settings.release_at);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_release_at.  */
+
+
+
+/**
+ *   @brief   Set the number of dynamic per-Host buckets.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the number of dynamic per-Host buckets (rounded up to a power of
+ *   2) shared by the VHostChokePerHost vhosts - 0 turns them off.
+ *
+ */
+static const char  *vhc_set_dynamic_hosts(cmd_parms *parms, void *unused,
+                                          const char *arg) {
+
+   apr_int64_t   nhosts = apr_atoi64(arg);
+   apr_uint32_t  nbuckets = VHC_DYNAMIC_HOSTS_PROBES;
+
+   if ((nhosts >= 0)  &&  (nhosts <= VHC_MAX_DYNAMIC_HOSTS) ) {
+      while (nbuckets < nhosts)
+         nbuckets <<= 1;
+
+      gs_vhc_env_settings.dynamic_hosts = (0 == nhosts) ? 0 : nbuckets;
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.dynamic_hosts = %d",
+                                   VHC_LOC,
+                                   (int) gs_vhc_env_settings.dynamic_hosts);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_dynamic_hosts.  */
+
+
+
+/**
+ *   @brief   Set the size of the global capacity pool.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the number of slots in the global capacity pool the vhosts can
+ *   borrow from beyond their slot limits - Off turns it off and Auto
+ *   sizes it from MaxRequestWorkers.
+ *
+ */
+static const char  *vhc_set_capacity_pool(cmd_parms *parms, void *unused,
+                                          const char *arg) {
+
+   apr_int64_t  nslots = apr_atoi64(arg);
+
+   if (0 == strcasecmp(arg, "Off") )
+      gs_vhc_env_settings.pool_slots = 0;
+   else if (0 == strcasecmp(arg, "Auto") )
+      gs_vhc_env_settings.pool_slots = VHC_CAPACITY_POOL_AUTO;
+   else if ((nslots >= 0)  &&  (nslots <= VHC_MAX_CAPACITY_POOL) )
+      gs_vhc_env_settings.pool_slots = (apr_uint32_t) nslots;
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   if (gs_vhc_env_settings.pool_slots > 0)
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server,
+                   "%s: no shm atomics on this platform, capacity pool "
+                   "disabled", VHC_MODULE_NAME);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.pool_slots = %u",
+                                   VHC_LOC, gs_vhc_env_settings.pool_slots);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_capacity_pool.  */
+
+
+
+/**
+ *   @brief   Set the number of slots a child leases per vhost in one go.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the size of the slot blocks the children lease from the vhosts
+ *   and hand out to their threads - 0 (or 1) turns batching off.
+ *
+ */
+static const char  *vhc_set_slot_batch(cmd_parms *parms, void *unused,
+                                       const char *arg) {
+
+   apr_int64_t  nslots = apr_atoi64(arg);
+
+   if ((nslots >= 0)  &&  (nslots <= VHC_MAX_SLOT_BATCH) )
+      gs_vhc_env_settings.slot_batch = (nslots < 2) ? 0 : nslots;
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   if (gs_vhc_env_settings.slot_batch > 0)
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server,
+                   "%s: no shm atomics on this platform, slot batching "
+                   "disabled", VHC_MODULE_NAME);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.slot_batch = %u",
+                                   VHC_LOC, gs_vhc_env_settings.slot_batch);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_slot_batch.  */
+
+
+
+/**
+ *   @brief   Set the size of the children's trace rings.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the number of admission event records (rounded up to a power of
+ *   2) each child keeps in its trace ring - Off (or 0) turns it off.
+ *
+ */
+static const char  *vhc_set_trace(cmd_parms *parms, void *unused,
+                                  const char *arg) {
+
+   apr_int64_t   nrecords = apr_atoi64(arg);
+   apr_uint32_t  size = 1;
+
+   if (0 == strcasecmp(arg, "Off") )
+      gs_vhc_env_settings.trace_records = 0;
+   else if ((nrecords >= 0)  &&  (nrecords <= VHC_MAX_TRACE_RECORDS) ) {
+      while (size < nrecords)
+         size <<= 1;
+
+      gs_vhc_env_settings.trace_records = (0 == nrecords) ? 0 : size;
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.trace_records = %u",
+                                   VHC_LOC,
+                                   gs_vhc_env_settings.trace_records);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_trace.  */
+
+
+
+/**
+ *   @brief   Set the directory trace dumps are written to.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the directory the children write their trace dumps to (on
+ *   VHC_TRACE_DUMP_SIGNAL) - relative paths are under the ServerRoot.
+ *
+ */
+static const char  *vhc_set_trace_dir(cmd_parms *parms, void *unused,
+                                      const char *arg) {
+
+   const char  *dir = ap_server_root_relative(parms->pool, arg);
+
+   if (NULL != dir)
+      gs_vhc_env_settings.trace_dir = dir;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.trace_dir = '%s'",
+                                   VHC_LOC, gs_vhc_env_settings.trace_dir);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_trace_dir.  */
+
+
+
+/*  B: Setter functions for individual vhosts.  */
+/*  ------------------------------------------  */
+
+/**
+ *   @brief   Set the concurrent request [slot] limit for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the slot limit or max number of concurrent requests allowed for
+ *   a specific 'server' (vhost).
+ *
+ */
+static const char  *vhc_set_slot_limit(cmd_parms *parms, void *unused,
+                                       const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its "choke" limit.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  nslots = apr_atoi64(arg);
+   if ((nslots >= 0)  &&  (nslots <= VHC_MAX_SLOT_LIMIT) )
+      cfg->slot_limit = (apr_uint16_t) nslots;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->slot_limit = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->slot_limit);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_slot_limit.  */
+
+
+
+/**
+ *   @brief   Set the percentage (of the vhost slot limit) that we will 
+ *            allow requests burst upto for a vhost when the slot limit is
+ *            reached.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the percentage (of the vhost slot limit) that we will allow
+ *   a vhost to burst beyond the slot limit. Note we will allow this 
+ *   percentage of additional requests for the entire grace period.
+ *
+ *   Example: If the slot limit for a vhost is 10 and the burst
+ *            percentage is 15, then we will allow for an additional 2
+ *            requests (ceil of 1.5 or 15*10/100) for the entire grace
+ *            period, meaning the slot limit is capped at 12 for that grace
+ *            period.
+ *
+ */
+static const char  *vhc_set_burst_percent(cmd_parms *parms, void *unused,
+                                          const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its "burst" percent.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  percent = apr_atoi64(arg);
+   if (percent >= 0)
+      cfg->burst_settings.percent = (apr_uint16_t) percent;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.percent = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->burst_settings.percent);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_burst_percent.  */
+
+
+
+/**
+ *   @brief   Set the grace period that we will allow requests bursting
+ *            for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the grace period (in seconds) that we will allow request bursting
+ *   for a vhost. The number of additional slots is governed by the burst
+ *   percent setting.
+ *
+ *   Example: If the slot limit for a vhost is 10 and the burst
+ *            percentage is 15, then we will allow for an additional 2
+ *            requests (ceil of 1.5 or 15*10/100) for the entire grace
+ *            period, meaning the slot limit is capped at 12 for that grace
+ *            period.
+ *
+ */
+static const char  *vhc_set_grace_period(cmd_parms *parms, void *unused,
+                                         const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its "grace" period.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  nsecs = apr_atoi64(arg);
+   if (nsecs >= 0) 
+      cfg->burst_settings.grace_period = (apr_uint16_t) nsecs;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.grace_period = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->burst_settings.grace_period);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_grace_period.  */
+
+
+
+/**
+ *   @brief   Set the flap period that controls when we will allow mxG
+ *            for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the grace period (in seconds) that we will allow request bursting
+ *   for a vhost. The number of additional slots is governed by the burst
+ *   percent setting.
+ *
+ *   Example: If the slot limit for a vhost is 10 and the burst
+ *            percentage is 15, then we will allow for an additional 2
+ *            requests (ceil of 1.5 or 15*10/100) for the entire grace
+ *            period, meaning the slot limit is capped at 12 for that grace
+ *            period.
+ *
+ */
+static const char  *vhc_set_burst_flap_period(cmd_parms *parms,
+                                              void *unused,
+                                              const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its flap period.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  nsecs = apr_atoi64(arg);
+   if (nsecs >= 0) 
+      cfg->burst_settings.flap_period = (apr_uint16_t) nsecs;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.flap_period = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->burst_settings.flap_period);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_burst_flap_period.  */
+
 
-/*  A: Setter functions (settings for the global/entire env).  */
-/*  ---------------------------------------------------------  */
 
 /**
- *   @brief   Turn on/off writing debug messages.
+ *   @brief   Set the request rate limit for a vhost.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Turn ON/OFF writing debug messages.
+ *   Set the request rate limit (<num-requests>[/s|/m|/h], default per
+ *   second) for a specific 'server' (vhost). Requests over the rate get
+ *   choked just like requests over the slot limit.
+ *
+ *   Example: 200/s allows a request every 5ms on average, with bursts of
+ *            upto VHostChokeRequestBurst requests (default is a second's
+ *            worth - 200 requests).
  *
  */
-static const char  *vhc_set_debug(cmd_parms *parms, void *unused,
-                                  int flag) {
+static const char  *vhc_set_request_rate(cmd_parms *parms, void *unused,
+                                         const char *arg) {
 
-   gs_vhc_env_settings.debug = flag ? VHC_TRUE : VHC_FALSE;
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.Debug = %d",
-                                   VHC_LOC, gs_vhc_env_settings.debug);
+   /*  Get the vhc config for the vhost and set its request rate.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_uint32_t  interval;
+   apr_uint32_t  burst;
+
+   if (VHC_APR_STATUS_IS_SUCCESS(vhc_parse_request_rate_(arg, &interval,
+                                                         &burst) ) ) {
+      cfg->rate_settings.interval = interval;
+
+      /*  Default bucket size is one period's worth of requests.  */
+      if (0 == cfg->rate_settings.burst)
+         cfg->rate_settings.burst = burst;
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->rate.interval = %d usecs",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   (int) cfg->rate_settings.interval);
 
    return NULL;
 
-}  /*  End of function  vhc_set_debug.  */
+}  /*  End of function  vhc_set_request_rate.  */
 
 
 
 /**
- *   @brief   Set HTTP error code to return back to clients when vhosts
- *            are "choked".
+ *   @brief   Set the request rate burst (token bucket size) for a vhost.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Set the HTTP response code (error code) to return back to clients
- *   when we throttle vhosts.
+ *   Set the number of requests a vhost can fire back-to-back before
+ *   the request rate limit kicks in (the token bucket size).
  *
  */
-static const char  *vhc_set_error_code(cmd_parms *parms, void *unused,
-                                       const char *arg) {
+static const char  *vhc_set_request_burst(cmd_parms *parms, void *unused,
+                                          const char *arg) {
 
-   apr_int64_t http_code = (apr_uint64_t) apr_atoi64(arg);
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
 
-   if (http_code >= 0)
-      gs_vhc_env_settings.http_code = (apr_uint16_t) http_code;
+   /*  Get the vhc config for the vhost and set its request burst.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
 
+   apr_int64_t  nrequests = apr_atoi64(arg);
+   if ((nrequests > 0)  &&  (nrequests <= VHC_MAX_REQUEST_BURST) )
+      cfg->rate_settings.burst = (apr_uint32_t) nrequests;
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.http_code = %d",
-                                   VHC_LOC, gs_vhc_env_settings.http_code);
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->rate.burst = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   (int) cfg->rate_settings.burst);
 
    return NULL;
 
-}  /*  End of function  vhc_set_error_code.  */
+}  /*  End of function  vhc_set_request_burst.  */
 
 
 
 /**
- *   @brief   Set the customized error message to return back to clients
- *            when vhosts are "choked".
+ *   @brief   Set the admission queue depth for a vhost.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Set the customized error message to send back to clients when we
- *   throttle vhosts.
+ *   Set the max. number of requests that can wait for a slot (instead of
+ *   getting choked right away) when a vhost is at its slot limit.
  *
  */
-static const char  *vhc_set_error_message(cmd_parms *parms, void *unused,
-                                          const char *arg) {
+static const char  *vhc_set_queue_depth(cmd_parms *parms, void *unused,
+                                        const char *arg) {
 
-   if ((arg != NULL)  &&  (strlen(arg) > 0) )
-      apr_cpystrn(gs_vhc_env_settings.err_message, arg,
-                  VHC_MAX_ERROR_MESSAGE_LEN);
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its queue depth.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
 
+   apr_int64_t  depth = apr_atoi64(arg);
+   if ((depth >= 0)  &&  (depth <= VHC_MAX_QUEUE_DEPTH) )
+      cfg->queue_settings.depth = (apr_uint16_t) depth;
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: Env.err_message = '%s'",
-                                   VHC_LOC,
-                                   gs_vhc_env_settings.err_message);
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   if (cfg->queue_settings.depth > 0)
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                   "%s: no shm atomics on this platform, queue disabled",
+                   VHC_MODULE_NAME);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
 
-   return NULL;
 
-}  /*  End of function  vhc_set_error_message.  */
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->queue.depth = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->queue_settings.depth);
 
+   return NULL;
+
+}  /*  End of function  vhc_set_queue_depth.  */
 
 
-/*  B: Setter functions for individual vhosts.  */
-/*  ------------------------------------------  */
 
 /**
- *   @brief   Set the concurrent request [slot] limit for a vhost.
+ *   @brief   Set the admission queue timeout for a vhost.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Set the slot limit or max number of concurrent requests allowed for
- *   a specific 'server' (vhost).
+ *   Set the max. time (in milliseconds) a queued request waits for a
+ *   slot before it gets choked.
  *
  */
-static const char  *vhc_set_slot_limit(cmd_parms *parms, void *unused,
-                                       const char *arg) {
+static const char  *vhc_set_queue_timeout(cmd_parms *parms, void *unused,
+                                          const char *arg) {
 
    /*  Get the 'server' record to operate on.  */
    server_rec  *s = parms->server;
 
-   /*  Get the vhc config for the vhost and set its "choke" limit.  */
+   /*  Get the vhc config for the vhost and set its queue timeout.  */
    VHC_server_config_t *cfg = (VHC_server_config_t *)
           ap_get_module_config(s->module_config, &vhost_choke_module);
 
-   apr_int64_t  nslots = apr_atoi64(arg);
-   if ((nslots >= 0)  &&  (nslots <= VHC_MAX_SLOT_LIMIT) )
-      cfg->slot_limit = (apr_uint16_t) nslots;
+   apr_int64_t  msecs = apr_atoi64(arg);
+   if ((msecs > 0)  &&  (msecs <= VHC_MAX_QUEUE_TIMEOUT) )
+      cfg->queue_settings.timeout = (apr_uint16_t) msecs;
 
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->slot_limit = %d",
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->queue.timeout = %d",
                                    VHC_LOC, vhc_get_vhost_name_(s),
-                                   cfg->slot_limit);
+                                   cfg->queue_settings.timeout);
 
    return NULL;
 
-}  /*  End of function  vhc_set_slot_limit.  */
+}  /*  End of function  vhc_set_queue_timeout.  */
 
 
 
 /**
- *   @brief   Set the percentage (of the vhost slot limit) that we will 
- *            allow requests burst upto for a vhost when the slot limit is
- *            reached.
+ *   @brief   Set the bandwidth limit for a vhost.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Set the percentage (of the vhost slot limit) that we will allow
- *   a vhost to burst beyond the slot limit. Note we will allow this 
- *   percentage of additional requests for the entire grace period.
+ *   Set the bandwidth limit (<num-bytes>[K|M|G][/s]) for the responses
+ *   of a specific 'server' (vhost) - shared across all the children.
  *
- *   Example: If the slot limit for a vhost is 10 and the burst
- *            percentage is 15, then we will allow for an additional 2
- *            requests (ceil of 1.5 or 15*10/100) for the entire grace
- *            period, meaning the slot limit is capped at 12 for that grace
- *            period.
+ *   Example: 10M/s paces the vhost's responses to 10 MiB per second in
+ *            total, in chunks of upto 64 KiB (a tenth of a second's
+ *            worth for slower limits).
  *
  */
-static const char  *vhc_set_burst_percent(cmd_parms *parms, void *unused,
-                                          const char *arg) {
+static const char  *vhc_set_bandwidth(cmd_parms *parms, void *unused,
+                                      const char *arg) {
 
    /*  Get the 'server' record to operate on.  */
    server_rec  *s = parms->server;
 
-   /*  Get the vhc config for the vhost and set its "burst" percent.  */
+   /*  Get the vhc config for the vhost and set its bandwidth.  */
    VHC_server_config_t *cfg = (VHC_server_config_t *)
           ap_get_module_config(s->module_config, &vhost_choke_module);
 
-   apr_int64_t  percent = apr_atoi64(arg);
-   if (percent >= 0)
-      cfg->burst_settings.percent = (apr_uint16_t) percent;
+   char         *unit;
+   apr_int64_t   nbytes = apr_strtoi64(arg, &unit, 10);
+   apr_uint64_t  chunk;
 
+   switch (*unit) {
+      case 'k':  case 'K':  nbytes <<= 10;  break;
+      case 'm':  case 'M':  nbytes <<= 20;  break;
+      case 'g':  case 'G':  nbytes <<= 30;  break;
+      default:   break;
+   }
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.percent = %d",
+   if ((nbytes >= 0)  &&  (nbytes <= VHC_MAX_BANDWIDTH) ) {
+      cfg->bandwidth_settings.rate = (apr_uint64_t) nbytes;
+
+      /*  Pace in chunks of a tenth of a second's worth of bytes.  */
+      chunk = cfg->bandwidth_settings.rate / VHC_BANDWIDTH_CHUNKS_PER_SEC;
+      if (chunk < VHC_BANDWIDTH_MIN_CHUNK)
+         chunk = VHC_BANDWIDTH_MIN_CHUNK;
+      else if (chunk > VHC_BANDWIDTH_MAX_CHUNK)
+         chunk = VHC_BANDWIDTH_MAX_CHUNK;
+
+      cfg->bandwidth_settings.chunk = (apr_size_t) chunk;
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->bandwidth.rate = %ld",
                                    VHC_LOC, vhc_get_vhost_name_(s),
-                                   cfg->burst_settings.percent);
+                                   (long int) cfg->bandwidth_settings.rate);
 
    return NULL;
 
-}  /*  End of function  vhc_set_burst_percent.  */
+}  /*  End of function  vhc_set_bandwidth.  */
 
 
 
 /**
- *   @brief   Set the grace period that we will allow requests bursting
- *            for a vhost.
+ *   @brief   Set whether each Host of a vhost is limited separately.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   flag       directive value (On/Off)
+ *   @return  always NULL.
+ *
+ *   Set whether each request Host of a 'server' (vhost) gets its own
+ *   slots + request rate (a dynamic bucket) - for mass virtual hosting,
+ *   where one vhost serves many sites. Needs VHostChokeDynamicHosts.
+ *
+ */
+static const char  *vhc_set_per_host(cmd_parms *parms, void *unused,
+                                     int flag) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set per host limiting.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   cfg->per_host = flag ? VHC_TRUE : VHC_FALSE;
+
+#ifndef  VHC_HAVE_SHM_ATOMICS
+   if (cfg->per_host)
+      ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                   "%s: no shm atomics on this platform, per host "
+                   "limits disabled", VHC_MODULE_NAME);
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->per_host = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->per_host);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_per_host.  */
+
+
+
+/**
+ *   @brief   Set the adaptive slot limit bounds for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg1       directive value (min. slot limit)
+ *   @param   arg2       directive value (max. slot limit)
+ *   @return  always NULL.
+ *
+ *   Set the bounds (<min> <max>) within which the slot limit of a
+ *   'server' (vhost) adapts to its request service times. The slot limit
+ *   (VHostChokeSlotLimit) is where it starts off - 0 0 turns it off.
+ *
+ */
+static const char  *vhc_set_adaptive_limit(cmd_parms *parms, void *unused,
+                                           const char *arg1,
+                                           const char *arg2) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its adaptive bounds.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  min_slots = apr_atoi64(arg1);
+   apr_int64_t  max_slots = apr_atoi64(arg2);
+
+   if ((0 == min_slots)  &&  (0 == max_slots) )
+      cfg->adaptive_settings.max = 0;
+   else if ((min_slots > 0)  &&  (min_slots <= max_slots)  &&
+            (max_slots <= VHC_MAX_SLOT_LIMIT) ) {
+      cfg->adaptive_settings.min = (apr_uint16_t) min_slots;
+      cfg->adaptive_settings.max = (apr_uint16_t) max_slots;
+   }
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->adaptive = %d-%d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->adaptive_settings.min,
+                                   cfg->adaptive_settings.max);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_adaptive_limit.  */
+
+
+
+/**
+ *   @brief   Set the target latency for a vhost's adaptive slot limit.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
  *   @param   arg        directive value
  *   @return  always NULL.
  *
- *   Set the grace period (in seconds) that we will allow request bursting
- *   for a vhost. The number of additional slots is governed by the burst
- *   percent setting.
+ *   Set the request service time (in msecs) a 'server' (vhost) with an
+ *   adaptive slot limit aims for - slower and the slot limit backs off.
  *
- *   Example: If the slot limit for a vhost is 10 and the burst
- *            percentage is 15, then we will allow for an additional 2
- *            requests (ceil of 1.5 or 15*10/100) for the entire grace
- *            period, meaning the slot limit is capped at 12 for that grace
- *            period.
+ */
+static const char  *vhc_set_target_latency(cmd_parms *parms, void *unused,
+                                           const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its target latency.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  msecs = apr_atoi64(arg);
+   if ((msecs > 0)  &&  (msecs <= VHC_MAX_TARGET_LATENCY) )
+      cfg->adaptive_settings.target_latency =
+         (apr_uint32_t) apr_time_from_msec(msecs);
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->adaptive.target_latency = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   (int) cfg->adaptive_settings.
+                                            target_latency);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_target_latency.  */
+
+
+
+/**
+ *   @brief   Set the capacity pool weight for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  always NULL.
+ *
+ *   Set the weight of a 'server' (vhost) - its share of the capacity
+ *   pool slots (relative to the other vhosts borrowing from it).
+ *
+ */
+static const char  *vhc_set_weight(cmd_parms *parms, void *unused,
+                                   const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its weight.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   apr_int64_t  weight = apr_atoi64(arg);
+   if ((weight > 0)  &&  (weight <= VHC_MAX_WEIGHT) )
+      cfg->weight = (apr_uint16_t) weight;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->weight = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->weight);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_weight.  */
+
+
+
+/**
+ *   @brief   Set the body format of the choked response for a vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  NULL on success, error message otherwise.
+ *
+ *   Set the body format of the choked response of a 'server' (vhost) -
+ *   HTML (default), JSON or Plain (text).
+ *
+ */
+static const char  *vhc_set_response_format(cmd_parms *parms,
+                                            void *unused, const char *arg) {
+
+   /*  Get the 'server' record to operate on.  */
+   server_rec  *s = parms->server;
+
+   /*  Get the vhc config for the vhost and set its response format.  */
+   VHC_server_config_t *cfg = (VHC_server_config_t *)
+          ap_get_module_config(s->module_config, &vhost_choke_module);
+
+   if (0 == strcasecmp(arg, "HTML") )
+      cfg->response_format = VHC_RESPONSE_FORMAT_HTML;
+   else if (0 == strcasecmp(arg, "JSON") )
+      cfg->response_format = VHC_RESPONSE_FORMAT_JSON;
+   else if (0 == strcasecmp(arg, "Plain") )
+      cfg->response_format = VHC_RESPONSE_FORMAT_PLAIN;
+   else
+      return "VHostChokeResponseFormat must be one of HTML, JSON or Plain";
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->response_format = %d",
+                                   VHC_LOC, vhc_get_vhost_name_(s),
+                                   cfg->response_format);
+
+   return NULL;
+
+}  /*  End of function  vhc_set_response_format.  */
+
+
+
+/**
+ *   @brief   Set the retry hint headers sent with choked responses for a
+ *            vhost.
+ *   @param   cmd_parms  command parameters 
+ *   @param   unused     unused (module config)
+ *   @param   arg        directive value
+ *   @return  NULL on success, error message otherwise.
+ *
+ *   Set the retry hint headers a 'server' (vhost) sends with its choked
+ *   responses - Off, RetryAfter (default) or RateLimit (Retry-After +
+ *   the RateLimit-* headers).
  *
  */
-static const char  *vhc_set_grace_period(cmd_parms *parms, void *unused,
-                                         const char *arg) {
+static const char  *vhc_set_retry_headers(cmd_parms *parms, void *unused,
+                                          const char *arg) {
 
    /*  Get the 'server' record to operate on.  */
    server_rec  *s = parms->server;
 
-   /*  Get the vhc config for the vhost and set its "grace" period.  */
+   /*  Get the vhc config for the vhost and set its retry headers.  */
    VHC_server_config_t *cfg = (VHC_server_config_t *)
           ap_get_module_config(s->module_config, &vhost_choke_module);
 
-   apr_int64_t  nsecs = apr_atoi64(arg);
-   if (nsecs >= 0) 
-      cfg->burst_settings.grace_period = (apr_uint16_t) nsecs;
+   if (0 == strcasecmp(arg, "Off") )
+      cfg->retry_headers = VHC_RETRY_HEADERS_OFF;
+   else if (0 == strcasecmp(arg, "RetryAfter") )
+      cfg->retry_headers = VHC_RETRY_HEADERS_RETRY_AFTER;
+   else if (0 == strcasecmp(arg, "RateLimit") )
+      cfg->retry_headers = VHC_RETRY_HEADERS_RATELIMIT;
+   else
+      return "VHostChokeRetryHeaders must be one of Off, RetryAfter or "
+             "RateLimit";
 
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.grace_period = %d",
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->retry_headers = %d",
                                    VHC_LOC, vhc_get_vhost_name_(s),
-                                   cfg->burst_settings.grace_period);
+                                   cfg->retry_headers);
 
    return NULL;
 
-}  /*  End of function  vhc_set_grace_period.  */
+}  /*  End of function  vhc_set_retry_headers.  */
 
 
 
 /**
- *   @brief   Set the flap period that controls when we will allow mxG
- *            for a vhost.
+ *   @brief   Set how a vhost accounts for subrequests.
  *   @param   cmd_parms  command parameters 
  *   @param   unused     unused (module config)
- *   @param   arg        directive value
- *   @return  always NULL.
- *
- *   Set the grace period (in seconds) that we will allow request bursting
- *   for a vhost. The number of additional slots is governed by the burst
- *   percent setting.
+ *   @param   arg1       accounting mode
+ *   @param   arg2       separate subrequest slot limit (optional)
+ *   @return  NULL on success, error message otherwise.
  *
- *   Example: If the slot limit for a vhost is 10 and the burst
- *            percentage is 15, then we will allow for an additional 2
- *            requests (ceil of 1.5 or 15*10/100) for the entire grace
- *            period, meaning the slot limit is capped at 12 for that grace
- *            period.
+ *   Set how a 'server' (vhost) accounts for the subrequests its requests
+ *   run - Ignore (default, the client request's slot covers them), Count
+ *   (each takes a slot) or Separate [limit] (own limit, which defaults
+ *   to the slot limit).
  *
  */
-static const char  *vhc_set_burst_flap_period(cmd_parms *parms,
-                                              void *unused,
-                                              const char *arg) {
+static const char  *vhc_set_subrequests(cmd_parms *parms, void *unused,
+                                        const char *arg1,
+                                        const char *arg2) {
 
    /*  Get the 'server' record to operate on.  */
    server_rec  *s = parms->server;
 
-   /*  Get the vhc config for the vhost and set its flap period.  */
+   /*  Get the vhc config for the vhost and set its subrequest mode.  */
    VHC_server_config_t *cfg = (VHC_server_config_t *)
           ap_get_module_config(s->module_config, &vhost_choke_module);
 
-   apr_int64_t  nsecs = apr_atoi64(arg);
-   if (nsecs >= 0) 
-      cfg->burst_settings.flap_period = (apr_uint16_t) nsecs;
+   apr_int64_t  nslots = 0;
+
+   if (0 == strcasecmp(arg1, "Ignore") )
+      cfg->subrequests = VHC_SUBREQUESTS_IGNORE;
+   else if (0 == strcasecmp(arg1, "Count") )
+      cfg->subrequests = VHC_SUBREQUESTS_COUNT;
+   else if (0 == strcasecmp(arg1, "Separate") )
+      cfg->subrequests = VHC_SUBREQUESTS_SEPARATE;
+   else
+      return "VHostChokeSubrequests must be one of Ignore, Count or "
+             "Separate";
 
+   if (NULL != arg2) {
+      if (VHC_SUBREQUESTS_SEPARATE != cfg->subrequests)
+         return "VHostChokeSubrequests takes a limit only with Separate";
 
-   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->burst.flap_period = %d",
+      nslots = apr_atoi64(arg2);
+      if ((nslots < 1)  ||  (nslots > VHC_MAX_SLOT_LIMIT) )
+         return "VHostChokeSubrequests limit must be between 1 and 32767";
+   }
+
+   cfg->subrequest_limit = (apr_uint16_t) nslots;
+
+
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: %s->subrequests = %d limit = %d",
                                    VHC_LOC, vhc_get_vhost_name_(s),
-                                   cfg->burst_settings.flap_period);
+                                   cfg->subrequests, cfg->subrequest_limit);
 
    return NULL;
 
-}  /*  End of function  vhc_set_burst_flap_period.  */
+}  /*  End of function  vhc_set_subrequests.  */
 
 /*  }}}  -- End section:ap-directive-handlers.  */
 
@@ -930,93 +5119,58 @@ static const char  *vhc_set_burst_flap_period(cmd_parms *parms,
 /**
   *   @brief   Pseudo-hook into the end of the request -- when the
   *            pool cleanup happens.
-  *   @param   arg  address of the request record.
+  *   @param   arg  address of the request's admission record.
   *   @return  APR_SUCCESS always.
   *
-  *   Hook into the end of a request's lifecycle.
+  *   Hook into the end of an admitted request's lifecycle - release the
+  *   slot it holds, unless an earlier release point (VHostChokeReleaseAt)
+  *   already did. Always registered, so no slot is ever left behind.
   *
   */
 static apr_status_t  vhc_req_pool_cleanup_(void *arg) {
 
-   request_rec          *req = (request_rec *) arg;
-   apr_status_t          status;
-   apr_pool_t           *pool = req->pool;
-   VHC_server_config_t  *cfg;
-   void                 *baseaddr;
-   void                 *data;
-   VHC_shm_data_t       *vhost_data;
-
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: CALLBACK req pool cleanup",
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: CALLBACK req pool cleanup",
                                    VHC_LOC);
 
-   cfg = ap_get_module_config(req->server->module_config,
-                              &vhost_choke_module);
-   
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
-                                   vhc_get_vhost_name_(req->server) );
-
-   /*  Check if we need to throttle this vhost.  */
-   if (0 == cfg->slot_limit) {
-      VHC_DEBUG  vhc_debug_log_(pool, "%s: DISABLED - no limit", VHC_LOC);
-      return APR_SUCCESS;
-   }
+   vhc_release_admission_((VHC_admission_t *) arg, 1);
 
-   /*  Ensure valid config id.  */
-   if (cfg->config_id >= gs_num_configs) {
-      VHC_DEBUG  vhc_debug_log_(pool, "%s: Config Id %d not valid (>= %d)",
-                                      VHC_LOC, cfg->config_id,
-                                      gs_num_configs);
-      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
-                   "%s: invalid config id [%d] >= %d",
-                   VHC_MODULE_NAME, cfg->config_id, gs_num_configs);
-      return APR_SUCCESS;
-   }
+   return APR_SUCCESS;
 
+}  /*  End of function  vhc_req_pool_cleanup_.  */
 
-   /*  Acquire the lock.  */
-   status = vhc_lock_acquire_(gs_shm_lock, VHC_MAX_LOCK_WAIT_TIME_USECS);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Lock acquistion status %d",
-                                   VHC_LOC, status);
-   if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
-      /*  Got some error - need to log and bail out.  */
-      ap_log_perror(APLOG_MARK, APLOG_ERR, status, pool,
-                   "%s: pool cleanup failed to acquire shm lock - pid=%ld",
-                   VHC_MODULE_NAME, (long int) getpid() );
-      return APR_SUCCESS;
-   }
 
-   /*  Get shm segment base address.  */
-   baseaddr = apr_shm_baseaddr_get(gs_shm);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: shm addr %ld", VHC_LOC, baseaddr);
 
-   if (NULL == baseaddr) {
-      /*  Error getting shm segment base address.  */
-      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
-                   "%s: pool cleanup error getting shm base address",
-                   VHC_MODULE_NAME);
+/**
+  *   @brief   Pseudo-hook into the end of a subrequest -- when its pool
+  *            cleanup happens.
+  *   @param   arg  address of the subrequest's admission record.
+  *   @return  APR_SUCCESS always.
+  *
+  *   Hook into the end of a subrequest admitted against a separate limit
+  *   (Separate subrequests) - give its subrequest slot back. This is
+  *   the only release point, so a lock timeout doesn't stop it.
+  *
+  */
+static apr_status_t  vhc_subreq_pool_cleanup_(void *arg) {
 
-      /*  Important: Need to release the lock before returning.  */
-      status = vhc_lock_release_(gs_shm_lock);
-      return APR_SUCCESS;
-   }
+   VHC_admission_t  *admission = (VHC_admission_t *) arg;
+   apr_uint16_t      shm_index = admission->config->shm_index;
+   int               locked = 0;
 
-   /*  Jump to right place for the vhost data.  */
-   data = baseaddr + (sizeof(VHC_shm_data_t) * cfg->config_id);
-   vhost_data = (VHC_shm_data_t *) data;
+   VHC_DEBUG  vhc_debug_log_(NULL, "%s: CALLBACK subreq pool cleanup",
+                                   VHC_LOC);
 
-   /*  Reduce the number of inuse slots if not choked.  */
-   if (!apr_table_get(req->headers_out, VHC_X_THROTTLED_BY_HEADER_NAME)  &&
-       (vhost_data->inuse_slots > 0) )
-      vhost_data->inuse_slots--;
+   if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)
+      locked = VHC_APR_STATUS_IS_SUCCESS(vhc_acquire_vhost_lock_(shm_index) );
 
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost usage = %d slots",
-                                   VHC_LOC, vhost_data->inuse_slots);
+   VHC_ATOMIC_ADD(&admission->shmdata->subreq_slots, -1);
 
-   status = vhc_lock_release_(gs_shm_lock);
+   if (locked)
+      vhc_lock_release_(vhc_get_vhost_lock_(shm_index) );
 
    return APR_SUCCESS;
 
-}  /*  End of function  vhc_req_pool_cleanup_.  */
+}  /*  End of function  vhc_subreq_pool_cleanup_.  */
 
 
 
@@ -1053,6 +5207,41 @@ static void  *vhc_create_server_config(apr_pool_t *pool,
    cfg->burst_settings.grace_period = VHC_DEFAULT_GRACE_PERIOD;
    cfg->burst_settings.flap_period  = VHC_DEFAULT_BURST_FLAP_PERIOD;
    cfg->burst_settings.percent      = VHC_DEFAULT_BURST_PERCENT;
+
+   /*  Note: default request rate is 0 === no rate limit.  */
+   cfg->rate_settings.interval = 0;
+   cfg->rate_settings.burst    = 0;
+
+   /*  Note: default queue depth is 0 === choke right away.  */
+   cfg->queue_settings.depth   = 0;
+   cfg->queue_settings.timeout = VHC_DEFAULT_QUEUE_TIMEOUT;
+
+   /*  Note: default bandwidth is 0 === no limit.  */
+   cfg->bandwidth_settings.rate  = 0;
+   cfg->bandwidth_settings.chunk = VHC_BANDWIDTH_MAX_CHUNK;
+
+   /*  Note: default max. 0 === fixed slot limit.  */
+   cfg->adaptive_settings.min = 1;
+   cfg->adaptive_settings.max = 0;
+   cfg->adaptive_settings.target_latency =
+      (apr_uint32_t) apr_time_from_msec(VHC_DEFAULT_TARGET_LATENCY);
+
+   /*  Note: default is to limit the vhost as a whole.  */
+   cfg->per_host = VHC_FALSE;
+
+   /*  Note: all vhosts get an equal share of the capacity pool.  */
+   cfg->weight = VHC_DEFAULT_WEIGHT;
+
+   /*  Note: choked responses are rendered in post_config.  */
+   cfg->response_format = VHC_RESPONSE_FORMAT_HTML;
+   cfg->choked          = NULL;
+
+   /*  Note: choked responses say when to retry (Retry-After).  */
+   cfg->retry_headers = VHC_RETRY_HEADERS_RETRY_AFTER;
+
+   /*  Note: the client request's slot covers its subrequests.  */
+   cfg->subrequests      = VHC_SUBREQUESTS_IGNORE;
+   cfg->subrequest_limit = 0;
  
    return (void *) cfg;
 
@@ -1076,9 +5265,16 @@ static void  *vhc_create_server_config(apr_pool_t *pool,
 static int  vhc_post_config(apr_pool_t *pool, apr_pool_t *plog,
                               apr_pool_t *ptemp, server_rec *srvr) {
 
-   const char      *key = VHC_MODULE_BASEPRODUCT;
-   void            *userdata;
-   apr_status_t     status;
+   const char        *key = VHC_MODULE_BASEPRODUCT;
+   apr_pool_t        *ppool = srvr->process->pool;
+   void              *userdata;
+   apr_status_t       status;
+   server_rec        *s;
+   VHC_shm_header_t  *header;
+   apr_shm_t         *shm;
+   char              *shm_file;
+   int                num_vhosts = 0;
+   int                num_entries;
    
    VHC_DEBUG  vhc_debug_log_(pool, "%s: CALLBACK - post config", VHC_LOC);
    VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
@@ -1092,249 +5288,663 @@ static int  vhc_post_config(apr_pool_t *pool, apr_pool_t *plog,
     */
    VHC_DEBUG  vhc_debug_log_(pool, "%s: Checking key existence", VHC_LOC);
 
-   apr_pool_userdata_get(&userdata, key, srvr->process->pool);
+   /*  Hang on to the server list - the status handler walks it.  */
+   gs_main_server = srvr;
+
+   /*  Trace dumps are the children's - don't die signalling them all.  */
+   apr_signal(VHC_TRACE_DUMP_SIGNAL, SIG_IGN);
+
+   apr_pool_userdata_get(&userdata, key, ppool);
    if (!userdata) {
       VHC_DEBUG  vhc_debug_log_(pool, "%s: Setting key '%s'",
                                       VHC_LOC, key);
       apr_pool_userdata_set((const void *) VHC_TRUE, key,
-                            apr_pool_cleanup_null, srvr->process->pool);
+                            apr_pool_cleanup_null, ppool);
+      return APR_SUCCESS;
+   }
+
+   /*
+    *  The shm segment + locks live in the process pool, so that they
+    *  survive (graceful) restarts - the vhosts keep their slots + burst
+    *  state and the old children keep on using them till they are done.
+    */
+   gs_state = vhc_get_persistent_state_(ppool);
+   gs_state->generation++;
+
+   vhc_set_vhost_keys_(ptemp, srvr);
+
+   /*  Render the choked responses (they live as long as the config).  */
+   vhc_render_choked_responses_(pool, srvr);
+
+   /*  Create global lock stripes (unless we still have them).  */
+   if ((NULL != gs_state->locks)  &&
+       (gs_state->num_lock_stripes == gs_vhc_env_settings.lock_stripes) ) {
+      gs_num_lock_stripes = gs_state->num_lock_stripes;
+      gs_shm_lockfiles    = gs_state->lockfiles;
+      gs_shm_locks        = gs_state->locks;
+   }
+   else {
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: Create global locks ...",
+                                      VHC_LOC);
+      status = vhc_create_global_locks_(ppool);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
+
+      gs_state->num_lock_stripes = gs_num_lock_stripes;
+      gs_state->lockfiles        = gs_shm_lockfiles;
+      gs_state->locks            = gs_shm_locks;
+   }
+
+   /*  Create the dynamic per-Host buckets (unless we still have them).  */
+   status = vhc_create_host_table_(ppool, ptemp);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   /*  Create the per-child slot lease area (just the once).  */
+   status = vhc_create_lease_area_(ppool, ptemp);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   /*  Reuse the shm segment if all the vhosts fit in it.  */
+   header = vhc_get_shm_header_(gs_state->shm);
+   if ((NULL != header)  &&
+       VHC_APR_STATUS_IS_SUCCESS(vhc_assign_shm_entries_(ptemp, header,
+                                                         srvr) ) ) {
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: Reusing shm segment", VHC_LOC);
+      gs_shm      = gs_state->shm;
+      gs_shm_file = gs_state->shm_file;
+      vhc_set_config_limits_(header, srvr);
+      vhc_set_pool_capacity_(header);
       return APR_SUCCESS;
    }
 
-   /*  Create global lock.  */
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Create global lock ...", VHC_LOC);
+   /*
+    *  Okay, need a (bigger) shm segment - with room to add vhosts. The
+    *  shm segment and shm file are global so as to allow the children
+    *  to inherit it.
+    */
+   for (s = srvr; NULL != s; s = s->next)
+      num_vhosts++;
+
+   num_entries = (2 * num_vhosts < VHC_SHM_MIN_ENTRIES) ?
+                    VHC_SHM_MIN_ENTRIES : 2 * num_vhosts;
+   if (num_entries >= VHC_SHM_NO_ENTRY)
+      num_entries = (num_vhosts < VHC_SHM_NO_ENTRY) ? VHC_SHM_NO_ENTRY - 1
+                                                    : num_vhosts;
+
+   if (num_entries < num_vhosts) {
+      ap_log_error(APLOG_MARK, APLOG_CRIT, 0, srvr,
+                   "%s: too many vhosts (%d)", VHC_MODULE_NAME, num_vhosts);
+      return HTTP_INTERNAL_SERVER_ERROR;
+   }
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Create shm segment ...", VHC_LOC);
+   status = vhc_create_shm_segment_(ppool, &shm,
+                                    apr_psprintf(ptemp, "gshm.%u",
+                                                 gs_state->generation),
+                                    &shm_file, (apr_uint16_t) num_entries);
+   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+      return status;
+
+   header = vhc_get_shm_header_(shm);
+   vhc_assign_shm_entries_(ptemp, header, srvr);
+
+   /*  Migrate the live state out of the old segment.  */
+   if (NULL != gs_state->shm)
+      vhc_retire_shm_segment_(ppool, ptemp, gs_state->shm, header, srvr);
+
+   gs_state->shm      = gs_shm      = shm;
+   gs_state->shm_file = gs_shm_file = shm_file;
+   vhc_set_config_limits_(header, srvr);
+   vhc_set_pool_capacity_(header);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_post_config.  */
+
+
+
+/**
+  *   @brief   Monitor callback - called periodically in the parent.
+  *   @param   pool  memory pool
+  *   @param   srvr  server record
+  *   @return  DECLINED always.
+  *
+  *   Monitor callback (parent process) - returns the slots of dead
+  *   children and carries over the slots the old children released into
+  *   retired shm segments after a restart.
+  *
+  */
+static int  vhc_monitor(apr_pool_t *pool, server_rec *srvr) {
+
+   vhc_reap_dead_children_();
+   vhc_reconcile_retired_shm_();
+
+   return DECLINED;
+
+}  /*  End of function  vhc_monitor.  */
+
+
+/**
+  *   @brief   Child initialization callback - on child process startup.
+  *   @param   pool   memory pool
+  *   @param   plog   log memory pool
+  *   @param   ptemp  temporary memory pool
+  *   @param   srvr   server record
+  *
+  *   Child initialization callback - need to reopen the global locks.
+  *
+  */
+static void  vhc_child_init(apr_pool_t *pool, server_rec *srvr) {
+
+   apr_status_t  status;
+   apr_uint16_t  stripe;
+
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Initializing child ...", VHC_LOC);
+
+   /*  Re-initialize our environment in the child process.  */
+   vhc_initialize_process_env_(pool);
+
+   /*  Reopen the mutexes in the child - reusing the lock pointers.  */
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Reopen global locks ...", VHC_LOC);
+   for (stripe = 0; stripe < gs_num_lock_stripes; stripe++) {
+      status = apr_global_mutex_child_init(&gs_shm_locks[stripe],
+                                           (const char *)
+                                              gs_shm_lockfiles[stripe],
+                                           pool);
+      VHC_DEBUG  vhc_debug_log_(pool, "%s: global lock %d init status %d",
+                                      VHC_LOC, (int) stripe, status);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         /*  Log error + exit as child initialization failed.  */
+         ap_log_error(APLOG_MARK, APLOG_CRIT, status, srvr,
+                      "%s: Failed to reopen shm lock in child - file=%s",
+                      VHC_MODULE_NAME, gs_shm_lockfiles[stripe]);
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   /*  Track the slots we grant, so they survive us crashing.  */
+   vhc_claim_lease_child_(pool);
+
+   /*  Trace admissions into our own ring (dumped on demand/signal).  */
+   vhc_init_trace_(pool);
+      
+   VHC_DEBUG  vhc_debug_log_(pool, "%s: Child initialization OK", VHC_LOC);
+
+}  /*  End of function  vhc_child_init.  */
+
+
+
+/**
+  *   @brief   Hook into after request is read - we check here as to
+  *            whether or not to choke requests to the vhost.
+  *   @param   req  request record
+  *   @return  DONE if we choked the request, DECLINED if there's enough
+  *            slots or within the burst grace period, HTTP_* if an error
+  *            occurred and needs to be reported
+  *
+  *   Hook into after request is read (default admission phase) - check
+  *   whether or not to choke requests to the vhost. Choked requests are
+  *   answered before any other module gets to touch the request.
+  *
+  */
+static int  vhc_post_read_request(request_rec *req) {
+
+   apr_status_t  status;
+
+   if (VHC_ADMIT_PHASE_POST_READ_REQUEST != gs_vhc_env_settings.admit_phase)
+      return DECLINED;
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: CALLBACK post read request",
+                                        VHC_LOC);
+
+   status = vhc_admit_request_(req);
+   if (VHC_HTTP_TOO_MANY_REQUESTS != status)
+      return status;
+
+   /*  No slots - send back the choked page and we are done.  */
+   vhc_send_choked_response_(req);
+
+   return DONE;
+
+}  /*  End of function  vhc_post_read_request.  */
+
+
+
+/**
+  *   @brief   Quick handler callback - we check here as to whether or not
+  *            to choke requests to the vhost.
+  *   @param   req         request record
+  *   @param   lookup_uri  non-zero if this is just a subrequest lookup
+  *   @return  OK if we choked the request, DECLINED if there's enough
+  *            slots or within the burst grace period, HTTP_* if an error
+  *            occurred and needs to be reported
+  *
+  *   Quick handler callback (QuickHandler admission phase) - check
+  *   whether or not to choke requests to the vhost before the URI gets
+  *   mapped to storage.
+  *
+  */
+static int  vhc_quick_handler(request_rec *req, int lookup_uri) {
+
+   apr_status_t  status;
+
+   /*  Subrequests are accounted for in the handler (if they run).  */
+   if ((VHC_ADMIT_PHASE_QUICK_HANDLER != gs_vhc_env_settings.admit_phase)
+       ||  lookup_uri  ||  (NULL != req->main) )
+      return DECLINED;
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: CALLBACK quick handler",
+                                        VHC_LOC);
+
+   status = vhc_admit_request_(req);
+   if (VHC_HTTP_TOO_MANY_REQUESTS != status)
+      return status;
+
+   /*  No slots - send back the choked page.  */
+   vhc_send_choked_response_(req);
+
+   return OK;
+
+}  /*  End of function  vhc_quick_handler.  */
+
+
+
+/**
+  *   @brief   Request content handler callback - we check here as to
+  *            whether or not to choke requests to the vhost.
+  *   @param   req  request record
+  *   @return  OK if we choked the request, DECLINED if there's
+  *            enough slots or within the burst grace period,
+  *            HTTP_* if an error occurred and needs to be reported
+  *
+  *   Request content handler callback (Handler admission phase) - check
+  *   whether or not to choke requests to the vhost. Subrequests that run
+  *   are accounted for here in any admission phase - a choked one fails
+  *   with a bare 429 (its output would end up in the client's page).
+  *
+  */
+static int  vhc_handler(request_rec *req) {
+
+   apr_status_t  status;
+
+   if (NULL != req->main)
+      return vhc_admit_subrequest_(req);
+
+   if (VHC_ADMIT_PHASE_HANDLER != gs_vhc_env_settings.admit_phase)
+      return DECLINED;
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: CALLBACK handler", VHC_LOC);
+
+   status = vhc_admit_request_(req);
+   if (VHC_HTTP_TOO_MANY_REQUESTS != status)
+      return status;
+
+   /*  Got here, means we have no slots, return choked page.  */
+   vhc_send_choked_response_(req);
+
+   return OK;
+      
+}  /*  End of function  vhc_handler.  */
+
+
+
+/**
+  *   @brief   Status handler callback - report the slot usage of all the
+  *            vhosts.
+  *   @param   req  request record
+  *   @return  OK if we handled the request, DECLINED if not ours.
+  *
+  *   Status handler callback (SetHandler vhost-choke-status) - report the
+  *   slot usage of all the vhosts as JSON (?json) or otherwise in the
+  *   Prometheus text format. Doesn't take any locks.
+  *
+  */
+static int  vhc_status_handler(request_rec *req) {
+
+   VHC_vhost_status_t  *status;
+   int                  n;
+
+   if ((NULL == req->handler)  ||
+       strcmp(req->handler, VHC_STATUS_HANDLER_NAME) )
+      return DECLINED;
+
+   if (M_GET != req->method_number)
+      return HTTP_METHOD_NOT_ALLOWED;
+
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: CALLBACK status handler",
+                                        VHC_LOC);
+
+   /*  Dump of this child's trace ring (see trace/vhc_trace.c).  */
+   if (req->args  &&  !strcmp(req->args, "trace") )
+      return vhc_send_trace_(req);
+
+   n = vhc_get_vhost_status_(req, &status);
+
+   if (req->args  &&  (!strcmp(req->args, "json")  ||
+                       strstr(req->args, "format=json") ) )
+      vhc_print_status_json_(req, status, n);
+   else
+      vhc_print_status_text_(req, status, n);
 
-   status = vhc_create_global_lock_(pool);
-   if (!VHC_APR_STATUS_IS_SUCCESS(status) )
-      return status;
+   return OK;
 
-   /*
-    *  Okay, all setup - just create the shm and return. The shm segment 
-    *  and shm file are global so as to allow the children to inherit it.
-    */
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Create shm segment ...", VHC_LOC);
-   return  vhc_create_shm_segment_(pool, &gs_shm, "gshm", gs_shm_file);
+}  /*  End of function  vhc_status_handler.  */
 
-}  /*  End of function  vhc_post_config.  */
 
 
 /**
-  *   @brief   Child initialization callback - on child process startup.
-  *   @param   pool   memory pool
-  *   @param   plog   log memory pool
-  *   @param   ptemp  temporary memory pool
-  *   @param   srvr   server record
+  *   @brief   Admin handler - view or change the vhosts' limits.
+  *   @param   req  request record
+  *   @return  DECLINED if not the admin handler, OK or HTTP_* errors.
   *
-  *   Child initialization callback - need to reopen the global lock.
+  *   GET lists the effective limits of all the vhosts. POST changes the
+  *   limits of a vhost (vhost=name or name:port, plus the limits to
+  *   change - see vhc_parse_vhost_limits_ - or reset to go back to the
+  *   configured limits). A change goes to the vhost's slot table entry,
+  *   so all the children use the new limits from their next request on.
+  *   Restrict access to the handler (Require) - it's not authenticated.
   *
   */
-static void  vhc_child_init(apr_pool_t *pool, server_rec *srvr) {
+static int  vhc_admin_handler(request_rec *req) {
 
-   apr_status_t  status;
+   VHC_server_config_t  *cfg;
+   VHC_shm_data_t       *vhost_data;
+   VHC_vhost_limits_t    limits;
+   apr_table_t          *args = NULL;
+   apr_status_t          status;
+   server_rec           *s;
+   const char           *vhost;
+   const char           *error;
+   int                   nchanged = 0;
 
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Initializing child ...", VHC_LOC);
+   if ((NULL == req->handler)  ||
+       strcmp(req->handler, VHC_ADMIN_HANDLER_NAME) )
+      return DECLINED;
 
-   /*  Re-initialize our environment in the child process.  */
-   vhc_initialize_process_env_(pool);
+   if ((M_GET != req->method_number)  &&  (M_POST != req->method_number) )
+      return HTTP_METHOD_NOT_ALLOWED;
 
-   /*  Reopen the mutex in the child - reusing the lock pointer global.  */
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Reopen global lock ...", VHC_LOC);
-   status = apr_global_mutex_child_init(&gs_shm_lock,
-                                        (const char *) gs_shm_lockfile,
-                                        pool);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: global lock init status %d",
-                                   VHC_LOC, status);
-   if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
-      /*  Log error + exit as child initialization failed.  */
-      ap_log_error(APLOG_MARK, APLOG_CRIT, status, srvr,
-                   "%s: Failed to reopen shm lock in child - file=%s",
-                   VHC_MODULE_NAME, gs_shm_lockfile);
-      exit(EXIT_FAILURE);
+   VHC_DEBUG  vhc_debug_log_(req->pool, "%s: CALLBACK admin handler",
+                                        VHC_LOC);
+
+   ap_set_content_type(req, VHC_ADMIN_CONTENT_TYPE);
+
+   /*  GET - the limits of all the vhosts.  */
+   if (M_GET == req->method_number) {
+      for (s = gs_main_server; (NULL != s)  &&  !req->header_only;
+           s = s->next)
+         vhc_print_vhost_limits_(req, s);
+
+      return OK;
    }
-      
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Child initialization OK", VHC_LOC);
 
-}  /*  End of function  vhc_child_init.  */
+   /*  POST - change the limits of a vhost.  */
+   ap_args_to_table(req, &args);
+   vhost = apr_table_get(args, "vhost");
+   if (NULL == vhost)
+      return HTTP_BAD_REQUEST;
+
+   for (s = gs_main_server; NULL != s; s = s->next) {
+      if (strcmp(vhost, vhc_get_vhost_name_(s) )  &&
+          strcmp(vhost, apr_psprintf(req->pool, "%s:%d",
+                                     vhc_get_vhost_name_(s),
+                                     (int) s->port) ) )
+         continue;
+
+      cfg = ap_get_module_config(s->module_config, &vhost_choke_module);
+      vhost_data = vhc_get_vhost_shm_data_(cfg->shm_index);
+      if (NULL == vhost_data)
+         continue;
+
+      if (NULL != apr_table_get(args, "reset") )
+         vhc_get_config_limits_(cfg, &limits);
+      else
+         vhc_get_vhost_limits_(vhost_data, &limits);
+
+      error = vhc_parse_vhost_limits_(args, &limits);
+      if (NULL != error) {
+         ap_log_error(APLOG_MARK, APLOG_WARNING, 0, req->server,
+                      "%s: admin - invalid %s for vhost %s",
+                      VHC_MODULE_NAME, error, vhost);
+         return HTTP_BAD_REQUEST;
+      }
+
+      /*  Acquire the lock if we are not lock-free.  */
+      if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode) {
+         status = vhc_acquire_vhost_lock_(cfg->shm_index);
+         if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, req->server,
+                         "%s: admin failed to acquire shm lock - pid=%ld",
+                         VHC_MODULE_NAME, (long int) getpid() );
+            return HTTP_INTERNAL_SERVER_ERROR;
+         }
+      }
+
+      vhc_set_vhost_limits_(vhost_data, &limits);
+
+      if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode)
+         vhc_lock_release_(vhc_get_vhost_lock_(cfg->shm_index) );
+
+      ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, req->server,
+                   "%s: vhost %s:%d limits set - slot_limit=%d "
+                   "burst_percent=%d grace_period=%d flap_period=%d "
+                   "rate_interval=%u rate_burst=%u", VHC_MODULE_NAME,
+                   vhc_get_vhost_name_(s), (int) s->port,
+                   (int) limits.slot_limit, (int) limits.burst_percent,
+                   (int) limits.grace_period, (int) limits.flap_period,
+                   (unsigned int) limits.rate_interval,
+                   (unsigned int) limits.rate_burst);
+
+      vhc_print_vhost_limits_(req, s);
+      nchanged++;
+   }
+
+   return (nchanged > 0) ? OK : HTTP_NOT_FOUND;
+
+}  /*  End of function  vhc_admin_handler.  */
 
 
 
 /**
-  *   @brief   Hook into after request is read - so that we can trap into
-  *            when the request ends.
+  *   @brief   Log transaction callback - release the slot of an admitted
+  *            request (if it still holds one).
   *   @param   req  request record
-  *   @return  DECLINED always.
+  *   @return  DECLINED always (let the loggers run).
   *
-  *   Hook into after request is read, so that we can get a pseudo hook
-  *   into when the request ends via a pool cleanup handler.
+  *   Log transaction callback - release the slot of an admitted request
+  *   (LogTransaction release point), or of one whose end of response
+  *   release filter got lost. The admission is always on the top-level
+  *   (client) request, whichever internal redirect got it admitted.
   *
   */
-static int  vhc_post_read_request(request_rec *req) {
-
-   apr_pool_t           *pool = req->pool;
-   struct request_rec  **clone;
+static int  vhc_log_transaction(request_rec *req) {
 
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: CALLBACK create request", VHC_LOC);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
-                                   vhc_get_vhost_name_(req->server) );
+   VHC_admission_t  *admission;
 
-   /*  Dummy allocation - so that cleanups happen.  */
-   clone = apr_palloc(pool, sizeof(struct request_rec *) );
-   *clone = req;
+   if (VHC_RELEASE_AT_POOL_CLEANUP == gs_vhc_env_settings.release_at)
+      return DECLINED;
 
-   /*  Register cleanup handler.  */
-   apr_pool_cleanup_register(pool, *clone, vhc_req_pool_cleanup_,
-                             apr_pool_cleanup_null);
+   admission = ap_get_module_config(vhc_get_top_request_(req)->request_config,
+                                    &vhost_choke_module);
+   if (NULL != admission)
+      vhc_release_admission_(admission, 0);
 
    return DECLINED;
 
-}  /*  End of function  vhc_post_read_request.  */
+}  /*  End of function  vhc_log_transaction.  */
 
 
 
 /**
-  *   @brief   Request content handler callback - we check here as to
-  *            whether or not to choke requests to the vhost.
+  *   @brief   Insert filter callback - add the bandwidth output filter
+  *            for vhosts with a bandwidth limit.
   *   @param   req  request record
-  *   @return  APR_SUCCESS if we choked the request, DECLINED if there's
-  *            enough slots or within the burst grace period,
-  *            HTTP_* if an error occurred and needs to be reported
   *
-  *   Request content handler callback - check whether or not to choke
-  *   requests to the vhost.
+  *   Insert filter callback - add the bandwidth output filter to (main)
+  *   requests for vhosts with a bandwidth limit. Once per client request
+  *   - it's a protocol filter, so it stays on for internal redirects.
   *
   */
-static int  vhc_handler(request_rec *req) {
+static void  vhc_insert_filter(request_rec *req) {
 
-   apr_status_t          status;
-   apr_pool_t           *pool = req->pool;
    VHC_server_config_t  *cfg;
-   void                 *baseaddr;
-   void                 *data;
    VHC_shm_data_t       *vhost_data;
-   apr_uint16_t          nslots;
-   char                  burst_grace[] = "(burst grace period)";
+   VHC_bandwidth_ctx_t  *ctx;
+   request_rec          *top;
 
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: CALLBACK handler", VHC_LOC);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost = %s", VHC_LOC,
-                                   vhc_get_vhost_name_(req->server) );
+   /*  Subrequest output goes through the main request's filters.  */
+   if (NULL != req->main)
+      return;
 
    cfg = ap_get_module_config(req->server->module_config,
                               &vhost_choke_module);
-   
-   /*  Check if we need to throttle this vhost.  */
-   if (0 == cfg->slot_limit) {
-      VHC_DEBUG  vhc_debug_log_(pool, "%s: NOT throttled slot limit=%d", 
-                                      VHC_LOC, cfg->slot_limit);
-      return DECLINED;
-   }
+   if (0 == cfg->bandwidth_settings.rate)
+      return;
 
-   /*  Ensure valid config id.  */
-   if (cfg->config_id >= gs_num_configs) {
-      VHC_DEBUG  vhc_debug_log_(pool, "%s: Config Id %d not valid (>= %d)",
-                                      VHC_LOC, cfg->config_id,
-                                      gs_num_configs);
-      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
-                   "%s: invalid config id [%d] >= %d",
-                   VHC_MODULE_NAME, cfg->config_id, gs_num_configs);
-      return HTTP_INTERNAL_SERVER_ERROR;
-   }
+   vhost_data = vhc_get_vhost_shm_data_(cfg->shm_index);
+   if (NULL == vhost_data)
+      return;
 
+   /*  Already metered (before an internal redirect)?  */
+   top = vhc_get_top_request_(req);
+   if (NULL != apr_table_get(top->notes, VHC_BANDWIDTH_NOTE) )
+      return;
 
-   /*  Acquire the lock.  */
-   status = vhc_lock_acquire_(gs_shm_lock, VHC_MAX_LOCK_WAIT_TIME_USECS);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: Lock acquistion status %d",
-                                   VHC_LOC, status);
-   if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
-      /*  Got some error - need to log and bail out.  */
-      ap_log_error(APLOG_MARK, APLOG_ERR, status, req->server,
-                   "%s: vhc_handler failed to acquire shm lock - pid=%ld",
-                   VHC_MODULE_NAME, (long int) getpid() );
-      return HTTP_INTERNAL_SERVER_ERROR;
-   }
+   apr_table_setn(top->notes, VHC_BANDWIDTH_NOTE, "1");
 
-   /*  Get shm segment base address.  */
-   baseaddr = apr_shm_baseaddr_get(gs_shm);
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: shm addr %ld", VHC_LOC, baseaddr);
+   ctx = apr_pcalloc(req->pool, sizeof(VHC_bandwidth_ctx_t) );
+   ctx->config  = cfg;
+   ctx->shmdata = vhost_data;
 
-   if (NULL == baseaddr) {
-      /*  Error getting shm segment base address.  */
-      ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
-                   "%s: vhc_handler error getting shm base address",
-                   VHC_MODULE_NAME);
+   ap_add_output_filter(VHC_BANDWIDTH_FILTER_NAME, ctx, req,
+                        req->connection);
 
-      /*  Important: Need to release the lock before returning.  */
-      status = vhc_lock_release_(gs_shm_lock);
-      return HTTP_INTERNAL_SERVER_ERROR;
-   }
+}  /*  End of function  vhc_insert_filter.  */
 
-   /*  Jump to right place for the vhost data.  */
-   data = baseaddr + (sizeof(VHC_shm_data_t) * cfg->config_id);
-   vhost_data = (VHC_shm_data_t *) data;
 
-   /*  Check vhost has capacity.  */
-   status = vhc_check_vhost_capacity_(cfg, vhost_data);
-   if (VHC_APR_STATUS_IS_SUCCESS(status) ) {
-      /*  We have enough slots for this vhost.  */
-      vhost_data->inuse_slots++;
 
-      nslots = cfg->slot_limit;
-      if (vhost_data->inuse_slots <= nslots)
-         burst_grace[0] = '\0';  /*  Within slot limit.  */
-      else  /*  Bursting ... */
-         nslots += (apr_uint16_t) (ceil(cfg->slot_limit / 100.0 *
-                                        cfg->burst_settings.percent) );
+/**
+  *   @brief   Bandwidth output filter - paces a vhost's response bytes.
+  *   @param   f   the filter
+  *   @param   bb  the brigade to pass on
+  *   @return  APR_SUCCESS on success, otherwise errors.
+  *
+  *   Bandwidth output filter - meters the response bytes against the
+  *   vhost's (shared) byte budget. The brigade is passed on in chunks and
+  *   each chunk's write is deferred until the budget allows it - one wait
+  *   per chunk, not one per bucket. The wait is a sleep, so the worker
+  *   thread stays busy while a response is paced (on event MPM too).
+  *
+  */
+static apr_status_t  vhc_bandwidth_filter(ap_filter_t *f,
+                                          apr_bucket_brigade *bb) {
+
+   VHC_bandwidth_ctx_t  *ctx = (VHC_bandwidth_ctx_t *) f->ctx;
+   VHC_server_config_t  *cfg = ctx->config;
+   apr_global_mutex_t   *lock;
+   apr_bucket           *split;
+   apr_off_t             nbytes;
+   apr_interval_time_t   delay;
+   apr_status_t          status;
+   int                   reserved;
+
+   if (NULL == ctx->pending)
+      ctx->pending = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+
+   while (!APR_BRIGADE_EMPTY(bb) ) {
+      /*  Split off a chunk - the rest waits in pending.  */
+      nbytes = (apr_off_t) cfg->bandwidth_settings.chunk;
+      status = apr_brigade_partition(bb, nbytes, &split);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status)  &&  (APR_INCOMPLETE != status) )
+         return status;
 
-      VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost has capacity %d/%d %s",
-                                      VHC_LOC, vhost_data->inuse_slots,
-                                      nslots, burst_grace);
-      status = DECLINED;
+      ctx->pending = apr_brigade_split_ex(bb, split, ctx->pending);
 
-   }  /*  End of  IF we had enough slots.  */
+      status = apr_brigade_length(bb, 1, &nbytes);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
 
+      do {
+         /*  Reserve the bytes - under the vhost's lock if not lock-free.  */
+         lock = NULL;
+         if (VHC_LOCK_MODE_MUTEX == gs_vhc_env_settings.lock_mode) {
+            status = vhc_acquire_vhost_lock_(cfg->shm_index);
+            if (VHC_APR_STATUS_IS_SUCCESS(status) )
+               lock = vhc_get_vhost_lock_(cfg->shm_index);
+         }
+
+         /*  No lock - send the bytes unmetered.  */
+         delay = 0;
+         reserved = 1;
+         if (lock  ||  (VHC_LOCK_MODE_ATOMIC ==
+                        gs_vhc_env_settings.lock_mode) )
+            delay = vhc_reserve_vhost_bandwidth_(cfg, ctx->shmdata, nbytes,
+                                                 &reserved);
+
+         if (NULL != lock)
+            vhc_lock_release_(lock);
+
+         /*  Defer the write (or the next try) until the budget allows.  */
+         if (delay > 0)
+            apr_sleep(delay);
+
+      } while (!reserved);
+
+      status = ap_pass_brigade(f->next, bb);
+      apr_brigade_cleanup(bb);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         apr_brigade_cleanup(ctx->pending);
+         return status;
+      }
 
-   /*  Save off number of inuse slots for lockless access later.  */
-   nslots = vhost_data->inuse_slots;
+      APR_BRIGADE_CONCAT(bb, ctx->pending);
 
-   /*  Release the previously acquired lock.  */
-   vhc_lock_release_(gs_shm_lock);
+   }  /*  End of  while more to send.  */
 
+   return APR_SUCCESS;
 
-   /*  DECLINED means the vhost has capacity, so just return it.  */
-   if (DECLINED == status)
-      return DECLINED; 
+}  /*  End of function  vhc_bandwidth_filter.  */
 
-   /*  Got here, means we have no slots, return choked page.  */
 
-   /*  Set response headers - content type, status & extension headers.  */
-   vhc_generate_choked_headers_(req, gs_vhc_env_settings.http_code);
 
-   /*  !HEAD request, so generate choked page content as well.  */
-   if (!req->header_only) {
-      /*  TODO: add a link to the choked page w/ the error message.  */
+/**
+  *   @brief   Slot release output filter - releases the slot of an
+  *            admitted request once its response is sent.
+  *   @param   f   the filter
+  *   @param   bb  the brigade to pass on
+  *   @return  status of passing the brigade on.
+  *
+  *   Slot release output filter (EOS release point) - passes the brigade
+  *   on and releases the request's slot once the end of the response
+  *   (EOS) has been handed to the connection, rather than when the
+  *   request pool goes away (after logging, keep-alive or write
+  *   completion). A protocol filter, so it survives internal redirects.
+  *
+  */
+static apr_status_t  vhc_release_filter(ap_filter_t *f,
+                                        apr_bucket_brigade *bb) {
 
-      /*  Send an error page w/ the customized "choked" message.     */
-      vhc_generate_choked_page_content_(req,
-                                        VHC_HTTP_MSG_TOO_MANY_REQUESTS,
-                                        gs_vhc_env_settings.err_message);
-   }
+   VHC_admission_t  *admission = (VHC_admission_t *) f->ctx;
+   apr_bucket       *b;
+   apr_status_t      status;
+   int               eos = 0;
 
+   for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb);
+        b = APR_BUCKET_NEXT(b) )
+      if (APR_BUCKET_IS_EOS(b) )
+         eos = 1;
 
-   /*  Log error if dev debugging - don't overload log on high load.  */
-#ifdef VHC_DEV_DEBUG
-   ap_log_error(APLOG_MARK, APLOG_ERR, 0, req->server,
-                "%s: vhost %s choked - %s, inuse_slots = %d",
-                   VHC_MODULE_NAME, vhc_get_vhost_name_(req->server),
-                   VHC_HTTP_MSG_TOO_MANY_REQUESTS, nslots);
+   status = ap_pass_brigade(f->next, bb);
 
-#endif  /*  For VHC_DEV_DEBUG.  */
+   if (eos) {
+      vhc_release_admission_(admission, 0);
+      ap_remove_output_filter(f);
+   }
 
-   /*  Log that we returned the customized "choked" http error code.  */
-   VHC_DEBUG  vhc_debug_log_(pool, "%s: vhost choked response status=%d",
-                                   VHC_LOC, gs_vhc_env_settings.http_code);
+   return status;
 
-   return APR_SUCCESS;
-      
-}  /*  End of function  vhc_handler.  */
+}  /*  End of function  vhc_release_filter.  */
 
 
 
@@ -1355,18 +5965,43 @@ static void  vhc_register_hooks(apr_pool_t *pool) {
     *  Register the callbacks we need to hook into:
     *     - post_config:        do this module's initialization  and
     *     - child_init:         when a child starts up. 
-    *     - post_read_request:  after request is read
-    *     - handler:            do the real "choke" work.
+    *     - monitor:            reconcile retired shm (parent)  and
+    *     - post_read_request:  after request is read  and
+    *     - quick_handler:      before URI mapping     and
+    *     - handler:            do the real "choke" work (whichever one is
+    *                           the configured admission phase)  or
+    *                           report the vhost status (status handler)
+    *     - log_transaction:    release the slot (if not already).
+    *     - insert_filter:      add the bandwidth output filter.
     */
    ap_hook_post_config(vhc_post_config, NULL, NULL, APR_HOOK_MIDDLE);
    ap_hook_child_init(vhc_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_monitor(vhc_monitor, NULL, NULL, APR_HOOK_MIDDLE);
    ap_hook_post_read_request(vhc_post_read_request, NULL, NULL,
-                             APR_HOOK_MIDDLE);
+                             APR_HOOK_REALLY_FIRST);
+   ap_hook_quick_handler(vhc_quick_handler, NULL, NULL,
+                         APR_HOOK_REALLY_FIRST);
    ap_hook_handler(vhc_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+   ap_hook_handler(vhc_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_handler(vhc_admin_handler, NULL, NULL, APR_HOOK_MIDDLE);
+   ap_hook_log_transaction(vhc_log_transaction, NULL, NULL,
+                           APR_HOOK_REALLY_FIRST);
+   ap_hook_insert_filter(vhc_insert_filter, NULL, NULL, APR_HOOK_MIDDLE);
+
+   /*  Pace the bytes just before they hit the connection.  */
+   ap_register_output_filter(VHC_BANDWIDTH_FILTER_NAME, vhc_bandwidth_filter,
+                             NULL, AP_FTYPE_CONNECTION - 1);
+
+   /*  Release slots at the end of response (kept across redirects).  */
+   ap_register_output_filter(VHC_RELEASE_FILTER_NAME, vhc_release_filter,
+                             NULL, AP_FTYPE_PROTOCOL);
 
    VHC_DEBUG  vhc_debug_log_(pool, "%s: registered %s OK",
                                    VHC_LOC,
-                                   "post_config+child_init+handler");
+                                   "post_config+child_init+monitor"
+                                   "+post_read_request"
+                                   "+quick_handler+handler"
+                                   "+log_transaction+insert_filter");
 
 }  /*  End of function  vhc_register_hooks.  */
 
@@ -1408,6 +6043,109 @@ static const command_rec vhc_cmds[] = {
                                       /*  Directive description        */
    ),
 
+   AP_INIT_TAKE1(
+      "VHostChokeLockMode",           /*  Directive name               */
+      vhc_set_lock_mode,              /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Use Atomic (lock-free, default) or Mutex (global lock) to update "
+      "the shared slot counters. Mutex is the fallback for platforms "
+      "without 64-bit shared memory atomics"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeLockWaitTime",       /*  Directive name               */
+      vhc_set_lock_wait_time,         /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Max. time in milliseconds (range: 1-10000) to wait for the global "
+      "lock in Mutex lock mode (Default is 100)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeLockStripes",        /*  Directive name               */
+      vhc_set_lock_stripes,           /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Number of global locks (range: 1-256) the vhosts are striped "
+      "across in Mutex lock mode (Default is 8)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeAdmitPhase",         /*  Directive name               */
+      vhc_set_admit_phase,            /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Request phase in which requests are admitted or choked - "
+      "PostReadRequest, QuickHandler or Handler "
+      "(Default is PostReadRequest)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeReleaseAt",          /*  Directive name               */
+      vhc_set_release_at,             /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "When admitted requests release their slot - EOS (response "
+      "sent), LogTransaction or PoolCleanup (Default is EOS)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeDynamicHosts",       /*  Directive name               */
+      vhc_set_dynamic_hosts,          /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Number of dynamic per-Host buckets (range: 0-1048576) shared by "
+      "the VHostChokePerHost Virtual Hosts (Default is 0 or none)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeCapacityPool",       /*  Directive name               */
+      vhc_set_capacity_pool,          /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Off | Auto | number of slots (range: 0-1048576) in the global "
+      "capacity pool Virtual Hosts borrow from beyond their slot limits. "
+      "Auto uses MaxRequestWorkers (Default is Off)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeSlotBatch",          /*  Directive name               */
+      vhc_set_slot_batch,             /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Number of slots (range: 0-64) a child leases from a Virtual Host "
+      "at a time and hands out to its threads (Default is 0 or none)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeTrace",              /*  Directive name               */
+      vhc_set_trace,                  /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Off | number of admission event records (range: 0-16777216) each "
+      "child keeps in its trace ring (Default is 4096)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeTraceDir",           /*  Directive name               */
+      vhc_set_trace_dir,              /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF,                      /*  Where available (*.conf)     */
+      "Directory the children write their trace dumps to when signalled "
+      "(SIGUSR2 - Default is the DefaultRuntimeDir)"
+                                      /*  Directive description        */
+   ),
+
    AP_INIT_TAKE1(
       "VHostChokeSlotLimit",          /*  Directive name               */
       vhc_set_slot_limit,             /*  Config action routine        */
@@ -1452,6 +6190,129 @@ static const command_rec vhc_cmds[] = {
                                       /*  Directive description        */
    ),
 
+   AP_INIT_TAKE1(
+      "VHostChokeRequestRate",        /*  Directive name               */
+      vhc_set_request_rate,           /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Request rate limit for a Virtual Host as <num-requests>[/s|/m|/h] "
+      "(Default is 0 or no rate limit)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeRequestBurst",       /*  Directive name               */
+      vhc_set_request_burst,          /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Number of requests a Virtual Host can burst over its request rate "
+      "(Default is one rate period's worth of requests)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeQueueDepth",         /*  Directive name               */
+      vhc_set_queue_depth,            /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Max. number of requests (range: 0-32767) that wait for a slot "
+      "when a Virtual Host is at its slot limit (Default is 0 or no "
+      "queueing)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeQueueTimeout",       /*  Directive name               */
+      vhc_set_queue_timeout,          /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Max. time in milliseconds (range: 1-60000) a queued request waits "
+      "for a slot before it is choked (Default is 100)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeBandwidth",          /*  Directive name               */
+      vhc_set_bandwidth,              /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Response bandwidth limit for a Virtual Host as "
+      "<num-bytes>[K|M|G][/s] (Default is 0 or no bandwidth limit)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_FLAG(
+      "VHostChokePerHost",            /*  Directive name               */
+      vhc_set_per_host,               /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Use On to apply the Virtual Host's limits to each request Host "
+      "separately (needs VHostChokeDynamicHosts - default is Off)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE2(
+      "VHostChokeAdaptiveLimit",      /*  Directive name               */
+      vhc_set_adaptive_limit,         /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Bounds <min> <max> (range: 1-32767) within which the slot limit "
+      "adapts to the request service time (Default is 0 0 or a fixed "
+      "slot limit)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeTargetLatency",      /*  Directive name               */
+      vhc_set_target_latency,         /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Request service time in milliseconds (range: 1-60000) an adaptive "
+      "slot limit aims for (Default is 100)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeWeight",             /*  Directive name               */
+      vhc_set_weight,                 /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Share (range: 1-1000) of the capacity pool slots a Virtual Host "
+      "gets relative to the others borrowing from it (Default is 1)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeResponseFormat",     /*  Directive name               */
+      vhc_set_response_format,        /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Body format of the choked response - HTML, JSON or Plain "
+      "(Default is HTML)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE1(
+      "VHostChokeRetryHeaders",       /*  Directive name               */
+      vhc_set_retry_headers,          /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Retry hints sent with choked responses - Off, RetryAfter or "
+      "RateLimit (Retry-After + RateLimit-* headers - default is "
+      "RetryAfter)"
+                                      /*  Directive description        */
+   ),
+
+   AP_INIT_TAKE12(
+      "VHostChokeSubrequests",        /*  Directive name               */
+      vhc_set_subrequests,            /*  Config action routine        */
+      NULL,                           /*  Argument to include in call  */
+      RSRC_CONF | ACCESS_CONF,        /*  Where available (*.conf)     */
+      "Subrequest accounting - Ignore (default), Count or Separate "
+      "[limit] (separate limit, default is the slot limit)"
+                                      /*  Directive description        */
+   ),
+
    {NULL}                             /*  Last command.  */
 };
 
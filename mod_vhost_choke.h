@@ -40,6 +40,10 @@
    #include <errno.h>
 #endif  /*  APR_HAVE_ERRNO_H  */
 
+#if APR_HAVE_SIGNAL_H
+   #include <signal.h>
+#endif  /*  APR_HAVE_SIGNAL_H  */
+
 #if APR_HAVE_STDIO_H
    #include <stdio.h>
 #endif  /*  APR_HAVE_STDIO_H  */
@@ -56,8 +60,30 @@
    #include <strings.h>
 #endif  /*  APR_HAVE_STRINGS_H  */
 
+#if APR_HAVE_FCNTL_H
+   #include <fcntl.h>
+#endif  /*  APR_HAVE_FCNTL_H  */
+
+#ifndef O_NOFOLLOW
+   #define  O_NOFOLLOW  0   /*  O_EXCL alone won't follow symlinks.  */
+#endif  /*  O_NOFOLLOW  */
+
 /*  TODO: Check on math functions.  */
 #include <math.h>   /*  For ceil  */
+#include <time.h>   /*  For clock_gettime  */
+
+/*  Linux futexes - for parking queued requests in the shm.  */
+#if defined(__linux__)
+   #include <linux/futex.h>
+   #include <sys/syscall.h>
+   #define  VHC_HAVE_FUTEX  1
+#endif  /*  defined(__linux__).  */
+
+/*  Include the admission engine (shm slot table + accounting) header.  */
+#include "vhc_engine.h"
+
+/*  Include the admission trace (event records + dump format) header.  */
+#include "vhc_trace.h"
 
 /*  }}}  -- End section:includes.  */
 
@@ -78,30 +104,56 @@
 #define  VHC_MODULE_VERSION      "0.1"
 
 
-/*  Defines for string conversion.  */
-#define  VHC_STR_CONVERT(str)  #str
-#define  VHC_STR(str)          VHC_STR_CONVERT(str)
-
+/*  Define for handling headers.  */
+#define  VHC_X_THROTTLED_BY_HEADER_NAME  "X-Throttled-By"
 
-/*  Define for handling headers and status.  */
-#define  VHC_X_THROTTLED_BY_HEADER_NAME     "X-Throttled-By"
-#define  VHC_APR_STATUS_IS_SUCCESS(status)  (APR_SUCCESS == (status))
+/*  Defines for the retry hint headers of choked responses.  */
+#define  VHC_RETRY_AFTER_HEADER_NAME          "Retry-After"
+#define  VHC_RATELIMIT_LIMIT_HEADER_NAME      "RateLimit-Limit"
+#define  VHC_RATELIMIT_REMAINING_HEADER_NAME  "RateLimit-Remaining"
+#define  VHC_RATELIMIT_RESET_HEADER_NAME      "RateLimit-Reset"
+#define  VHC_MAX_RETRY_AFTER       300   /*  In seconds.                  */
+#define  VHC_DECIMAL_STRINGS       1024  /*  Pre-rendered header values.  */
 
 /*  Define for default temporary directory and debug message limits.  */
 #define  VHC_DEFAULT_TEMP_DIR       "/tmp"
 #define  VHC_MAX_DEBUG_MESSAGE_LEN  (1024 + 1)
 
-/*  Define for getting function names.  */
-#if defined(__FUNCTION__)
-   #define VHC_LOC  __FUNCTION__
-#else
-   #define VHC_LOC  __FILE__ ":" VHC_STR(__LINE__)
-#endif  /*  defined(__FUNCTION__).  */
+/*  Defines for the admission trace (per-child ring of event records).  */
+#define  VHC_DEFAULT_TRACE_RECORDS  4096      /*  128 KiB per child.     */
+#define  VHC_MAX_TRACE_RECORDS      (1 << 24)
+#define  VHC_TRACE_DUMP_SIGNAL      SIGUSR2
+#define  VHC_TRACE_FILE_PREFIX      "vhc-trace"
+#define  VHC_TRACE_CONTENT_TYPE     "application/octet-stream"
+
 
+/*  Defines for the per-child slot lease area.  */
+#define  VHC_LEASE_AREA_MAGIC     0x56484c41  /*  "VHLA".                 */
+#define  VHC_LEASE_AREA_VERSION   2           /*  Bump on layout changes. */
+#define  VHC_LEASES_PER_THREAD    4           /*  Requests pending clean- */
+                                              /*  up (write completion).  */
+#define  VHC_MAX_LEASES_PER_CHILD 16384
+#define  VHC_LEASE_OWNER_REAPING  0xFFFFFFFF  /*  Leases being returned.  */
+#define  VHC_SLOT_BLOCKS_PER_CHILD  64        /*  Vhosts a child batches  */
+                                              /*  slots for (by index).   */
+#define  VHC_MAX_SLOT_BATCH       64
 
-/*  Defines for how long to wait on locks + number of tries.  */
+
+/*  Defines for the stable vhost identity (64-bit FNV-1a hash).  */
+#define  VHC_FNV1A_64_OFFSET_BASIS  APR_UINT64_C(0xcbf29ce484222325)
+#define  VHC_FNV1A_64_PRIME         APR_UINT64_C(0x100000001b3)
+
+/*  Define for the state that survives restarts (process pool userdata).  */
+#define  VHC_PERSISTENT_STATE_KEY   VHC_MODULE_BASEPRODUCT ":state"
+
+
+/*  Defines for how long to wait on locks.  */
 #define  VHC_MAX_LOCK_WAIT_TIME_USECS  (100 * 1000) /*  100ms in usecs.  */
-#define  VHC_TRYLOCK_SLEEP_TIME_USECS  (5 * 1000)   /*  5ms in usecs.    */
+#define  VHC_MAX_LOCK_WAIT_TIME_MSECS  (10 * 1000)  /*  Directive limit. */
+
+/*  Defines for lock striping - vhosts map onto stripe shm_index % N.  */
+#define  VHC_DEFAULT_LOCK_STRIPES  8
+#define  VHC_MAX_LOCK_STRIPES      256
 
 /*  Defines for apache config directive value limits.  */
 #define  VHC_MAX_SLOT_LIMIT         32767
@@ -113,18 +165,73 @@
 #define  VHC_DEFAULT_HTTP_ERROR_CODE  VHC_HTTP_TOO_MANY_REQUESTS
 #define  VHC_DEFAULT_ERROR_MSG        "VirtualHost choked. Try again later."
 
+/*  Define for default locking mode (lock-free if the platform can).  */
+#ifdef  VHC_HAVE_SHM_ATOMICS
+   #define  VHC_DEFAULT_LOCK_MODE     VHC_LOCK_MODE_ATOMIC
+#else
+   #define  VHC_DEFAULT_LOCK_MODE     VHC_LOCK_MODE_MUTEX
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+/*  Defines for per-vhost request rate (token bucket) limits.  */
+#define  VHC_MAX_REQUEST_RATE    1000000   /*  Requests per period.  */
+#define  VHC_MAX_REQUEST_BURST   1000000   /*  Token bucket size.    */
+
+/*  Defines for per-vhost bandwidth (bytes/sec) throttling.  */
+#define  VHC_BANDWIDTH_FILTER_NAME      "VHOST_CHOKE_BW"
+#define  VHC_BANDWIDTH_NOTE             "vhost-choke-bandwidth"
+#define  VHC_MAX_BANDWIDTH              (APR_INT64_C(100) << 30)
+#define  VHC_BANDWIDTH_MAX_CHUNK        (64 * 1024)  /*  Paced unit.    */
+#define  VHC_BANDWIDTH_MIN_CHUNK        1024
+#define  VHC_BANDWIDTH_CHUNKS_PER_SEC   10
+#define  VHC_BANDWIDTH_MAX_DELAY_USECS  (10 * APR_USEC_PER_SEC)
+
+/*  Define for the slot release (at the end of response) filter.  */
+#define  VHC_RELEASE_FILTER_NAME        "VHOST_CHOKE_RELEASE"
+
+/*  Define for the note on a client request that got admitted (once).  */
+#define  VHC_ADMITTED_NOTE              "vhost-choke-admitted"
+
+/*  Defines for the dynamic (per-Host) bucket table.  */
+#define  VHC_MAX_DYNAMIC_HOSTS          (1 << 20)
+#define  VHC_DYNAMIC_HOSTS_PROBES       8     /*  Probe/eviction window.*/
+
+/*  Defines for per-vhost admission queue settings.  */
+#define  VHC_MAX_QUEUE_DEPTH            32767
+#define  VHC_MAX_QUEUE_TIMEOUT          (60 * 1000)  /*  In msecs.      */
+#define  VHC_DEFAULT_QUEUE_TIMEOUT      100          /*  In msecs.      */
+#define  VHC_QUEUE_POLL_USECS           1000  /*  Poll if no futexes.   */
+
+/*  Defines for per-vhost adaptive (AIMD) slot limit settings.  */
+#define  VHC_MAX_TARGET_LATENCY         (60 * 1000)  /*  In msecs.      */
+#define  VHC_DEFAULT_TARGET_LATENCY     100          /*  In msecs.      */
+
+/*  Defines for the global capacity pool (borrowing between vhosts).  */
+#define  VHC_CAPACITY_POOL_AUTO         0xFFFFFFFF  /*  MaxRequestWorkers. */
+#define  VHC_MAX_CAPACITY_POOL          (1 << 20)
+#define  VHC_DEFAULT_WEIGHT             1
+#define  VHC_MAX_WEIGHT                 1000
+
 /*  Defines for per-vhost burst settings.  */
 #define  VHC_DEFAULT_BURST_PERCENT      30    /*  Burst upto 30%.  */
 #define  VHC_DEFAULT_GRACE_PERIOD       10    /*  In seconds.      */
 #define  VHC_DEFAULT_BURST_FLAP_PERIOD  1800  /*  In seconds.      */
+#define  VHC_MAX_BURST_SETTING          65535
+
 
+/*  Defines for the status handler (SetHandler vhost-choke-status).  */
+#define  VHC_STATUS_HANDLER_NAME          "vhost-choke-status"
+#define  VHC_STATUS_JSON_CONTENT_TYPE     "application/json"
+#define  VHC_STATUS_TEXT_CONTENT_TYPE     "text/plain; version=0.0.4"
+#define  VHC_STATUS_METRIC_PREFIX         "vhost_choke_"
 
-/*  Defines for HTTP response code for too many requests (see RFC 6585).  */
-#define  VHC_HTTP_TOO_MANY_REQUESTS         429   /*  As per RFC 6585.  */
-#define  VHC_HTTP_MSG_TOO_MANY_REQUESTS     "Too Many Requests"
+/*  Defines for the admin handler (SetHandler vhost-choke-admin).  */
+#define  VHC_ADMIN_HANDLER_NAME           "vhost-choke-admin"
+#define  VHC_ADMIN_CONTENT_TYPE           "text/plain"
 
-/*  Define for choked responses.  */
-#define  VHC_CHOKED_RESPONSE_CONTENT_TYPE    "text/html"
+/*  Defines for choked responses (content type per body format).  */
+#define  VHC_CHOKED_HTML_CONTENT_TYPE        "text/html"
+#define  VHC_CHOKED_JSON_CONTENT_TYPE        "application/json"
+#define  VHC_CHOKED_PLAIN_CONTENT_TYPE       "text/plain"
 
 
 /*  }}}  -- End section:defines.  */
@@ -133,13 +240,60 @@
 /*  section:typedefs {{{  */
 /*  ++++++++++++++++      */
 
-/*  Boolean.  */
-typedef  enum { VHC_FALSE = 0, VHC_TRUE = !VHC_FALSE }  VHC_boolean;
+/*  Request phase in which requests are admitted (or choked).  */
+typedef  enum {
+   VHC_ADMIT_PHASE_POST_READ_REQUEST = 0,  /*  Right after read.    */
+   VHC_ADMIT_PHASE_QUICK_HANDLER,          /*  Before URI mapping.  */
+   VHC_ADMIT_PHASE_HANDLER                 /*  Content handler.     */
+
+}  VHC_admit_phase;
+
+/*  When admitted requests release their slot.  */
+typedef  enum {
+   VHC_RELEASE_AT_EOS = 0,                 /*  Response (EOS) sent. */
+   VHC_RELEASE_AT_LOG_TRANSACTION,         /*  Request logged.      */
+   VHC_RELEASE_AT_POOL_CLEANUP             /*  Request pool freed.  */
+
+}  VHC_release_point;
+
+/*  How a vhost accounts for subrequests (SSI includes, ...).  */
+typedef  enum {
+   VHC_SUBREQUESTS_IGNORE = 0,             /*  Main request's slot. */
+   VHC_SUBREQUESTS_COUNT,                  /*  A slot each.         */
+   VHC_SUBREQUESTS_SEPARATE                /*  Own slot limit.      */
+
+}  VHC_subrequests;
+
+/*  Body format of the choked response.  */
+typedef  enum {
+   VHC_RESPONSE_FORMAT_HTML = 0,           /*  HTML page (default). */
+   VHC_RESPONSE_FORMAT_JSON,               /*  JSON object.         */
+   VHC_RESPONSE_FORMAT_PLAIN               /*  Plain text.          */
+
+}  VHC_response_format;
+
+/*  Retry hint headers sent with choked responses.  */
+typedef  enum {
+   VHC_RETRY_HEADERS_OFF = 0,              /*  None.                */
+   VHC_RETRY_HEADERS_RETRY_AFTER,          /*  Retry-After.         */
+   VHC_RETRY_HEADERS_RATELIMIT             /*  + RateLimit-*.       */
+
+}  VHC_retry_headers;
 
 /*  Structure contain settings related to the whole module.  */
 typedef struct vhc_env_settings {
    VHC_boolean   debug;          /*  Debugging flag.           */
    apr_uint16_t  http_code;      /*  HTTP response code.       */
+   apr_uint16_t  lock_mode;      /*  Shm locking mode.         */
+   apr_uint32_t  lock_wait_usecs;  /*  Max. wait for the lock. */
+   apr_uint16_t  lock_stripes;   /*  # of shm lock stripes.    */
+   apr_uint16_t  admit_phase;    /*  Request admission phase.  */
+   apr_uint16_t  release_at;     /*  Slot release point.       */
+   apr_uint32_t  dynamic_hosts;  /*  # of per-Host buckets.    */
+   apr_uint32_t  pool_slots;     /*  Capacity pool (0 = none). */
+   apr_uint32_t  slot_batch;     /*  Slots per child block.    */
+   apr_uint32_t  trace_records;  /*  Trace ring size (0 = off).*/
+   const char   *trace_dir;      /*  Where trace dumps go.     */
 
    char          err_message[VHC_MAX_ERROR_MESSAGE_LEN /* 141 */];
                                  /*  Error message to client.  */
@@ -149,34 +303,147 @@ typedef struct vhc_env_settings {
 } VHC_env_settings_t, *VHC_env_settings_t_p;
 
 
-/*  Structure definitions for vhost_choke server configs.  */
-typedef struct  vhc_server_config {
-   char         *server_hostname;   /*  The server hostname.           */
+/*  Structure definitions for the slot lease area header (in shm).  */
+typedef struct  vhc_lease_header {
+   apr_uint32_t  magic;             /*  VHC_LEASE_AREA_MAGIC.          */
+   apr_uint32_t  version;           /*  VHC_LEASE_AREA_VERSION.        */
+   apr_uint32_t  num_children;      /*  # of child lease records.      */
+   apr_uint32_t  leases_per_child;  /*  # of leases per child.         */
+   apr_uint32_t  child_stride;      /*  Bytes between child records.   */
+   apr_uint32_t  blocks_per_child;  /*  # of slot blocks per child.    */
+   apr_uint32_t  block_offset;      /*  Slot blocks offset in a child  */
+                                    /*  record (after the leases).     */
+   volatile apr_uint64_t  reclaimed_slots;   /*  # of slots the reaper   */
+                                             /*  returned.               */
+   volatile apr_uint64_t  reaped_children;   /*  # of dead children.     */
+   volatile apr_uint64_t  untracked;         /*  # of slots w/o a lease. */
+
+}  VHC_CACHE_ALIGNED  VHC_lease_header_t, *VHC_lease_header_t_p;
+
+
+/*
+ *  Structure definitions for a child's lease record (in shm) - followed
+ *  by its leases and its slot blocks. Only the owning child grants
+ *  leases, the parent (or a child that got the same pid) returns them
+ *  once the owner is dead.
+ */
+typedef struct  vhc_lease_child {
+   volatile apr_uint32_t  owner;             /*  Child pid (0 = free).   */
+   apr_int32_t            mpm_generation;    /*  Owner's MPM generation. */
+
+}  VHC_CACHE_ALIGNED  VHC_lease_child_t, *VHC_lease_child_t_p;
+
 
-   apr_uint16_t  config_id;         /*  Unique config id.              */
-   apr_uint16_t  slot_limit;        /*  Slot (or choke at) limit.      */
-                                    /*  Default: 0 or no limit.        */
+/*  Structure definitions for a slot lease (in shm).  */
+typedef struct  vhc_slot_lease {
+   volatile apr_uintptr_t  shmdata;          /*  VHC_shm_data_t the slot */
+                                             /*  is from (0 = free).     */
 
-   /*  Structure contain burst settings related to the "bursting".  */
-   struct burst_settings {
-      apr_uint16_t  grace_period;   /*  Grace period for "bursting".   */
-      apr_uint16_t  flap_period;    /*  Handle burst flapping.         */
+}  VHC_slot_lease_t, *VHC_slot_lease_t_p;
 
-      apr_uint16_t  percent;        /*  Max. allowable percentage to   */
-                                    /*  burst over the choke limit.    */
-      char          filler[2];      /*  Filler/boundary adjust.        */
 
-   } burst_settings;
+/*
+ *  Structure definitions for a child's block of slots for a vhost (in
+ *  shm). The spare slots are counted in the vhost's inuse slots, but only
+ *  the child's own threads hand them out - the reaper returns them if
+ *  the child dies.
+ */
+typedef struct  vhc_slot_block {
+   volatile apr_uintptr_t  shmdata;          /*  VHC_shm_data_t the block*/
+                                             /*  is for (0 = free).      */
+   volatile apr_uint64_t   spare;            /*  # of spare slots.       */
+
+}  VHC_CACHE_ALIGNED  VHC_slot_block_t, *VHC_slot_block_t_p;
 
-}  VHC_server_config_t, *VHC_server_config_t_p;
 
+/*  Structure definitions for a request's slot admission (for release).  */
+typedef struct  vhc_admission {
+   request_rec          *req;       /*  Admitted request.              */
+   VHC_server_config_t  *config;    /*  Vhost config.                  */
+   VHC_shm_data_t       *shmdata;   /*  Vhost shm data (slot owner).   */
+   VHC_slot_lease_t     *lease;     /*  Slot lease (NULL = untracked). */
+   VHC_slot_block_t     *block;     /*  Child's slot block (or NULL).  */
+   apr_time_t            admitted_at;  /*  Admission time (mono).      */
+   volatile apr_uint32_t released;     /*  Slot released (just once).  */
 
-/*  Structure definitions for per-vhost shm data.  */
-typedef struct  vhc_shm_data {
-   apr_time_t    grace_expires_at;  /*  When grace period expires.     */
-   apr_uint64_t  inuse_slots;       /*  # of slots currently in use.   */
+}  VHC_admission_t, *VHC_admission_t_p;
 
-}  VHC_shm_data_t, *VHC_shm_data_t_p;
+
+/*
+ *  Structure definitions for a vhost's choked response - rendered once
+ *  (post_config) and sent as is, so choking a request formats nothing.
+ */
+typedef struct  vhc_choked_response {
+   int           status;            /*  HTTP response code.            */
+   const char   *status_line;       /*  "<code> Too Many Requests".    */
+   const char   *content_type;      /*  Body content type.             */
+   const char   *x_throttled_by;    /*  X-Throttled-By header value.   */
+   const char   *content_length;    /*  Content-Length header value.   */
+   const char   *body;              /*  Response body.                 */
+   apr_size_t    body_len;          /*  Response body length.          */
+
+}  VHC_choked_response_t, *VHC_choked_response_t_p;
+
+
+/*  Structure definitions for a vhost's status (snapshot of shm data).  */
+typedef struct  vhc_vhost_status {
+   server_rec       *server;            /*  Vhost server record.         */
+   apr_uint16_t      shm_index;         /*  Slot table index.            */
+   apr_uint16_t      slot_limit;        /*  Configured slot limit.       */
+   apr_uint16_t      weight;            /*  Capacity pool fair share.    */
+   VHC_boolean       per_host;          /*  Limits apply per Host.       */
+   apr_uint32_t      queue_waiters;     /*  # of queued requests.        */
+   apr_uint64_t      inuse_slots;       /*  # of slots in use.           */
+   apr_uint64_t      borrowed;          /*  # of borrowed slots.         */
+   apr_uint32_t      effective_limit;   /*  Adapted (or fixed) limit.    */
+   apr_uint32_t      latency_ewma;      /*  Service time EWMA (usecs).   */
+   VHC_burst_state   burst_state;       /*  Current burst state.         */
+   apr_time_t        grace_expires_at;  /*  Grace expiry (wall, 0=none). */
+   apr_time_t        burst_changed_at;  /*  Last state change (wall).    */
+   VHC_shm_stats_t   stats;             /*  Stats (sum of all shards).   */
+
+}  VHC_vhost_status_t, *VHC_vhost_status_t_p;
+
+
+/*  Structure definitions for a retired (pre-restart) slot table.  */
+typedef struct  vhc_retired_shm {
+   apr_shm_t      *shm;             /*  Old shm segment.               */
+   apr_uint16_t   *new_index;       /*  Old entry -> new entry index.  */
+   apr_uint64_t   *inuse_slots;     /*  Old entry slots (as migrated). */
+
+}  VHC_retired_shm_t, *VHC_retired_shm_t_p;
+
+
+/*  Structure definitions for state that survives (graceful) restarts.  */
+typedef struct  vhc_persistent_state {
+   apr_uint32_t          generation;     /*  # of config passes.       */
+   apr_shm_t            *shm;            /*  Current shm segment.      */
+   char                 *shm_file;       /*  Current shm file name.    */
+   apr_uint16_t          num_lock_stripes;   /*  # lock stripes.       */
+   char                **lockfiles;      /*  Lock stripe files.        */
+   apr_global_mutex_t  **locks;          /*  Lock stripes.             */
+   apr_array_header_t   *retired;        /*  VHC_retired_shm_t's still */
+                                         /*  used by old children.     */
+   apr_shm_t            *host_shm;       /*  Dynamic per-Host buckets. */
+   apr_shm_t            *lease_shm;      /*  Per-child slot leases.    */
+
+}  VHC_persistent_state_t, *VHC_persistent_state_t_p;
+
+
+/*  Structure definitions for the bandwidth output filter context.  */
+typedef struct  vhc_bandwidth_ctx {
+   VHC_server_config_t  *config;    /*  Vhost config.                  */
+   VHC_shm_data_t       *shmdata;   /*  Vhost shm data (byte budget).  */
+   apr_bucket_brigade   *pending;   /*  Not yet paced part of brigade. */
+
+}  VHC_bandwidth_ctx_t, *VHC_bandwidth_ctx_t_p;
+
+
+/*  Defines for the lease area header + child record sizes.  */
+#define  VHC_LEASE_HEADER_SIZE                                             \
+            VHC_CACHE_LINE_ROUNDUP(sizeof(VHC_lease_header_t) )
+#define  VHC_LEASE_CHILD_SIZE                                              \
+            VHC_CACHE_LINE_ROUNDUP(sizeof(VHC_lease_child_t) )
 
 /*  }}}  -- End section:typedefs.  */
 
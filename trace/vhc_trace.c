@@ -0,0 +1,383 @@
+/*  =======================================================================
+ *
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *
+ *  =======================================================================
+ *
+ *     File:  vhc_trace.c
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Offline decoder for the admission trace dumps - reads the
+ *            trace dumps of one or more children (files or the status
+ *            handler's ?trace output), merges them by time and prints the
+ *            events (or a per vhost summary).
+ *
+ */
+
+/*  section:compile {{{
+ *  +++++++++++++++
+ *     normal:  cc -O2 -I. -o vhc_trace trace/vhc_trace.c
+ *     usage:   ./vhc_trace [-c config-id] [-e event] [-s] dump ...
+ *
+ *  }}}  -- End section:compile.
+ */
+
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the standard header files we need.  */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  Include the trace (record + dump format) header.  */
+#include "vhc_trace.h"
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Defines for the decoder limits.  */
+#define  VHC_TRACE_MAX_RECORDS   (1 << 24)   /*  Per dump.               */
+#define  VHC_TRACE_MAX_CONFIGS   65536       /*  # of vhost config ids.  */
+#define  VHC_TRACE_ANY           -1          /*  No filter.              */
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:globals {{{  */
+/*  +++++++++++++++      */
+
+/*  Static global variables - visibility is restricted to this file.  */
+static const char          *gs_event_names[] = VHC_TRACE_EVENT_NAMES;
+
+static VHC_trace_record_t  *gs_records     = NULL;  /*  All the dumps.  */
+static size_t               gs_num_records = 0;
+
+/*  }}}  -- End section:globals.  */
+
+
+/*  section:functions {{{  */
+/*  +++++++++++++++++      */
+
+/**
+ *   @brief   Print the usage message and exit.
+ *   @param   prog  program name
+ *
+ */
+static void  vhc_usage_(const char *prog) {
+
+   fprintf(stderr, "Usage: %s [-c config-id] [-e event] [-s] dump ...\n"
+                   "   -c  only the events of this vhost config id\n"
+                   "   -e  only this event (admit, admit-burst, queued,\n"
+                   "       choke-slots, choke-rate, release, "
+                   "lock-timeout)\n"
+                   "   -s  per vhost event summary (not the events)\n",
+                   prog);
+   exit(EXIT_FAILURE);
+
+}  /*  End of function  vhc_usage_.  */
+
+
+
+/**
+ *   @brief   Look up an event type by name.
+ *   @param   name  event name
+ *   @return  the event type or VHC_TRACE_ANY if unknown.
+ *
+ */
+static int  vhc_get_event_(const char *name) {
+
+   int  event;
+
+   for (event = 0; event < VHC_TRACE_EVENT_MAX; event++)
+      if (0 == strcmp(name, gs_event_names[event]) )
+         return event;
+
+   return VHC_TRACE_ANY;
+
+}  /*  End of function  vhc_get_event_.  */
+
+
+
+/**
+ *   @brief   Read a trace dump and add its (valid) records.
+ *   @param   path  trace dump file ("-" for stdin)
+ *   @return  0 on success, -1 on failure.
+ *
+ *   Read a trace dump - the header and the ring - and add the records
+ *   that made it into the ring intact, oldest first. Records that were
+ *   being written (or got overwritten) when the ring was dumped don't
+ *   match their slot in the ring and are skipped.
+ *
+ */
+static int  vhc_read_dump_(const char *path) {
+
+   FILE                *fp;
+   VHC_trace_header_t   header;
+   VHC_trace_record_t  *ring;
+   VHC_trace_record_t  *record;
+   VHC_trace_record_t  *records;
+   uint32_t             mask;
+   uint32_t             n;
+   uint32_t             idx;
+
+   fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+   if (NULL == fp) {
+      perror(path);
+      return -1;
+   }
+
+   if ((1 != fread(&header, sizeof(header), 1, fp) )  ||
+       (VHC_TRACE_MAGIC != header.magic) ) {
+      fprintf(stderr, "%s: not a trace dump\n", path);
+      goto failed;
+   }
+
+   if ((VHC_TRACE_VERSION != header.version)  ||
+       (sizeof(VHC_trace_record_t) != header.record_size)  ||
+       (0 == header.num_records)  ||
+       (header.num_records > VHC_TRACE_MAX_RECORDS)  ||
+       (header.num_records & (header.num_records - 1) ) ) {
+      fprintf(stderr, "%s: unsupported trace dump (version %u)\n", path,
+                      header.version);
+      goto failed;
+   }
+
+   ring = calloc(header.num_records, sizeof(VHC_trace_record_t) );
+   records = realloc(gs_records, (gs_num_records + header.num_records) *
+                                 sizeof(VHC_trace_record_t) );
+   if ((NULL == ring)  ||  (NULL == records) ) {
+      fprintf(stderr, "%s: out of memory\n", path);
+      free(ring);
+      goto failed;
+   }
+
+   gs_records = records;
+
+   if (header.num_records != fread(ring, sizeof(VHC_trace_record_t),
+                                   header.num_records, fp) )
+      fprintf(stderr, "%s: truncated trace dump\n", path);
+
+   /*  Oldest record first - the one the next record would overwrite.  */
+   mask = header.num_records - 1;
+   for (n = 0; n < header.num_records; n++) {
+      idx = (header.next_seq + n) & mask;
+      record = &ring[idx];
+      if ((0 == record->seq)  ||  ((record->seq & mask) != idx)  ||
+          (record->event >= VHC_TRACE_EVENT_MAX) )
+         continue;   /*  Empty, torn or overwritten.  */
+
+      gs_records[gs_num_records++] = *record;
+   }
+
+   free(ring);
+
+   if (stdin != fp)
+      fclose(fp);
+
+   return 0;
+
+failed:
+   if (stdin != fp)
+      fclose(fp);
+
+   return -1;
+
+}  /*  End of function  vhc_read_dump_.  */
+
+
+
+/**
+ *   @brief   Compare two records by time (then pid + sequence #).
+ *   @param   a  record
+ *   @param   b  record
+ *   @return  < 0, 0 or > 0 (qsort).
+ *
+ */
+static int  vhc_compare_records_(const void *a, const void *b) {
+
+   const VHC_trace_record_t  *ra = (const VHC_trace_record_t *) a;
+   const VHC_trace_record_t  *rb = (const VHC_trace_record_t *) b;
+
+   if (ra->timestamp != rb->timestamp)
+      return (ra->timestamp < rb->timestamp) ? -1 : 1;
+
+   if (ra->pid != rb->pid)
+      return (ra->pid < rb->pid) ? -1 : 1;
+
+   return (ra->seq < rb->seq) ? -1 : (ra->seq > rb->seq);
+
+}  /*  End of function  vhc_compare_records_.  */
+
+
+
+/**
+ *   @brief   Print a record.
+ *   @param   record  trace record
+ *
+ */
+static void  vhc_print_record_(VHC_trace_record_t *record) {
+
+   time_t     secs = (time_t) (record->timestamp / 1000000);
+   struct tm  tm;
+   char       when[32];
+   char       config[16];
+
+   localtime_r(&secs, &tm);
+   strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+   if (VHC_TRACE_NO_CONFIG == record->config_id)
+      strcpy(config, "-");
+   else
+      snprintf(config, sizeof(config), "%u", record->config_id);
+
+   printf("%s.%06u  pid %-7u tid %08x  cfg %-5s %-12s slots %-6u "
+          "value %u\n", when, (unsigned) (record->timestamp % 1000000),
+          record->pid, record->tid, config, gs_event_names[record->event],
+          record->slots, record->value);
+
+}  /*  End of function  vhc_print_record_.  */
+
+
+
+/**
+ *   @brief   Print a per vhost summary of the events.
+ *   @param   config_id  only this vhost (or VHC_TRACE_ANY)
+ *
+ *   Print the # of events of each type per vhost config id - with the
+ *   max. slots in use and the average service time (releases).
+ *
+ */
+static void  vhc_print_summary_(int config_id) {
+
+   static uint64_t  counts[VHC_TRACE_MAX_CONFIGS][VHC_TRACE_EVENT_MAX];
+   static uint64_t  service_time[VHC_TRACE_MAX_CONFIGS];
+   static uint32_t  max_slots[VHC_TRACE_MAX_CONFIGS];
+   VHC_trace_record_t  *record;
+   size_t               n;
+   int                  id;
+   int                  event;
+
+   for (n = 0; n < gs_num_records; n++) {
+      record = &gs_records[n];
+      counts[record->config_id][record->event]++;
+      if (record->slots > max_slots[record->config_id])
+         max_slots[record->config_id] = record->slots;
+
+      if (VHC_TRACE_EVENT_RELEASE == record->event)
+         service_time[record->config_id] += record->value;
+   }
+
+   printf("%-6s", "cfg");
+   for (event = 1; event < VHC_TRACE_EVENT_MAX; event++)
+      printf(" %12s", gs_event_names[event]);
+
+   printf(" %9s %12s\n", "max-slots", "avg-svc(ms)");
+
+   for (id = 0; id < VHC_TRACE_MAX_CONFIGS; id++) {
+      if ((VHC_TRACE_ANY != config_id)  &&  (id != config_id) )
+         continue;
+
+      for (event = 1; event < VHC_TRACE_EVENT_MAX; event++)
+         if (counts[id][event] > 0)
+            break;
+
+      if (VHC_TRACE_EVENT_MAX == event)
+         continue;   /*  No events.  */
+
+      if (VHC_TRACE_NO_CONFIG == id)
+         printf("%-6s", "-");
+      else
+         printf("%-6d", id);
+
+      for (event = 1; event < VHC_TRACE_EVENT_MAX; event++)
+         printf(" %12" PRIu64, counts[id][event]);
+
+      printf(" %9u %12.3f\n", max_slots[id],
+             counts[id][VHC_TRACE_EVENT_RELEASE] ?
+                (double) service_time[id] / 1000.0 /
+                   counts[id][VHC_TRACE_EVENT_RELEASE] : 0.0);
+   }
+
+}  /*  End of function  vhc_print_summary_.  */
+
+
+
+/**
+ *   @brief   main - decode the trace dumps.
+ *   @param   argc  # of args
+ *   @param   argv  args
+ *   @return  exit code.
+ *
+ */
+int  main(int argc, char **argv) {
+
+   int     config_id = VHC_TRACE_ANY;
+   int     event = VHC_TRACE_ANY;
+   int     summary = 0;
+   int     failed = 0;
+   int     opt;
+   size_t  n;
+
+   while (-1 != (opt = getopt(argc, argv, "c:e:s") ) ) {
+      switch (opt) {
+         case 'c':  config_id = atoi(optarg);  break;
+         case 's':  summary = 1;               break;
+         case 'e':
+            event = vhc_get_event_(optarg);
+            if (VHC_TRACE_ANY == event)
+               vhc_usage_(argv[0]);
+            break;
+
+         default:   vhc_usage_(argv[0]);
+      }
+   }
+
+   if (optind >= argc)
+      vhc_usage_(argv[0]);
+
+   for (; optind < argc; optind++)
+      if (0 != vhc_read_dump_(argv[optind]) )
+         failed = 1;
+
+   qsort(gs_records, gs_num_records, sizeof(VHC_trace_record_t),
+         vhc_compare_records_);
+
+   if (summary)
+      vhc_print_summary_(config_id);
+   else {
+      for (n = 0; n < gs_num_records; n++) {
+         if ((VHC_TRACE_ANY != config_id)  &&
+             (gs_records[n].config_id != config_id) )
+            continue;
+
+         if ((VHC_TRACE_ANY != event)  &&  (gs_records[n].event != event) )
+            continue;
+
+         vhc_print_record_(&gs_records[n]);
+      }
+   }
+
+   free(gs_records);
+
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+}  /*  End of function  main.  */
+
+/*  }}}  -- End section:functions.  */
+
+
+
+/**
+ *  EOF
+ */
@@ -0,0 +1,1225 @@
+/*  =======================================================================
+ * 
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *  
+ *  =======================================================================
+ *
+ *     File:  vhc_engine.c
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Admission engine - the shm slot table and the slot accounting
+ *            (capacity, bursts, request rates, adaptive limits and the
+ *            capacity pool) behind the choke module. Only needs APR.
+ *
+ */
+
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the engine header file.  */
+#include "vhc_engine.h"
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Define for logging debug messages (if there's a debug hook).  */
+#define  VHC_DEBUG   if (NULL != vhc_debug_out_)
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:globals {{{  */
+/*  +++++++++++++++      */
+
+/*  Debug message hook - the module sets it when debugging is on.  */
+void  (*vhc_debug_out_)(apr_pool_t *pool, char *fmt, ...) = NULL;
+
+/*  }}}  -- End section:globals.  */
+
+
+/*  section:engine-functions {{{  */
+/*  ++++++++++++++++++++++++      */
+
+/*  ===================================================================  */
+/*  @@@@@  Time + locking.                                               */
+/*  ===================================================================  */
+
+
+/**
+ *   @brief   Returns the current monotonic time.
+ *   @return  monotonic time in microseconds.
+ *
+ *   Returns the current monotonic time (system-wide, so the same across
+ *   processes). Falls back to the wall clock if there's no monotonic one.
+ *
+ */
+apr_time_t  vhc_monotonic_now_(void) {
+
+#if defined(CLOCK_MONOTONIC)
+   struct timespec  ts;
+
+   if (0 == clock_gettime(CLOCK_MONOTONIC, &ts) )
+      return apr_time_from_sec(ts.tv_sec) + (ts.tv_nsec / 1000);
+#endif  /*  defined(CLOCK_MONOTONIC).  */
+
+   return apr_time_now();
+
+}  /*  End of function  vhc_monotonic_now_.  */
+
+
+
+/**
+ *   @brief   Try and acquire the global lock within the specified timeout
+ *            period (in microseconds).
+ *   @param   lock           the lock
+ *   @param   timeout_usecs  timeout
+ *   @return  APR_SUCCESS on success, otherwise errors.
+ *
+ *   Try and acquire a global lock - timing out if we are unable to acquire
+ *   it within the specified time. Waiters block (queue) on the lock and
+ *   get woken up as soon as it is released. We only fall back to polling
+ *   when the APR lock mechanism has no timed lock support.
+ *
+ */
+int  vhc_lock_acquire_(apr_global_mutex_t *lock,
+                       apr_interval_time_t timeout_usecs) {
+
+   apr_status_t         status;
+   apr_time_t           end_time;
+   apr_time_t           now;
+   apr_interval_time_t  sleep_usecs = VHC_TRYLOCK_MIN_SLEEP_USECS;
+
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: Acquiring lock", VHC_LOC);
+
+#if APR_VERSION_AT_LEAST(1, 6, 0)
+   /*  Blocking timed acquire.  */
+   status = apr_global_mutex_timedlock(lock, timeout_usecs);
+   if (APR_STATUS_IS_TIMEUP(status) ) {
+      VHC_DEBUG  vhc_debug_out_(NULL, "%s: Lock acquisition timed out",
+                                      VHC_LOC);
+      return ETIMEDOUT;
+   }
+
+   if (!APR_STATUS_IS_ENOTIMPL(status) )
+      return status;
+
+   /*  No timed lock support for this lock mechanism - poll for it.  */
+#endif  /*  APR_VERSION_AT_LEAST(1, 6, 0)  */
+
+   end_time = apr_time_now() + timeout_usecs;
+
+   while ((now = apr_time_now() ) < end_time) {
+      status = apr_global_mutex_trylock(lock);
+      if (VHC_APR_STATUS_IS_SUCCESS(status) )
+         return status;
+      else if (APR_STATUS_IS_ENOTIMPL(status) )
+         return apr_global_mutex_lock(lock);  /*  No trylock support,  */
+                                              /*  so just wait.        */
+
+      /*  Need to retry - back off upto 5ms blocks (never past timeout).  */
+      if (sleep_usecs > (end_time - now) )
+         sleep_usecs = end_time - now;
+
+      VHC_DEBUG  vhc_debug_out_(NULL, "%s: Retry lock acquire in %d usecs",
+                                      VHC_LOC, (int) sleep_usecs);
+      apr_sleep(sleep_usecs);
+
+      sleep_usecs *= 2;
+      if (sleep_usecs > VHC_TRYLOCK_SLEEP_TIME_USECS)
+         sleep_usecs = VHC_TRYLOCK_SLEEP_TIME_USECS;
+
+   }  /*  End of  while not timed out.  */
+
+
+   /*  Got here, means we timed out - so return ETIMEDOUT.  */
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: Lock acquisition timed out",
+                                   VHC_LOC);
+
+   return ETIMEDOUT;
+
+}  /*  End of function  vhc_lock_acquire_.  */
+
+
+
+/**
+ *   @brief   Release a previously acquired global lock.
+ *   @param   lock           the lock
+ *   @return  APR_SUCCESS on success, otherwise errors.
+ *
+ *   Release a previously acquired global lock.
+ *
+ */
+int  vhc_lock_release_(apr_global_mutex_t *lock) {
+
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: Releasing lock", VHC_LOC);
+
+   return  apr_global_mutex_unlock(lock); 
+
+}  /*  End of function  vhc_lock_release_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Slot table layout.                                            */
+/*  ===================================================================  */
+
+
+/**
+ *   @brief   Returns the size of a slot table.
+ *   @param   num_entries  # of vhost entries
+ *   @return  the slot table size (in bytes).
+ *
+ *   Returns the size of a slot table - the table header + cache line
+ *   padded entries for every vhost followed by the (cache line padded)
+ *   stats shards of every vhost.
+ *
+ */
+apr_size_t  vhc_get_table_size_(apr_uint16_t num_entries) {
+
+   return VHC_SHM_HEADER_SIZE +
+          (apr_size_t) num_entries * VHC_SHM_ENTRY_STRIDE +
+          (apr_size_t) num_entries * VHC_STATS_SHARDS * VHC_SHM_STATS_STRIDE;
+
+}  /*  End of function  vhc_get_table_size_.  */
+
+
+
+/**
+ *   @brief   Initialize a slot table.
+ *   @param   baseaddr     table memory (vhc_get_table_size_ bytes)
+ *   @param   num_entries  # of vhost entries
+ *   @return  the slot table header.
+ *
+ *   Initialize a slot table - all entries free, and the header stamped
+ *   with the layout so that readers can validate it.
+ *
+ */
+VHC_shm_header_t  *vhc_init_table_(void *baseaddr,
+                                   apr_uint16_t num_entries) {
+   VHC_shm_header_t  *header = (VHC_shm_header_t *) baseaddr;
+
+   /*  Sad. bzero got deprecated - use memset to initialize shm.   */
+   memset(baseaddr, 0, vhc_get_table_size_(num_entries) );
+
+   header->num_entries  = num_entries;
+   header->entry_stride = (apr_uint32_t) VHC_SHM_ENTRY_STRIDE;
+   header->stats_offset = (apr_uint32_t) (VHC_SHM_HEADER_SIZE +
+                                          (apr_size_t) num_entries *
+                                             VHC_SHM_ENTRY_STRIDE);
+   header->stats_shards = VHC_STATS_SHARDS;
+   header->stats_stride = (apr_uint32_t) VHC_SHM_STATS_STRIDE;
+   header->version      = VHC_SHM_TABLE_VERSION;
+   header->magic        = VHC_SHM_TABLE_MAGIC;
+
+   return header;
+
+}  /*  End of function  vhc_init_table_.  */
+
+
+
+/**
+ *   @brief   Returns the slot table header at an address.
+ *   @param   baseaddr  table memory
+ *   @return  the slot table header, NULL if the memory doesn't have our
+ *            (current) slot table layout.
+ *
+ *   Returns the slot table header at an address - after checking it
+ *   really is our slot table.
+ *
+ */
+VHC_shm_header_t  *vhc_get_table_header_(void *baseaddr) {
+   VHC_shm_header_t  *header = (VHC_shm_header_t *) baseaddr;
+
+   if ((NULL == header)  ||  (VHC_SHM_TABLE_MAGIC != header->magic)  ||
+       (VHC_SHM_TABLE_VERSION != header->version) )
+      return NULL;
+
+   return header;
+
+}  /*  End of function  vhc_get_table_header_.  */
+
+
+
+/**
+ *   @brief   Returns a slot table entry.
+ *   @param   header     slot table header
+ *   @param   shm_index  slot table index
+ *   @return  the slot table entry, NULL if the index is out of range.
+ *
+ *   Returns a slot table entry (the shm data for a vhost).
+ *
+ */
+VHC_shm_data_t  *vhc_get_shm_entry_(VHC_shm_header_t *header,
+                                    apr_uint16_t shm_index) {
+
+   if ((NULL == header)  ||  (shm_index >= header->num_entries) )
+      return NULL;
+
+   return (VHC_shm_data_t *) ((char *) header + VHC_SHM_HEADER_SIZE +
+                              header->entry_stride * shm_index);
+
+}  /*  End of function  vhc_get_shm_entry_.  */
+
+
+
+/**
+ *   @brief   Returns a stats shard of a slot table entry.
+ *   @param   header     slot table header
+ *   @param   shm_index  slot table index
+ *   @param   shard      stats shard
+ *   @return  the stats shard, NULL if the index is out of range.
+ *
+ *   Returns a stats shard of a slot table entry - the shards of each
+ *   entry are laid out one after the other.
+ *
+ */
+VHC_shm_stats_t  *vhc_get_shm_stats_(VHC_shm_header_t *header,
+                                     apr_uint16_t shm_index,
+                                     apr_uint32_t shard) {
+
+   if ((NULL == header)  ||  (shm_index >= header->num_entries) )
+      return NULL;
+
+   return (VHC_shm_stats_t *) ((char *) header + header->stats_offset +
+                               header->stats_stride *
+                                 (shm_index * header->stats_shards + shard) );
+
+}  /*  End of function  vhc_get_shm_stats_.  */
+
+
+
+/**
+ *   @brief   Sums up all the stats shards of a slot table entry.
+ *   @param   header     slot table header
+ *   @param   shm_index  slot table index
+ *   @param   sum        the summed up stats (returned back)
+ *
+ *   Sums up all the stats shards of a slot table entry - the counters are
+ *   only ever added to, so reading them without a lock is fine.
+ *
+ */
+void  vhc_sum_vhost_stats_(VHC_shm_header_t *header,
+                           apr_uint16_t shm_index,
+                           VHC_shm_stats_t *sum) {
+   VHC_shm_stats_t   *stats;
+   apr_uint32_t       shard;
+
+   memset(sum, 0, sizeof(VHC_shm_stats_t) );
+
+   stats = vhc_get_shm_stats_(header, shm_index, 0);
+   if (NULL == stats)
+      return;
+
+   for (shard = 0; shard < header->stats_shards; shard++) {
+      sum->admitted         += VHC_ATOMIC_LOAD(&stats->admitted);
+      sum->burst_admitted   += VHC_ATOMIC_LOAD(&stats->burst_admitted);
+      sum->borrow_admitted  += VHC_ATOMIC_LOAD(&stats->borrow_admitted);
+      sum->bursts           += VHC_ATOMIC_LOAD(&stats->bursts);
+      sum->choked_no_slots  += VHC_ATOMIC_LOAD(&stats->choked_no_slots);
+      sum->choked_no_tokens += VHC_ATOMIC_LOAD(&stats->choked_no_tokens);
+      sum->lock_timeouts    += VHC_ATOMIC_LOAD(&stats->lock_timeouts);
+      sum->lock_wait_usecs  += VHC_ATOMIC_LOAD(&stats->lock_wait_usecs);
+
+      stats = (VHC_shm_stats_t *) ((char *) stats + header->stats_stride);
+   }
+
+}  /*  End of function  vhc_sum_vhost_stats_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Burst state + slot limits.                                    */
+/*  ===================================================================  */
+
+
+/**
+  *   @brief   Get the burst state of a virtual host.
+  *   @param   config        vhost config record
+  *   @param   shmdata       vhost shm data
+  *   @param   current_time  current (monotonic) time
+  *   @param   changed_at    when the vhost got into this state (returned)
+  *   @return  the vhost's burst state.
+  *
+  *   Get the burst state of a virtual host - it follows from when the
+  *   last burst (grace period) expires: bursting until then, cooling down
+  *   for the flap period after that and back to normal after that.
+  *
+  */
+VHC_burst_state  vhc_get_burst_state_(VHC_server_config_t *config,
+                                      VHC_shm_data_t *shmdata,
+                                      apr_time_t current_time,
+                                      apr_time_t *changed_at) {
+
+   apr_time_t  grace_expires_at = VHC_ATOMIC_LOAD(&shmdata->grace_expires_at);
+   apr_time_t  grace_secs;
+   apr_time_t  cooldown_expires_at;
+
+   grace_secs = apr_time_from_sec(config->burst_settings.grace_period);
+
+   cooldown_expires_at = grace_expires_at +
+                         apr_time_from_sec(config->burst_settings.flap_period);
+
+   *changed_at = VHC_ATOMIC_LOAD(&shmdata->burst_changed_at);
+
+   if (0 == grace_expires_at)
+      return VHC_BURST_STATE_NORMAL;   /*  Never burst.  */
+
+   if (grace_expires_at > current_time) {
+      if (*changed_at < (grace_expires_at - grace_secs) )
+         *changed_at = grace_expires_at - grace_secs;
+
+      return VHC_BURST_STATE_BURSTING;
+   }
+
+   if (cooldown_expires_at > current_time) {
+      if (*changed_at < grace_expires_at)
+         *changed_at = grace_expires_at;
+
+      return VHC_BURST_STATE_COOLDOWN;
+   }
+
+   if (*changed_at < cooldown_expires_at)
+      *changed_at = cooldown_expires_at;
+
+   return VHC_BURST_STATE_NORMAL;
+
+}  /*  End of function  vhc_get_burst_state_.  */
+
+
+
+/**
+  *   @brief   Record the burst state (transitions) of a virtual host.
+  *   @param   config        vhost config record
+  *   @param   shmdata       vhost shm data
+  *   @param   current_time  current (monotonic) time
+  *
+  *   Record the burst state of a virtual host in its shm data (for
+  *   monitoring) - along with when it changed. Bursts expire with time,
+  *   so the exits get recorded by the first request to notice them.
+  *
+  */
+void  vhc_record_burst_state_(VHC_server_config_t *config,
+                              VHC_shm_data_t *shmdata,
+                              apr_time_t current_time) {
+
+   VHC_burst_state  state;
+   apr_uint32_t     recorded;
+   apr_time_t       changed_at;
+
+   state = vhc_get_burst_state_(config, shmdata, current_time, &changed_at);
+   recorded = VHC_ATOMIC_LOAD(&shmdata->burst_state);
+
+   /*  Only the one that flips the state records when it changed.  */
+   if ((recorded != (apr_uint32_t) state)  &&
+       VHC_ATOMIC_CAS(&shmdata->burst_state, &recorded,
+                      (apr_uint32_t) state) ) {
+      VHC_ATOMIC_STORE(&shmdata->burst_changed_at, changed_at);
+
+      VHC_DEBUG  vhc_debug_out_(NULL, "%s: burst state %d -> %d",
+                                      VHC_LOC, (int) recorded, (int) state);
+   }
+
+}  /*  End of function  vhc_record_burst_state_.  */
+
+
+
+/**
+  *   @brief   Returns the vhost's slot limit in fixed point.
+  *   @param   config   vhost config record
+  *   @param   adapted  adapted slot limit (from shm - 0 = not adapted)
+  *   @return  the slot limit (in 1/VHC_ADAPTIVE_FP_ONE slots).
+  *
+  *   Returns the vhost's (adapted) slot limit in fixed point - the
+  *   configured slot limit (within the adaptive bounds) until the first
+  *   request completes.
+  *
+  */
+apr_uint32_t  vhc_get_slot_limit_fp_(VHC_server_config_t *config,
+                                     apr_uint32_t adapted) {
+   apr_uint32_t  limit;
+
+   if (0 == config->adaptive_settings.max)
+      return (apr_uint32_t) config->slot_limit * VHC_ADAPTIVE_FP_ONE;
+
+   if (adapted > 0)
+      return adapted;
+
+   limit = config->slot_limit;
+   if (limit < config->adaptive_settings.min)
+      limit = config->adaptive_settings.min;
+   else if (limit > config->adaptive_settings.max)
+      limit = config->adaptive_settings.max;
+
+   return limit * VHC_ADAPTIVE_FP_ONE;
+
+}  /*  End of function  vhc_get_slot_limit_fp_.  */
+
+
+
+/**
+  *   @brief   Returns the vhost's effective slot limit.
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @return  the effective slot limit.
+  *
+  *   Returns the vhost's effective slot limit - the adapted limit in
+  *   adaptive mode, otherwise the configured slot limit.
+  *
+  */
+apr_uint32_t  vhc_get_slot_limit_(VHC_server_config_t *config,
+                                  VHC_shm_data_t *shmdata) {
+
+   if (0 == config->adaptive_settings.max)
+      return config->slot_limit;   /*  Fixed slot limit.  */
+
+   return vhc_get_slot_limit_fp_(config,
+                                 VHC_ATOMIC_LOAD(&shmdata->adaptive_limit) ) /
+          VHC_ADAPTIVE_FP_ONE;
+
+}  /*  End of function  vhc_get_slot_limit_.  */
+
+
+
+/**
+  *   @brief   Record a request's service time in the vhost's EWMA.
+  *   @param   shmdata       vhost shm data
+  *   @param   service_time  time from admission to release
+  *   @return  the updated service time EWMA (usecs).
+  *
+  *   Record the service time of a request that just finished in the
+  *   vhost's service time EWMA (the first sample seeds it) - it drives the
+  *   adaptive slot limit and the Retry-After hints of choked requests.
+  *
+  */
+apr_uint32_t  vhc_record_service_time_(VHC_shm_data_t *shmdata,
+                                       apr_interval_time_t service_time) {
+   apr_uint32_t  sample;
+   apr_uint32_t  ewma;
+   apr_uint32_t  new_ewma;
+
+   sample = (service_time < 0) ? 0 :
+            (service_time > (apr_interval_time_t) 0xFFFFFFFF) ? 0xFFFFFFFF :
+            (apr_uint32_t) service_time;
+
+   ewma = VHC_ATOMIC_LOAD(&shmdata->latency_ewma);
+   do {
+      new_ewma = (0 == ewma) ? sample :
+         (apr_uint32_t) ((apr_int64_t) ewma +
+                         ((apr_int64_t) sample - ewma) /
+                            VHC_ADAPTIVE_EWMA_WEIGHT);
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->latency_ewma, &ewma, new_ewma) );
+
+   return new_ewma;
+
+}  /*  End of function  vhc_record_service_time_.  */
+
+
+
+/**
+  *   @brief   Adapt the vhost's slot limit to a request's service time.
+  *   @param   config        vhost config record
+  *   @param   shmdata       vhost shm data
+  *   @param   service_time  time from admission to release
+  *   @param   inflight      # of slots in use when the request finished
+  *
+  *   Adapt the vhost's slot limit (AIMD) to the service time of a request
+  *   that just finished. The service time feeds an EWMA (recorded for all
+  *   the vhosts) - while it is over the target latency, the limit backs
+  *   off to 90% (at most once per EWMA period, so a slow spell isn't
+  *   counted over and over). Otherwise a busy vhost (over half its limit
+  *   in use) grows its limit by 1/limit per request - about a slot per
+  *   limit's worth of requests.
+  *
+  */
+void  vhc_adapt_slot_limit_(VHC_server_config_t *config,
+                            VHC_shm_data_t *shmdata,
+                            apr_interval_time_t service_time,
+                            apr_uint64_t inflight) {
+   apr_uint32_t  min_fp = (apr_uint32_t) config->adaptive_settings.min *
+                          VHC_ADAPTIVE_FP_ONE;
+   apr_uint32_t  max_fp = (apr_uint32_t) config->adaptive_settings.max *
+                          VHC_ADAPTIVE_FP_ONE;
+   apr_uint32_t  new_ewma;
+   apr_uint32_t  adapted;
+   apr_uint32_t  limit;
+   apr_uint32_t  new_limit;
+   apr_time_t    current_time;
+   apr_time_t    decreased_at;
+
+   /*  Service time EWMA - kept even for a fixed slot limit.  */
+   new_ewma = vhc_record_service_time_(shmdata, service_time);
+
+   if (0 == config->adaptive_settings.max)
+      return;   /*  Fixed slot limit.  */
+
+   adapted = VHC_ATOMIC_LOAD(&shmdata->adaptive_limit);
+
+   if (new_ewma > config->adaptive_settings.target_latency) {
+      /*  Too slow - multiplicative decrease (one request does it).  */
+      current_time = vhc_monotonic_now_();
+      decreased_at = VHC_ATOMIC_LOAD(&shmdata->decreased_at);
+      if ((current_time - decreased_at < (apr_time_t) new_ewma)  ||
+          !VHC_ATOMIC_CAS(&shmdata->decreased_at, &decreased_at,
+                          current_time) )
+         return;
+
+      do {
+         limit = vhc_get_slot_limit_fp_(config, adapted);
+         new_limit = (apr_uint32_t) ((apr_uint64_t) limit *
+                                     VHC_ADAPTIVE_DECREASE_PERCENT / 100);
+         if (new_limit < min_fp)
+            new_limit = min_fp;
+
+      } while (!VHC_ATOMIC_CAS(&shmdata->adaptive_limit, &adapted,
+                               new_limit) );
+
+      VHC_DEBUG  vhc_debug_out_(NULL, "%s: latency %d > %d usecs, limit "
+                                      "down to %d", VHC_LOC, (int) new_ewma,
+                                      (int) config->adaptive_settings.
+                                               target_latency,
+                                      (int) (new_limit /
+                                             VHC_ADAPTIVE_FP_ONE) );
+      return;
+   }
+
+   /*  Fast enough - additive increase, but only if we need the room.  */
+   do {
+      limit = vhc_get_slot_limit_fp_(config, adapted);
+      if (inflight * 2 * VHC_ADAPTIVE_FP_ONE < limit)
+         return;
+
+      /*  +1 slot per limit's worth of requests (never a 0 step).  */
+      new_limit = limit + (apr_uint32_t)
+                     ((apr_uint64_t) VHC_ADAPTIVE_FP_ONE *
+                      VHC_ADAPTIVE_FP_ONE / limit);
+      if (new_limit > max_fp)
+         new_limit = max_fp;
+
+      if (new_limit == adapted)
+         return;
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->adaptive_limit, &adapted,
+                            new_limit) );
+
+}  /*  End of function  vhc_adapt_slot_limit_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Capacity pool.                                                */
+/*  ===================================================================  */
+
+
+/**
+  *   @brief   Borrow a slot from the global capacity pool.
+  *   @param   header   slot table header (with the pool)
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @param   stats    vhost stats shard (or NULL)
+  *   @return  1 if a slot was borrowed, 0 otherwise.
+  *
+  *   Borrow a slot from the global capacity pool for a vhost that is out
+  *   of slots (and burst slots). Slots the vhosts don't use within their
+  *   own slot limits are lent out in proportion to the weights of the
+  *   vhosts that are borrowing - so a lone borrower can use all of them.
+  *   Requests within a slot limit never wait on the pool: they take their
+  *   slot even if that overcommits it, which stops all lending until the
+  *   borrowed slots are returned (released slots repay loans first).
+  *
+  */
+int  vhc_borrow_pool_slot_(VHC_shm_header_t *header,
+                           VHC_server_config_t *config,
+                           VHC_shm_data_t *shmdata,
+                           VHC_shm_stats_t *stats) {
+   apr_uint64_t  capacity;
+   apr_uint64_t  inuse_slots;
+   apr_uint64_t  guaranteed;
+   apr_uint64_t  borrowed;
+   apr_uint64_t  share;
+   apr_int64_t   weight;
+   apr_int64_t   counted = 0;
+
+   if ((NULL == header)  ||  (0 == (capacity = header->pool.capacity) ) )
+      return 0;
+
+   /*  Take a slot out of the pool - unless it's all in use.  */
+   inuse_slots = VHC_ATOMIC_LOAD(&header->pool.inuse_slots);
+   do {
+      if (inuse_slots >= capacity)
+         return 0;
+
+   } while (!VHC_ATOMIC_CAS(&header->pool.inuse_slots, &inuse_slots,
+                            inuse_slots + 1) );
+
+   /*  Our weighted share of the slots not used within slot limits.  */
+   guaranteed = inuse_slots - VHC_ATOMIC_LOAD(&header->pool.borrowed);
+   if (guaranteed > inuse_slots)
+      guaranteed = 0;   /*  Raced with a release.  */
+
+   borrowed = VHC_ATOMIC_LOAD(&shmdata->borrowed);
+   do {
+      /*  A first loan counts our weight in before the loan shows - so a  */
+      /*  release that repays it always has the weight to take out. The   */
+      /*  weight comes back out if someone else got the first loan.      */
+      if ((0 == borrowed)  &&  (0 == counted) ) {
+         counted = config->weight;
+         VHC_ATOMIC_STORE(&shmdata->borrow_weight, config->weight);
+         VHC_ATOMIC_ADD(&header->pool.borrow_weight, counted);
+      }
+      else if ((0 != borrowed)  &&  (0 != counted) ) {
+         VHC_ATOMIC_ADD(&header->pool.borrow_weight, -counted);
+         counted = 0;
+      }
+
+      weight = VHC_ATOMIC_LOAD(&header->pool.borrow_weight);
+      if (weight < config->weight)
+         weight = config->weight;
+
+      share = ((capacity - guaranteed) * config->weight + weight - 1) /
+              (apr_uint64_t) weight;
+      if (borrowed >= share) {
+         if (0 != counted)
+            VHC_ATOMIC_ADD(&header->pool.borrow_weight, -counted);
+
+         VHC_ATOMIC_ADD(&header->pool.inuse_slots, -1);
+         return 0;
+      }
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->borrowed, &borrowed, borrowed + 1) );
+
+   VHC_ATOMIC_ADD(&header->pool.borrowed, 1);
+
+   if (NULL != stats)
+      VHC_ATOMIC_INC_RELAXED(&stats->borrow_admitted, 1);
+
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: borrowed slot %d/%d", VHC_LOC,
+                                   (int) borrowed + 1, (int) share);
+
+   return 1;
+
+}  /*  End of function  vhc_borrow_pool_slot_.  */
+
+
+
+/**
+  *   @brief   Return released slots to the global capacity pool.
+  *   @param   header   slot table header (with the pool)
+  *   @param   shmdata  vhost shm data the slots were released from
+  *   @param   nslots   # of slots released
+  *
+  *   Return released slots to the global capacity pool - they repay the
+  *   vhost's loans first, so a borrower gives back its borrowed slots as
+  *   soon as its requests finish.
+  *
+  */
+void  vhc_return_pool_slots_(VHC_shm_header_t *header,
+                             VHC_shm_data_t *shmdata,
+                             apr_uint64_t nslots) {
+   apr_uint64_t  borrowed;
+   apr_uint64_t  repaid;
+   apr_uint64_t  inuse_slots;
+
+   if ((NULL == header)  ||  (0 == header->pool.capacity)  ||
+       (0 == nslots) )
+      return;
+
+   borrowed = VHC_ATOMIC_LOAD(&shmdata->borrowed);
+   do {
+      repaid = (borrowed > nslots) ? nslots : borrowed;
+      if (0 == repaid)
+         break;
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->borrowed, &borrowed,
+                            borrowed - repaid) );
+
+   if (repaid > 0) {
+      VHC_ATOMIC_ADD(&header->pool.borrowed, -repaid);
+      if (repaid == borrowed)
+         VHC_ATOMIC_ADD(&header->pool.borrow_weight,
+                        -(apr_int64_t) VHC_ATOMIC_LOAD(
+                                          &shmdata->borrow_weight) );
+   }
+
+   inuse_slots = VHC_ATOMIC_LOAD(&header->pool.inuse_slots);
+   do {
+      if (0 == inuse_slots)
+         return;
+
+   } while (!VHC_ATOMIC_CAS(&header->pool.inuse_slots, &inuse_slots,
+                            inuse_slots -
+                               ((inuse_slots > nslots) ? nslots
+                                                       : inuse_slots) ) );
+
+}  /*  End of function  vhc_return_pool_slots_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Admission + release.                                          */
+/*  ===================================================================  */
+
+
+/**
+  *   @brief   Check if the virtual host has capacity.
+  *   @param   config       vhost config record
+  *   @param   shmdata      vhost shm data
+  *   @param   inuse_slots  # of slots in use (as last read from shm)
+  *   @param   stats        vhost stats shard (or NULL)
+  *   @return  APR_SUCCESS if host has capacity, otherwise errors.
+  *
+  *   Check if a virtual host has capacity (slots available or can
+  *   burst to free additional slots). A burst is started by atomically
+  *   moving the grace expiry forward - so only one request starts it and
+  *   a vhost can't burst again until it has cooled down (flap period).
+  *
+  */
+int  vhc_check_vhost_capacity_(VHC_server_config_t *config,
+                               VHC_shm_data_t *shmdata,
+                               apr_uint64_t inuse_slots,
+                               VHC_shm_stats_t *stats) {
+
+   apr_time_t        current_time;
+   apr_uint32_t      slot_limit = vhc_get_slot_limit_(config, shmdata);
+   apr_uint32_t      burst_slots;
+   apr_time_t        grace_expires_at;
+   apr_time_t        changed_at;
+   VHC_burst_state   state;
+
+
+   /*  Check that we have enough slots for this vhost.  */
+   if (inuse_slots < slot_limit)
+      return APR_SUCCESS;  /*  Optimized case all's good.  */
+
+   /*  Ok - at or beyond slot limit - check if within grace period.  */
+   burst_slots = ceil(slot_limit * config->burst_settings.percent / 100.0);
+   if ((0 == burst_slots)  ||  (0 == config->burst_settings.grace_period)  ||
+       (inuse_slots >= (apr_uint64_t) slot_limit + burst_slots) )
+      return VHC_CHOKED_NO_SLOTS;  /*  Choked!!  */
+
+
+   /*  Check where the vhost is in its burst cycle.  */
+   current_time = vhc_monotonic_now_();
+   vhc_record_burst_state_(config, shmdata, current_time);
+
+   state = vhc_get_burst_state_(config, shmdata, current_time, &changed_at);
+   if (VHC_BURST_STATE_BURSTING == state)
+      return APR_SUCCESS;  /*  Still within the grace period.  */
+
+   if (VHC_BURST_STATE_COOLDOWN == state)
+      return VHC_CHOKED_NO_SLOTS;  /*  Cooling down - no bursting.  */
+
+
+   /*  Normal - start a burst (only one of the racing requests does).  */
+   grace_expires_at = VHC_ATOMIC_LOAD(&shmdata->grace_expires_at);
+   if (!VHC_ATOMIC_CAS(&shmdata->grace_expires_at, &grace_expires_at,
+                       current_time +
+                          apr_time_from_sec(
+                             config->burst_settings.grace_period) ) ) {
+      /*  Lost the race - admit if someone else started the burst.  */
+      return (grace_expires_at > current_time) ? APR_SUCCESS :
+                                                 VHC_CHOKED_NO_SLOTS;
+   }
+
+   vhc_record_burst_state_(config, shmdata, current_time);
+
+   if (NULL != stats)
+      VHC_ATOMIC_INC_RELAXED(&stats->bursts, 1);
+
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: burst started for %d secs",
+                                   VHC_LOC,
+                                   (int) config->burst_settings.grace_period);
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_check_vhost_capacity_.  */
+
+
+
+/**
+  *   @brief   Check if the virtual host is within its request rate.
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @return  APR_SUCCESS if a token was available, otherwise errors.
+  *
+  *   Check (and take a token from) the vhost's request rate token bucket.
+  *   The bucket is kept as a single theoretical arrival time (GCRA) - it
+  *   refills lazily based on the monotonic clock, so there's no timer and
+  *   the update is one compare-and-swap.
+  *
+  */
+int  vhc_check_vhost_rate_(VHC_server_config_t *config,
+                           VHC_shm_data_t *shmdata) {
+
+   apr_time_t  interval = (apr_time_t) config->rate_settings.interval;
+   apr_time_t  bucket;
+   apr_time_t  current_time;
+   apr_time_t  tat;
+   apr_time_t  new_tat;
+
+   /*  No rate limit - nothing to check.  */
+   if (0 == interval)
+      return APR_SUCCESS;
+
+   bucket = interval * config->rate_settings.burst;
+   current_time = vhc_monotonic_now_();
+   tat = VHC_ATOMIC_LOAD(&shmdata->rate_tat);
+
+   do {
+      /*  Empty bucket refills by current time - tat (in tokens).  */
+      new_tat = ((tat > current_time) ? tat : current_time) + interval;
+      if ((new_tat - current_time) > bucket)
+         return VHC_CHOKED_NO_TOKENS;  /*  Out of tokens.  */
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->rate_tat, &tat, new_tat) );
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_check_vhost_rate_.  */
+
+
+
+/**
+  *   @brief   Claim a slot (+ extra slots for a slot block) for a request
+  *            if the virtual host has capacity.
+  *   @param   header   slot table header (with the pool)
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @param   stats    vhost stats shard (or NULL)
+  *   @param   wanted   extra slots wanted for a slot block
+  *   @param   nslots   # of slots in use (returned back)
+  *   @param   nextra   extra slots granted (returned back)
+  *   @return  APR_SUCCESS if a slot was granted, otherwise errors.
+  *
+  *   Claim a slot for a request. The capacity check + increment is a
+  *   compare-and-swap loop on the inuse slot counter, so no lock is
+  *   needed with atomics. In mutex mode, the caller holds the vhost's
+  *   lock and the CAS always succeeds on the first go. Vhosts out of
+  *   slots borrow one from the capacity pool. Extra slots are only
+  *   granted when the vhost is well within its slot limit.
+  *
+  */
+int  vhc_claim_vhost_slots_(VHC_shm_header_t *header,
+                            VHC_server_config_t *config,
+                            VHC_shm_data_t *shmdata,
+                            VHC_shm_stats_t *stats,
+                            apr_uint64_t wanted,
+                            apr_uint64_t *nslots,
+                            apr_uint64_t *nextra) {
+
+   apr_status_t  status;
+   apr_uint64_t  inuse_slots;
+   apr_uint64_t  extra = 0;
+
+   *nslots = 0;
+   *nextra = 0;
+
+   /*  Slot limit 0 == unlimited slots.  */
+   if (0 == config->slot_limit)
+      return APR_SUCCESS;
+
+   inuse_slots = VHC_ATOMIC_LOAD(&shmdata->inuse_slots);
+
+   do {
+      /*  Check vhost has capacity at the current usage level.  */
+      status = vhc_check_vhost_capacity_(config, shmdata, inuse_slots,
+                                         stats);
+      if (!VHC_APR_STATUS_IS_SUCCESS(status) ) {
+         /*  Out of slots - see if the capacity pool has one to lend.  */
+         if ((VHC_CHOKED_NO_SLOTS != status)  ||
+             !vhc_borrow_pool_slot_(header, config, shmdata, stats) ) {
+            *nslots = inuse_slots;
+            return status;
+         }
+
+         inuse_slots = VHC_ATOMIC_ADD(&shmdata->inuse_slots, 1) - 1;
+         extra = 0;
+         break;
+      }
+
+      /*  A block of slots - unless that gets us near the slot limit.  */
+      extra = ((wanted > 0)  &&
+               (inuse_slots + 1 + wanted + 2 * (wanted + 1) <=
+                  vhc_get_slot_limit_(config, shmdata) ) ) ? wanted : 0;
+
+      /*  Claim the slot - retry if someone else changed the count.  */
+   } while (!VHC_ATOMIC_CAS(&shmdata->inuse_slots, &inuse_slots,
+                            inuse_slots + 1 + extra) );
+
+   /*  Slots within the slot limit count against the pool too.  */
+   if (VHC_APR_STATUS_IS_SUCCESS(status)  &&  (NULL != header)  &&
+       (header->pool.capacity > 0) )
+      VHC_ATOMIC_ADD(&header->pool.inuse_slots, 1 + extra);
+
+   *nslots = inuse_slots + 1 + extra;
+   *nextra = extra;
+
+   return APR_SUCCESS;
+
+}  /*  End of function  vhc_claim_vhost_slots_.  */
+
+
+
+/**
+  *   @brief   Release slots previously claimed for requests.
+  *   @param   header   slot table header (with the pool) - NULL if the
+  *                     slots don't go back to the capacity pool
+  *   @param   shmdata  vhost shm data
+  *   @param   nslots   # of slots to release
+  *   @return  # of slots in use after the release.
+  *
+  *   Release a number of slots with a single update (never goes below
+  *   zero) - and return them to the capacity pool.
+  *
+  */
+apr_uint64_t  vhc_release_slots_(VHC_shm_header_t *header,
+                                 VHC_shm_data_t *shmdata,
+                                 apr_uint64_t nslots) {
+
+   apr_uint64_t  inuse_slots = VHC_ATOMIC_LOAD(&shmdata->inuse_slots);
+   apr_uint64_t  released;
+
+   do {
+      if (0 == inuse_slots)
+         return 0;   /*  Nothing to release.  */
+
+      released = (inuse_slots > nslots) ? nslots : inuse_slots;
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->inuse_slots, &inuse_slots,
+                            inuse_slots - released) );
+
+   vhc_return_pool_slots_(header, shmdata, released);
+
+   return inuse_slots - released;
+
+}  /*  End of function  vhc_release_slots_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Retry hints.                                                  */
+/*  ===================================================================  */
+
+
+/**
+  *   @brief   Predict how long a choked request should wait to retry.
+  *   @param   config   vhost config record
+  *   @param   shmdata  vhost shm data
+  *   @param   reason   why the request got choked (VHC_CHOKED_*)
+  *   @param   cooldown_expires_at  when the vhost's burst cooldown ends
+  *                                 (monotonic, 0 = not cooling down)
+  *   @return  the predicted wait (usecs, 0 = right away).
+  *
+  *   Predict when the vhost could admit a request that just got choked -
+  *   the longest of the waits that apply. Tokens - when the token bucket
+  *   has refilled by a token. Out of slots - when the slots in use (over
+  *   the unburst slot limit) and the queued requests ahead have drained,
+  *   assuming each slot is held for the vhost's service time EWMA, and
+  *   when the burst cooldown is over.
+  *
+  */
+apr_interval_time_t  vhc_get_retry_after_(VHC_server_config_t *config,
+                                          VHC_shm_data_t *shmdata,
+                                          int reason,
+                                          apr_time_t cooldown_expires_at) {
+
+   apr_time_t    interval = (apr_time_t) config->rate_settings.interval;
+   apr_time_t    current_time = vhc_monotonic_now_();
+   apr_time_t    wait = 0;
+   apr_time_t    slots_wait;
+   apr_uint64_t  hold_time;
+   apr_uint64_t  inuse_slots;
+   apr_uint64_t  limit;
+   apr_uint64_t  ahead;
+
+   /*  The next request conforms once tat - now fits in the bucket.  */
+   if (0 != interval) {
+      wait = VHC_ATOMIC_LOAD(&shmdata->rate_tat) + interval -
+             interval * config->rate_settings.burst - current_time;
+      if (wait < 0)
+         wait = 0;
+   }
+
+   if (VHC_CHOKED_NO_TOKENS == reason)
+      return wait;
+
+   /*  No burst slots until the cooldown is over.  */
+   if (cooldown_expires_at - current_time > wait)
+      wait = cooldown_expires_at - current_time;
+
+   hold_time = VHC_ATOMIC_LOAD(&shmdata->latency_ewma);
+   if (0 == hold_time)
+      hold_time = VHC_RETRY_DEFAULT_HOLD_TIME;   /*  Nothing measured.  */
+
+   inuse_slots = VHC_ATOMIC_LOAD(&shmdata->inuse_slots);
+   limit = vhc_get_slot_limit_(config, shmdata);
+
+   /*  Requests ahead of us - queued + the ones over the slot limit.  */
+   ahead = VHC_ATOMIC_LOAD(&shmdata->queue_waiters) + 1;
+   if (inuse_slots > limit)
+      ahead += inuse_slots - limit;
+
+   /*  The slots in use drain at inuse_slots per hold time.  */
+   if (0 == inuse_slots)
+      inuse_slots = 1;
+
+   slots_wait = (apr_time_t) (ahead * hold_time / inuse_slots);
+
+   return (slots_wait > wait) ? slots_wait : wait;
+
+}  /*  End of function  vhc_get_retry_after_.  */
+
+
+
+/*  ===================================================================  */
+/*  @@@@@  Runtime limits.                                               */
+/*  ===================================================================  */
+
+
+/**
+  *   @brief   Get the limits a vhost is configured with.
+  *   @param   config  vhost config record
+  *   @param   limits  vhost limits (returned back)
+  *
+  */
+void  vhc_get_config_limits_(VHC_server_config_t *config,
+                             VHC_vhost_limits_t *limits) {
+
+   limits->slot_limit    = config->slot_limit;
+   limits->burst_percent = config->burst_settings.percent;
+   limits->grace_period  = config->burst_settings.grace_period;
+   limits->flap_period   = config->burst_settings.flap_period;
+   limits->rate_interval = config->rate_settings.interval;
+   limits->rate_burst    = config->rate_settings.burst;
+
+}  /*  End of function  vhc_get_config_limits_.  */
+
+
+
+/**
+  *   @brief   Get the vhost's effective limits (from shm).
+  *   @param   shmdata  vhost shm data
+  *   @param   limits   vhost limits (returned back)
+  *
+  *   Get a consistent copy of the vhost's effective limits - a seqlock
+  *   read, retried if the limits got changed while we read them. Never
+  *   blocks the writer and costs a handful of loads of a cache line the
+  *   request uses anyway.
+  *
+  */
+void  vhc_get_vhost_limits_(VHC_shm_data_t *shmdata,
+                            VHC_vhost_limits_t *limits) {
+
+   apr_uint32_t  seq;
+
+   do {
+      seq = VHC_ATOMIC_LOAD(&shmdata->limits_seq);
+
+      limits->slot_limit    = VHC_ATOMIC_LOAD(&shmdata->limits.slot_limit);
+      limits->burst_percent = VHC_ATOMIC_LOAD(&shmdata->limits.
+                                                 burst_percent);
+      limits->grace_period  = VHC_ATOMIC_LOAD(&shmdata->limits.
+                                                 grace_period);
+      limits->flap_period   = VHC_ATOMIC_LOAD(&shmdata->limits.flap_period);
+      limits->rate_interval = VHC_ATOMIC_LOAD(&shmdata->limits.
+                                                 rate_interval);
+      limits->rate_burst    = VHC_ATOMIC_LOAD(&shmdata->limits.rate_burst);
+
+   } while ((seq & 1)  ||  (seq != VHC_ATOMIC_LOAD(&shmdata->limits_seq) ) );
+
+}  /*  End of function  vhc_get_vhost_limits_.  */
+
+
+
+/**
+  *   @brief   Set the vhost's effective limits (in shm).
+  *   @param   shmdata  vhost shm data
+  *   @param   limits   new vhost limits
+  *
+  *   Set the vhost's effective limits - all of them in one go (a seqlock
+  *   write), so no request ever sees half of a change. Writers serialize
+  *   on the sequence #. A new slot limit restarts the adaptive slot limit
+  *   from it.
+  *
+  */
+void  vhc_set_vhost_limits_(VHC_shm_data_t *shmdata,
+                            VHC_vhost_limits_t *limits) {
+
+   apr_uint32_t  seq = VHC_ATOMIC_LOAD(&shmdata->limits_seq);
+
+   /*  Odd sequence # - wait for the other writer to finish.  */
+   do {
+      seq &= ~((apr_uint32_t) 1);
+
+   } while (!VHC_ATOMIC_CAS(&shmdata->limits_seq, &seq, seq + 1) );
+
+   if (VHC_ATOMIC_LOAD(&shmdata->limits.slot_limit) != limits->slot_limit)
+      VHC_ATOMIC_STORE(&shmdata->adaptive_limit, 0);
+
+   VHC_ATOMIC_STORE(&shmdata->limits.slot_limit, limits->slot_limit);
+   VHC_ATOMIC_STORE(&shmdata->limits.burst_percent, limits->burst_percent);
+   VHC_ATOMIC_STORE(&shmdata->limits.grace_period, limits->grace_period);
+   VHC_ATOMIC_STORE(&shmdata->limits.flap_period, limits->flap_period);
+   VHC_ATOMIC_STORE(&shmdata->limits.rate_interval, limits->rate_interval);
+   VHC_ATOMIC_STORE(&shmdata->limits.rate_burst, limits->rate_burst);
+
+   VHC_ATOMIC_STORE(&shmdata->limits_seq, seq + 2);
+
+   VHC_DEBUG  vhc_debug_out_(NULL, "%s: limits #%d slots=%d burst=%d%% "
+                                   "rate=%d usecs/%d", VHC_LOC,
+                                   (int) (seq + 2), (int) limits->slot_limit,
+                                   (int) limits->burst_percent,
+                                   (int) limits->rate_interval,
+                                   (int) limits->rate_burst);
+
+}  /*  End of function  vhc_set_vhost_limits_.  */
+
+
+
+/**
+  *   @brief   Get the vhost's config with its effective limits.
+  *   @param   config     vhost config record
+  *   @param   shmdata    vhost shm data (its slot table entry)
+  *   @param   effective  config copy to fill in
+  *   @return  the effective config.
+  *
+  *   Get a copy of the vhost's config with the limits replaced by the
+  *   effective ones from shm - what a request gets admitted (and its slot
+  *   released) with.
+  *
+  */
+VHC_server_config_t  *vhc_get_effective_config_(VHC_server_config_t *config,
+                                       VHC_shm_data_t *shmdata,
+                                       VHC_server_config_t *effective) {
+
+   VHC_vhost_limits_t  limits;
+
+   *effective = *config;
+   vhc_get_vhost_limits_(shmdata, &limits);
+
+   effective->slot_limit                  = limits.slot_limit;
+   effective->burst_settings.percent      = limits.burst_percent;
+   effective->burst_settings.grace_period = limits.grace_period;
+   effective->burst_settings.flap_period  = limits.flap_period;
+   effective->rate_settings.interval      = limits.rate_interval;
+   effective->rate_settings.burst         = limits.rate_burst;
+
+   return effective;
+
+}  /*  End of function  vhc_get_effective_config_.  */
+
+
+/*  }}}  -- End section:engine-functions.  */
+
+
+
+/**
+ *  EOF
+ */
@@ -0,0 +1,451 @@
+/*  =======================================================================
+ * 
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *  
+ *  =======================================================================
+ *
+ *     File:  vhc_engine.h
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Header file for the admission engine - the shm slot table
+ *            layout, slot accounting (capacity, bursts, rates, capacity
+ *            pool) and locking. Only needs APR, so the engine can also be
+ *            built and benchmarked outside of apache (see bench/).
+ *
+ */
+
+#ifndef  _VHC_ENGINE_H_
+#define  _VHC_ENGINE_H_  "vhc-engine.h"
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the APR header files we need here.  */
+#include "apr.h"
+#include "apr_errno.h"
+#include "apr_global_mutex.h"
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_version.h"
+
+/*  Include the standard header files we use here.  */
+#if APR_HAVE_ERRNO_H
+   #include <errno.h>
+#endif  /*  APR_HAVE_ERRNO_H  */
+
+#if APR_HAVE_STRING_H
+   #include <string.h>
+#endif  /*  APR_HAVE_STRING_H  */
+
+#include <math.h>   /*  For ceil  */
+#include <time.h>   /*  For clock_gettime  */
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Defines for string conversion.  */
+#define  VHC_STR_CONVERT(str)  #str
+#define  VHC_STR(str)          VHC_STR_CONVERT(str)
+
+
+/*  Define for checking APR status codes.  */
+#define  VHC_APR_STATUS_IS_SUCCESS(status)  (APR_SUCCESS == (status))
+
+/*  Define for getting function names.  */
+#if defined(__FUNCTION__)
+   #define VHC_LOC  __FUNCTION__
+#else
+   #define VHC_LOC  __FILE__ ":" VHC_STR(__LINE__)
+#endif  /*  defined(__FUNCTION__).  */
+
+
+/*  Defines for cache line size + aligning shared data to cache lines.  */
+#ifndef  VHC_CACHE_LINE_SIZE
+   #define  VHC_CACHE_LINE_SIZE  64
+#endif  /*  VHC_CACHE_LINE_SIZE  */
+
+#if defined(__GNUC__)
+   #define  VHC_CACHE_ALIGNED  __attribute__((aligned(VHC_CACHE_LINE_SIZE)))
+#else
+   #define  VHC_CACHE_ALIGNED
+#endif  /*  defined(__GNUC__).  */
+
+#define  VHC_CACHE_LINE_ROUNDUP(n)  (((n) + VHC_CACHE_LINE_SIZE - 1) &     \
+                                     ~((apr_size_t) VHC_CACHE_LINE_SIZE - 1))
+
+
+/*  Defines for the shm slot table header.  */
+#define  VHC_SHM_MIN_ENTRIES    16          /*  Room for added vhosts.    */
+#define  VHC_SHM_NO_ENTRY       0xFFFF      /*  Not in the slot table.    */
+#define  VHC_SHM_TABLE_MAGIC    0x56484353  /*  "VHCS".                   */
+#define  VHC_SHM_TABLE_VERSION  13          /*  Bump on layout changes.   */
+
+/*
+ *  Defines for atomic access to the shm data. We need 64-bit atomics that
+ *  work across processes (lock-free) - the gcc/clang builtins do that on
+ *  the platforms we care about. Build with -DVHC_NO_SHM_ATOMICS to force
+ *  the plain accessors (all access then happens under the global lock).
+ */
+#if defined(__GNUC__)  &&  defined(__ATOMIC_ACQ_REL)  &&  \
+    defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)  &&    \
+    !defined(VHC_NO_SHM_ATOMICS)
+   #define  VHC_HAVE_SHM_ATOMICS  1
+#endif  /*  gcc atomics  &&  64-bit CAS  &&  !VHC_NO_SHM_ATOMICS.  */
+
+#ifdef  VHC_HAVE_SHM_ATOMICS
+   #define  VHC_ATOMIC_LOAD(ptr)        __atomic_load_n((ptr),            \
+                                                        __ATOMIC_ACQUIRE)
+   #define  VHC_ATOMIC_STORE(ptr, val)  __atomic_store_n((ptr), (val),    \
+                                                         __ATOMIC_RELEASE)
+   #define  VHC_ATOMIC_CAS(ptr, expected, desired)                        \
+            __atomic_compare_exchange_n((ptr), (expected), (desired), 0,  \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+   #define  VHC_ATOMIC_ADD(ptr, val)    __atomic_add_fetch((ptr), (val),  \
+                                                           __ATOMIC_ACQ_REL)
+   #define  VHC_ATOMIC_INC_RELAXED(ptr, val)                              \
+            __atomic_add_fetch((ptr), (val), __ATOMIC_RELAXED)
+#else
+   /*  Plain accessors - only safe when used under the global lock.  */
+   #define  VHC_ATOMIC_LOAD(ptr)        (*(ptr))
+   #define  VHC_ATOMIC_STORE(ptr, val)  (*(ptr) = (val))
+   #define  VHC_ATOMIC_CAS(ptr, expected, desired)                        \
+            ((*(ptr) == *(expected)) ? ((*(ptr) = (desired)), 1)          \
+                                     : ((*(expected) = *(ptr)), 0))
+   #define  VHC_ATOMIC_ADD(ptr, val)    (*(ptr) += (val))
+   #define  VHC_ATOMIC_INC_RELAXED(ptr, val)  (*(ptr) += (val))
+#endif  /*  VHC_HAVE_SHM_ATOMICS  */
+
+
+/*  Defines for polling for a lock (no timed lock support).  */
+#define  VHC_TRYLOCK_SLEEP_TIME_USECS  (5 * 1000)   /*  5ms in usecs.    */
+#define  VHC_TRYLOCK_MIN_SLEEP_USECS   50           /*  Backoff start.   */
+
+/*  Defines for adaptive (AIMD) slot limits.  */
+#define  VHC_ADAPTIVE_FP_ONE            65536 /*  Fixed point 1 slot.   */
+#define  VHC_ADAPTIVE_EWMA_WEIGHT       8     /*  alpha = 1/8.          */
+#define  VHC_ADAPTIVE_DECREASE_PERCENT  90    /*  Backoff to 90%.       */
+
+/*  Define for the slot hold time to assume until one is measured.  */
+#define  VHC_RETRY_DEFAULT_HOLD_TIME    APR_USEC_PER_SEC
+
+
+/*  Defines for HTTP response code for too many requests (see RFC 6585).  */
+#define  VHC_HTTP_TOO_MANY_REQUESTS         429   /*  As per RFC 6585.  */
+#define  VHC_HTTP_MSG_TOO_MANY_REQUESTS     "Too Many Requests"
+
+/*  Defines for why a request got choked (internal admission results).  */
+#define  VHC_CHOKED_NO_SLOTS   VHC_HTTP_TOO_MANY_REQUESTS
+#define  VHC_CHOKED_NO_TOKENS  (VHC_HTTP_TOO_MANY_REQUESTS + 1000)
+#define  VHC_IS_CHOKED(status)  ((VHC_CHOKED_NO_SLOTS == (status))  ||    \
+                                 (VHC_CHOKED_NO_TOKENS == (status)) )
+
+/*  Defines for per-vhost stats - counters are sharded by process id.  */
+#ifndef  VHC_STATS_SHARDS
+   #define  VHC_STATS_SHARDS  16
+#endif  /*  VHC_STATS_SHARDS  */
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:typedefs {{{  */
+/*  ++++++++++++++++      */
+
+/*  Boolean.  */
+typedef  enum { VHC_FALSE = 0, VHC_TRUE = !VHC_FALSE }  VHC_boolean;
+
+/*  Locking mode used to update the shm data.  */
+typedef  enum {
+   VHC_LOCK_MODE_ATOMIC = 0,     /*  Lock-free (CAS) updates.  */
+   VHC_LOCK_MODE_MUTEX           /*  Global mutex held.        */
+
+}  VHC_lock_mode;
+
+/*  Burst state of a vhost - bursting until T, cooling down until T+flap.  */
+typedef  enum {
+   VHC_BURST_STATE_NORMAL = 0,             /*  Burst allowed.       */
+   VHC_BURST_STATE_BURSTING,               /*  In the grace period. */
+   VHC_BURST_STATE_COOLDOWN                /*  In the flap period.  */
+
+}  VHC_burst_state;
+
+/*  Structure definitions for vhost_choke server configs.  */
+typedef struct  vhc_server_config {
+   char         *server_hostname;   /*  The server hostname.           */
+
+   apr_uint16_t  config_id;         /*  Unique config id.              */
+   apr_uint16_t  shm_index;         /*  Slot table entry (post_config).*/
+   apr_uint64_t  vhost_key;         /*  Stable vhost identity (hash of */
+                                    /*  ServerName:port).              */
+   VHC_boolean   per_host;          /*  Limit each Host separately.    */
+   apr_uint16_t  slot_limit;        /*  Slot (or choke at) limit.      */
+                                    /*  Default: 0 or no limit.        */
+   apr_uint16_t  weight;            /*  Capacity pool fair share.      */
+
+   /*  Structure contain burst settings related to the "bursting".  */
+   struct burst_settings {
+      apr_uint16_t  grace_period;   /*  Grace period for "bursting".   */
+      apr_uint16_t  flap_period;    /*  Handle burst flapping.         */
+
+      apr_uint16_t  percent;        /*  Max. allowable percentage to   */
+                                    /*  burst over the choke limit.    */
+      char          filler[2];      /*  Filler/boundary adjust.        */
+
+   } burst_settings;
+
+   /*  Structure contain request rate (token bucket) settings.  */
+   struct rate_settings {
+      apr_uint32_t  interval;       /*  Usecs per request (token) -    */
+                                    /*  Default: 0 or no rate limit.   */
+      apr_uint32_t  burst;          /*  Bucket size (# of requests).   */
+
+   } rate_settings;
+
+   /*  Structure contain admission queue settings.  */
+   struct queue_settings {
+      apr_uint16_t  depth;          /*  Max. # of queued requests -    */
+                                    /*  Default: 0 or no queueing.     */
+      apr_uint16_t  timeout;        /*  Max. queue wait (in msecs).    */
+
+   } queue_settings;
+
+   /*  Structure contain bandwidth settings (response bytes/sec).  */
+   struct bandwidth_settings {
+      apr_uint64_t  rate;           /*  Bytes per second -             */
+                                    /*  Default: 0 or no limit.        */
+      apr_size_t    chunk;          /*  Bytes paced at a time.         */
+
+   } bandwidth_settings;
+
+   /*  Structure contain adaptive (AIMD) slot limit settings.  */
+   struct adaptive_settings {
+      apr_uint16_t  min;            /*  Min. slot limit.               */
+      apr_uint16_t  max;            /*  Max. slot limit - Default: 0   */
+                                    /*  or fixed slot limit.           */
+      apr_uint32_t  target_latency; /*  Service time target (usecs).   */
+
+   } adaptive_settings;
+
+   apr_uint16_t  response_format;   /*  Choked response body format.   */
+   apr_uint16_t  retry_headers;     /*  Retry hints for choked         */
+                                    /*  requests (VHC_retry_headers).  */
+   apr_uint16_t  subrequests;       /*  Subrequest accounting          */
+                                    /*  (VHC_subrequests).             */
+   apr_uint16_t  subrequest_limit;  /*  Separate subrequest slot limit */
+                                    /*  (0 = the slot limit).          */
+   struct vhc_choked_response  *choked;  /*  Pre-rendered choked       */
+                                         /*  response (post_config).   */
+
+}  VHC_server_config_t, *VHC_server_config_t_p;
+
+/*
+ *  Structure definitions for a vhost's effective limits - the configured
+ *  ones at startup, they can be changed at runtime (see the admin
+ *  handler). Kept in the vhost's slot table entry, so all the children
+ *  see a change right away.
+ */
+typedef struct  vhc_vhost_limits {
+   apr_uint16_t  slot_limit;        /*  Slot (or choke at) limit.      */
+   apr_uint16_t  burst_percent;     /*  Max. burst over the limit.     */
+   apr_uint16_t  grace_period;      /*  Grace period for "bursting".   */
+   apr_uint16_t  flap_period;       /*  Handle burst flapping.         */
+   apr_uint32_t  rate_interval;     /*  Usecs per request (token).     */
+   apr_uint32_t  rate_burst;        /*  Bucket size (# of requests).   */
+
+}  VHC_vhost_limits_t, *VHC_vhost_limits_t_p;
+
+/*  Define to check if a vhost is throttled (slot or rate limited).  */
+#define  VHC_VHOST_IS_THROTTLED(cfg)  (((cfg)->slot_limit > 0)  ||        \
+                                       ((cfg)->rate_settings.interval > 0))
+
+
+/*
+ *  Structure definitions for the shm slot table header. The table is the
+ *  header followed by one entry per vhost config, every entry padded to
+ *  (a multiple of) the cache line size.
+ */
+typedef struct  vhc_shm_header {
+   apr_uint32_t  magic;             /*  VHC_SHM_TABLE_MAGIC.           */
+   apr_uint32_t  version;           /*  VHC_SHM_TABLE_VERSION.         */
+   apr_uint32_t  num_entries;       /*  # of vhost entries.            */
+   apr_uint32_t  entry_stride;      /*  Bytes between vhost entries.   */
+   apr_uint32_t  stats_offset;      /*  Where the stats shards start.  */
+   apr_uint32_t  stats_shards;      /*  # of stats shards per vhost.   */
+   apr_uint32_t  stats_stride;      /*  Bytes between stats shards.    */
+   volatile apr_uint32_t  used_entries;   /*  # of claimed (dynamic)   */
+                                          /*  entries.                 */
+
+   /*  Global capacity pool - on its own cache line (hot for all vhosts). */
+   struct capacity_pool {
+      apr_uint64_t           capacity;       /*  Server-wide # of slots. */
+      volatile apr_uint64_t  inuse_slots;    /*  # of slots in use.      */
+      volatile apr_uint64_t  borrowed;       /*  # of borrowed slots.    */
+      volatile apr_int64_t   borrow_weight;  /*  Weight of the vhosts    */
+                                             /*  that are borrowing.     */
+
+   }  VHC_CACHE_ALIGNED  pool;
+
+}  VHC_CACHE_ALIGNED  VHC_shm_header_t, *VHC_shm_header_t_p;
+
+
+/*
+ *  Structure definitions for per-vhost shm data (slot table entry).
+ *  Updated with atomics (or under the global lock in mutex mode) - aligned
+ *  to a cache line so that vhosts never share (false-share) a line.
+ */
+typedef struct  vhc_shm_data {
+   apr_uint64_t           vhost_key;         /*  Owner vhost (0 = free). */
+   volatile apr_uint64_t  inuse_slots;       /*  # of slots in use.      */
+   volatile apr_time_t    grace_expires_at;  /*  When grace expires -    */
+                                             /*  burst end (mono, 0=n/a).*/
+   volatile apr_time_t    burst_changed_at;  /*  Last burst state change.*/
+   volatile apr_uint32_t  burst_state;       /*  VHC_burst_state.        */
+   volatile apr_uint32_t  referenced;        /*  Used since last sweep.  */
+   volatile apr_time_t    rate_tat;          /*  Token bucket - theo.    */
+                                             /*  arrival time (mono).    */
+   volatile apr_uint32_t  queue_waiters;     /*  # of queued requests.   */
+   volatile apr_uint32_t  wake_seq;          /*  Queue wakeup (futex).   */
+   volatile apr_int64_t   bandwidth_tat;     /*  Byte budget - theo.     */
+                                             /*  arrival time (nsecs).   */
+   volatile apr_uint32_t  adaptive_limit;    /*  Slot limit (fixed point,*/
+                                             /*  0 = not adapted yet).   */
+   volatile apr_uint32_t  latency_ewma;      /*  Service time (usecs).   */
+   volatile apr_time_t    decreased_at;      /*  Last backoff (mono).    */
+   volatile apr_uint64_t  borrowed;          /*  # of slots borrowed     */
+                                             /*  from the capacity pool. */
+   volatile apr_uint32_t  borrow_weight;     /*  Weight while borrowing. */
+   volatile apr_uint32_t  limits_seq;        /*  Limits version (odd =   */
+                                             /*  being changed).         */
+   volatile VHC_vhost_limits_t  limits;      /*  Effective limits.       */
+   volatile apr_uint32_t  subreq_slots;      /*  # of slots in use by    */
+                                             /*  subrequests (Separate). */
+
+}  VHC_CACHE_ALIGNED  VHC_shm_data_t, *VHC_shm_data_t_p;
+
+
+/*  Structure definitions for a per-vhost stats shard (in shm).  */
+typedef struct  vhc_shm_stats {
+   volatile apr_uint64_t  admitted;          /*  # of admitted requests. */
+   volatile apr_uint64_t  burst_admitted;    /*  # admitted in a burst.  */
+   volatile apr_uint64_t  borrow_admitted;   /*  # admitted on a slot    */
+                                             /*  borrowed from the pool. */
+   volatile apr_uint64_t  bursts;            /*  # of bursts started.    */
+   volatile apr_uint64_t  choked_no_slots;   /*  # choked - slot limit.  */
+   volatile apr_uint64_t  choked_no_tokens;  /*  # choked - rate limit.  */
+   volatile apr_uint64_t  lock_timeouts;     /*  # lock acquire timeouts.*/
+   volatile apr_uint64_t  lock_wait_usecs;   /*  Total lock wait time.   */
+
+}  VHC_CACHE_ALIGNED  VHC_shm_stats_t, *VHC_shm_stats_t_p;
+
+
+/*  Defines for the shm slot table header size + entry/stats strides.  */
+#define  VHC_SHM_HEADER_SIZE   VHC_CACHE_LINE_ROUNDUP(sizeof(VHC_shm_header_t))
+#define  VHC_SHM_ENTRY_STRIDE  VHC_CACHE_LINE_ROUNDUP(sizeof(VHC_shm_data_t))
+#define  VHC_SHM_STATS_STRIDE  VHC_CACHE_LINE_ROUNDUP(sizeof(VHC_shm_stats_t))
+
+/*  }}}  -- End section:typedefs.  */
+
+
+/*  section:prototypes {{{  */
+/*  ++++++++++++++++++      */
+
+/*  Debug message hook (NULL = no debug messages) - set by the module.  */
+extern void  (*vhc_debug_out_)(apr_pool_t *pool, char *fmt, ...);
+
+/*  Time + locking.  */
+apr_time_t         vhc_monotonic_now_(void);
+int                vhc_lock_acquire_(apr_global_mutex_t *lock,
+                                     apr_interval_time_t timeout_usecs);
+int                vhc_lock_release_(apr_global_mutex_t *lock);
+
+/*  Slot table layout.  */
+apr_size_t         vhc_get_table_size_(apr_uint16_t num_entries);
+VHC_shm_header_t  *vhc_init_table_(void *baseaddr, apr_uint16_t num_entries);
+VHC_shm_header_t  *vhc_get_table_header_(void *baseaddr);
+VHC_shm_data_t    *vhc_get_shm_entry_(VHC_shm_header_t *header,
+                                      apr_uint16_t shm_index);
+VHC_shm_stats_t   *vhc_get_shm_stats_(VHC_shm_header_t *header,
+                                      apr_uint16_t shm_index,
+                                      apr_uint32_t shard);
+void               vhc_sum_vhost_stats_(VHC_shm_header_t *header,
+                                        apr_uint16_t shm_index,
+                                        VHC_shm_stats_t *sum);
+
+/*  Burst state + slot limits.  */
+VHC_burst_state    vhc_get_burst_state_(VHC_server_config_t *config,
+                                        VHC_shm_data_t *shmdata,
+                                        apr_time_t current_time,
+                                        apr_time_t *changed_at);
+void               vhc_record_burst_state_(VHC_server_config_t *config,
+                                           VHC_shm_data_t *shmdata,
+                                           apr_time_t current_time);
+apr_uint32_t       vhc_get_slot_limit_fp_(VHC_server_config_t *config,
+                                          apr_uint32_t adapted);
+apr_uint32_t       vhc_get_slot_limit_(VHC_server_config_t *config,
+                                       VHC_shm_data_t *shmdata);
+apr_uint32_t       vhc_record_service_time_(VHC_shm_data_t *shmdata,
+                                       apr_interval_time_t service_time);
+void               vhc_adapt_slot_limit_(VHC_server_config_t *config,
+                                         VHC_shm_data_t *shmdata,
+                                         apr_interval_time_t service_time,
+                                         apr_uint64_t inflight);
+
+/*  Capacity pool.  */
+int                vhc_borrow_pool_slot_(VHC_shm_header_t *header,
+                                         VHC_server_config_t *config,
+                                         VHC_shm_data_t *shmdata,
+                                         VHC_shm_stats_t *stats);
+void               vhc_return_pool_slots_(VHC_shm_header_t *header,
+                                          VHC_shm_data_t *shmdata,
+                                          apr_uint64_t nslots);
+
+/*  Admission + release.  */
+int                vhc_check_vhost_capacity_(VHC_server_config_t *config,
+                                             VHC_shm_data_t *shmdata,
+                                             apr_uint64_t inuse_slots,
+                                             VHC_shm_stats_t *stats);
+int                vhc_check_vhost_rate_(VHC_server_config_t *config,
+                                         VHC_shm_data_t *shmdata);
+int                vhc_claim_vhost_slots_(VHC_shm_header_t *header,
+                                          VHC_server_config_t *config,
+                                          VHC_shm_data_t *shmdata,
+                                          VHC_shm_stats_t *stats,
+                                          apr_uint64_t wanted,
+                                          apr_uint64_t *nslots,
+                                          apr_uint64_t *nextra);
+apr_uint64_t       vhc_release_slots_(VHC_shm_header_t *header,
+                                      VHC_shm_data_t *shmdata,
+                                      apr_uint64_t nslots);
+
+/*  Retry hints.  */
+apr_interval_time_t  vhc_get_retry_after_(VHC_server_config_t *config,
+                                          VHC_shm_data_t *shmdata,
+                                          int reason,
+                                          apr_time_t cooldown_expires_at);
+
+/*  Runtime limits.  */
+void               vhc_get_config_limits_(VHC_server_config_t *config,
+                                          VHC_vhost_limits_t *limits);
+void               vhc_get_vhost_limits_(VHC_shm_data_t *shmdata,
+                                         VHC_vhost_limits_t *limits);
+void               vhc_set_vhost_limits_(VHC_shm_data_t *shmdata,
+                                         VHC_vhost_limits_t *limits);
+VHC_server_config_t  *vhc_get_effective_config_(VHC_server_config_t *config,
+                                       VHC_shm_data_t *shmdata,
+                                       VHC_server_config_t *effective);
+
+/*  }}}  -- End section:prototypes.  */
+
+
+#endif  /*  For  _VHC_ENGINE_H_.  */
+
+
+
+/**
+ *  EOF
+ */
@@ -0,0 +1,111 @@
+/*  =======================================================================
+ *
+ *  ~ramr
+ *  <see-license-file />
+ *  <insert-mit-license-here />
+ *
+ *  =======================================================================
+ *
+ *     File:  vhc_trace.h
+ *
+ *    Author: ~ramr
+ *
+ *  Summary:  Header file for the admission trace - the fixed size event
+ *            records each child keeps in its trace ring and the layout of
+ *            a trace dump. Plain C (no APR), so that the offline decoder
+ *            (see trace/) builds anywhere.
+ *
+ */
+
+#ifndef  _VHC_TRACE_H_
+#define  _VHC_TRACE_H_  "vhc-trace.h"
+
+/*  section:includes {{{  */
+/*  ++++++++++++++++      */
+
+/*  Include the standard header files we use here.  */
+#include <stdint.h>
+
+/*  }}}  -- End section:includes.  */
+
+
+/*  section:defines {{{  */
+/*  +++++++++++++++      */
+
+/*  Defines for the trace dump format.  */
+#define  VHC_TRACE_MAGIC         0x56484354  /*  "VHCT".                  */
+#define  VHC_TRACE_VERSION       1           /*  Bump on layout changes.  */
+#define  VHC_TRACE_NO_CONFIG     0xFFFF      /*  Event isn't for a vhost. */
+
+/*  Define for the names of the trace events (indexed by event type).  */
+#define  VHC_TRACE_EVENT_NAMES   { "none", "admit", "admit-burst",       \
+                                   "queued", "choke-slots",              \
+                                   "choke-rate", "release",              \
+                                   "lock-timeout" }
+
+/*  }}}  -- End section:defines.  */
+
+
+/*  section:typedefs {{{  */
+/*  ++++++++++++++++      */
+
+/*  Trace event types - what the slots + value of a record are.  */
+typedef  enum {
+   VHC_TRACE_EVENT_NONE = 0,
+   VHC_TRACE_EVENT_ADMIT,          /*  slots = in use, value = 0.       */
+   VHC_TRACE_EVENT_ADMIT_BURST,    /*  slots = in use, value = 0.       */
+   VHC_TRACE_EVENT_QUEUED,         /*  slots = in use, value = usecs    */
+                                   /*  waited in the queue.             */
+   VHC_TRACE_EVENT_CHOKE_SLOTS,    /*  slots = in use, value = queued.  */
+   VHC_TRACE_EVENT_CHOKE_RATE,     /*  slots = in use, value = queued.  */
+   VHC_TRACE_EVENT_RELEASE,        /*  slots = in use (after), value =  */
+                                   /*  service time (usecs).            */
+   VHC_TRACE_EVENT_LOCK_TIMEOUT,   /*  slots = 0, value = shm index.    */
+   VHC_TRACE_EVENT_MAX
+
+}  VHC_trace_event;
+
+
+/*
+ *  Structure definitions for a trace record (32 bytes). A record is
+ *  valid once its seq is set - seq % ring size is its slot in the ring,
+ *  so a torn (or overwritten) record doesn't match its slot.
+ */
+typedef struct  vhc_trace_record {
+   uint64_t  timestamp;          /*  Wall clock time (usecs).       */
+   uint32_t  seq;                /*  Sequence # (0 = being written).*/
+   uint32_t  pid;                /*  Process id.                    */
+   uint32_t  tid;                /*  Thread id (truncated).         */
+   uint16_t  config_id;          /*  Vhost config id.               */
+   uint16_t  event;              /*  VHC_trace_event.               */
+   uint32_t  slots;              /*  Slots in use.                  */
+   uint32_t  value;              /*  Event specific value.          */
+
+}  VHC_trace_record_t, *VHC_trace_record_t_p;
+
+
+/*
+ *  Structure definitions for the trace dump header (32 bytes) - followed
+ *  by num_records records (the whole ring, in ring order).
+ */
+typedef struct  vhc_trace_header {
+   uint32_t  magic;              /*  VHC_TRACE_MAGIC.               */
+   uint32_t  version;            /*  VHC_TRACE_VERSION.             */
+   uint32_t  record_size;        /*  sizeof(VHC_trace_record_t).    */
+   uint32_t  num_records;        /*  # of records in the ring.      */
+   uint32_t  pid;                /*  Process id.                    */
+   uint32_t  next_seq;           /*  Sequence # of the next record. */
+   uint64_t  dumped_at;          /*  Wall clock time (usecs).       */
+
+}  VHC_trace_header_t, *VHC_trace_header_t_p;
+
+/*  }}}  -- End section:typedefs.  */
+
+
+#endif  /*  For  _VHC_TRACE_H_.  */
+
+
+
+/**
+ *  EOF
+ */